@@ -0,0 +1,332 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "accounting.h"
+#include "cgroup.h"
+#include "coresched.h"
+#include "proc.h"
+#include "procread.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct acct_group {
+	char name[NAME_MAX + 1];
+	char path[PATH_MAX];
+	// Time spent running, in nanoseconds.
+	unsigned long long cpu_ns;
+	// Time spent waiting for a CPU, in nanoseconds.
+	unsigned long long wait_ns;
+	unsigned long long forceidle_ns;
+	unsigned long long forceidle_at;
+	double forceidle_rate;
+	bool have_forceidle;
+	// The totals of the previous tick, if it was sampled.
+	unsigned long long prev_cpu_ns;
+	unsigned long long prev_wait_ns;
+	bool have_prev;
+};
+
+// The tasks that make up a cookie group come and go, so its totals can go
+// down between two ticks. That is reported as no time at all.
+static unsigned long long delta(unsigned long long now,
+				unsigned long long prev)
+{
+	return now > prev ? now - prev : 0;
+}
+
+static int add_forceidle(pid_t tid, void *data)
+{
+	unsigned long long ns = 0;
+	if (!proc_read_forceidle(tid, &ns)) {
+		*(unsigned long long *)data += ns;
+	}
+	return 0;
+}
+
+struct tid_list {
+	pid_t *tids;
+	size_t count;
+	size_t capacity;
+};
+
+static int add_tid(pid_t tid, void *data)
+{
+	struct tid_list *list = data;
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 256;
+		list->tids = realloc(list->tids,
+				     list->capacity * sizeof(*list->tids));
+		if (!list->tids) {
+			error(1, errno, "Failed to allocate thread list");
+		}
+	}
+	list->tids[list->count++] = tid;
+	return 0;
+}
+
+// Sum the forced idle time of the threads of a cgroup, reading the sched
+// files of a batch of them at once.
+static unsigned long long sum_forceidle(struct procread *reader,
+					const char *cgroup)
+{
+	struct tid_list list = { 0 };
+	cgroup_for_each_thread(cgroup, add_tid, &list);
+
+	unsigned long long total = 0;
+	char paths[PROCREAD_BATCH][32];
+	const char *path_list[PROCREAD_BATCH];
+	for (size_t i = 0; i < list.count; i += PROCREAD_BATCH) {
+		size_t batch = list.count - i < PROCREAD_BATCH ?
+				       list.count - i :
+				       PROCREAD_BATCH;
+		for (size_t j = 0; j < batch; j++) {
+			snprintf(paths[j], sizeof(paths[j]), "/proc/%d/sched",
+				 list.tids[i + j]);
+			path_list[j] = paths[j];
+		}
+		procread_run(reader, path_list, batch);
+		for (size_t j = 0; j < batch; j++) {
+			unsigned long long ns;
+			const char *sched = procread_data(reader, j);
+			if (sched) {
+				proc_parse_forceidle(sched, &ns);
+				total += ns;
+			}
+		}
+	}
+	free(list.tids);
+	return total;
+}
+
+static bool sample_cgroup(struct acct_group *group, bool forceidle,
+			  struct procread *reader)
+{
+	struct cgroup_cpu_stat stat;
+	struct cgroup_pressure some;
+	if (cgroup_read_cpu_stat(group->path, &stat)) {
+		return false;
+	}
+	group->cpu_ns = stat.usage_usec * 1000ULL;
+	if (!cgroup_read_cpu_pressure(group->path, &some)) {
+		group->wait_ns = some.total_usec * 1000ULL;
+	}
+	if (forceidle) {
+		group->forceidle_ns = sum_forceidle(reader, group->path);
+	}
+	return true;
+}
+
+struct cookie_scan {
+	unsigned long cookie;
+	bool forceidle;
+	unsigned long long cpu_ns;
+	unsigned long long wait_ns;
+	unsigned long long forceidle_ns;
+};
+
+static int scan_task(pid_t tid, void *data)
+{
+	struct cookie_scan *scan = data;
+	unsigned long cookie;
+	if (core_sched_get(tid, &cookie) || cookie != scan->cookie) {
+		return 0;
+	}
+
+	unsigned long long run_ns, wait_ns;
+	if (!proc_read_schedstat(tid, &run_ns, &wait_ns)) {
+		scan->cpu_ns += run_ns;
+		scan->wait_ns += wait_ns;
+	}
+	if (scan->forceidle) {
+		add_forceidle(tid, &scan->forceidle_ns);
+	}
+	return 0;
+}
+
+static int scan_pid(pid_t pid, void *data)
+{
+	proc_for_each_task(pid, scan_task, data);
+	return 0;
+}
+
+// Without an accounting cgroup, a cookie group can only be found by asking
+// every task on the system for its cookie.
+static bool sample_cookie(struct acct_group *group, unsigned long cookie,
+			  bool forceidle)
+{
+	struct cookie_scan scan = { .cookie = cookie, .forceidle = forceidle };
+	proc_for_each_pid(scan_pid, &scan);
+	group->cpu_ns = scan.cpu_ns;
+	group->wait_ns = scan.wait_ns;
+	if (forceidle) {
+		group->forceidle_ns = scan.forceidle_ns;
+	}
+	return true;
+}
+
+static size_t collect_all_groups(struct acct_group **groups)
+{
+	const char *root = cgroup_root();
+	if (!root) {
+		error(1, 0, "No cgroup v2 hierarchy is mounted");
+	}
+	char base[PATH_MAX];
+	snprintf(base, sizeof(base), "%s/" CGROUP_ACCT_DIR, root);
+
+	DIR *dir = opendir(base);
+	if (!dir) {
+		error(1, errno, "Failed to open %s", base);
+	}
+	size_t count = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.') {
+			continue;
+		}
+		char path[PATH_MAX];
+		if ((size_t)snprintf(path, sizeof(path), "%s/%s", base,
+				     entry->d_name) >= sizeof(path)) {
+			continue;
+		}
+		*groups = realloc(*groups, (count + 1) * sizeof(**groups));
+		if (!*groups) {
+			error(1, errno, "Failed to allocate accounting groups");
+		}
+		struct acct_group *group = &(*groups)[count++];
+		memset(group, 0, sizeof(*group));
+		snprintf(group->name, sizeof(group->name), "%s",
+			 entry->d_name);
+		memcpy(group->path, path, sizeof(group->path));
+	}
+	closedir(dir);
+	return count;
+}
+
+void acct_stat(const struct acct_options *opts)
+{
+	struct acct_group *groups = NULL;
+	size_t count = 0;
+	unsigned long cookie = 0;
+
+	if (opts->pid) {
+		if (core_sched_get(opts->pid, &cookie)) {
+			error(1, errno, "Failed to get cookie from PID %d",
+			      opts->pid);
+		}
+		groups = calloc(1, sizeof(*groups));
+		if (!groups) {
+			error(1, errno, "Failed to allocate accounting groups");
+		}
+		snprintf(groups->name, sizeof(groups->name), "0x%lx", cookie);
+		count = 1;
+	} else if (opts->group_count) {
+		groups = calloc(opts->group_count, sizeof(*groups));
+		if (!groups) {
+			error(1, errno, "Failed to allocate accounting groups");
+		}
+		for (size_t i = 0; i < opts->group_count; i++) {
+			snprintf(groups[i].name, sizeof(groups[i].name), "%s",
+				 opts->groups[i]);
+			if (cgroup_acct_resolve(opts->groups[i],
+						groups[i].path,
+						sizeof(groups[i].path))) {
+				error(1, errno,
+				      "Failed to find accounting cgroup of %s",
+				      opts->groups[i]);
+			}
+		}
+		count = opts->group_count;
+	} else {
+		count = collect_all_groups(&groups);
+	}
+	if (!count) {
+		error(1, 0, "There are no accounting groups to report on");
+	}
+
+	struct procread reader;
+	if (procread_init(&reader)) {
+		error(1, errno, "Failed to allocate the procfs reader");
+	}
+
+	unsigned int fi_every = opts->fi_every ? opts->fi_every : 1;
+	unsigned long long prev_at = now_ns();
+	struct timespec interval = {
+		.tv_sec = opts->interval_ms / 1000,
+		.tv_nsec = (opts->interval_ms % 1000) * 1000000L,
+	};
+
+	for (unsigned int tick = 0;; tick++) {
+		bool forceidle = tick % fi_every == 0;
+		unsigned long long at = now_ns();
+		double elapsed = (at - prev_at) / 1e9;
+
+		if (tick) {
+			printf("%-24s %8s %8s %10s\n", "GROUP", "CPU%", "WAIT%",
+			       "FI ms/s");
+		}
+		for (size_t i = 0; i < count; i++) {
+			struct acct_group *group = &groups[i];
+			unsigned long long fi_prev = group->forceidle_ns;
+			bool ok = opts->pid ?
+					  sample_cookie(group, cookie,
+							forceidle) :
+					  sample_cgroup(group, forceidle,
+							&reader);
+			if (!ok) {
+				error(0, errno, "Failed to sample group %s",
+				      group->name);
+				group->have_prev = false;
+				group->have_forceidle = false;
+				group->forceidle_rate = 0;
+				continue;
+			}
+			if (forceidle) {
+				if (group->have_forceidle) {
+					double fi_elapsed =
+						(at - group->forceidle_at) /
+						1e9;
+					group->forceidle_rate =
+						delta(group->forceidle_ns,
+						      fi_prev) /
+						1e6 / fi_elapsed;
+				}
+				group->forceidle_at = at;
+				group->have_forceidle = true;
+			}
+			if (tick && group->have_prev) {
+				printf("%-24s %8.1f %8.1f %10.2f\n",
+				       group->name,
+				       delta(group->cpu_ns,
+					     group->prev_cpu_ns) /
+					       1e7 / elapsed,
+				       delta(group->wait_ns,
+					     group->prev_wait_ns) /
+					       1e7 / elapsed,
+				       group->forceidle_rate);
+			}
+			group->prev_cpu_ns = group->cpu_ns;
+			group->prev_wait_ns = group->wait_ns;
+			group->have_prev = true;
+		}
+		if (tick) {
+			printf("\n");
+			fflush(stdout);
+		}
+		prev_at = at;
+		if (opts->count && tick == opts->count) {
+			break;
+		}
+		nanosleep(&interval, NULL);
+	}
+	procread_free(&reader);
+	free(groups);
+}
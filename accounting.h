@@ -0,0 +1,27 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_ACCOUNTING_H
+#define CORESCHED_ACCOUNTING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct acct_options {
+	// Accounting cgroups to report on. When empty and no pid is given,
+	// every group below <cgroup root>/coresched is reported.
+	const char **groups;
+	size_t group_count;
+	// Report on the cookie group of this pid by scanning all tasks.
+	pid_t pid;
+	unsigned int interval_ms;
+	// Number of samples to print, 0 for no limit.
+	unsigned int count;
+	// Forced idle is read from every member task, so only sample it
+	// every this many intervals.
+	unsigned int fi_every;
+};
+
+void acct_stat(const struct acct_options *opts);
+
+#endif
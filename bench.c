@@ -0,0 +1,1635 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "bench.h"
+#include "control.h"
+#include "coresched.h"
+#include "energy.h"
+#include "handoff.h"
+#include "pool.h"
+#include "proc.h"
+#include "topology.h"
+#include "util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Requests that the launch benchmark sends per run.
+#define LAUNCH_REQUESTS_PER_RUN 100
+// Longest pause between two requests, so that they land at different points
+// of the daemon's scans.
+#define LAUNCH_MAX_GAP_MS 10
+// Depth of the fork-join tree that the pool benchmark runs per round, and
+// the work done by each of its leaves.
+#define POOL_TREE_DEPTH 14
+#define POOL_LEAF_OPS 20000
+// Rounds of the tree per run.
+#define POOL_ROUNDS 10
+// Requests that every client of the handoff benchmark sends per run, and
+// the work each of them does.
+#define HANDOFF_REQUESTS_PER_RUN 500
+#define HANDOFF_REQUEST_OPS 5000
+// The synthetic VMs of the haltpoll benchmark: vCPUs per VM, the work a
+// vCPU does per event, the mean gap between its events and how long each
+// point of the sweep runs per run.
+#define HALTPOLL_VCPUS 2
+#define HALTPOLL_BURST_NS 100000ULL
+#define HALTPOLL_EVENT_NS 500000.0
+#define HALTPOLL_RUN_MS 1000
+// Wakeup latencies that each vCPU keeps.
+#define HALTPOLL_SAMPLES 4096
+// Containers that the init benchmark starts per run and wrapper.
+#define INIT_STARTS_PER_RUN 100
+// The service of the tier benchmark: mean gap between the requests of a
+// thread, the work per request, how long each configuration runs per run
+// and the latencies that each thread keeps.
+#define TIER_REQUEST_GAP_NS 1000000.0
+#define TIER_REQUEST_NS 100000ULL
+#define TIER_RUN_MS 1000
+#define TIER_SAMPLES 16384
+// Tasks that the fork benchmark starts per run, for every operation.
+#define FORK_STARTS_PER_RUN 200
+
+enum smt_config {
+	CONFIG_COOKIE,
+	CONFIG_NOSMT,
+	CONFIG_SMT,
+	CONFIG_COUNT,
+};
+
+static const char *config_names[CONFIG_COUNT] = {
+	[CONFIG_COOKIE] = "cookie",
+	[CONFIG_NOSMT] = "nosmt",
+	[CONFIG_SMT] = "smt",
+};
+
+struct bench_result {
+	bool ran;
+	unsigned int jobs;
+	unsigned int failed;
+	double wall_s;
+	double cpu_s;
+	unsigned int cpus;
+	double p50_ms;
+	double p90_ms;
+	double p99_ms;
+	double max_ms;
+	long max_rss_kb;
+	struct energy_reading energy;
+};
+
+// Measures every phase of a benchmark that runs with --energy.
+static struct energy_meter energy_meter;
+
+static void measure_start(const struct bench_options *opts)
+{
+	if (opts->energy) {
+		energy_start(&energy_meter);
+	}
+}
+
+static void measure_stop(const struct bench_options *opts,
+			 struct energy_reading *reading)
+{
+	if (opts->energy) {
+		energy_stop(&energy_meter, reading);
+	}
+}
+
+static void print_value(double value, int width, int precision)
+{
+	if (isnan(value)) {
+		printf(" %*s", width, "-");
+	} else {
+		printf(" %*.*f", width, precision, value);
+	}
+}
+
+// End a row of a table with the columns of --energy: package power,
+// effective frequency and the work done per joule, which is the throughput
+// per watt.
+static void print_energy_header(const struct bench_options *opts,
+				const char *per_joule)
+{
+	if (opts->energy) {
+		printf(" %8s %8s %12s", "WATTS", "MHZ", per_joule);
+	}
+	printf("\n");
+}
+
+static void print_energy(const struct bench_options *opts,
+			 const struct energy_reading *reading, double work)
+{
+	if (opts->energy) {
+		double seconds = reading->seconds;
+		print_value(reading->joules / seconds, 8, 1);
+		print_value(reading->mega_cycles / seconds, 8, 0);
+		print_value(work / reading->joules, 12, 3);
+	}
+	printf("\n");
+}
+
+// SMT has to come back on even if the benchmark is interrupted.
+static struct smt_saved smt_saved;
+
+static void restore_smt_and_exit(int sig)
+{
+	smt_restore(&smt_saved);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+double bench_percentile(double *samples, size_t count, double p)
+{
+	if (!count) {
+		return 0;
+	}
+	qsort(samples, count, sizeof(*samples), compare_double);
+	size_t index = p / 100 * (count - 1) + 0.5;
+	return samples[index < count ? index : count - 1];
+}
+
+static pid_t spawn_job(const struct bench_options *opts, bool cookie)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		error(1, errno, "Failed to spawn benchmark job");
+	}
+	if (pid) {
+		return pid;
+	}
+
+	if (cookie && core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+		error(126, errno, "Failed to create cookie for benchmark job");
+	}
+	if (opts->workload) {
+		struct workload_result result;
+		workload_run(opts->workload, cookie, &result);
+		exit(0);
+	}
+	int null = open("/dev/null", O_WRONLY);
+	if (null >= 0) {
+		dup2(null, STDOUT_FILENO);
+		close(null);
+	}
+	execvp(opts->argv[0], opts->argv);
+	error(127, errno, "Failed to run %s", opts->argv[0]);
+	__builtin_unreachable();
+}
+
+static void run_config(const struct bench_options *opts, bool cookie,
+		       struct bench_result *result)
+{
+	size_t total = opts->jobs * opts->runs;
+	double *latency = calloc(total, sizeof(*latency));
+	pid_t *pids = calloc(opts->jobs, sizeof(*pids));
+	unsigned long long *started = calloc(opts->jobs, sizeof(*started));
+	if (!latency || !pids || !started) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+
+	size_t done = 0;
+	unsigned long long begin = now_ns();
+	measure_start(opts);
+	for (unsigned int run = 0; run < opts->runs; run++) {
+		for (unsigned int job = 0; job < opts->jobs; job++) {
+			started[job] = now_ns();
+			pids[job] = spawn_job(opts, cookie);
+		}
+		for (unsigned int left = opts->jobs; left; left--) {
+			int status;
+			struct rusage usage;
+			pid_t pid = wait4(-1, &status, 0, &usage);
+			if (pid < 0) {
+				error(1, errno, "Failed to wait for job");
+			}
+			unsigned long long end = now_ns();
+			for (unsigned int job = 0; job < opts->jobs; job++) {
+				if (pids[job] == pid) {
+					latency[done++] =
+						(end - started[job]) / 1e6;
+				}
+			}
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+				result->failed++;
+			}
+			result->cpu_s += usage.ru_utime.tv_sec +
+					 usage.ru_utime.tv_usec / 1e6 +
+					 usage.ru_stime.tv_sec +
+					 usage.ru_stime.tv_usec / 1e6;
+		}
+	}
+	measure_stop(opts, &result->energy);
+	result->wall_s = (now_ns() - begin) / 1e9;
+	result->jobs = done;
+	result->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	result->p50_ms = bench_percentile(latency, done, 50);
+	result->p90_ms = bench_percentile(latency, done, 90);
+	result->p99_ms = bench_percentile(latency, done, 99);
+	result->ran = true;
+
+	free(latency);
+	free(pids);
+	free(started);
+}
+
+static bool config_enabled(const char *configs, const char *name)
+{
+	size_t len = strlen(name);
+	for (const char *at = configs; (at = strstr(at, name)); at += len) {
+		if ((at == configs || at[-1] == ',') &&
+		    (at[len] == ',' || at[len] == '\0')) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void bench_smt(const struct bench_options *opts)
+{
+	if (!opts->argv && !opts->workload) {
+		error(1, 0,
+		      "The smt benchmark requires a program or a workload to run");
+	}
+	unsigned long cookie;
+	bool have_cookies = !core_sched_get(0, &cookie) || errno != EINVAL;
+
+	struct bench_result results[CONFIG_COUNT] = { 0 };
+	for (int config = 0; config < CONFIG_COUNT; config++) {
+		if (!config_enabled(opts->configs, config_names[config])) {
+			continue;
+		}
+		fprintf(stderr, "running %u x %u jobs with %s\n", opts->runs,
+			opts->jobs, config_names[config]);
+
+		switch (config) {
+		case CONFIG_COOKIE:
+			if (!have_cookies) {
+				error(0, 0,
+				      "Skipping cookie: core scheduling is not supported by this kernel");
+				continue;
+			}
+			run_config(opts, true, &results[config]);
+			break;
+		case CONFIG_NOSMT:
+			signal(SIGINT, restore_smt_and_exit);
+			signal(SIGTERM, restore_smt_and_exit);
+			if (smt_disable(&smt_saved)) {
+				error(0, errno, "Skipping nosmt: failed to disable SMT");
+			} else {
+				run_config(opts, false, &results[config]);
+			}
+			if (smt_restore(&smt_saved)) {
+				error(0, errno, "Failed to turn SMT back on");
+			}
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			break;
+		case CONFIG_SMT:
+			run_config(opts, false, &results[config]);
+			break;
+		}
+	}
+
+	printf("%-8s %6s %6s %10s %10s %10s %10s %10s %7s", "CONFIG", "JOBS",
+	       "FAILED", "JOBS/S", "P50 MS", "P90 MS", "P99 MS", "CPU-S/JOB",
+	       "UTIL%");
+	print_energy_header(opts, "JOBS/J");
+	for (int config = 0; config < CONFIG_COUNT; config++) {
+		struct bench_result *r = &results[config];
+		if (!r->ran) {
+			continue;
+		}
+		printf("%-8s %6u %6u %10.2f %10.2f %10.2f %10.2f %10.3f %7.1f",
+		       config_names[config], r->jobs, r->failed,
+		       r->jobs / r->wall_s, r->p50_ms, r->p90_ms, r->p99_ms,
+		       r->jobs ? r->cpu_s / r->jobs : 0,
+		       100 * r->cpu_s / (r->wall_s * r->cpus));
+		print_energy(opts, &r->energy, r->jobs);
+	}
+}
+
+static pid_t spawn_idle(void)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		error(1, errno, "Failed to spawn idle process");
+	}
+	if (!pid) {
+		for (;;) {
+			pause();
+		}
+	}
+	return pid;
+}
+
+static void reap(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+static void launch_phase(const struct bench_options *opts,
+			 unsigned int background, struct bench_result *result)
+{
+	pid_t *idle = calloc(background ? background : 1, sizeof(*idle));
+	size_t total = opts->runs * LAUNCH_REQUESTS_PER_RUN;
+	double *latency = calloc(total, sizeof(*latency));
+	if (!idle || !latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+	for (unsigned int i = 0; i < background; i++) {
+		idle[i] = spawn_idle();
+	}
+
+	size_t done = 0;
+	unsigned long long begin = now_ns();
+	measure_start(opts);
+	for (size_t i = 0; i < total; i++) {
+		struct timespec gap = {
+			.tv_nsec = rand() % (LAUNCH_MAX_GAP_MS * 1000000),
+		};
+		nanosleep(&gap, NULL);
+
+		pid_t pid = spawn_idle();
+		unsigned long long start = now_ns();
+		if (control_request(opts->socket, pid, opts->group)) {
+			if (!result->failed++) {
+				error(0, errno, "Request for PID %d failed",
+				      pid);
+			}
+		} else {
+			latency[done++] = (now_ns() - start) / 1e6;
+		}
+		reap(pid);
+	}
+	measure_stop(opts, &result->energy);
+	result->wall_s = (now_ns() - begin) / 1e9;
+	result->jobs = done;
+	result->p50_ms = bench_percentile(latency, done, 50);
+	result->p90_ms = bench_percentile(latency, done, 90);
+	result->p99_ms = bench_percentile(latency, done, 99);
+	// bench_percentile sorted the samples.
+	result->max_ms = done ? latency[done - 1] : 0;
+	result->ran = true;
+
+	for (unsigned int i = 0; i < background; i++) {
+		reap(idle[i]);
+	}
+	free(idle);
+	free(latency);
+}
+
+// Measure how long the daemon takes to answer a launch request, first on
+// an otherwise idle system and then with as many extra processes as there
+// are jobs, which every scan of the daemon has to go through.
+static void bench_launch(const struct bench_options *opts)
+{
+	if (!opts->group) {
+		error(1, 0, "The launch benchmark requires a group to request");
+	}
+	srand(now_ns());
+
+	struct bench_result results[2] = { 0 };
+	unsigned int background[2] = { 0, opts->jobs };
+	for (int phase = 0; phase < 2; phase++) {
+		fprintf(stderr,
+			"sending %u requests with %u background processes\n",
+			opts->runs * LAUNCH_REQUESTS_PER_RUN, background[phase]);
+		launch_phase(opts, background[phase], &results[phase]);
+	}
+
+	printf("%10s %8s %6s %10s %10s %10s %10s", "BACKGROUND", "REQUESTS",
+	       "FAILED", "P50 MS", "P90 MS", "P99 MS", "MAX MS");
+	print_energy_header(opts, "REQUESTS/J");
+	for (int phase = 0; phase < 2; phase++) {
+		struct bench_result *r = &results[phase];
+		printf("%10u %8u %6u %10.2f %10.2f %10.2f %10.2f",
+		       background[phase], r->jobs, r->failed, r->p50_ms,
+		       r->p90_ms, r->p99_ms, r->max_ms);
+		print_energy(opts, &r->energy, r->jobs);
+	}
+}
+
+struct pool_node {
+	struct pool *pool;
+	unsigned int depth;
+	struct pool_node *children;
+	double sum;
+};
+
+static void pool_tree(void *arg)
+{
+	struct pool_node *node = arg;
+	if (!node->depth) {
+		double x = node->depth + 1;
+		for (int i = 0; i < POOL_LEAF_OPS; i++) {
+			x = x * 1.0000001 + 0.5;
+		}
+		node->sum = x;
+		return;
+	}
+	node->children = calloc(2, sizeof(*node->children));
+	if (!node->children) {
+		error(1, errno, "Failed to allocate pool benchmark task");
+	}
+	for (int i = 0; i < 2; i++) {
+		node->children[i].pool = node->pool;
+		node->children[i].depth = node->depth - 1;
+		pool_submit(node->pool, pool_tree, &node->children[i]);
+	}
+}
+
+static void pool_tree_free(struct pool_node *node)
+{
+	if (node->children) {
+		pool_tree_free(&node->children[0]);
+		pool_tree_free(&node->children[1]);
+		free(node->children);
+	}
+}
+
+static pid_t spawn_busy(void)
+{
+	pid_t pid = fork();
+	if (pid == -1) {
+		error(1, errno, "Failed to spawn busy process");
+	}
+	if (!pid) {
+		for (volatile unsigned long spin = 0;; spin++) {
+		}
+	}
+	return pid;
+}
+
+static void pool_phase(const struct bench_options *opts, bool isolated,
+		       struct bench_result *result)
+{
+	pid_t *noise = calloc(opts->jobs, sizeof(*noise));
+	size_t tasks = (2UL << POOL_TREE_DEPTH) - 1;
+	double *latency = calloc(opts->runs * POOL_ROUNDS, sizeof(*latency));
+	if (!noise || !latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+	// Noisy neighbours, without a cookie, that the isolated pool should
+	// not have to share its cores with. They start first, so that they do
+	// not inherit the affinity of a reserving pool.
+	for (unsigned int i = 0; i < opts->jobs; i++) {
+		noise[i] = opts->argv || opts->workload ?
+				   spawn_job(opts, false) :
+				   spawn_busy();
+	}
+
+	struct pool_options pool_opts = {
+		.reserve = isolated,
+		.no_cookie = !isolated,
+	};
+	struct pool *pool = pool_create(&pool_opts);
+	if (!pool) {
+		error(1, errno, "Failed to create thread pool");
+	}
+
+	size_t done = 0;
+	unsigned long long begin = now_ns();
+	measure_start(opts);
+	for (unsigned int round = 0; round < opts->runs * POOL_ROUNDS;
+	     round++) {
+		struct pool_node root = { pool, POOL_TREE_DEPTH, NULL, 0 };
+		unsigned long long start = now_ns();
+		pool_submit(pool, pool_tree, &root);
+		pool_wait(pool);
+		latency[done++] = (now_ns() - start) / 1e6;
+		pool_tree_free(&root);
+	}
+	measure_stop(opts, &result->energy);
+	result->wall_s = (now_ns() - begin) / 1e9;
+	result->jobs = done * tasks;
+	result->cpus = pool_worker_count(pool);
+	result->p50_ms = bench_percentile(latency, done, 50);
+	result->p90_ms = bench_percentile(latency, done, 90);
+	result->p99_ms = bench_percentile(latency, done, 99);
+	result->max_ms = done ? latency[done - 1] : 0;
+	result->ran = true;
+
+	for (unsigned int i = 0; i < opts->jobs; i++) {
+		reap(noise[i]);
+	}
+	pool_destroy(pool);
+	free(noise);
+	free(latency);
+}
+
+// Compare the throughput of a thread pool with its own cookie and reserved
+// cores against the same pool without either, while the jobs run next to
+// it as noisy neighbours.
+static void bench_pool(const struct bench_options *opts)
+{
+	unsigned long cookie;
+	bool have_cookies = !core_sched_get(0, &cookie) || errno != EINVAL;
+
+	static const int configs[] = { CONFIG_COOKIE, CONFIG_SMT };
+	struct bench_result results[2] = { 0 };
+	for (int i = 0; i < 2; i++) {
+		if (!config_enabled(opts->configs, config_names[configs[i]])) {
+			continue;
+		}
+		if (configs[i] == CONFIG_COOKIE && !have_cookies) {
+			error(0, 0,
+			      "Skipping cookie: core scheduling is not supported by this kernel");
+			continue;
+		}
+		fprintf(stderr, "running %u x %u pool rounds with %s\n",
+			opts->runs, POOL_ROUNDS, config_names[configs[i]]);
+		pool_phase(opts, configs[i] == CONFIG_COOKIE, &results[i]);
+	}
+
+	printf("%-8s %7s %12s %10s %10s %10s %10s", "CONFIG", "WORKERS",
+	       "TASKS/S", "P50 MS", "P90 MS", "P99 MS", "MAX MS");
+	print_energy_header(opts, "TASKS/J");
+	for (int i = 0; i < 2; i++) {
+		struct bench_result *r = &results[i];
+		if (!r->ran) {
+			continue;
+		}
+		printf("%-8s %7u %12.0f %10.2f %10.2f %10.2f %10.2f",
+		       config_names[configs[i]], r->cpus, r->jobs / r->wall_s,
+		       r->p50_ms, r->p90_ms, r->p99_ms, r->max_ms);
+		print_energy(opts, &r->energy, r->jobs);
+	}
+}
+
+enum handoff_config {
+	HANDOFF_SWITCH,
+	HANDOFF_WORKER,
+};
+
+struct handoff_bench {
+	const struct bench_options *opts;
+	enum handoff_config config;
+	struct handoff *handoff;
+	// A process in the cookie of every tenant, for the switching clients
+	// to share it from.
+	pid_t *anchors;
+	atomic_uint failed;
+};
+
+struct handoff_client {
+	struct handoff_bench *bench;
+	pthread_t thread;
+	unsigned int seed;
+	sem_t done;
+	double *latency;
+	size_t count;
+};
+
+static volatile double handoff_sink;
+
+static void handoff_work(void *arg)
+{
+	struct handoff_client *client = arg;
+	double x = client->count;
+	for (int i = 0; i < HANDOFF_REQUEST_OPS; i++) {
+		x = x * 1.0000001 + 0.5;
+	}
+	handoff_sink = x;
+}
+
+static void handoff_done(void *arg)
+{
+	struct handoff_client *client = arg;
+	handoff_work(client);
+	sem_post(&client->done);
+}
+
+static void *handoff_client_main(void *data)
+{
+	struct handoff_client *client = data;
+	struct handoff_bench *bench = client->bench;
+	size_t total = bench->opts->runs * HANDOFF_REQUESTS_PER_RUN;
+	for (size_t i = 0; i < total; i++) {
+		unsigned int tenant = rand_r(&client->seed) % bench->opts->jobs;
+		unsigned long long start = now_ns();
+		if (bench->config == HANDOFF_SWITCH) {
+			if (core_sched_share_from(bench->anchors[tenant])) {
+				bench->failed++;
+				continue;
+			}
+			handoff_work(client);
+		} else {
+			if (handoff_submit(bench->handoff, tenant,
+					   handoff_done, client)) {
+				bench->failed++;
+				continue;
+			}
+			while (sem_wait(&client->done) && errno == EINTR) {
+			}
+		}
+		client->latency[client->count++] = (now_ns() - start) / 1e6;
+	}
+	return NULL;
+}
+
+static pid_t spawn_anchor(void)
+{
+	int ready[2];
+	if (pipe(ready)) {
+		error(1, errno, "Failed to create pipe");
+	}
+	pid_t pid = fork();
+	if (pid == -1) {
+		error(1, errno, "Failed to spawn tenant process");
+	}
+	if (!pid) {
+		char ok = !core_sched_create(0, SCHED_CORE_SCOPE_TGID);
+		if (write(ready[1], &ok, 1) != 1 || !ok) {
+			exit(1);
+		}
+		for (;;) {
+			pause();
+		}
+	}
+	char ok = 0;
+	close(ready[1]);
+	if (read(ready[0], &ok, 1) != 1 || !ok) {
+		error(1, 0, "Failed to create a cookie for a tenant");
+	}
+	close(ready[0]);
+	return pid;
+}
+
+static void handoff_phase(struct handoff_bench *bench,
+			  struct bench_result *result)
+{
+	const struct bench_options *opts = bench->opts;
+	unsigned int clients = opts->jobs;
+	size_t per_client = opts->runs * HANDOFF_REQUESTS_PER_RUN;
+	struct handoff_client *client = calloc(clients, sizeof(*client));
+	double *latency = calloc(clients * per_client, sizeof(*latency));
+	if (!client || !latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+
+	unsigned long long begin = now_ns();
+	measure_start(opts);
+	for (unsigned int i = 0; i < clients; i++) {
+		client[i].bench = bench;
+		client[i].seed = i + 1;
+		client[i].latency = &latency[i * per_client];
+		sem_init(&client[i].done, 0, 0);
+		errno = pthread_create(&client[i].thread, NULL,
+				       handoff_client_main, &client[i]);
+		if (errno) {
+			error(1, errno, "Failed to start benchmark client");
+		}
+	}
+	size_t done = 0;
+	for (unsigned int i = 0; i < clients; i++) {
+		pthread_join(client[i].thread, NULL);
+		sem_destroy(&client[i].done);
+		// Pack the samples of every client together.
+		memmove(&latency[done], client[i].latency,
+			client[i].count * sizeof(*latency));
+		done += client[i].count;
+	}
+	measure_stop(opts, &result->energy);
+	result->wall_s = (now_ns() - begin) / 1e9;
+	result->jobs = done;
+	result->failed = bench->failed;
+	result->p50_ms = bench_percentile(latency, done, 50);
+	result->p90_ms = bench_percentile(latency, done, 90);
+	result->p99_ms = bench_percentile(latency, done, 99);
+	result->max_ms = done ? latency[done - 1] : 0;
+	result->ran = true;
+
+	free(client);
+	free(latency);
+}
+
+// Compare two ways for a server to run the requests of -j tenants each in
+// the cookie of its tenant, with as many clients as tenants: the thread of
+// a client switching to the tenant's cookie for every request, and handing
+// the request off to a worker that stays in that cookie.
+static void bench_handoff(const struct bench_options *opts)
+{
+	unsigned long cookie;
+	if (core_sched_get(0, &cookie) && errno == EINVAL) {
+		error(1, 0, "Core scheduling is not supported by this kernel");
+	}
+
+	static const char *names[] = {
+		[HANDOFF_SWITCH] = "switch",
+		[HANDOFF_WORKER] = "handoff",
+	};
+	struct bench_result results[2] = { 0 };
+	struct handoff_bench bench = { .opts = opts };
+
+	bench.anchors = calloc(opts->jobs, sizeof(*bench.anchors));
+	if (!bench.anchors) {
+		error(1, errno, "Failed to allocate tenants");
+	}
+	for (unsigned int i = 0; i < opts->jobs; i++) {
+		bench.anchors[i] = spawn_anchor();
+	}
+	fprintf(stderr, "switching cookies for %u x %u requests\n",
+		opts->jobs, opts->runs * HANDOFF_REQUESTS_PER_RUN);
+	bench.config = HANDOFF_SWITCH;
+	handoff_phase(&bench, &results[HANDOFF_SWITCH]);
+	for (unsigned int i = 0; i < opts->jobs; i++) {
+		reap(bench.anchors[i]);
+	}
+	free(bench.anchors);
+
+	struct handoff_options handoff_opts = { 0 };
+	bench.handoff = handoff_create(&handoff_opts);
+	if (!bench.handoff) {
+		error(1, errno, "Failed to create handoff workers");
+	}
+	fprintf(stderr, "handing off %u x %u requests\n", opts->jobs,
+		opts->runs * HANDOFF_REQUESTS_PER_RUN);
+	bench.config = HANDOFF_WORKER;
+	bench.failed = 0;
+	handoff_phase(&bench, &results[HANDOFF_WORKER]);
+	handoff_destroy(bench.handoff);
+
+	printf("%-8s %8s %6s %12s %10s %10s %10s %10s", "CONFIG", "REQUESTS",
+	       "FAILED", "REQUESTS/S", "P50 MS", "P90 MS", "P99 MS", "MAX MS");
+	print_energy_header(opts, "REQUESTS/J");
+	for (int i = 0; i < 2; i++) {
+		struct bench_result *r = &results[i];
+		printf("%-8s %8u %6u %12.0f %10.3f %10.3f %10.3f %10.3f",
+		       names[i], r->jobs, r->failed, r->jobs / r->wall_s,
+		       r->p50_ms, r->p90_ms, r->p99_ms, r->max_ms);
+		print_energy(opts, &r->energy, r->jobs);
+	}
+}
+
+// Poll durations in microseconds that the haltpoll benchmark sweeps, like
+// halt_poll_ns of KVM. -1 polls until the next event, like a guest booted
+// with idle=poll.
+static const long haltpoll_sweep_us[] = { 0, 10, 50, 200, 1000, -1 };
+
+struct vcpu_stats {
+	unsigned long long bursts;
+	unsigned long long wakeups;
+	// Wakeups that arrived while polling, so without blocking.
+	unsigned long long polled;
+	unsigned long long poll_ns;
+	unsigned long long forceidle_ns;
+	size_t samples;
+	double wake_us[HALTPOLL_SAMPLES];
+};
+
+struct vcpu {
+	pthread_t thread;
+	long poll_ns;
+	unsigned long long end;
+	unsigned int seed;
+	struct vcpu_stats stats;
+};
+
+static void spin_until(unsigned long long deadline)
+{
+	while (now_ns() < deadline) {
+	}
+}
+
+// An exponentially distributed gap between events with the given mean.
+static unsigned long long next_gap(unsigned int *seed, double mean_ns)
+{
+	double u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+	return -mean_ns * log(u);
+}
+
+// Run a burst for every event and halt in between, first polling for the
+// next event for poll_ns and then blocking until it arrives.
+static void *vcpu_main(void *data)
+{
+	struct vcpu *v = data;
+	struct vcpu_stats *stats = &v->stats;
+	unsigned long long event = now_ns() + next_gap(&v->seed, HALTPOLL_EVENT_NS);
+	while (event < v->end) {
+		unsigned long long now = now_ns();
+		if (event > now) {
+			unsigned long long poll_until =
+				v->poll_ns < 0 ? event : now + v->poll_ns;
+			unsigned long long polled = now;
+			while (polled < event && polled < poll_until) {
+				polled = now_ns();
+			}
+			stats->poll_ns += polled - now;
+			if (polled >= event) {
+				stats->polled++;
+			} else {
+				struct timespec at = {
+					.tv_sec = event / 1000000000ULL,
+					.tv_nsec = event % 1000000000ULL,
+				};
+				while (clock_nanosleep(CLOCK_MONOTONIC,
+						       TIMER_ABSTIME, &at,
+						       NULL) == EINTR) {
+				}
+			}
+			if (stats->samples < HALTPOLL_SAMPLES) {
+				stats->wake_us[stats->samples++] =
+					(now_ns() - event) / 1e3;
+			}
+			stats->wakeups++;
+		}
+		spin_until(now_ns() + HALTPOLL_BURST_NS);
+		stats->bursts++;
+		event += next_gap(&v->seed, HALTPOLL_EVENT_NS);
+	}
+	proc_read_forceidle(gettid(), &stats->forceidle_ns);
+	return NULL;
+}
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	for (const char *at = buf; len;) {
+		ssize_t n = write(fd, at, len);
+		if (n <= 0) {
+			exit(1);
+		}
+		at += n;
+		len -= n;
+	}
+}
+
+static bool read_all(int fd, void *buf, size_t len)
+{
+	for (char *at = buf; len;) {
+		ssize_t n = read(fd, at, len);
+		if (n <= 0) {
+			return false;
+		}
+		at += n;
+		len -= n;
+	}
+	return true;
+}
+
+// A process in a cookie of its own with HALTPOLL_VCPUS vCPU threads, that
+// writes their statistics to the returned pipe when they are done.
+static int spawn_vm(long poll_us, unsigned long long end, bool cookie,
+		    unsigned int seed, pid_t *pid)
+{
+	int out[2];
+	if (pipe(out)) {
+		error(1, errno, "Failed to create pipe");
+	}
+	*pid = fork();
+	if (*pid == -1) {
+		error(1, errno, "Failed to spawn VM");
+	}
+	if (*pid) {
+		close(out[1]);
+		return out[0];
+	}
+
+	close(out[0]);
+	if (cookie && core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+		error(1, errno, "Failed to create cookie for VM");
+	}
+	struct vcpu *vcpus = calloc(HALTPOLL_VCPUS, sizeof(*vcpus));
+	if (!vcpus) {
+		error(1, errno, "Failed to allocate vCPUs");
+	}
+	for (int i = 0; i < HALTPOLL_VCPUS; i++) {
+		vcpus[i].poll_ns = poll_us < 0 ? -1 : poll_us * 1000;
+		vcpus[i].end = end;
+		vcpus[i].seed = seed * HALTPOLL_VCPUS + i;
+		errno = pthread_create(&vcpus[i].thread, NULL, vcpu_main,
+				       &vcpus[i]);
+		if (errno) {
+			error(1, errno, "Failed to start vCPU");
+		}
+	}
+	for (int i = 0; i < HALTPOLL_VCPUS; i++) {
+		pthread_join(vcpus[i].thread, NULL);
+		write_all(out[1], &vcpus[i].stats, sizeof(vcpus[i].stats));
+	}
+	exit(0);
+}
+
+static void *batch_main(void *data)
+{
+	unsigned long long *ops = data;
+	unsigned long long end = *ops;
+	*ops = 0;
+	while (now_ns() < end) {
+		for (volatile int i = 0; i < 1000; i++) {
+		}
+		*ops += 1000;
+	}
+	return NULL;
+}
+
+// A process that spins on threads threads until end, and writes the number
+// of loop iterations it did to the returned pipe. It gets a cookie of its
+// own if cookie is set, and runs with SCHED_IDLE if idle is set.
+static int spawn_batch(unsigned long long end, long threads, bool cookie,
+		       bool idle, pid_t *pid)
+{
+	int out[2];
+	if (pipe(out)) {
+		error(1, errno, "Failed to create pipe");
+	}
+	*pid = fork();
+	if (*pid == -1) {
+		error(1, errno, "Failed to spawn batch job");
+	}
+	if (*pid) {
+		close(out[1]);
+		return out[0];
+	}
+
+	close(out[0]);
+	if (cookie && core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+		error(1, errno, "Failed to create cookie for batch job");
+	}
+	struct sched_param param = { 0 };
+	if (idle && sched_setscheduler(0, SCHED_IDLE, &param)) {
+		error(1, errno, "Failed to switch batch job to SCHED_IDLE");
+	}
+	pthread_t *thread = calloc(threads, sizeof(*thread));
+	unsigned long long *ops = calloc(threads, sizeof(*ops));
+	if (!thread || !ops) {
+		error(1, errno, "Failed to allocate batch threads");
+	}
+	for (long i = 0; i < threads; i++) {
+		ops[i] = end;
+		errno = pthread_create(&thread[i], NULL, batch_main, &ops[i]);
+		if (errno) {
+			error(1, errno, "Failed to start batch thread");
+		}
+	}
+	unsigned long long total = 0;
+	for (long i = 0; i < threads; i++) {
+		pthread_join(thread[i], NULL);
+		total += ops[i];
+	}
+	write_all(out[1], &total, sizeof(total));
+	exit(0);
+}
+
+// Run -j VMs with HALTPOLL_VCPUS vCPUs each, every VM in a cookie of its
+// own, next to a batch job on every CPU of the host, for every poll
+// duration of the sweep. The time the vCPUs spent polling is the time the
+// batch job could not use the sibling, unless it shares the cookie.
+static void bench_haltpoll(const struct bench_options *opts)
+{
+	unsigned long cookie;
+	bool cookies = !core_sched_get(0, &cookie) || errno != EINVAL;
+	if (!cookies) {
+		error(0, 0,
+		      "Core scheduling is not supported by this kernel, running the VMs without cookies");
+	}
+	unsigned long long duration = opts->runs * HALTPOLL_RUN_MS * 1000000ULL;
+	size_t vcpu_count = opts->jobs * HALTPOLL_VCPUS;
+	struct vcpu_stats *stats = malloc(sizeof(*stats));
+	double *wake_us = calloc(vcpu_count * HALTPOLL_SAMPLES,
+				 sizeof(*wake_us));
+	pid_t *vms = calloc(opts->jobs, sizeof(*vms));
+	int *pipes = calloc(opts->jobs, sizeof(*pipes));
+	if (!stats || !wake_us || !vms || !pipes) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+
+	printf("%9s %10s %12s %7s %7s %11s %11s %11s", "POLL US", "BURSTS/S",
+	       "HOST MOPS/S", "POLL%", "HIT%", "P50 WAKE US", "P99 WAKE US",
+	       "FORCEIDLE%");
+	print_energy_header(opts, "HOST MOPS/J");
+	for (size_t point = 0;
+	     point < sizeof(haltpoll_sweep_us) / sizeof(*haltpoll_sweep_us);
+	     point++) {
+		long poll_us = haltpoll_sweep_us[point];
+		fprintf(stderr, "running %u VMs polling for %ld us\n",
+			opts->jobs, poll_us);
+
+		// The VMs would print what is still buffered when they exit.
+		fflush(stdout);
+		struct energy_reading energy = { 0 };
+		measure_start(opts);
+		unsigned long long end = now_ns() + duration;
+		pid_t batch;
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		int batch_pipe = spawn_batch(end, cpus, false, false, &batch);
+		for (unsigned int i = 0; i < opts->jobs; i++) {
+			pipes[i] = spawn_vm(poll_us, end, cookies, i + 1,
+					    &vms[i]);
+		}
+
+		struct vcpu_stats sum = { 0 };
+		size_t samples = 0;
+		unsigned int failed = 0;
+		for (unsigned int i = 0; i < opts->jobs; i++) {
+			for (int v = 0; v < HALTPOLL_VCPUS; v++) {
+				if (!read_all(pipes[i], stats,
+					      sizeof(*stats))) {
+					failed++;
+					break;
+				}
+				sum.bursts += stats->bursts;
+				sum.wakeups += stats->wakeups;
+				sum.polled += stats->polled;
+				sum.poll_ns += stats->poll_ns;
+				sum.forceidle_ns += stats->forceidle_ns;
+				memcpy(&wake_us[samples], stats->wake_us,
+				       stats->samples * sizeof(*wake_us));
+				samples += stats->samples;
+			}
+			close(pipes[i]);
+			waitpid(vms[i], NULL, 0);
+		}
+		unsigned long long host_ops = 0;
+		if (!read_all(batch_pipe, &host_ops, sizeof(host_ops))) {
+			failed++;
+		}
+		close(batch_pipe);
+		waitpid(batch, NULL, 0);
+		measure_stop(opts, &energy);
+		if (failed) {
+			error(0, 0, "%u VMs did not report their results",
+			      failed);
+		}
+
+		double vcpu_ns = (double)vcpu_count * duration;
+		char label[16];
+		snprintf(label, sizeof(label), poll_us < 0 ? "idle=poll" : "%ld",
+			 poll_us);
+		printf("%9s %10.0f %12.1f %7.1f %7.1f %11.1f %11.1f %11.1f",
+		       label, sum.bursts / (duration / 1e9),
+		       host_ops / (duration / 1e3), 100 * sum.poll_ns / vcpu_ns,
+		       sum.wakeups ? 100.0 * sum.polled / sum.wakeups : 0,
+		       bench_percentile(wake_us, samples, 50),
+		       bench_percentile(wake_us, samples, 99),
+		       100 * sum.forceidle_ns / vcpu_ns);
+		print_energy(opts, &energy, host_ops / 1e6);
+	}
+
+	free(stats);
+	free(wake_us);
+	free(vms);
+	free(pipes);
+}
+
+enum tier_config {
+	TIER_ALONE,
+	TIER_BATCH,
+	TIER_BACKGROUND,
+	TIER_COUNT,
+};
+
+static const char *tier_names[TIER_COUNT] = {
+	[TIER_ALONE] = "alone",
+	[TIER_BATCH] = "batch",
+	[TIER_BACKGROUND] = "background",
+};
+
+struct service_thread {
+	pthread_t thread;
+	unsigned long long end;
+	unsigned int seed;
+	size_t samples;
+	double latency_us[TIER_SAMPLES];
+};
+
+// Requests arrive on a fixed schedule, so their latency includes the time
+// the thread waited for a CPU after the arrival.
+static void *service_main(void *data)
+{
+	struct service_thread *t = data;
+	unsigned long long arrival =
+		now_ns() + next_gap(&t->seed, TIER_REQUEST_GAP_NS);
+	while (arrival < t->end) {
+		struct timespec at = {
+			.tv_sec = arrival / 1000000000ULL,
+			.tv_nsec = arrival % 1000000000ULL,
+		};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at,
+				       NULL) == EINTR) {
+		}
+		spin_until(now_ns() + TIER_REQUEST_NS);
+		if (t->samples < TIER_SAMPLES) {
+			t->latency_us[t->samples++] = (now_ns() - arrival) / 1e3;
+		}
+		arrival += next_gap(&t->seed, TIER_REQUEST_GAP_NS);
+	}
+	return NULL;
+}
+
+// A latency-critical service in a cookie of its own, with a thread per
+// CPU, that writes the number of latencies followed by the latencies to
+// the returned pipe.
+static int spawn_service(unsigned long long end, long threads, pid_t *pid)
+{
+	int out[2];
+	if (pipe(out)) {
+		error(1, errno, "Failed to create pipe");
+	}
+	*pid = fork();
+	if (*pid == -1) {
+		error(1, errno, "Failed to spawn service");
+	}
+	if (*pid) {
+		close(out[1]);
+		return out[0];
+	}
+
+	close(out[0]);
+	if (core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+		error(1, errno, "Failed to create cookie for service");
+	}
+	struct service_thread *thread = calloc(threads, sizeof(*thread));
+	if (!thread) {
+		error(1, errno, "Failed to allocate service threads");
+	}
+	for (long i = 0; i < threads; i++) {
+		thread[i].end = end;
+		thread[i].seed = i + 1;
+		errno = pthread_create(&thread[i].thread, NULL, service_main,
+				       &thread[i]);
+		if (errno) {
+			error(1, errno, "Failed to start service thread");
+		}
+	}
+	size_t total = 0;
+	for (long i = 0; i < threads; i++) {
+		pthread_join(thread[i].thread, NULL);
+		total += thread[i].samples;
+	}
+	write_all(out[1], &total, sizeof(total));
+	for (long i = 0; i < threads; i++) {
+		write_all(out[1], thread[i].latency_us,
+			  thread[i].samples * sizeof(double));
+	}
+	exit(0);
+}
+
+// Run a service with a cookie next to -j batch threads: without them,
+// with the batch in a cookie of its own, and with the batch in a cookie of
+// its own in the background tier, that is with SCHED_IDLE, as the daemon
+// does for tier=background groups without a cgroup.
+static void bench_tier(const struct bench_options *opts)
+{
+	unsigned long cookie;
+	if (core_sched_get(0, &cookie) && errno == EINVAL) {
+		error(1, 0, "Core scheduling is not supported by this kernel");
+	}
+	unsigned long long duration = opts->runs * TIER_RUN_MS * 1000000ULL;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double *latency = malloc(cpus * TIER_SAMPLES * sizeof(*latency));
+	if (!latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+
+	printf("%-10s %8s %10s %10s %10s %10s %12s", "CONFIG", "REQUESTS",
+	       "P50 US", "P99 US", "P99.9 US", "MAX US", "BATCH MOPS/S");
+	print_energy_header(opts, "BATCH MOPS/J");
+	for (int config = 0; config < TIER_COUNT; config++) {
+		fprintf(stderr, "running the service with %s\n",
+			tier_names[config]);
+		fflush(stdout);
+		struct energy_reading energy = { 0 };
+		measure_start(opts);
+		unsigned long long end = now_ns() + duration;
+		pid_t service, batch = 0;
+		int service_pipe = spawn_service(end, cpus, &service);
+		int batch_pipe = -1;
+		if (config != TIER_ALONE) {
+			batch_pipe = spawn_batch(end, opts->jobs, true,
+						 config == TIER_BACKGROUND,
+						 &batch);
+		}
+
+		size_t samples = 0;
+		if (!read_all(service_pipe, &samples, sizeof(samples)) ||
+		    samples > (size_t)cpus * TIER_SAMPLES ||
+		    !read_all(service_pipe, latency,
+			      samples * sizeof(*latency))) {
+			error(1, 0, "The service did not report its results");
+		}
+		close(service_pipe);
+		waitpid(service, NULL, 0);
+		unsigned long long batch_ops = 0;
+		if (batch_pipe >= 0) {
+			if (!read_all(batch_pipe, &batch_ops,
+				      sizeof(batch_ops))) {
+				error(0, 0,
+				      "The batch job did not report its results");
+			}
+			close(batch_pipe);
+			waitpid(batch, NULL, 0);
+		}
+		measure_stop(opts, &energy);
+
+		double p50 = bench_percentile(latency, samples, 50);
+		double p99 = bench_percentile(latency, samples, 99);
+		double p999 = bench_percentile(latency, samples, 99.9);
+		printf("%-10s %8zu %10.1f %10.1f %10.1f %10.1f %12.1f",
+		       tier_names[config], samples, p50, p99, p999,
+		       samples ? latency[samples - 1] : 0,
+		       batch_ops / (duration / 1e3));
+		print_energy(opts, &energy, batch_ops / 1e6);
+	}
+	free(latency);
+}
+
+// Ways to start the program of a container. Wrappers that are not
+// installed are skipped.
+struct init_wrapper {
+	const char *name;
+	const char *prefix[4];
+	// Found through PATH, not our own binary.
+	bool external;
+};
+
+static const struct init_wrapper init_wrappers[] = {
+	{ "direct", { NULL }, false },
+	{ "exec", { "/proc/self/exe", "exec", "--", NULL }, false },
+	{ "init", { "/proc/self/exe", "init", "--", NULL }, false },
+	{ "tini", { "tini", "-s", "--", NULL }, true },
+	{ "dumb-init", { "dumb-init", NULL }, true },
+};
+
+static bool in_path(const char *name)
+{
+	const char *path = getenv("PATH");
+	char candidate[PATH_MAX];
+	for (const char *dir = path; dir && *dir;) {
+		size_t len = strcspn(dir, ":");
+		snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, dir,
+			 name);
+		if (!access(candidate, X_OK)) {
+			return true;
+		}
+		dir += len + (dir[len] == ':');
+	}
+	return false;
+}
+
+static void init_phase(const struct bench_options *opts, char **argv,
+		       struct bench_result *result)
+{
+	size_t total = opts->runs * INIT_STARTS_PER_RUN;
+	double *latency = calloc(total, sizeof(*latency));
+	if (!latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+
+	size_t done = 0;
+	measure_start(opts);
+	for (size_t i = 0; i < total; i++) {
+		unsigned long long start = now_ns();
+		pid_t pid = fork();
+		if (pid == -1) {
+			error(1, errno, "Failed to spawn container");
+		}
+		if (!pid) {
+			int null = open("/dev/null", O_WRONLY);
+			if (null >= 0) {
+				dup2(null, STDOUT_FILENO);
+				dup2(null, STDERR_FILENO);
+				close(null);
+			}
+			execvp(argv[0], argv);
+			_exit(127);
+		}
+		int status;
+		struct rusage usage;
+		if (wait4(pid, &status, 0, &usage) < 0) {
+			error(1, errno, "Failed to wait for container");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			result->failed++;
+			continue;
+		}
+		latency[done++] = (now_ns() - start) / 1e6;
+		if (usage.ru_maxrss > result->max_rss_kb) {
+			result->max_rss_kb = usage.ru_maxrss;
+		}
+	}
+	measure_stop(opts, &result->energy);
+	result->jobs = done;
+	result->p50_ms = bench_percentile(latency, done, 50);
+	result->p90_ms = bench_percentile(latency, done, 90);
+	result->p99_ms = bench_percentile(latency, done, 99);
+	result->ran = true;
+	free(latency);
+}
+
+// Compare how long it takes to start and finish a short program directly,
+// through exec, through init, and through the tiny inits that are
+// installed, and the peak RSS of the wrapper or the program, whichever is
+// larger.
+static void bench_init(const struct bench_options *opts)
+{
+	char *true_argv[] = { "true", NULL };
+	char **program = opts->argv ? opts->argv : true_argv;
+	size_t program_len = 0;
+	while (program[program_len]) {
+		program_len++;
+	}
+
+	size_t count = sizeof(init_wrappers) / sizeof(*init_wrappers);
+	struct bench_result results[sizeof(init_wrappers) /
+				    sizeof(*init_wrappers)] = { 0 };
+	for (size_t i = 0; i < count; i++) {
+		const struct init_wrapper *w = &init_wrappers[i];
+		if (w->external && !in_path(w->prefix[0])) {
+			error(0, 0, "Skipping %s: not found in PATH", w->name);
+			continue;
+		}
+		char *argv[4 + program_len + 1];
+		size_t argc = 0;
+		for (; w->prefix[argc]; argc++) {
+			argv[argc] = (char *)w->prefix[argc];
+		}
+		memcpy(&argv[argc], program, (program_len + 1) * sizeof(*argv));
+
+		fprintf(stderr, "starting %u containers with %s\n",
+			opts->runs * INIT_STARTS_PER_RUN, w->name);
+		init_phase(opts, argv, &results[i]);
+		if (results[i].failed && !results[i].jobs) {
+			error(0, 0, "Every start with %s failed", w->name);
+		}
+	}
+
+	printf("%-10s %7s %6s %10s %10s %10s %12s", "WRAPPER", "STARTS",
+	       "FAILED", "P50 MS", "P90 MS", "P99 MS", "MAX RSS KB");
+	print_energy_header(opts, "STARTS/J");
+	for (size_t i = 0; i < count; i++) {
+		struct bench_result *r = &results[i];
+		if (!r->ran) {
+			continue;
+		}
+		printf("%-10s %7u %6u %10.3f %10.3f %10.3f %12ld",
+		       init_wrappers[i].name, r->jobs, r->failed, r->p50_ms,
+		       r->p90_ms, r->p99_ms, r->max_rss_kb);
+		print_energy(opts, &r->energy, r->jobs);
+	}
+}
+
+enum fork_op {
+	FORK_EXIT,
+	FORK_EXEC,
+	FORK_VFORK,
+	FORK_THREAD,
+	FORK_OP_COUNT,
+};
+
+static const char *fork_op_names[FORK_OP_COUNT] = {
+	[FORK_EXIT] = "fork",
+	[FORK_EXEC] = "exec",
+	[FORK_VFORK] = "vfork",
+	[FORK_THREAD] = "thread",
+};
+
+enum fork_cookie {
+	FORK_NONE,
+	FORK_INHERITED,
+	FORK_FRESH,
+	FORK_COOKIE_COUNT,
+};
+
+static const char *fork_cookie_names[FORK_COOKIE_COUNT] = {
+	[FORK_NONE] = "none",
+	[FORK_INHERITED] = "inherited",
+	[FORK_FRESH] = "fresh",
+};
+
+// Threads of the parent, as fork has to copy the cookie of each of them.
+static const unsigned int fork_threads[] = { 1, 8, 64 };
+
+static void *fork_idle_main(void *data)
+{
+	(void)data;
+	for (;;) {
+		pause();
+	}
+	return NULL;
+}
+
+static void *fork_thread_main(void *data)
+{
+	bool fresh = *(bool *)data;
+	if (fresh && core_sched_create(0, SCHED_CORE_SCOPE_PID)) {
+		return (void *)1;
+	}
+	return NULL;
+}
+
+// Microseconds from starting a task until it is reaped or joined, or -1 if
+// it failed.
+static double fork_once(enum fork_op op, bool fresh, char **argv)
+{
+	unsigned long long start = now_ns();
+	if (op == FORK_THREAD) {
+		pthread_t thread;
+		void *failed;
+		if (pthread_create(&thread, NULL, fork_thread_main, &fresh)) {
+			return -1;
+		}
+		pthread_join(thread, &failed);
+		return failed ? -1 : (now_ns() - start) / 1e3;
+	}
+
+	pid_t pid = op == FORK_VFORK ? vfork() : fork();
+	if (pid == -1) {
+		return -1;
+	}
+	if (!pid) {
+		if (fresh && core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+			_exit(126);
+		}
+		if (op != FORK_EXIT) {
+			execvp(argv[0], argv);
+		}
+		_exit(op == FORK_EXIT ? 0 : 127);
+	}
+	int status;
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		return -1;
+	}
+	return (now_ns() - start) / 1e3;
+}
+
+// Start the tasks of one operation in a child with the given number of
+// threads and cookie, so that neither sticks to the benchmark. The child
+// writes the number of samples and then the samples.
+static int spawn_fork_phase(const struct bench_options *opts,
+			    unsigned int threads, enum fork_cookie cookie,
+			    enum fork_op op, char **argv, pid_t *pid)
+{
+	int fds[2];
+	if (pipe(fds)) {
+		error(1, errno, "Failed to create pipe");
+	}
+	fflush(stdout);
+	*pid = fork();
+	if (*pid == -1) {
+		error(1, errno, "Failed to spawn benchmark process");
+	}
+	if (*pid) {
+		close(fds[1]);
+		return fds[0];
+	}
+	close(fds[0]);
+
+	// The cookie comes first, so that every thread inherits it.
+	if (cookie == FORK_INHERITED &&
+	    core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+		error(1, errno, "Failed to create cookie");
+	}
+	for (unsigned int i = 1; i < threads; i++) {
+		pthread_t thread;
+		errno = pthread_create(&thread, NULL, fork_idle_main, NULL);
+		if (errno) {
+			error(1, errno, "Failed to start parent thread");
+		}
+	}
+
+	size_t total = opts->runs * FORK_STARTS_PER_RUN;
+	double *latency = calloc(total, sizeof(*latency));
+	if (!latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+	size_t done = 0;
+	for (size_t i = 0; i < total; i++) {
+		double us = fork_once(op, cookie == FORK_FRESH, argv);
+		if (us >= 0) {
+			latency[done++] = us;
+		}
+	}
+	write_all(fds[1], &done, sizeof(done));
+	write_all(fds[1], latency, done * sizeof(*latency));
+	_exit(0);
+}
+
+// Measure how long it takes to start and finish a task with fork and exit,
+// fork and exec of the program, true by default, vfork and exec, and
+// pthread_create and join. Tasks run without a cookie, with the cookie of
+// the parent, and with a new cookie that they create right away, for
+// parents with a varying number of threads.
+static void bench_fork(const struct bench_options *opts)
+{
+	unsigned long cookie;
+	bool have_cookies = !core_sched_get(0, &cookie) || errno != EINVAL;
+	if (!have_cookies) {
+		error(0, 0,
+		      "Core scheduling is not supported by this kernel, only running without cookies");
+	}
+	char *true_argv[] = { "true", NULL };
+	char **argv = opts->argv ? opts->argv : true_argv;
+	size_t total = opts->runs * FORK_STARTS_PER_RUN;
+	double *latency = calloc(total, sizeof(*latency));
+	if (!latency) {
+		error(1, errno, "Failed to allocate benchmark results");
+	}
+
+	printf("%7s %-9s %-6s %6s %6s %10s %10s %10s %10s", "THREADS",
+	       "COOKIE", "OP", "STARTS", "FAILED", "P50 US", "P90 US",
+	       "P99 US", "MAX US");
+	print_energy_header(opts, "STARTS/J");
+	for (size_t t = 0; t < sizeof(fork_threads) / sizeof(*fork_threads);
+	     t++) {
+		for (int c = 0; c < FORK_COOKIE_COUNT; c++) {
+			if (c != FORK_NONE && !have_cookies) {
+				continue;
+			}
+			fprintf(stderr,
+				"starting tasks with cookie %s from %u threads\n",
+				fork_cookie_names[c], fork_threads[t]);
+			for (int op = 0; op < FORK_OP_COUNT; op++) {
+				struct energy_reading energy = { 0 };
+				measure_start(opts);
+				pid_t pid;
+				int fd = spawn_fork_phase(opts, fork_threads[t],
+							  c, op, argv, &pid);
+				size_t done = 0;
+				if (!read_all(fd, &done, sizeof(done)) ||
+				    done > total ||
+				    !read_all(fd, latency,
+					      done * sizeof(*latency))) {
+					error(0, 0,
+					      "The %s phase did not report its results",
+					      fork_op_names[op]);
+					done = 0;
+				}
+				close(fd);
+				waitpid(pid, NULL, 0);
+				measure_stop(opts, &energy);
+
+				printf("%7u %-9s %-6s %6zu %6zu", fork_threads[t],
+				       fork_cookie_names[c], fork_op_names[op],
+				       done, total - done);
+				double p50 = bench_percentile(latency, done, 50);
+				double p90 = bench_percentile(latency, done, 90);
+				double p99 = bench_percentile(latency, done, 99);
+				printf(" %10.1f %10.1f %10.1f %10.1f", p50, p90,
+				       p99, done ? latency[done - 1] : 0);
+				print_energy(opts, &energy, done);
+			}
+		}
+	}
+	free(latency);
+}
+
+struct bench_mode {
+	const char *name;
+	void (*run)(const struct bench_options *opts);
+};
+
+static const struct bench_mode bench_modes[] = {
+	{ "smt", bench_smt },
+	{ "launch", bench_launch },
+	{ "pool", bench_pool },
+	{ "handoff", bench_handoff },
+	{ "haltpoll", bench_haltpoll },
+	{ "init", bench_init },
+	{ "tier", bench_tier },
+	{ "fork", bench_fork },
+};
+
+void bench_run(const struct bench_options *opts)
+{
+	if (!opts->jobs || !opts->runs) {
+		error(1, 0, "A benchmark needs at least one job and one run");
+	}
+	for (size_t i = 0; i < sizeof(bench_modes) / sizeof(*bench_modes);
+	     i++) {
+		if (!strcmp(bench_modes[i].name, opts->mode)) {
+			if (opts->energy) {
+				energy_open(&energy_meter);
+			}
+			bench_modes[i].run(opts);
+			if (opts->energy) {
+				energy_close(&energy_meter);
+			}
+			return;
+		}
+	}
+	error(1, 0, "Unknown benchmark mode '%s'", opts->mode);
+}
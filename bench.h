@@ -0,0 +1,38 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_BENCH_H
+#define CORESCHED_BENCH_H
+
+#include "workload.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct bench_options {
+	const char *mode;
+	// Number of copies of the workload that run at the same time.
+	unsigned int jobs;
+	// Number of times the jobs are started for each configuration.
+	unsigned int runs;
+	// Comma separated list of configurations to compare.
+	const char *configs;
+	// The program to benchmark, NULL terminated.
+	char **argv;
+	// A built-in workload to run instead of a program, see workload.h.
+	const struct workload *workload;
+	// Control socket of a running daemon, and the group to request.
+	const char *socket;
+	const char *group;
+	// Also report package power, effective frequency and work per joule,
+	// see energy.h.
+	bool energy;
+};
+
+void bench_run(const struct bench_options *opts);
+
+// Sort the samples and return the value below which p percent of them
+// fall.
+double bench_percentile(double *samples, size_t count, double p);
+
+#endif
@@ -0,0 +1,734 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+// The kernel charges forced idle time to the tasks that were running on a
+// core while its siblings were forced idle, and reports it per task as
+// core_forceidle_sum. That gives an exact total per task but not where in
+// the task the time was spent. To get that, every CPU is sampled with
+// perf, and sched_switch tracepoints track which siblings were idle at the
+// time of each sample. The forced idle total of a task is then spread over
+// its samples that were taken while a sibling was idle.
+
+#include "blame.h"
+#include "snapshot.h"
+#include "topology.h"
+#include "util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLAME_RING_PAGES 64
+#define BLAME_MAX_STACK 127
+#define BLAME_STACK_BUCKETS 65536
+#define BLAME_TOP_TASKS 20
+
+struct ring {
+	int fd;
+	int cpu;
+	bool is_switch;
+	void *base;
+	size_t size;
+};
+
+struct blame_record {
+	unsigned long long time;
+	int cpu;
+	bool is_switch;
+	pid_t pid;
+	pid_t tid;
+	pid_t next_tid;
+	unsigned int nr;
+	uint64_t *ips;
+};
+
+struct blame_stack {
+	struct blame_stack *next;
+	uint64_t hash;
+	pid_t tid;
+	pid_t pid;
+	unsigned int nr;
+	double weight;
+	uint64_t ips[];
+};
+
+struct blame_task {
+	pid_t tid;
+	double weight;
+	unsigned long samples;
+};
+
+struct blame {
+	const struct blame_options *opts;
+	struct topology topo;
+	struct ring *rings;
+	size_t ring_count;
+	bool have_switch;
+	// Offset of next_pid in the raw sched_switch record.
+	size_t next_pid_offset;
+	// Task running on each CPU according to sched_switch, -1 if unknown.
+	pid_t current[CPU_SETSIZE];
+	struct blame_record *records;
+	size_t record_count;
+	size_t record_capacity;
+	struct blame_stack **stacks;
+	struct blame_task *tasks;
+	size_t task_count;
+	size_t task_capacity;
+	unsigned long lost;
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int cpu)
+{
+	return syscall(SYS_perf_event_open, attr, -1, cpu, -1,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+static const char *tracefs_paths[] = {
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+};
+
+static FILE *open_switch_file(const char *name)
+{
+	for (size_t i = 0; i < sizeof(tracefs_paths) / sizeof(*tracefs_paths);
+	     i++) {
+		char path[128];
+		snprintf(path, sizeof(path), "%s/events/sched/sched_switch/%s",
+			 tracefs_paths[i], name);
+		FILE *file = fopen(path, "r");
+		if (file) {
+			return file;
+		}
+	}
+	return NULL;
+}
+
+// Find the tracepoint id of sched_switch and where next_pid lives in its
+// raw record.
+static bool read_switch_format(struct blame *b, unsigned long long *id)
+{
+	FILE *file = open_switch_file("id");
+	if (!file) {
+		return false;
+	}
+	int matched = fscanf(file, "%llu", id);
+	fclose(file);
+	if (matched != 1 || !(file = open_switch_file("format"))) {
+		return false;
+	}
+
+	char line[256];
+	bool found = false;
+	while (fgets(line, sizeof(line), file)) {
+		char *offset_field = strstr(line, "offset:");
+		unsigned int offset;
+		if (strstr(line, " next_pid;") && offset_field &&
+		    sscanf(offset_field, "offset:%u", &offset) == 1) {
+			b->next_pid_offset = offset;
+			found = true;
+		}
+	}
+	fclose(file);
+	return found;
+}
+
+static void add_ring(struct blame *b, struct perf_event_attr *attr, int cpu)
+{
+	int fd = perf_event_open(attr, cpu);
+	if (fd < 0) {
+		error(1, errno, "Failed to open perf event on cpu %d", cpu);
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (1 + BLAME_RING_PAGES) * page;
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			  0);
+	if (base == MAP_FAILED) {
+		error(1, errno, "Failed to map perf buffer of cpu %d", cpu);
+	}
+
+	b->rings = realloc(b->rings, (b->ring_count + 1) * sizeof(*b->rings));
+	if (!b->rings) {
+		error(1, errno, "Failed to allocate perf buffers");
+	}
+	b->rings[b->ring_count++] = (struct ring){
+		.fd = fd,
+		.cpu = cpu,
+		.is_switch = attr->type == PERF_TYPE_TRACEPOINT,
+		.base = base,
+		.size = size,
+	};
+}
+
+static void open_events(struct blame *b)
+{
+	unsigned long long switch_id = 0;
+	b->have_switch = read_switch_format(b, &switch_id);
+	if (!b->have_switch) {
+		error(0, 0,
+		      "sched_switch is not available, blaming every sample of a task equally");
+	}
+
+	struct perf_event_attr sample = {
+		.type = PERF_TYPE_SOFTWARE,
+		.size = sizeof(sample),
+		.config = PERF_COUNT_SW_CPU_CLOCK,
+		.freq = 1,
+		.sample_freq = b->opts->frequency,
+		.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+			       PERF_SAMPLE_CPU,
+		.exclude_idle = 1,
+		.use_clockid = 1,
+		.clockid = CLOCK_MONOTONIC,
+		.disabled = 1,
+		.wakeup_watermark = BLAME_RING_PAGES * 4096 / 4,
+		.watermark = 1,
+	};
+	if (b->opts->stacks) {
+		sample.sample_type |= PERF_SAMPLE_CALLCHAIN;
+	}
+	struct perf_event_attr sched_switch = {
+		.type = PERF_TYPE_TRACEPOINT,
+		.size = sizeof(sched_switch),
+		.config = switch_id,
+		.sample_period = 1,
+		.sample_type = PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+			       PERF_SAMPLE_CPU | PERF_SAMPLE_RAW,
+		.use_clockid = 1,
+		.clockid = CLOCK_MONOTONIC,
+		.disabled = 1,
+		.wakeup_watermark = BLAME_RING_PAGES * 4096 / 4,
+		.watermark = 1,
+	};
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		b->current[cpu] = -1;
+		if (!CPU_ISSET(cpu, &b->topo.online)) {
+			continue;
+		}
+		add_ring(b, &sample, cpu);
+		if (b->have_switch) {
+			add_ring(b, &sched_switch, cpu);
+		}
+	}
+}
+
+static struct blame_record *new_record(struct blame *b)
+{
+	if (b->record_count == b->record_capacity) {
+		b->record_capacity =
+			b->record_capacity ? b->record_capacity * 2 : 4096;
+		b->records = realloc(b->records,
+				     b->record_capacity * sizeof(*b->records));
+		if (!b->records) {
+			error(1, errno, "Failed to allocate perf records");
+		}
+	}
+	struct blame_record *record = &b->records[b->record_count++];
+	memset(record, 0, sizeof(*record));
+	return record;
+}
+
+static void parse_sample(struct blame *b, const struct ring *ring,
+			 const char *data, size_t len)
+{
+	const char *end = data + len;
+	struct blame_record *record = new_record(b);
+	record->is_switch = ring->is_switch;
+
+	uint32_t ids[2];
+	memcpy(ids, data, sizeof(ids));
+	record->pid = ids[0];
+	record->tid = ids[1];
+	data += sizeof(ids);
+	memcpy(&record->time, data, sizeof(uint64_t));
+	data += sizeof(uint64_t);
+	uint32_t cpu[2];
+	memcpy(cpu, data, sizeof(cpu));
+	record->cpu = cpu[0];
+	data += sizeof(cpu);
+
+	if (ring->is_switch) {
+		uint32_t size;
+		int32_t next;
+		memcpy(&size, data, sizeof(size));
+		data += sizeof(size);
+		if (b->next_pid_offset + sizeof(next) > size ||
+		    data + size > end) {
+			b->record_count--;
+			return;
+		}
+		memcpy(&next, data + b->next_pid_offset, sizeof(next));
+		record->next_tid = next;
+		return;
+	}
+
+	if (b->opts->stacks && data + sizeof(uint64_t) <= end) {
+		uint64_t nr;
+		memcpy(&nr, data, sizeof(nr));
+		data += sizeof(nr);
+		if (nr > BLAME_MAX_STACK) {
+			nr = BLAME_MAX_STACK;
+		}
+		if (data + nr * sizeof(uint64_t) > end) {
+			nr = 0;
+		}
+		record->nr = nr;
+		record->ips = malloc((nr ? nr : 1) * sizeof(uint64_t));
+		if (!record->ips) {
+			error(1, errno, "Failed to allocate stack");
+		}
+		memcpy(record->ips, data, nr * sizeof(uint64_t));
+	}
+}
+
+static void drain_ring(struct blame *b, struct ring *ring)
+{
+	struct perf_event_mmap_page *meta = ring->base;
+	char *data = (char *)ring->base + meta->data_offset;
+	uint64_t size = meta->data_size;
+	uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+	uint64_t tail = meta->data_tail;
+	char copy[sizeof(struct perf_event_header) +
+		  (BLAME_MAX_STACK + 8) * sizeof(uint64_t) + 4096];
+
+	while (tail < head) {
+		struct perf_event_header header;
+		for (size_t i = 0; i < sizeof(header); i++) {
+			((char *)&header)[i] = data[(tail + i) % size];
+		}
+		if (header.size < sizeof(header)) {
+			break;
+		}
+		// Records can wrap around the end of the buffer.
+		size_t len = header.size < sizeof(copy) ? header.size :
+							  sizeof(copy);
+		for (size_t i = 0; i < len; i++) {
+			copy[i] = data[(tail + i) % size];
+		}
+		if (header.type == PERF_RECORD_SAMPLE) {
+			parse_sample(b, ring, copy + sizeof(header),
+				     len - sizeof(header));
+		} else if (header.type == PERF_RECORD_LOST) {
+			uint64_t lost;
+			memcpy(&lost, copy + sizeof(header) + sizeof(uint64_t),
+			       sizeof(lost));
+			b->lost += lost;
+		}
+		tail += header.size;
+	}
+	__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct blame_record *x = a, *y = b;
+	if (x->time != y->time) {
+		return (x->time > y->time) - (x->time < y->time);
+	}
+	// A switch at the same time as a sample happened first.
+	return y->is_switch - x->is_switch;
+}
+
+static struct blame_task *find_task(struct blame *b, pid_t tid)
+{
+	for (size_t i = 0; i < b->task_count; i++) {
+		if (b->tasks[i].tid == tid) {
+			return &b->tasks[i];
+		}
+	}
+	if (b->task_count == b->task_capacity) {
+		b->task_capacity = b->task_capacity ? b->task_capacity * 2 : 256;
+		b->tasks = realloc(b->tasks,
+				   b->task_capacity * sizeof(*b->tasks));
+		if (!b->tasks) {
+			error(1, errno, "Failed to allocate tasks");
+		}
+	}
+	struct blame_task *task = &b->tasks[b->task_count++];
+	*task = (struct blame_task){ .tid = tid };
+	return task;
+}
+
+static uint64_t hash_stack(pid_t tid, const uint64_t *ips, unsigned int nr)
+{
+	uint64_t hash = 1469598103934665603ULL ^ (uint64_t)tid;
+	for (unsigned int i = 0; i < nr; i++) {
+		hash = (hash ^ ips[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void add_stack(struct blame *b, const struct blame_record *record,
+		      double weight)
+{
+	uint64_t hash = hash_stack(record->tid, record->ips, record->nr);
+	struct blame_stack **bucket = &b->stacks[hash % BLAME_STACK_BUCKETS];
+	for (struct blame_stack *stack = *bucket; stack; stack = stack->next) {
+		if (stack->hash == hash && stack->tid == record->tid &&
+		    stack->nr == record->nr &&
+		    !memcmp(stack->ips, record->ips,
+			    record->nr * sizeof(uint64_t))) {
+			stack->weight += weight;
+			return;
+		}
+	}
+	struct blame_stack *stack =
+		malloc(sizeof(*stack) + record->nr * sizeof(uint64_t));
+	if (!stack) {
+		error(1, errno, "Failed to allocate stack");
+	}
+	stack->hash = hash;
+	stack->tid = record->tid;
+	stack->pid = record->pid;
+	stack->nr = record->nr;
+	stack->weight = weight;
+	memcpy(stack->ips, record->ips, record->nr * sizeof(uint64_t));
+	stack->next = *bucket;
+	*bucket = stack;
+}
+
+// Count the siblings of cpu that were idle, as seen from sched_switch.
+static unsigned int idle_siblings(struct blame *b, int cpu)
+{
+	if (!b->have_switch) {
+		return 1;
+	}
+	int core = topology_core_of(&b->topo, cpu);
+	if (core < 0) {
+		return 0;
+	}
+	unsigned int idle = 0;
+	for (int sibling = 0; sibling < CPU_SETSIZE; sibling++) {
+		if (sibling != cpu &&
+		    CPU_ISSET(sibling, &b->topo.cores[core].cpus) &&
+		    b->current[sibling] == 0) {
+			idle++;
+		}
+	}
+	return idle;
+}
+
+static void process_records(struct blame *b)
+{
+	qsort(b->records, b->record_count, sizeof(*b->records),
+	      compare_records);
+	for (size_t i = 0; i < b->record_count; i++) {
+		struct blame_record *record = &b->records[i];
+		if (record->cpu < 0 || record->cpu >= CPU_SETSIZE) {
+			continue;
+		}
+		if (record->is_switch) {
+			b->current[record->cpu] = record->next_tid;
+			continue;
+		}
+		if (!record->tid) {
+			free(record->ips);
+			continue;
+		}
+		unsigned int idle = idle_siblings(b, record->cpu);
+		struct blame_task *task = find_task(b, record->tid);
+		task->samples++;
+		if (idle) {
+			task->weight += idle;
+			if (b->opts->stacks) {
+				add_stack(b, record, idle);
+			}
+		}
+		free(record->ips);
+	}
+	b->record_count = 0;
+}
+
+static void drain_all(struct blame *b)
+{
+	for (size_t i = 0; i < b->ring_count; i++) {
+		drain_ring(b, &b->rings[i]);
+	}
+	process_records(b);
+}
+
+struct kallsym {
+	uint64_t addr;
+	char *name;
+};
+
+static int compare_kallsyms(const void *a, const void *b)
+{
+	const struct kallsym *x = a, *y = b;
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static size_t load_kallsyms(struct kallsym **syms)
+{
+	FILE *file = fopen("/proc/kallsyms", "r");
+	size_t count = 0, capacity = 0;
+	*syms = NULL;
+	if (!file) {
+		return 0;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), file)) {
+		unsigned long long addr;
+		char type, name[256];
+		if (sscanf(line, "%llx %c %255s", &addr, &type, name) != 3 ||
+		    !addr || (type != 't' && type != 'T')) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 65536;
+			*syms = realloc(*syms, capacity * sizeof(**syms));
+			if (!*syms) {
+				error(1, errno, "Failed to load kernel symbols");
+			}
+		}
+		(*syms)[count].addr = addr;
+		(*syms)[count++].name = strdup(name);
+	}
+	fclose(file);
+	qsort(*syms, count, sizeof(**syms), compare_kallsyms);
+	return count;
+}
+
+static void format_frame(uint64_t ip, pid_t pid, const struct kallsym *syms,
+			 size_t sym_count, char *buf, size_t len)
+{
+	if (ip >= 0xffff800000000000ULL && sym_count) {
+		size_t lo = 0, hi = sym_count;
+		while (hi - lo > 1) {
+			size_t mid = (lo + hi) / 2;
+			if (syms[mid].addr <= ip) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		if (syms[lo].addr <= ip) {
+			snprintf(buf, len, "%s_[k]", syms[lo].name);
+			return;
+		}
+	}
+
+	// User space frames are named by the mapping they fall in, which is
+	// enough to tell libraries apart and to symbolize offline.
+	char path[64], line[512];
+	snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+	FILE *maps = fopen(path, "r");
+	while (maps && fgets(line, sizeof(line), maps)) {
+		unsigned long long start, end, offset;
+		char file[256] = "";
+		if (sscanf(line, "%llx-%llx %*s %llx %*s %*s %255s", &start,
+			   &end, &offset, file) < 3 ||
+		    ip < start || ip >= end) {
+			continue;
+		}
+		const char *base = strrchr(file, '/');
+		snprintf(buf, len, "%s+0x%llx", base ? base + 1 : "[anon]",
+			 (unsigned long long)(ip - start + offset));
+		fclose(maps);
+		return;
+	}
+	if (maps) {
+		fclose(maps);
+	}
+	snprintf(buf, len, "0x%llx", (unsigned long long)ip);
+}
+
+static void write_stacks(struct blame *b, const struct snapshot *after)
+{
+	FILE *out = fopen(b->opts->stacks, "w");
+	if (!out) {
+		error(1, errno, "Failed to open %s", b->opts->stacks);
+	}
+	struct kallsym *syms;
+	size_t sym_count = load_kallsyms(&syms);
+
+	size_t written = 0;
+	for (size_t i = 0; i < BLAME_STACK_BUCKETS; i++) {
+		for (struct blame_stack *stack = b->stacks[i]; stack;
+		     stack = stack->next) {
+			struct thread_sample *t =
+				snapshot_find(after, stack->tid);
+			struct blame_task *task = find_task(b, stack->tid);
+			if (!t || !task->weight || !t->forceidle_delta_ns) {
+				continue;
+			}
+			unsigned long long us = stack->weight / task->weight *
+						t->forceidle_delta_ns / 1000;
+			if (!us) {
+				continue;
+			}
+			fprintf(out, "cookie-0x%lx;%s-%d", t->cookie, t->comm,
+				t->tid);
+			// Callchains are leaf first and contain context
+			// markers that are not addresses.
+			for (unsigned int j = stack->nr; j-- > 0;) {
+				char frame[320];
+				if (stack->ips[j] >= PERF_CONTEXT_MAX) {
+					continue;
+				}
+				format_frame(stack->ips[j], stack->pid, syms,
+					     sym_count, frame, sizeof(frame));
+				fprintf(out, ";%s", frame);
+			}
+			fprintf(out, " %llu\n", us);
+			written++;
+		}
+	}
+	fclose(out);
+	for (size_t i = 0; i < sym_count; i++) {
+		free(syms[i].name);
+	}
+	free(syms);
+	fprintf(stderr, "wrote %zu folded stacks to %s\n", written,
+		b->opts->stacks);
+}
+
+struct cookie_total {
+	unsigned long cookie;
+	size_t tasks;
+	unsigned long long forceidle_ns;
+};
+
+static int compare_blamed(const void *a, const void *b)
+{
+	const struct thread_sample *const *x = a, *const *y = b;
+	return ((*x)->forceidle_delta_ns < (*y)->forceidle_delta_ns) -
+	       ((*x)->forceidle_delta_ns > (*y)->forceidle_delta_ns);
+}
+
+static int compare_cookies(const void *a, const void *b)
+{
+	const struct cookie_total *x = a, *y = b;
+	return (x->forceidle_ns < y->forceidle_ns) -
+	       (x->forceidle_ns > y->forceidle_ns);
+}
+
+static void report(struct blame *b, struct snapshot *after, double seconds)
+{
+	struct thread_sample **blamed =
+		calloc(after->count ? after->count : 1, sizeof(*blamed));
+	struct cookie_total *cookies =
+		calloc(after->count ? after->count : 1, sizeof(*cookies));
+	if (!blamed || !cookies) {
+		error(1, errno, "Failed to allocate report");
+	}
+	size_t blamed_count = 0, cookie_count = 0;
+	for (size_t i = 0; i < after->count; i++) {
+		struct thread_sample *t = &after->threads[i];
+		if (!t->diffed || !t->forceidle_delta_ns) {
+			continue;
+		}
+		blamed[blamed_count++] = t;
+		size_t c = 0;
+		while (c < cookie_count && cookies[c].cookie != t->cookie) {
+			c++;
+		}
+		if (c == cookie_count) {
+			cookies[cookie_count++].cookie = t->cookie;
+		}
+		cookies[c].tasks++;
+		cookies[c].forceidle_ns += t->forceidle_delta_ns;
+	}
+	qsort(blamed, blamed_count, sizeof(*blamed), compare_blamed);
+	qsort(cookies, cookie_count, sizeof(*cookies), compare_cookies);
+
+	printf("forced idle caused during %.1f s", seconds);
+	if (b->lost) {
+		printf(" (%lu perf records lost)", b->lost);
+	}
+	printf("\n\n%-18s %6s %12s\n", "COOKIE", "TASKS", "FI ms");
+	for (size_t i = 0; i < cookie_count; i++) {
+		printf("%#-18lx %6zu %12.2f\n", cookies[i].cookie,
+		       cookies[i].tasks, cookies[i].forceidle_ns / 1e6);
+	}
+	printf("\n%-8s %-8s %-16s %18s %12s %8s\n", "TID", "PID", "COMM",
+	       "COOKIE", "FI ms", "SAMPLES");
+	for (size_t i = 0; i < blamed_count && i < BLAME_TOP_TASKS; i++) {
+		struct thread_sample *t = blamed[i];
+		struct blame_task *task = find_task(b, t->tid);
+		printf("%-8d %-8d %-16s %#18lx %12.2f %8lu\n", t->tid, t->pid,
+		       t->comm, t->cookie, t->forceidle_delta_ns / 1e6,
+		       task->samples);
+	}
+	if (!blamed_count) {
+		printf("no task caused forced idle\n");
+	}
+	free(blamed);
+	free(cookies);
+}
+
+void blame_profile(const struct blame_options *opts)
+{
+	struct blame b = { .opts = opts };
+	if (topology_read(&b.topo)) {
+		error(1, errno, "Failed to read the CPU topology");
+	}
+	b.stacks = calloc(BLAME_STACK_BUCKETS, sizeof(*b.stacks));
+	if (!b.stacks) {
+		error(1, errno, "Failed to allocate stacks");
+	}
+	open_events(&b);
+
+	struct snapshot before = { 0 }, after = { 0 };
+	snapshot_take(&before);
+	for (size_t i = 0; i < b.ring_count; i++) {
+		ioctl(b.rings[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	struct pollfd *fds = calloc(b.ring_count, sizeof(*fds));
+	if (!fds) {
+		error(1, errno, "Failed to allocate perf buffers");
+	}
+	for (size_t i = 0; i < b.ring_count; i++) {
+		fds[i] = (struct pollfd){ .fd = b.rings[i].fd, .events = POLLIN };
+	}
+	unsigned long long end = now_ns() + opts->duration_ms * 1000000ULL;
+	for (unsigned long long now = now_ns(); now < end; now = now_ns()) {
+		unsigned long long left = (end - now) / 1000000;
+		poll(fds, b.ring_count, left < 100 ? left : 100);
+		drain_all(&b);
+	}
+	for (size_t i = 0; i < b.ring_count; i++) {
+		ioctl(b.rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+	drain_all(&b);
+	snapshot_take(&after);
+	snapshot_diff(&before, &after);
+
+	report(&b, &after, (after.taken_at - before.taken_at) / 1e9);
+	if (opts->stacks) {
+		write_stacks(&b, &after);
+	}
+
+	for (size_t i = 0; i < BLAME_STACK_BUCKETS; i++) {
+		while (b.stacks[i]) {
+			struct blame_stack *next = b.stacks[i]->next;
+			free(b.stacks[i]);
+			b.stacks[i] = next;
+		}
+	}
+	for (size_t i = 0; i < b.ring_count; i++) {
+		munmap(b.rings[i].base, b.rings[i].size);
+		close(b.rings[i].fd);
+	}
+	free(fds);
+	free(b.stacks);
+	free(b.rings);
+	free(b.records);
+	free(b.tasks);
+	snapshot_free(&before);
+	snapshot_free(&after);
+	topology_free(&b.topo);
+}
@@ -0,0 +1,20 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_BLAME_H
+#define CORESCHED_BLAME_H
+
+struct blame_options {
+	// How long to profile in milliseconds.
+	unsigned int duration_ms;
+	// Sampling frequency of the running tasks.
+	unsigned int frequency;
+	// Write folded stacks of the blamed code paths to this file.
+	const char *stacks;
+};
+
+// Profile the whole system and attribute forced idle time to the tasks,
+// cookie groups and optionally the stacks that occupied the core.
+void blame_profile(const struct blame_options *opts);
+
+#endif
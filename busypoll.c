@@ -0,0 +1,189 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "busypoll.h"
+#include "snapshot.h"
+#include "topology.h"
+
+#include <errno.h>
+#include <error.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A poller that makes its siblings idle for less than this is harmless.
+#define BUSYPOLL_MIN_FORCEIDLE_MS 1.0
+
+static int compare_forceidle(const void *a, const void *b)
+{
+	const struct thread_sample *const *x = a, *const *y = b;
+	return ((*x)->forceidle_rate < (*y)->forceidle_rate) -
+	       ((*x)->forceidle_rate > (*y)->forceidle_rate);
+}
+
+static int pin(pid_t tid, const cpu_set_t *cpus)
+{
+	return sched_setaffinity(tid, sizeof(*cpus), cpus);
+}
+
+// The busiest thread that shares the poller's cookie and is not a poller
+// itself is the best partner, since it keeps the sibling doing useful work.
+static struct thread_sample *find_partner(struct snapshot *snap,
+					  const bool *is_poller,
+					  const struct thread_sample *poller)
+{
+	struct thread_sample *best = NULL;
+	for (size_t i = 0; i < snap->count; i++) {
+		struct thread_sample *t = &snap->threads[i];
+		if (is_poller[i] || t->cookie != poller->cookie ||
+		    t->run_pct < 1) {
+			continue;
+		}
+		if (!best || t->run_pct > best->run_pct) {
+			best = t;
+		}
+	}
+	return best;
+}
+
+static void make_exclusive(struct snapshot *snap, const cpu_set_t *core,
+			   const struct thread_sample *poller)
+{
+	size_t moved = 0;
+	for (size_t i = 0; i < snap->count; i++) {
+		struct thread_sample *t = &snap->threads[i];
+		cpu_set_t allowed, rest;
+		if (t->tid == poller->tid ||
+		    sched_getaffinity(t->tid, sizeof(allowed), &allowed)) {
+			continue;
+		}
+		CPU_XOR(&rest, &allowed, core);
+		CPU_AND(&rest, &rest, &allowed);
+		// Threads that are pinned to the core on purpose stay.
+		if (CPU_EQUAL(&rest, &allowed) || !CPU_COUNT(&rest)) {
+			continue;
+		}
+		moved += !pin(t->tid, &rest);
+	}
+	printf("  moved %zu other threads off the core\n", moved);
+}
+
+static void apply_remedy(const struct busypoll_options *opts,
+			 struct snapshot *snap, const bool *is_poller,
+			 const struct topology *topo,
+			 struct thread_sample *poller, cpu_set_t *taken)
+{
+	int index = topology_core_of(topo, poller->processor);
+	if (index < 0) {
+		return;
+	}
+	const cpu_set_t *core = &topo->cores[index].cpus;
+	char cpus[64];
+	cpulist_format(core, cpus, sizeof(cpus));
+
+	struct thread_sample *partner = find_partner(snap, is_poller, poller);
+	if (opts->remedy == BUSYPOLL_REPORT) {
+		if (partner) {
+			printf("  recommend: pair with %d (%s) on cpus %s\n",
+			       partner->tid, partner->comm, cpus);
+		} else {
+			printf("  recommend: give it the exclusive core %s\n",
+			       cpus);
+		}
+		return;
+	}
+
+	CPU_OR(taken, taken, core);
+	if (pin(poller->tid, core)) {
+		printf("  failed to pin to cpus %s: %s\n", cpus,
+		       strerror(errno));
+		return;
+	}
+	if (opts->remedy == BUSYPOLL_PAIR && partner) {
+		if (pin(partner->tid, core)) {
+			printf("  failed to pin partner %d: %s\n", partner->tid,
+			       strerror(errno));
+			return;
+		}
+		printf("  paired with %d (%s) on cpus %s\n", partner->tid,
+		       partner->comm, cpus);
+		return;
+	}
+	printf("  pinned to exclusive cpus %s\n", cpus);
+	make_exclusive(snap, core, poller);
+}
+
+void busypoll_detect(const struct busypoll_options *opts)
+{
+	struct snapshot before = { 0 }, after = { 0 };
+	struct topology topo;
+	if (topology_read(&topo)) {
+		error(1, errno, "Failed to read the CPU topology");
+	}
+
+	snapshot_take(&before);
+	struct timespec interval = {
+		.tv_sec = opts->interval_ms / 1000,
+		.tv_nsec = (opts->interval_ms % 1000) * 1000000L,
+	};
+	nanosleep(&interval, NULL);
+	snapshot_take(&after);
+	snapshot_diff(&before, &after);
+
+	struct thread_sample **pollers = NULL;
+	size_t poller_count = 0;
+	bool *is_poller =
+		calloc(after.count ? after.count : 1, sizeof(*is_poller));
+	if (!is_poller) {
+		error(1, errno, "Failed to allocate pollers");
+	}
+	for (size_t i = 0; i < after.count; i++) {
+		struct thread_sample *t = &after.threads[i];
+		// A poller is almost always runnable, and mostly gets to run.
+		if (!t->diffed ||
+		    t->run_pct + t->wait_pct < opts->threshold_pct ||
+		    t->run_pct < opts->threshold_pct / 2.0) {
+			continue;
+		}
+		is_poller[i] = true;
+		pollers = realloc(pollers, (poller_count + 1) * sizeof(*pollers));
+		if (!pollers) {
+			error(1, errno, "Failed to allocate pollers");
+		}
+		pollers[poller_count++] = t;
+	}
+	qsort(pollers, poller_count, sizeof(*pollers), compare_forceidle);
+
+	printf("%-8s %-8s %-16s %6s %6s %10s %18s\n", "TID", "PID", "COMM",
+	       "RUN%", "WAIT%", "FI ms/s", "COOKIE");
+	cpu_set_t taken;
+	CPU_ZERO(&taken);
+	for (size_t i = 0; i < poller_count; i++) {
+		struct thread_sample *t = pollers[i];
+		printf("%-8d %-8d %-16s %6.1f %6.1f %10.2f %#18lx\n", t->tid,
+		       t->pid, t->comm, t->run_pct, t->wait_pct,
+		       t->forceidle_rate, t->cookie);
+		if (t->forceidle_rate < BUSYPOLL_MIN_FORCEIDLE_MS) {
+			continue;
+		}
+		// Two pollers on one core would make things worse.
+		if (t->processor >= 0 && CPU_ISSET(t->processor, &taken)) {
+			printf("  skipped: its core was given to another poller\n");
+			continue;
+		}
+		apply_remedy(opts, &after, is_poller, &topo, t, &taken);
+	}
+	if (!poller_count) {
+		printf("no threads were runnable for %u%% of %u ms\n",
+		       opts->threshold_pct, opts->interval_ms);
+	}
+
+	free(pollers);
+	free(is_poller);
+	snapshot_free(&before);
+	snapshot_free(&after);
+	topology_free(&topo);
+}
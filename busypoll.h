@@ -0,0 +1,26 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_BUSYPOLL_H
+#define CORESCHED_BUSYPOLL_H
+
+enum busypoll_remedy {
+	BUSYPOLL_REPORT,
+	// Pin the poller and the busiest thread with the same cookie to
+	// the siblings of one core.
+	BUSYPOLL_PAIR,
+	// Pin the poller to one core and move every other thread off it.
+	BUSYPOLL_EXCLUSIVE,
+};
+
+struct busypoll_options {
+	unsigned int interval_ms;
+	// Percentage of the interval a thread has to be running or waiting
+	// to run to be considered a poller.
+	unsigned int threshold_pct;
+	enum busypoll_remedy remedy;
+};
+
+void busypoll_detect(const struct busypoll_options *opts);
+
+#endif
@@ -0,0 +1,414 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "cgroup.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const char *cgroup_root(void)
+{
+	static char root[PATH_MAX];
+	static bool probed = false;
+
+	if (probed) {
+		return root[0] ? root : NULL;
+	}
+	probed = true;
+
+	FILE *mountinfo = fopen("/proc/self/mountinfo", "r");
+	if (!mountinfo) {
+		return NULL;
+	}
+	char line[4096];
+	while (fgets(line, sizeof(line), mountinfo)) {
+		// The filesystem type follows the " - " separator.
+		char *sep = strstr(line, " - ");
+		char mnt[PATH_MAX];
+		if (!sep || strncmp(sep, " - cgroup2 ", 11) ||
+		    sscanf(line, "%*s %*s %*s %*s %4095s", mnt) != 1) {
+			continue;
+		}
+		snprintf(root, sizeof(root), "%s", mnt);
+		break;
+	}
+	fclose(mountinfo);
+	return root[0] ? root : NULL;
+}
+
+int cgroup_parse_path(const char *content, char *buf, size_t len)
+{
+	const char *line = content;
+	while (line && strncmp(line, "0::", 3)) {
+		line = strchr(line, '\n');
+		line = line ? line + 1 : NULL;
+	}
+	if (!line) {
+		errno = ENOENT;
+		return -1;
+	}
+	int path_len = strcspn(line + 3, "\n");
+	if ((size_t)snprintf(buf, len, "%.*s", path_len, line + 3) >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+int cgroup_path_of(pid_t pid, char *buf, size_t len)
+{
+	char path[64];
+	char content[PATH_MAX + 64];
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t read_len = read(fd, content, sizeof(content) - 1);
+	close(fd);
+	if (read_len < 0) {
+		return -1;
+	}
+	content[read_len] = '\0';
+	return cgroup_parse_path(content, buf, len);
+}
+
+static int write_in(const char *dir, const char *name, const char *value)
+{
+	char path[PATH_MAX];
+	if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, name) >=
+	    sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t len = strlen(value);
+	int ret = write(fd, value, len) == len ? 0 : -1;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+static int write_pid(const char *dir, pid_t pid)
+{
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%d", pid);
+	return write_in(dir, "cgroup.procs", buf);
+}
+
+static int mkdir_exist_ok(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		return -1;
+	}
+	return 0;
+}
+
+static int place_leaf(pid_t pid, const char *root, const char *group,
+		      char *path, size_t len)
+{
+	char current[PATH_MAX];
+	if (cgroup_path_of(pid, current, sizeof(current))) {
+		return -1;
+	}
+	// Processes cannot live in the root cgroup's children without
+	// ending up next to everything else, so only nest below a real
+	// cgroup. A task that is already in a leaf of this group stays put.
+	if (!strcmp(current, "/")) {
+		errno = EPERM;
+		return -1;
+	}
+	const char *base = strrchr(current, '/') + 1;
+	if (!strncmp(base, CGROUP_LEAF_PREFIX, strlen(CGROUP_LEAF_PREFIX)) &&
+	    !strcmp(base + strlen(CGROUP_LEAF_PREFIX), group)) {
+		snprintf(path, len, "%s%s", root, current);
+		return 0;
+	}
+
+	if ((size_t)snprintf(path, len, "%s%s/" CGROUP_LEAF_PREFIX "%s", root,
+			     current, group) >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (mkdir_exist_ok(path) || write_pid(path, pid)) {
+		return -1;
+	}
+	return 0;
+}
+
+int cgroup_acct_place(pid_t pid, const char *group, bool leaf, char *path,
+		      size_t len)
+{
+	const char *root = cgroup_root();
+	if (!root) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (!*group || strchr(group, '/') || !strcmp(group, ".") ||
+	    !strcmp(group, "..")) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (leaf && !place_leaf(pid, root, group, path, len)) {
+		return 0;
+	}
+
+	if ((size_t)snprintf(path, len, "%s/" CGROUP_ACCT_DIR, root) >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (mkdir_exist_ok(path)) {
+		return -1;
+	}
+	size_t used = strlen(path);
+	if ((size_t)snprintf(path + used, len - used, "/%s", group) >=
+	    len - used) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (mkdir_exist_ok(path) || write_pid(path, pid)) {
+		return -1;
+	}
+	return 0;
+}
+
+// Length of the part of the relative path current that the accounting
+// cgroup of group is below, or -1 if current is not one.
+static int acct_parent_len(const char *current, const char *group)
+{
+	static const char dir[] = "/" CGROUP_ACCT_DIR "/";
+	if (!strncmp(current, dir, sizeof(dir) - 1) &&
+	    !strcmp(current + sizeof(dir) - 1, group)) {
+		return 0;
+	}
+	const char *base = strrchr(current, '/');
+	size_t prefix = strlen(CGROUP_LEAF_PREFIX);
+	if (base && base != current &&
+	    !strncmp(base + 1, CGROUP_LEAF_PREFIX, prefix) &&
+	    !strcmp(base + 1 + prefix, group)) {
+		return base - current;
+	}
+	return -1;
+}
+
+int cgroup_acct_of(pid_t pid, const char *group, char *path, size_t len)
+{
+	const char *root = cgroup_root();
+	char current[PATH_MAX];
+	if (!root) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (cgroup_path_of(pid, current, sizeof(current))) {
+		return -1;
+	}
+	if (acct_parent_len(current, group) < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	if ((size_t)snprintf(path, len, "%s%s", root, current) >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+int cgroup_acct_leave(pid_t pid, const char *group, const char *origin)
+{
+	const char *root = cgroup_root();
+	char current[PATH_MAX];
+	if (!root || cgroup_path_of(pid, current, sizeof(current))) {
+		return 0;
+	}
+	int parent = acct_parent_len(current, group);
+	if (parent < 0 || (!parent && !origin)) {
+		return 0;
+	}
+	char path[PATH_MAX];
+	int written = parent ? snprintf(path, sizeof(path), "%s%.*s", root,
+					parent, current) :
+			       snprintf(path, sizeof(path), "%s%s", root,
+					strcmp(origin, "/") ? origin : "");
+	if ((size_t)written >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	// The cgroup it came from may have been removed once it was empty.
+	if (write_pid(path, pid)) {
+		return !parent && errno == ENOENT ? 0 : -1;
+	}
+	return 0;
+}
+
+bool cgroup_acct_unwrap(char *path, char *group, size_t len)
+{
+	static const char dir[] = "/" CGROUP_ACCT_DIR "/";
+	if (!strncmp(path, dir, sizeof(dir) - 1)) {
+		const char *name = path + sizeof(dir) - 1;
+		size_t name_len = strcspn(name, "/");
+		if (name_len && name_len < len) {
+			memcpy(group, name, name_len);
+			group[name_len] = '\0';
+			return true;
+		}
+		return false;
+	}
+
+	char *base = strrchr(path, '/');
+	if (base && base != path &&
+	    !strncmp(base + 1, CGROUP_LEAF_PREFIX,
+		     strlen(CGROUP_LEAF_PREFIX))) {
+		*base = '\0';
+	}
+	return false;
+}
+
+int cgroup_acct_resolve(const char *group, char *path, size_t len)
+{
+	const char *root = cgroup_root();
+	if (!root) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	int written;
+	if (group[0] == '/') {
+		written = snprintf(path, len, "%s%s", root, group);
+	} else {
+		written = snprintf(path, len, "%s/" CGROUP_ACCT_DIR "/%s", root,
+				   group);
+	}
+	if ((size_t)written >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	struct stat st;
+	if (stat(path, &st)) {
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	return 0;
+}
+
+int cgroup_set_idle(const char *path, bool idle)
+{
+	return write_in(path, "cpu.idle", idle ? "1" : "0");
+}
+
+static FILE *open_in(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return fopen(path, "r");
+}
+
+int cgroup_read_cpu_stat(const char *path, struct cgroup_cpu_stat *stat)
+{
+	FILE *file = open_in(path, "cpu.stat");
+	if (!file) {
+		return -1;
+	}
+	memset(stat, 0, sizeof(*stat));
+
+	char key[64];
+	unsigned long long value;
+	while (fscanf(file, "%63s %llu", key, &value) == 2) {
+		if (!strcmp(key, "usage_usec")) {
+			stat->usage_usec = value;
+		} else if (!strcmp(key, "user_usec")) {
+			stat->user_usec = value;
+		} else if (!strcmp(key, "system_usec")) {
+			stat->system_usec = value;
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+int cgroup_read_cpu_pressure(const char *path, struct cgroup_pressure *some)
+{
+	FILE *file = open_in(path, "cpu.pressure");
+	if (!file) {
+		return -1;
+	}
+	memset(some, 0, sizeof(*some));
+
+	int matched = fscanf(file,
+			     "some avg10=%lf avg60=%lf avg300=%lf total=%llu",
+			     &some->avg10, &some->avg60, &some->avg300,
+			     &some->total_usec);
+	fclose(file);
+	if (matched != 4) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int cgroup_for_each_thread(const char *path, int (*fn)(pid_t, void *),
+			   void *data)
+{
+	FILE *file = open_in(path, "cgroup.threads");
+	if (!file) {
+		return -1;
+	}
+
+	int ret = 0;
+	int tid;
+	while (!ret && fscanf(file, "%d", &tid) == 1) {
+		ret = fn(tid, data);
+	}
+	fclose(file);
+	return ret;
+}
+
+int cgroup_for_each_process(const char *path, int (*fn)(pid_t, void *),
+			    void *data)
+{
+	FILE *file = open_in(path, "cgroup.procs");
+	if (!file) {
+		return -1;
+	}
+	int ret = 0;
+	int pid;
+	while (!ret && fscanf(file, "%d", &pid) == 1) {
+		ret = fn(pid, data);
+	}
+	fclose(file);
+
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return ret;
+	}
+	struct dirent *entry;
+	while (!ret && (entry = readdir(dir))) {
+		if (entry->d_type != DT_DIR || entry->d_name[0] == '.') {
+			continue;
+		}
+		char child[PATH_MAX];
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		// A cgroup that is removed meanwhile is skipped.
+		int child_ret = cgroup_for_each_process(child, fn, data);
+		ret = child_ret > 0 ? child_ret : 0;
+	}
+	closedir(dir);
+	return ret;
+}
@@ -0,0 +1,81 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_CGROUP_H
+#define CORESCHED_CGROUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Accounting cgroups are created as <root>/coresched/<group>, or as a
+// coresched-<group> leaf below the cgroup the task is already in.
+#define CGROUP_ACCT_DIR "coresched"
+#define CGROUP_LEAF_PREFIX "coresched-"
+
+struct cgroup_cpu_stat {
+	unsigned long long usage_usec;
+	unsigned long long user_usec;
+	unsigned long long system_usec;
+};
+
+struct cgroup_pressure {
+	double avg10;
+	double avg60;
+	double avg300;
+	unsigned long long total_usec;
+};
+
+// Mount point of the cgroup v2 hierarchy, or NULL if there is none.
+const char *cgroup_root(void);
+
+// The cgroup v2 path of pid relative to cgroup_root(), starting with '/'.
+int cgroup_path_of(pid_t pid, char *buf, size_t len);
+// The same, taken from the contents of /proc/<pid>/cgroup.
+int cgroup_parse_path(const char *content, char *buf, size_t len);
+
+// Move the process pid into the accounting cgroup of group. If leaf is set,
+// a leaf below the current cgroup of pid is preferred and the dedicated
+// cgroup is only used when that is not possible. On success, the absolute
+// path of the cgroup is written to path.
+int cgroup_acct_place(pid_t pid, const char *group, bool leaf, char *path,
+		      size_t len);
+
+// The absolute path of the accounting cgroup of group that pid is in, the
+// dedicated one or a leaf. Fails with ENOENT if pid is in neither.
+int cgroup_acct_of(pid_t pid, const char *group, char *path, size_t len);
+
+// Move pid out of the accounting cgroup of group: from a leaf back into the
+// cgroup above it, which is where it came from, and from the dedicated
+// cgroup back into origin, relative to cgroup_root(). A task that is in
+// neither, or in the dedicated cgroup without an origin, stays put.
+int cgroup_acct_leave(pid_t pid, const char *group, const char *origin);
+
+// Undo what cgroup_acct_place did to the cgroup path of a task, relative to
+// cgroup_root(). A leaf of an accounting group is removed from path, which
+// then names the cgroup the task was in before. The cgroup a task came from
+// is lost when it was moved into the dedicated cgroup of a group, in which
+// case true is returned and the name of the group is written to group.
+bool cgroup_acct_unwrap(char *path, char *group, size_t len);
+
+// Resolve a group name or a path relative to cgroup_root() to an absolute
+// path of an existing cgroup.
+int cgroup_acct_resolve(const char *group, char *path, size_t len);
+
+// Set cpu.idle of the cgroup at path, which gives its tasks the weight of
+// SCHED_IDLE tasks against the rest of the system. Requires Linux 5.15 and
+// the cpu controller.
+int cgroup_set_idle(const char *path, bool idle);
+
+int cgroup_read_cpu_stat(const char *path, struct cgroup_cpu_stat *stat);
+int cgroup_read_cpu_pressure(const char *path, struct cgroup_pressure *some);
+
+// Call fn for each thread listed in cgroup.threads of the cgroup at path.
+int cgroup_for_each_thread(const char *path, int (*fn)(pid_t, void *),
+			   void *data);
+// Call fn for each process in the cgroup at path and in every cgroup below
+// it.
+int cgroup_for_each_process(const char *path, int (*fn)(pid_t, void *),
+			    void *data);
+
+#endif
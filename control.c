@@ -0,0 +1,110 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+// Requests on the control socket are single text datagrams of the form
+// "assign PID GROUP", and the daemon answers with "ok" or "error ERRNO" once
+// the cookie has been applied.
+
+#include "control.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int control_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int control_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	if (control_address(path, &addr)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			0);
+	if (fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	// Only processes that may change cookies anyway should be able to
+	// ask the daemon to do it for them.
+	mode_t mask = umask(077);
+	int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret || listen(fd, SOMAXCONN)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int control_parse(const char *msg, pid_t *pid, char *group, size_t len)
+{
+	int name_start, name_end;
+	if (sscanf(msg, "assign %d %n%*s%n", pid, &name_start, &name_end) < 1 ||
+	    *pid <= 0 || name_end <= name_start ||
+	    (size_t)(name_end - name_start) >= len) {
+		return -1;
+	}
+	memcpy(group, msg + name_start, name_end - name_start);
+	group[name_end - name_start] = '\0';
+	return 0;
+}
+
+void control_reply(int fd, int err)
+{
+	char msg[CONTROL_MSG_LEN];
+	int len = err ? snprintf(msg, sizeof(msg), "error %d", err) :
+			snprintf(msg, sizeof(msg), "ok");
+	send(fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	close(fd);
+}
+
+int control_request(const char *path, pid_t pid, const char *group)
+{
+	struct sockaddr_un addr;
+	if (control_address(path, &addr)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	char msg[CONTROL_MSG_LEN];
+	int len = snprintf(msg, sizeof(msg), "assign %d %s", pid, group);
+	ssize_t received = -1;
+	if (len >= (int)sizeof(msg)) {
+		errno = ENAMETOOLONG;
+	} else if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)) &&
+		   send(fd, msg, len, MSG_NOSIGNAL) == len) {
+		received = recv(fd, msg, sizeof(msg) - 1, 0);
+	}
+	int saved = errno;
+	close(fd);
+	if (received < 0) {
+		errno = saved;
+		return -1;
+	}
+
+	msg[received] = '\0';
+	int err;
+	if (!strcmp(msg, "ok")) {
+		return 0;
+	}
+	errno = sscanf(msg, "error %d", &err) == 1 ? err : EPROTO;
+	return -1;
+}
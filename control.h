@@ -0,0 +1,31 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_CONTROL_H
+#define CORESCHED_CONTROL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Where the daemon listens for requests unless told otherwise.
+#define CONTROL_SOCKET_PATH "/run/coresched.sock"
+
+// Longest request or reply on the control socket.
+#define CONTROL_MSG_LEN 256
+
+// Create the listening socket of the daemon, replacing a stale one.
+int control_listen(const char *path);
+
+// Parse a request that was received by the daemon. Returns -1 if it is
+// malformed.
+int control_parse(const char *msg, pid_t *pid, char *group, size_t len);
+
+// Tell the client how its request ended, 0 for success or an errno value.
+void control_reply(int fd, int err);
+
+// Ask the daemon listening on path to move process pid into group, and
+// wait until it did. Returns -1 with errno set to the daemon's error or to
+// the error of talking to it.
+int control_request(const char *path, pid_t pid, const char *group);
+
+#endif
@@ -3,22 +3,70 @@
 
 #include <argp.h>
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <sys/prctl.h>
 #include <string.h>
 #include <stdbool.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <error.h>
 
+#include "accounting.h"
+#include "bench.h"
+#include "blame.h"
+#include "busypoll.h"
+#include "control.h"
+#include "cgroup.h"
+#include "coresched.h"
+#include "criu.h"
+#include "daemon.h"
+#include "init.h"
+#include "plan.h"
+#include "proc.h"
+#include "vm.h"
+#include "workload.h"
+
 static char args_doc[] = "get -p PID\n"
-			 "create -p PID\n"
+			 "create -p PID [-g GROUP [--leaf]]\n"
 			 "copy -p PID -d PID [-t PID]\n"
-			 "exec [-p PID] -- PROGRAM ARGS...";
+			 "exec [-p PID] [-g GROUP [--leaf]] -- PROGRAM ARGS...\n"
+			 "stat [-g GROUP]... [-p PID] [-i MS] [-n COUNT]\n"
+			 "daemon -c CONFIG [-i MS] [--lanes N] [--socket PATH]\n"
+			 "bench [-m MODE] [-j JOBS] [-r RUNS] [--configs LIST] [-w SPEC] [--energy] [-- PROGRAM ARGS...]\n"
+			 "workload -w SPEC\n"
+			 "vm -p PID [--pin [--topology SPEC]]\n"
+			 "busypoll [-i MS] [--threshold PCT] [--apply REMEDY]\n"
+			 "blame [--duration MS] [--frequency HZ] [--stacks FILE]\n"
+			 "assign -p PID --group NAME [--socket PATH]\n"
+			 "plan -c PLAN [--max-load LOAD] [--push]\n"
+			 "criu [-p PID] [-D DIR]\n"
+			 "init [-p PID] -- PROGRAM ARGS...";
 
 static char doc[] = "Manage core scheduling cookies for tasks";
 
-static struct argp_option options[7] = {
+enum {
+	OPT_LEAF = 0x100,
+	OPT_FI_EVERY,
+	OPT_CONFIGS,
+	OPT_THRESHOLD,
+	OPT_APPLY,
+	OPT_DURATION,
+	OPT_FREQUENCY,
+	OPT_STACKS,
+	OPT_LANES,
+	OPT_SOCKET,
+	OPT_GROUP,
+	OPT_PIN,
+	OPT_TOPOLOGY,
+	OPT_MAX_LOAD,
+	OPT_PUSH,
+	OPT_ENERGY,
+};
+
+static struct argp_option options[] = {
 	{ "pid", 'p', "PID", 0,
 	  "the PID to get or copy the core scheduling cookie from, or the PID to create the cookie for.",
 	  0 },
@@ -27,20 +75,105 @@ static struct argp_option options[7] = {
 	{ "type", 't', "TYPE", 0,
 	  "the type of the destination PID, or the type of the PID to create a core scheduling cookie for. Can be one of the following: pid, tgid or pgid. Defaults to tgid.",
 	  0 },
+	{ 0, 0, 0, 0, "Accounting cgroups:", 1 },
+	{ "cgroup", 'g', "GROUP", 0,
+	  "place the processes that receive the cookie in the accounting cgroup of GROUP. For stat, the group to report on; can be given multiple times.",
+	  1 },
+	{ "leaf", OPT_LEAF, 0, 0,
+	  "create the accounting cgroup as a leaf below the current cgroup of the process where possible",
+	  1 },
+	{ "interval", 'i', "MS", 0,
+	  "the time between two stat samples or two daemon scans in milliseconds. Defaults to 1000.",
+	  1 },
+	{ "count", 'n', "COUNT", 0,
+	  "the number of stat samples to print. Defaults to no limit.", 1 },
+	{ "fi-every", OPT_FI_EVERY, "N", 0,
+	  "only sample the forced idle time of each task every N intervals. Defaults to 10.",
+	  1 },
+	{ 0, 0, 0, 0, "Daemon:", 2 },
+	{ "config", 'c', "CONFIG", 0,
+	  "the file with the groups and rules the daemon enforces, or the groups that may share a cookie for plan",
+	  2 },
+	{ "lanes", OPT_LANES, "N", 0,
+	  "the number of lanes that classify and apply tasks in parallel. Defaults to one per 32 online CPUs.",
+	  2 },
+	{ "socket", OPT_SOCKET, "PATH", 0,
+	  "the control socket of the daemon. The daemon only listens on it when it is given. Defaults to " CONTROL_SOCKET_PATH
+	  " for assign and the launch benchmark.",
+	  2 },
+	{ "group", OPT_GROUP, "NAME", 0,
+	  "the daemon group to assign the process to, or to request in the launch benchmark",
+	  2 },
+	{ 0, 0, 0, 0, "Benchmarks:", 3 },
+	{ "mode", 'm', "MODE", 0,
+	  "the benchmark to run. Can be one of the following: smt, launch (the latency of requests to a running daemon, with as many background processes as jobs) or pool (the throughput of a thread pool with a cookie and reserved cores, config cookie, against one without, config smt, next to the jobs as noisy neighbours) or handoff (requests of as many tenants as jobs, switching cookies per request against handing them to a worker per tenant) or haltpoll (as many VMs as jobs with spin-then-block vCPUs in a cookie each, next to a host batch job, for a sweep of poll durations) or init (start latency and peak RSS of the program, true by default, run directly, through exec, through init and through tini and dumb-init when installed) or tier (tail latency of a service with a cookie next to as many batch threads as jobs, in a cookie of their own with and without SCHED_IDLE, and the batch throughput) or fork (latency of fork and exit, fork and exec of the program, true by default, vfork and exec, and pthread_create and join, without a cookie, with an inherited cookie and with a fresh one, from parents with 1, 8 and 64 threads). Defaults to smt.",
+	  3 },
+	{ "jobs", 'j', "JOBS", 0,
+	  "the number of copies of the program that run at the same time. Defaults to the number of online CPUs.",
+	  3 },
+	{ "runs", 'r', "RUNS", 0,
+	  "the number of times the jobs are started for each configuration. Defaults to 5.",
+	  3 },
+	{ "configs", OPT_CONFIGS, "LIST", 0,
+	  "comma separated configurations to compare: cookie (a cookie per job), nosmt (SMT turned off) and smt (no cookies). Defaults to all of them.",
+	  3 },
+	{ "workload", 'w', "SPEC", 0,
+	  "run a built-in synthetic workload instead of a program, for example 'threads=4,kernel=fp,duty=50;threads=2,kernel=chase,cookie=1'. Keys are threads, kernel (int, fp, stream, chase, syscall, sleep), duty, period, size, ops, cookie, time and seed.",
+	  3 },
+	{ "energy", OPT_ENERGY, 0, 0,
+	  "also report package power from powercap RAPL, the effective frequency from APERF and MPERF or cpufreq, and the work done per joule",
+	  3 },
+	{ 0, 0, 0, 0, "Busy-poll detection:", 4 },
+	{ "threshold", OPT_THRESHOLD, "PCT", 0,
+	  "the percentage of the interval a thread has to be runnable to count as a poller. Defaults to 95.",
+	  4 },
+	{ "apply", OPT_APPLY, "REMEDY", 0,
+	  "apply a remedy to pollers that cause forced idle instead of only recommending one. Can be one of the following: pair (pin it with the busiest thread of the same cookie) or exclusive (give it a core of its own).",
+	  4 },
+	{ 0, 0, 0, 0, "Forced idle blame:", 5 },
+	{ "duration", OPT_DURATION, "MS", 0,
+	  "how long to profile in milliseconds. Defaults to 10000.", 5 },
+	{ "frequency", OPT_FREQUENCY, "HZ", 0,
+	  "how often each CPU is sampled per second. Defaults to 99.", 5 },
+	{ "stacks", OPT_STACKS, "FILE", 0,
+	  "write the blamed code paths as folded stacks to FILE, weighted by the forced idle time in microseconds",
+	  5 },
+	{ 0, 0, 0, 0, "Virtual machines:", 6 },
+	{ "pin", OPT_PIN, 0, 0,
+	  "pin the vCPU threads so that the vCPUs of every guest core run on the SMT siblings of one host core, using the CPUs the VM may run on",
+	  6 },
+	{ "topology", OPT_TOPOLOGY, "SPEC", 0,
+	  "the topology the guest sees, in the syntax of QEMU's -smp option, for example 8,threads=2. Read from the -smp option of the VM process when not given.",
+	  6 },
+	{ 0, 0, 0, 0, "Cookie planning:", 7 },
+	{ "max-load", OPT_MAX_LOAD, "LOAD", 0,
+	  "the most load the groups of one cookie may have together, to spread the load over the cookies. Defaults to no limit.",
+	  7 },
+	{ "push", OPT_PUSH, 0, 0,
+	  "give the processes of the groups their planned cookie instead of only printing the plan",
+	  7 },
+	{ 0, 0, 0, 0, "Checkpoint/restore:", 8 },
+	{ "images", 'D', "DIR", 0,
+	  "the CRIU image directory to record the cookies in and restore them from. Defaults to CRTOOLS_IMAGE_DIR.",
+	  8 },
 	{ 0 }
 };
 
-typedef enum {
-	SCHED_CORE_SCOPE_PID = PR_SCHED_CORE_SCOPE_THREAD,
-	SCHED_CORE_SCOPE_TGID = PR_SCHED_CORE_SCOPE_THREAD_GROUP,
-	SCHED_CORE_SCOPE_PGID = PR_SCHED_CORE_SCOPE_PROCESS_GROUP,
-} core_sched_type_t;
-
 typedef enum {
 	SCHED_CORE_CMD_GET,
 	SCHED_CORE_CMD_CREATE,
 	SCHED_CORE_CMD_COPY,
 	SCHED_CORE_CMD_EXEC,
+	SCHED_CORE_CMD_STAT,
+	SCHED_CORE_CMD_DAEMON,
+	SCHED_CORE_CMD_BENCH,
+	SCHED_CORE_CMD_WORKLOAD,
+	SCHED_CORE_CMD_VM,
+	SCHED_CORE_CMD_BUSYPOLL,
+	SCHED_CORE_CMD_BLAME,
+	SCHED_CORE_CMD_ASSIGN,
+	SCHED_CORE_CMD_PLAN,
+	SCHED_CORE_CMD_CRIU,
 } core_sched_cmd_t;
 
 struct args {
@@ -49,6 +182,21 @@ struct args {
 	core_sched_type_t type;
 	core_sched_cmd_t cmd;
 	int exec_argv_offset;
+	const char *cgroup;
+	bool cgroup_leaf;
+	struct acct_options acct;
+	struct daemon_options daemon;
+	struct bench_options bench;
+	struct workload workload;
+	bool have_workload;
+	struct busypoll_options busypoll;
+	struct blame_options blame;
+	bool vm_pin;
+	struct vm_topology vm_topology;
+	bool have_vm_topology;
+	double plan_max_load;
+	bool plan_push;
+	const char *criu_images;
 };
 
 unsigned long core_sched_get_cookie(struct args *args)
@@ -73,6 +221,36 @@ void core_sched_create_cookie(struct args *args)
 	}
 }
 
+static void place_in_cgroup(pid_t pid, struct args *args)
+{
+	char path[PATH_MAX];
+	if (cgroup_acct_place(pid, args->cgroup, args->cgroup_leaf, path,
+			      sizeof(path))) {
+		error(1, errno, "Failed to move PID %d to accounting group %s",
+		      pid, args->cgroup);
+	}
+}
+
+static int place_if_in_pgid(pid_t pid, void *data)
+{
+	struct args *args = data;
+	if (proc_read_pgid(pid) == args->from_pid) {
+		place_in_cgroup(pid, args);
+	}
+	return 0;
+}
+
+// cgroup v2 moves whole processes, so a thread scope moves the process the
+// thread belongs to.
+void core_sched_place_cookie(struct args *args)
+{
+	if (args->type == SCHED_CORE_SCOPE_PGID) {
+		proc_for_each_pid(place_if_in_pgid, args);
+	} else {
+		place_in_cgroup(args->from_pid, args);
+	}
+}
+
 void core_sched_pull_cookie(pid_t from)
 {
 	int prctl_errno = prctl(PR_SCHED_CORE, PR_SCHED_CORE_SHARE_FROM, from,
@@ -124,6 +302,9 @@ void core_sched_exec_with_cookie(struct args *args, char **argv)
 			args->from_pid = getpid();
 			core_sched_create_cookie(args);
 		}
+		if (args->cgroup) {
+			place_in_cgroup(getpid(), args);
+		}
 		unsigned long cookie = core_sched_get_cookie(args);
 		fprintf(stderr,
 			"spawned pid %d with core scheduling cookie 0x%lx\n",
@@ -138,13 +319,132 @@ void core_sched_exec_with_cookie(struct args *args, char **argv)
 	}
 }
 
+void core_sched_run_workload(struct args *args)
+{
+	struct workload_result result;
+	workload_run(&args->workload, true, &result);
+
+	double p50 = bench_percentile(result.latency_us, result.latency_count,
+				      50);
+	double p99 = bench_percentile(result.latency_us, result.latency_count,
+				      99);
+	printf("%llu ops in %.3f s: %.1f ops/s, op latency p50 %.1f us, p99 %.1f us\n",
+	       result.ops, result.wall_s, result.ops / result.wall_s, p50, p99);
+	workload_result_free(&result);
+}
+
+void core_sched_vm(struct args *args)
+{
+	size_t failed = vm_tag_vhost_workers(args->from_pid);
+	if (args->vm_pin) {
+		if (!args->have_vm_topology &&
+		    vm_read_topology(args->from_pid, &args->vm_topology)) {
+			error(1, errno,
+			      "Failed to find the guest topology of PID %d, pass it with --topology",
+			      args->from_pid);
+		}
+		failed += vm_pin_vcpus(args->from_pid, &args->vm_topology);
+	}
+	if (failed) {
+		exit(1);
+	}
+}
+
+void core_sched_assign(struct args *args)
+{
+	if (control_request(args->bench.socket, args->from_pid,
+			    args->bench.group)) {
+		error(1, errno, "Failed to assign PID %d to group %s",
+		      args->from_pid, args->bench.group);
+	}
+}
+
+void core_sched_plan(struct args *args)
+{
+	struct plan plan;
+	if (plan_load(args->daemon.config, &plan)) {
+		exit(1);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	plan_solve(&plan, args->plan_max_load);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double solve_ms = (end.tv_sec - start.tv_sec) * 1e3 +
+			  (end.tv_nsec - start.tv_nsec) / 1e6;
+
+	for (size_t c = 0; c < plan.cookie_count; c++) {
+		printf("cookie %zu (load %g):", c, plan.cookie_load[c]);
+		for (size_t i = 0; i < plan.group_count; i++) {
+			if (plan.groups[i].cookie == c) {
+				printf(" %s", plan.groups[i].name);
+			}
+		}
+		printf("\n");
+	}
+	printf("%zu groups in %zu cookies, solved in %.3f ms\n",
+	       plan.group_count, plan.cookie_count, solve_ms);
+
+	size_t failed = args->plan_push ? plan_apply(&plan) : 0;
+	plan_free(&plan);
+	if (failed) {
+		exit(1);
+	}
+}
+
 static const char *copying_requires_dest_msg =
 	"Copying a core scheduling cookie requires a destination PID\0";
 static const char *retrieve_requires_source_msg =
 	"Retrieving a core scheduling cookie requires a source PID\0";
+static const char *daemon_requires_config_msg =
+	"The daemon requires a configuration file\0";
+static const char *plan_requires_config_msg =
+	"Planning cookies requires a file with the groups\0";
+static const char *workload_requires_spec_msg =
+	"Running a workload requires a workload specification\0";
+static const char *assign_requires_group_msg =
+	"Assigning a process requires a group\0";
+static const char *interval_not_zero_msg =
+	"The interval has to be at least one millisecond\0";
 bool verify_arguments(struct args *args, const char **error_msg)
 {
-	if (args->from_pid != 0 || args->cmd == SCHED_CORE_CMD_EXEC) {
+	if (!args->acct.interval_ms) {
+		*error_msg = interval_not_zero_msg;
+		return false;
+	}
+	if (args->cmd == SCHED_CORE_CMD_WORKLOAD) {
+		if (!args->have_workload) {
+			*error_msg = workload_requires_spec_msg;
+			return false;
+		}
+		return true;
+	}
+	if (args->cmd == SCHED_CORE_CMD_ASSIGN && !args->bench.group) {
+		*error_msg = assign_requires_group_msg;
+		return false;
+	}
+	if (args->cmd == SCHED_CORE_CMD_CRIU) {
+		return true;
+	}
+	if (args->cmd == SCHED_CORE_CMD_PLAN) {
+		if (!args->daemon.config) {
+			*error_msg = plan_requires_config_msg;
+			return false;
+		}
+		return true;
+	}
+	if (args->cmd == SCHED_CORE_CMD_DAEMON) {
+		if (!args->daemon.config) {
+			*error_msg = daemon_requires_config_msg;
+			return false;
+		}
+		return true;
+	}
+	if (args->from_pid != 0 || args->cmd == SCHED_CORE_CMD_EXEC ||
+	    args->cmd == SCHED_CORE_CMD_STAT ||
+	    args->cmd == SCHED_CORE_CMD_BENCH ||
+	    args->cmd == SCHED_CORE_CMD_BUSYPOLL ||
+	    args->cmd == SCHED_CORE_CMD_BLAME) {
 		if (args->cmd == SCHED_CORE_CMD_COPY && args->to_pid == 0) {
 			*error_msg = copying_requires_dest_msg;
 			return false;
@@ -173,6 +473,32 @@ pid_t parse_pid(struct argp_state *state, char *str)
 	}
 }
 
+unsigned int parse_uint(struct argp_state *state, char *str)
+{
+	char *tailptr = NULL;
+	errno = 0;
+	unsigned long value = strtoul(str, &tailptr, 10);
+
+	if (*tailptr != '\0' || tailptr == str || str[0] == '-' || errno ||
+	    value > UINT_MAX) {
+		argp_error(state, "Failed to parse number %s", str);
+	}
+	return value;
+}
+
+static void add_acct_group(struct argp_state *state, struct args *args,
+			   const char *group)
+{
+	const char **groups = realloc(args->acct.groups,
+				      (args->acct.group_count + 1) *
+					      sizeof(*groups));
+	if (!groups) {
+		argp_failure(state, 1, errno, "Failed to allocate groups");
+	}
+	groups[args->acct.group_count++] = group;
+	args->acct.groups = groups;
+}
+
 core_sched_type_t parse_core_sched_type(struct argp_state *state, char *str)
 {
 	if (!strncmp(str, "pid\0", 4)) {
@@ -189,6 +515,20 @@ core_sched_type_t parse_core_sched_type(struct argp_state *state, char *str)
 	__builtin_unreachable();
 }
 
+enum busypoll_remedy parse_remedy(struct argp_state *state, char *arg)
+{
+	if (!strncmp(arg, "pair\0", 5)) {
+		return BUSYPOLL_PAIR;
+	} else if (!strncmp(arg, "exclusive\0", 10)) {
+		return BUSYPOLL_EXCLUSIVE;
+	}
+
+	argp_error(state,
+		   "'%s' is an invalid remedy. Must be one of pair/exclusive",
+		   arg);
+	__builtin_unreachable();
+}
+
 core_sched_cmd_t parse_cmd(struct argp_state *state, char *arg)
 {
 	if (!strncmp(arg, "get\0", 4)) {
@@ -199,6 +539,26 @@ core_sched_cmd_t parse_cmd(struct argp_state *state, char *arg)
 		return SCHED_CORE_CMD_COPY;
 	} else if (!strncmp(arg, "exec\0", 5)) {
 		return SCHED_CORE_CMD_EXEC;
+	} else if (!strncmp(arg, "stat\0", 5)) {
+		return SCHED_CORE_CMD_STAT;
+	} else if (!strncmp(arg, "daemon\0", 7)) {
+		return SCHED_CORE_CMD_DAEMON;
+	} else if (!strncmp(arg, "bench\0", 6)) {
+		return SCHED_CORE_CMD_BENCH;
+	} else if (!strncmp(arg, "workload\0", 9)) {
+		return SCHED_CORE_CMD_WORKLOAD;
+	} else if (!strncmp(arg, "vm\0", 3)) {
+		return SCHED_CORE_CMD_VM;
+	} else if (!strncmp(arg, "busypoll\0", 9)) {
+		return SCHED_CORE_CMD_BUSYPOLL;
+	} else if (!strncmp(arg, "blame\0", 6)) {
+		return SCHED_CORE_CMD_BLAME;
+	} else if (!strncmp(arg, "assign\0", 7)) {
+		return SCHED_CORE_CMD_ASSIGN;
+	} else if (!strncmp(arg, "plan\0", 5)) {
+		return SCHED_CORE_CMD_PLAN;
+	} else if (!strncmp(arg, "criu\0", 5)) {
+		return SCHED_CORE_CMD_CRIU;
 	} else {
 		argp_error(state, "Unknown command '%s'", arg);
 		__builtin_unreachable();
@@ -227,6 +587,107 @@ error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'd':
 		arguments->to_pid = parse_pid(state, arg);
 		break;
+	case 'g':
+		arguments->cgroup = arg;
+		add_acct_group(state, arguments, arg);
+		break;
+	case OPT_LEAF:
+		arguments->cgroup_leaf = true;
+		break;
+	case 'i':
+		arguments->acct.interval_ms = parse_uint(state, arg);
+		break;
+	case 'n':
+		arguments->acct.count = parse_uint(state, arg);
+		break;
+	case 'c':
+		arguments->daemon.config = arg;
+		break;
+	case 'm':
+		arguments->bench.mode = arg;
+		break;
+	case 'j':
+		arguments->bench.jobs = parse_uint(state, arg);
+		break;
+	case 'r':
+		arguments->bench.runs = parse_uint(state, arg);
+		break;
+	case 'w': {
+		const char *error_msg = NULL;
+		if (arguments->have_workload) {
+			workload_free(&arguments->workload);
+		}
+		if (workload_parse(arg, &arguments->workload, &error_msg)) {
+			argp_error(state, "Invalid workload '%s': %s", arg,
+				   error_msg);
+		}
+		arguments->have_workload = true;
+		arguments->bench.workload = &arguments->workload;
+		break;
+	}
+	case OPT_CONFIGS:
+		arguments->bench.configs = arg;
+		break;
+	case OPT_THRESHOLD:
+		arguments->busypoll.threshold_pct = parse_uint(state, arg);
+		if (arguments->busypoll.threshold_pct > 100) {
+			argp_error(state, "The threshold is a percentage");
+		}
+		break;
+	case OPT_APPLY:
+		arguments->busypoll.remedy = parse_remedy(state, arg);
+		break;
+	case OPT_DURATION:
+		arguments->blame.duration_ms = parse_uint(state, arg);
+		break;
+	case OPT_FREQUENCY:
+		arguments->blame.frequency = parse_uint(state, arg);
+		if (!arguments->blame.frequency) {
+			argp_error(state, "The frequency must be at least 1");
+		}
+		break;
+	case OPT_SOCKET:
+		arguments->daemon.socket = arg;
+		arguments->bench.socket = arg;
+		break;
+	case OPT_GROUP:
+		arguments->bench.group = arg;
+		break;
+	case OPT_LANES:
+		arguments->daemon.lanes = parse_uint(state, arg);
+		break;
+	case OPT_STACKS:
+		arguments->blame.stacks = arg;
+		break;
+	case OPT_PIN:
+		arguments->vm_pin = true;
+		break;
+	case OPT_TOPOLOGY:
+		if (vm_parse_topology(arg, &arguments->vm_topology)) {
+			argp_error(state, "Invalid topology '%s'", arg);
+		}
+		arguments->have_vm_topology = true;
+		break;
+	case OPT_MAX_LOAD: {
+		char *end = NULL;
+		arguments->plan_max_load = strtod(arg, &end);
+		if (end == arg || *end || arguments->plan_max_load <= 0) {
+			argp_error(state, "Invalid load '%s'", arg);
+		}
+		break;
+	}
+	case 'D':
+		arguments->criu_images = arg;
+		break;
+	case OPT_ENERGY:
+		arguments->bench.energy = true;
+		break;
+	case OPT_PUSH:
+		arguments->plan_push = true;
+		break;
+	case OPT_FI_EVERY:
+		arguments->acct.fi_every = parse_uint(state, arg);
+		break;
 	case ARGP_KEY_SUCCESS:
 		if (state->argc <= 1) {
 			argp_usage(state);
@@ -245,8 +706,23 @@ error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 int main(int argc, char *argv[argc])
 {
+	// Before argp, which allocates, so that a container starts quickly.
+	if (argc > 1 && !strcmp(argv[1], "init")) {
+		init_run(argc - 2, &argv[2]);
+	}
+
 	struct args arguments = { 0 };
 	arguments.type = SCHED_CORE_SCOPE_TGID;
+	arguments.acct.interval_ms = 1000;
+	arguments.acct.fi_every = 10;
+	arguments.busypoll.threshold_pct = 95;
+	arguments.blame.duration_ms = 10000;
+	arguments.blame.frequency = 99;
+	arguments.bench.mode = "smt";
+	arguments.bench.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	arguments.bench.runs = 5;
+	arguments.bench.configs = "cookie,nosmt,smt";
+	arguments.bench.socket = CONTROL_SOCKET_PATH;
 
 	struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
 
@@ -267,6 +743,9 @@ int main(int argc, char *argv[argc])
 		break;
 	case SCHED_CORE_CMD_CREATE:
 		core_sched_create_cookie(&arguments);
+		if (arguments.cgroup) {
+			core_sched_place_cookie(&arguments);
+		}
 		break;
 	case SCHED_CORE_CMD_COPY:
 		core_sched_copy_cookie(&arguments);
@@ -274,6 +753,44 @@ int main(int argc, char *argv[argc])
 	case SCHED_CORE_CMD_EXEC:
 		core_sched_exec_with_cookie(&arguments, argv);
 		break;
+	case SCHED_CORE_CMD_STAT:
+		arguments.acct.pid = arguments.from_pid;
+		acct_stat(&arguments.acct);
+		break;
+	case SCHED_CORE_CMD_DAEMON:
+		arguments.daemon.interval_ms = arguments.acct.interval_ms;
+		daemon_run(&arguments.daemon);
+		break;
+	case SCHED_CORE_CMD_BENCH:
+		if (arguments.exec_argv_offset) {
+			arguments.bench.argv = &argv[arguments.exec_argv_offset];
+		}
+		bench_run(&arguments.bench);
+		break;
+	case SCHED_CORE_CMD_WORKLOAD:
+		core_sched_run_workload(&arguments);
+		break;
+	case SCHED_CORE_CMD_VM:
+		core_sched_vm(&arguments);
+		break;
+	case SCHED_CORE_CMD_BUSYPOLL:
+		arguments.busypoll.interval_ms = arguments.acct.interval_ms;
+		busypoll_detect(&arguments.busypoll);
+		break;
+	case SCHED_CORE_CMD_BLAME:
+		blame_profile(&arguments.blame);
+		break;
+	case SCHED_CORE_CMD_ASSIGN:
+		core_sched_assign(&arguments);
+		break;
+	case SCHED_CORE_CMD_PLAN:
+		core_sched_plan(&arguments);
+		break;
+	case SCHED_CORE_CMD_CRIU: {
+		struct criu_options criu = { arguments.from_pid,
+					     arguments.criu_images };
+		exit(criu_hook(&criu));
+	}
 	default:
 		exit(1);
 	}
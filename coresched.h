@@ -0,0 +1,24 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_H
+#define CORESCHED_H
+
+#include <sys/prctl.h>
+#include <sys/types.h>
+
+typedef enum {
+	SCHED_CORE_SCOPE_PID = PR_SCHED_CORE_SCOPE_THREAD,
+	SCHED_CORE_SCOPE_TGID = PR_SCHED_CORE_SCOPE_THREAD_GROUP,
+	SCHED_CORE_SCOPE_PGID = PR_SCHED_CORE_SCOPE_PROCESS_GROUP,
+} core_sched_type_t;
+
+// Thin wrappers around PR_SCHED_CORE that report failure through errno
+// instead of terminating, for callers that handle many tasks at once.
+// All of them return 0 on success and -1 on failure.
+int core_sched_get(pid_t pid, unsigned long *cookie);
+int core_sched_create(pid_t pid, core_sched_type_t type);
+int core_sched_share_from(pid_t pid);
+int core_sched_share_to(pid_t pid, core_sched_type_t type);
+
+#endif
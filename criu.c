@@ -0,0 +1,256 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "criu.h"
+#include "coresched.h"
+#include "proc.h"
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CRIU_IMAGE "coresched.img"
+
+struct criu_thread {
+	// Thread ID in the innermost PID namespace of the thread.
+	pid_t ns_tid;
+	pid_t tid;
+	unsigned long cookie;
+};
+
+struct criu_tree {
+	// The process whose threads are being visited.
+	pid_t pid;
+	struct criu_thread *threads;
+	size_t count;
+	size_t capacity;
+	// Whether to read the cookie of every thread.
+	int cookies;
+};
+
+// The last field of NSpid in the status file of a thread, or 0 if it
+// cannot be read.
+static pid_t read_ns_tid(pid_t pid, pid_t tid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/status", pid, tid);
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return 0;
+	}
+	char *buf = NULL;
+	size_t size = 0;
+	pid_t ns_tid = 0;
+	while (getline(&buf, &size, file) != -1) {
+		if (strncmp(buf, "NSpid:", 6)) {
+			continue;
+		}
+		char *field = strtok(buf + 6, " \t\n");
+		for (; field; field = strtok(NULL, " \t\n")) {
+			ns_tid = strtol(field, NULL, 10);
+		}
+		break;
+	}
+	free(buf);
+	fclose(file);
+	return ns_tid;
+}
+
+static int visit_thread(pid_t tid, void *data)
+{
+	struct criu_tree *tree = data;
+	struct criu_thread thread = { read_ns_tid(tree->pid, tid), tid, 0 };
+	if (!thread.ns_tid) {
+		return 0;
+	}
+	if (tree->cookies &&
+	    (core_sched_get(tid, &thread.cookie) || !thread.cookie)) {
+		return 0;
+	}
+	if (tree->count == tree->capacity) {
+		tree->capacity = tree->capacity ? tree->capacity * 2 : 64;
+		tree->threads = realloc(tree->threads,
+					tree->capacity * sizeof(*tree->threads));
+		if (!tree->threads) {
+			error(1, errno, "Failed to allocate threads");
+		}
+	}
+	tree->threads[tree->count++] = thread;
+	return 0;
+}
+
+static int visit_process(pid_t pid, void *data)
+{
+	struct criu_tree *tree = data;
+	pid_t parent = tree->pid;
+	tree->pid = pid;
+	proc_for_each_task(pid, visit_thread, tree);
+	proc_for_each_child(pid, visit_process, tree);
+	tree->pid = parent;
+	return 0;
+}
+
+static void image_path(const struct criu_options *options, char *path,
+		       size_t len)
+{
+	snprintf(path, len, "%s/" CRIU_IMAGE, options->images);
+}
+
+static int criu_dump(const struct criu_options *options)
+{
+	if (!options->pid) {
+		error(0, 0, "Dumping cookies requires the PID of the tree");
+		return 1;
+	}
+	struct criu_tree tree = { .cookies = 1 };
+	visit_process(options->pid, &tree);
+
+	char path[PATH_MAX];
+	image_path(options, path, sizeof(path));
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		error(0, errno, "Failed to create %s", path);
+		free(tree.threads);
+		return 1;
+	}
+	for (size_t i = 0; i < tree.count; i++) {
+		fprintf(file, "%d %lx\n", tree.threads[i].ns_tid,
+			tree.threads[i].cookie);
+	}
+	int ret = 0;
+	if (fclose(file)) {
+		error(0, errno, "Failed to write %s", path);
+		ret = 1;
+	}
+	free(tree.threads);
+	return ret;
+}
+
+static int compare_cookie(const void *a, const void *b)
+{
+	const struct criu_thread *x = a;
+	const struct criu_thread *y = b;
+	return (x->cookie > y->cookie) - (x->cookie < y->cookie);
+}
+
+static pid_t find_thread(const struct criu_tree *tree, pid_t ns_tid)
+{
+	for (size_t i = 0; i < tree->count; i++) {
+		if (tree->threads[i].ns_tid == ns_tid) {
+			return tree->threads[i].tid;
+		}
+	}
+	return 0;
+}
+
+static int criu_restore(const struct criu_options *options)
+{
+	if (!options->pid) {
+		error(0, 0, "Restoring cookies requires the PID of the tree");
+		return 1;
+	}
+
+	char path[PATH_MAX];
+	image_path(options, path, sizeof(path));
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		// Dumped without the hook, so there is nothing to restore.
+		if (errno == ENOENT) {
+			return 0;
+		}
+		error(0, errno, "Failed to open %s", path);
+		return 1;
+	}
+	struct criu_tree saved = { 0 };
+	struct criu_thread thread = { 0 };
+	while (fscanf(file, "%d %lx", &thread.ns_tid, &thread.cookie) == 2) {
+		if (saved.count == saved.capacity) {
+			saved.capacity = saved.capacity ? saved.capacity * 2 :
+							  64;
+			saved.threads = realloc(saved.threads,
+						saved.capacity *
+							sizeof(*saved.threads));
+			if (!saved.threads) {
+				error(1, errno, "Failed to allocate threads");
+			}
+		}
+		saved.threads[saved.count++] = thread;
+	}
+	fclose(file);
+	qsort(saved.threads, saved.count, sizeof(*saved.threads),
+	      compare_cookie);
+
+	struct criu_tree restored = { 0 };
+	visit_process(options->pid, &restored);
+
+	// One new cookie per recorded cookie, pulled into this thread and
+	// pushed to the other threads that had it.
+	size_t failed = 0;
+	for (size_t i = 0; i < saved.count;) {
+		size_t end = i;
+		while (end < saved.count &&
+		       saved.threads[end].cookie == saved.threads[i].cookie) {
+			end++;
+		}
+		pid_t first = 0;
+		for (; i < end; i++) {
+			pid_t ns_tid = saved.threads[i].ns_tid;
+			pid_t tid = find_thread(&restored, ns_tid);
+			int err = 0;
+			if (!tid) {
+				err = ESRCH;
+			} else if (first) {
+				if (core_sched_share_to(tid,
+							SCHED_CORE_SCOPE_PID)) {
+					err = errno;
+				}
+			} else if (core_sched_create(tid,
+						     SCHED_CORE_SCOPE_PID) ||
+				   core_sched_share_from(tid)) {
+				err = errno;
+			} else {
+				first = tid;
+			}
+			if (err) {
+				error(0, err,
+				      "Failed to restore the cookie of thread %d",
+				      ns_tid);
+				failed++;
+			}
+		}
+	}
+	free(saved.threads);
+	free(restored.threads);
+	return failed ? 1 : 0;
+}
+
+int criu_hook(const struct criu_options *options)
+{
+	const char *action = getenv("CRTOOLS_SCRIPT_ACTION");
+	if (!action) {
+		error(0, 0, "criu has to be run by CRIU as an action script");
+		return 1;
+	}
+	bool dump = !strcmp(action, "pre-dump");
+	if (!dump && strcmp(action, "post-restore")) {
+		return 0;
+	}
+
+	struct criu_options resolved = *options;
+	if (!resolved.images) {
+		resolved.images = getenv("CRTOOLS_IMAGE_DIR");
+	}
+	if (!resolved.images) {
+		error(0, 0, "The image directory is not known, pass it with -D");
+		return 1;
+	}
+	const char *init_pid = getenv("CRTOOLS_INIT_PID");
+	if (!dump && init_pid) {
+		resolved.pid = strtol(init_pid, NULL, 10);
+	}
+	return dump ? criu_dump(&resolved) : criu_restore(&resolved);
+}
@@ -0,0 +1,30 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_CRIU_H
+#define CORESCHED_CRIU_H
+
+#include <sys/types.h>
+
+// CRIU does not checkpoint core scheduling cookies, so restored processes
+// run without them. Passed to CRIU as an action script, for example
+//
+//	criu dump -t PID -D DIR --action-script 'coresched criu -p PID -D DIR'
+//	criu restore -D DIR --action-script 'coresched criu -D DIR'
+//
+// the hook records which threads share a cookie in DIR/coresched.img on
+// pre-dump, and gives the restored threads their cookies back on
+// post-restore, before they resume. Threads are recorded by their ID in
+// their own PID namespace, which CRIU restores. Other actions are ignored.
+struct criu_options {
+	// The root of the tree that is dumped. CRIU passes the root of a
+	// restored tree in CRTOOLS_INIT_PID.
+	pid_t pid;
+	// The image directory, CRTOOLS_IMAGE_DIR when not given.
+	const char *images;
+};
+
+// Returns the exit status for CRIU, which aborts on anything but 0.
+int criu_hook(const struct criu_options *options);
+
+#endif
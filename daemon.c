@@ -0,0 +1,2229 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+// Tasks flow through the daemon in four stages. The main thread takes them
+// in from the scans of /proc, the classify thread of a lane matches them
+// against the rules, the apply thread of the same lane moves them into the
+// cookie of their group, and a single account thread keeps the statistics.
+// The lane of a task is picked by a hash of its tgid, so that everything that
+// happens to one process stays in order, and only one apply thread ever
+// touches its entry in the task map.
+//
+// Requests from the control socket are urgent: they have their own queues in
+// every lane, which are always drained before the bulk queues, and the main
+// thread only feeds a scan into the lanes a budget at a time so that it keeps
+// answering the socket while a large scan is in progress.
+
+#include "daemon.h"
+#include "bench.h"
+#include "cgroup.h"
+#include "control.h"
+#include "coresched.h"
+#include "domain.h"
+#include "label.h"
+#include "pidmap.h"
+#include "placement.h"
+#include "proc.h"
+#include "procread.h"
+#include "queue.h"
+#include "rebalance.h"
+#include "rules.h"
+#include "topology.h"
+#include "util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <limits.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CPU hotplug and SMT control changes arrive as one uevent per CPU, so
+// wait for the burst to settle before looking at the topology again.
+#define UEVENT_SETTLE_MS 100
+
+// The apply thread holds no cookie, or one that is not known.
+#define HOLDING_NONE -1
+#define HOLDING_UNKNOWN -2
+
+// Without an explicit number of lanes, one is started per this many CPUs.
+#define CPUS_PER_LANE 32
+#define MAX_LANES 64
+#define LANE_QUEUE_SIZE 4096
+#define ACCOUNT_QUEUE_SIZE 4096
+// Scans that can be in flight through the lanes at the same time.
+#define SCANS_IN_FLIGHT 8
+// Tasks of a scan that are handed to the lanes before the main thread looks
+// at the control socket again.
+#define INTAKE_BUDGET 256
+#define CONTROL_MAX_CLIENTS 64
+// Latencies of the most recent requests, for the statistics.
+#define REQUEST_SAMPLES 1024
+// A classify thread reads the stat, status and cgroup files of this many
+// tasks at once.
+#define CLASSIFY_FILES 3
+#define CLASSIFY_BATCH (PROCREAD_BATCH / CLASSIFY_FILES)
+
+enum daemon_msg_type {
+	MSG_TASK,
+	// Every task of the scan was sent, forget the ones that were not.
+	MSG_SWEEP,
+	// Move a task into a group on behalf of a client of the control
+	// socket.
+	MSG_REQUEST,
+	MSG_STOP,
+	// A task the classify stage decided to leave alone.
+	MSG_SKIP,
+	// Give a task the cookie of its group again, after the compliance
+	// sampling found that it lost it.
+	MSG_REPAIR,
+};
+
+struct daemon_msg {
+	enum daemon_msg_type type;
+	pid_t pid;
+	int group;
+	unsigned int generation;
+	// Start of the scan for a sweep, or arrival of a request.
+	unsigned long long started;
+	// Connection to answer a request on.
+	int client;
+};
+
+enum account_event {
+	ACCOUNT_APPLIED,
+	ACCOUNT_FAILED,
+	ACCOUNT_FORGOTTEN,
+	ACCOUNT_SWEPT,
+	ACCOUNT_REQUEST,
+	ACCOUNT_STATS,
+	ACCOUNT_STOP,
+};
+
+struct account_msg {
+	enum account_event event;
+	unsigned int generation;
+	unsigned long long started;
+	unsigned long long finished;
+};
+
+struct daemon_group {
+	struct placement_group place;
+	// A thread of the daemon that carries the cookie of the group for as
+	// long as the daemon runs, and that cookie.
+	pid_t keeper;
+	unsigned long cookie;
+	// Accounting cgroup of the group once a member was placed in it.
+	pthread_mutex_t cgroup_lock;
+	char cgroup[PATH_MAX];
+	struct rebalance_group balance;
+	// Counters at the previous rebalance, to compute rates from.
+	unsigned long long cpu_ns;
+	unsigned long long forceidle_ns;
+	bool sampled;
+	// The last rebalance move, whose effect is reported in the next
+	// period.
+	int last_move;
+	double forceidle_before;
+	// Removed from the configuration by a reload. The group keeps its
+	// index and cookie, but no rule or request puts tasks in it anymore.
+	bool retired;
+};
+
+struct daemon_lane {
+	struct daemon *d;
+	pthread_t classify_thread;
+	pthread_t apply_thread;
+	struct spsc_queue intake;
+	struct spsc_queue intake_urgent;
+	struct queue_waiter classify_waiter;
+	struct spsc_queue classified;
+	struct spsc_queue classified_urgent;
+	struct queue_waiter apply_waiter;
+	// Protects tasks and members from the main thread, which walks the
+	// members of a group to sample or re-pin them.
+	pthread_mutex_t lock;
+	struct pidmap tasks;
+	size_t *members;
+	// Group whose cookie the apply thread currently holds, so that
+	// consecutive pushes to one group only pull the cookie once.
+	int holding;
+};
+
+// State of the account stage, only touched by its thread.
+struct account {
+	unsigned long applied;
+	unsigned long failed;
+	unsigned long forgotten;
+	unsigned long scans;
+	double last_scan_ms;
+	unsigned long requests;
+	double request_ms[REQUEST_SAMPLES];
+	unsigned int sweep_generation[SCANS_IN_FLIGHT];
+	size_t sweep_acks[SCANS_IN_FLIGHT];
+	// Counters at the previous report, to compute throughput from.
+	unsigned long long reported_at;
+	size_t intake_popped;
+	size_t classified_popped;
+	size_t account_popped;
+};
+
+struct daemon {
+	const struct daemon_options *opts;
+	// Written by a reload in the main thread, read by the lanes, which
+	// hold it while they use the rules or the groups.
+	pthread_rwlock_t rules_lock;
+	struct ruleset rules;
+	struct daemon_group **groups;
+	struct daemon_lane *lanes;
+	size_t lane_count;
+	unsigned int generation;
+	// The scan that is being fed into the lanes.
+	struct proc_iter scan;
+	bool scanning;
+	// A task that did not fit in its lane yet.
+	pid_t pending;
+	// Lanes that received the sweep of the scan.
+	size_t swept;
+	unsigned long long scan_started;
+	int control_fd;
+	// Connections that did not send their request yet.
+	int clients[CONTROL_MAX_CLIENTS];
+	size_t client_count;
+	struct topology topo;
+	// Written by the main thread, read by the apply threads.
+	pthread_rwlock_t place_lock;
+	struct placement placement;
+	// A thread that never receives a cookie, to clear cookies with.
+	pid_t null_tid;
+	struct mpmc_queue account_queue;
+	struct queue_waiter account_waiter;
+	pthread_t account_thread;
+	struct account account;
+	int uevent_fd;
+	int signal_fd;
+	// Labels of cgroups, when the configuration uses them. The inotify
+	// descriptor is -1 otherwise.
+	struct label_cache labels;
+	// Domains of executables and the process events that report execs,
+	// when the configuration uses them. The descriptor is -1 otherwise.
+	struct domain_cache domains;
+	int procev_fd;
+	// Time of the first and last CPU uevent that was not handled yet.
+	unsigned long long uevent_first;
+	unsigned long long uevent_last;
+	unsigned long long rebalanced_at;
+	// Compliance sampling, only touched by the main thread.
+	unsigned int sample_seed;
+	unsigned long sample_ticks;
+	unsigned long long sampled;
+	unsigned long long violations;
+	unsigned long long repaired;
+	bool running;
+};
+
+static void daemon_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void daemon_log(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	flockfile(stdout);
+	vprintf(fmt, args);
+	putchar('\n');
+	fflush(stdout);
+	funlockfile(stdout);
+	va_end(args);
+}
+
+struct keeper {
+	pid_t tid;
+	sem_t ready;
+};
+
+static void *keeper_main(void *data)
+{
+	struct keeper *k = data;
+	k->tid = gettid();
+	sem_post(&k->ready);
+	for (;;) {
+		pause();
+	}
+	return NULL;
+}
+
+// Start a thread that does nothing but carry a cookie for others to share.
+static pid_t start_keeper(void)
+{
+	struct keeper k;
+	pthread_t thread;
+	sem_init(&k.ready, 0, 0);
+	if ((errno = pthread_create(&thread, NULL, keeper_main, &k))) {
+		error(1, errno, "Failed to start a cookie keeper thread");
+	}
+	sem_wait(&k.ready);
+	sem_destroy(&k.ready);
+	return k.tid;
+}
+
+static struct daemon_lane *lane_of(struct daemon *d, pid_t pid)
+{
+	// The task maps hash on the low bits, so pick the lane with the high
+	// bits to keep every map evenly filled.
+	unsigned int hash = (unsigned int)pid * 2654435761u;
+	return &d->lanes[(unsigned long long)hash * d->lane_count >> 32];
+}
+
+static void lane_send(struct daemon_lane *lane, const struct daemon_msg *msg)
+{
+	spsc_push_wait(msg->type == MSG_REQUEST ? &lane->intake_urgent :
+						  &lane->intake,
+		       msg);
+	queue_wake(&lane->classify_waiter);
+}
+
+static bool lane_try_send(struct daemon_lane *lane,
+			  const struct daemon_msg *msg)
+{
+	if (!spsc_push(&lane->intake, msg)) {
+		return false;
+	}
+	queue_wake(&lane->classify_waiter);
+	return true;
+}
+
+static void account_send(struct daemon *d, enum account_event event,
+			 unsigned int generation, unsigned long long started)
+{
+	struct account_msg msg = {
+		.event = event,
+		.generation = generation,
+		.started = started,
+		.finished = now_ns(),
+	};
+	mpmc_push_wait(&d->account_queue, &msg);
+	queue_wake(&d->account_waiter);
+}
+
+static int hold_cookie(struct daemon_lane *lane, int group)
+{
+	if (lane->holding == group) {
+		return 0;
+	}
+	pid_t keeper = group < 0 ? lane->d->null_tid :
+				   lane->d->groups[group]->keeper;
+	if (core_sched_share_from(keeper)) {
+		lane->holding = HOLDING_UNKNOWN;
+		return -1;
+	}
+	lane->holding = group < 0 ? HOLDING_NONE : group;
+	return 0;
+}
+
+static int set_affinity(pid_t tid, void *data)
+{
+	sched_setaffinity(tid, sizeof(cpu_set_t), data);
+	return 0;
+}
+
+static int set_idle_policy(pid_t tid, void *data)
+{
+	(void)data;
+	struct sched_param param = { 0 };
+	sched_setscheduler(tid, SCHED_IDLE, &param);
+	return 0;
+}
+
+static int clear_idle_policy(pid_t tid, void *data)
+{
+	(void)data;
+	struct sched_param param = { 0 };
+	if (sched_getscheduler(tid) == SCHED_IDLE) {
+		sched_setscheduler(tid, SCHED_OTHER, &param);
+	}
+	return 0;
+}
+
+// Undo what daemon_place did for a group that a task leaves, as far as the
+// group it moves to does not do the same. group is negative for a task that
+// leaves every group.
+static void daemon_unplace(struct daemon *d, pid_t pid, int from, int group,
+			   char **origin)
+{
+	const struct group_config *old = &d->rules.groups[from];
+	const struct group_config *config =
+		group >= 0 ? &d->rules.groups[group] : NULL;
+	if (old->accounting != GROUP_ACCT_NONE &&
+	    (!config || config->accounting == GROUP_ACCT_NONE)) {
+		if (cgroup_acct_leave(pid, old->name, *origin) &&
+		    errno != ESRCH) {
+			error(0, errno,
+			      "Failed to move PID %d out of accounting group %s",
+			      pid, old->name);
+		}
+		free(*origin);
+		*origin = NULL;
+	}
+	if (old->tier == GROUP_TIER_BACKGROUND &&
+	    (!config || config->tier != GROUP_TIER_BACKGROUND)) {
+		proc_for_each_task(pid, clear_idle_policy, NULL);
+	}
+}
+
+// Remember the cgroup that pid is in as its origin, unless it is in the
+// dedicated cgroup of a group, which it only got into through the daemon.
+static void remember_origin(pid_t pid, char **origin)
+{
+	char current[PATH_MAX];
+	char group[NAME_MAX + 1];
+	if (cgroup_path_of(pid, current, sizeof(current)) ||
+	    cgroup_acct_unwrap(current, group, sizeof(group))) {
+		return;
+	}
+	char *copy = strdup(current);
+	if (!copy) {
+		error(1, errno, "Failed to allocate the pid table");
+	}
+	free(*origin);
+	*origin = copy;
+}
+
+// origin is where the process came from, which is updated when it is moved
+// into an accounting cgroup.
+static void daemon_place(struct daemon *d, pid_t pid, int group, char **origin)
+{
+	struct group_config *config = &d->rules.groups[group];
+	struct daemon_group *g = d->groups[group];
+
+	bool idle = false;
+	if (config->accounting != GROUP_ACCT_NONE) {
+		char path[PATH_MAX];
+		remember_origin(pid, origin);
+		if (!cgroup_acct_place(pid, config->name,
+				       config->accounting == GROUP_ACCT_LEAF,
+				       path, sizeof(path))) {
+			pthread_mutex_lock(&g->cgroup_lock);
+			memcpy(g->cgroup, path, sizeof(g->cgroup));
+			pthread_mutex_unlock(&g->cgroup_lock);
+			idle = config->tier == GROUP_TIER_BACKGROUND &&
+			       !cgroup_set_idle(path, true);
+		} else if (errno != ESRCH) {
+			error(0, errno,
+			      "Failed to move PID %d to accounting group %s",
+			      pid, config->name);
+		}
+	}
+	// Without a cgroup that can be made idle, every thread is.
+	if (config->tier == GROUP_TIER_BACKGROUND && !idle) {
+		proc_for_each_task(pid, set_idle_policy, NULL);
+	}
+
+	pthread_rwlock_rdlock(&d->place_lock);
+	bool pinned = g->place.core_count;
+	cpu_set_t cpus = g->place.cpus;
+	pthread_rwlock_unlock(&d->place_lock);
+	if (pinned) {
+		proc_for_each_task(pid, set_affinity, &cpus);
+	}
+}
+
+// Give the process pid the cookie of group, or no cookie if group is
+// negative. from is the group the process was in, or negative, and origin
+// the cgroup it came from, as kept in its pidmap entry.
+static int daemon_apply(struct daemon_lane *lane, pid_t pid, int from,
+			int group, char **origin)
+{
+	if (hold_cookie(lane, group) ||
+	    core_sched_share_to(pid, SCHED_CORE_SCOPE_TGID)) {
+		return -1;
+	}
+	if (from >= 0 && from != group) {
+		daemon_unplace(lane->d, pid, from, group, origin);
+	}
+	if (group >= 0) {
+		daemon_place(lane->d, pid, group, origin);
+	}
+	return 0;
+}
+
+// Find the group of a task from the contents of its stat, status and
+// cgroup files. Return false for tasks the daemon leaves alone, which are
+// then forgotten by the next sweep.
+static bool daemon_classify(struct daemon *d, pid_t pid, const char *stat_buf,
+			    const char *status, const char *cgroup,
+			    int *group)
+{
+	struct proc_stat stat;
+	struct task_info info;
+
+	if (pid == getpid() || !stat_buf || proc_parse_stat(stat_buf, &stat) ||
+	    proc_is_kthread(pid, &stat)) {
+		return false;
+	}
+	info.pid = pid;
+	memcpy(info.comm, stat.comm, sizeof(info.comm));
+	if (!status || proc_parse_uid(status, &info.uid)) {
+		info.uid = (uid_t)-1;
+	}
+	info.cgroup[0] = '\0';
+	// Rules and labels see the cgroup a task was in before the daemon
+	// moved it into an accounting cgroup, so that the move does not
+	// change its group.
+	char label[256];
+	bool placed = false;
+	if (cgroup && !cgroup_parse_path(cgroup, info.cgroup,
+					 sizeof(info.cgroup))) {
+		placed = cgroup_acct_unwrap(info.cgroup, label, sizeof(label));
+	}
+	int placed_group = placed ? ruleset_find_group(&d->rules, label) : -1;
+	// A domain overrides labels and rules, and a label overrides the
+	// rules, unless they name no group.
+	if (d->rules.domain_xattr &&
+	    domain_lookup(&d->domains, pid, label, sizeof(label))) {
+		int index = ruleset_find_group(&d->rules, label);
+		if (index >= 0 && !d->groups[index]->retired) {
+			*group = index;
+			return true;
+		}
+	}
+	// Where a task in the dedicated cgroup of a group came from is not
+	// known anymore, so it stays in that group.
+	if (placed_group >= 0 && !d->groups[placed_group]->retired) {
+		*group = placed_group;
+		return true;
+	}
+	if (d->rules.label_xattr && d->labels.inotify_fd >= 0 &&
+	    info.cgroup[0] &&
+	    label_lookup(&d->labels, info.cgroup, label, sizeof(label))) {
+		int index = ruleset_find_group(&d->rules, label);
+		if (index >= 0 && !d->groups[index]->retired) {
+			*group = index;
+			return true;
+		}
+	}
+	*group = ruleset_classify(&d->rules, &info);
+	return true;
+}
+
+// Read the files of a batch of tasks at once and classify them. Tasks that
+// are left alone are marked MSG_SKIP.
+static void classify_batch(struct daemon_lane *lane, struct procread *reader,
+			   struct daemon_msg *batch, size_t count)
+{
+	struct daemon *d = lane->d;
+	static const char *files[CLASSIFY_FILES] = { "stat", "status",
+						     "cgroup" };
+	size_t per_task = d->rules.needs_cgroup ? 3 : 2;
+	char paths[PROCREAD_BATCH][32];
+	const char *path_list[PROCREAD_BATCH];
+	size_t used = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (batch[i].type != MSG_TASK) {
+			continue;
+		}
+		for (size_t file = 0; file < per_task; file++) {
+			snprintf(paths[used], sizeof(paths[used]),
+				 "/proc/%d/%s", batch[i].pid, files[file]);
+			path_list[used] = paths[used];
+			used++;
+		}
+	}
+	procread_run(reader, path_list, used);
+
+	used = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (batch[i].type != MSG_TASK) {
+			continue;
+		}
+		const char *cgroup = per_task == 3 ?
+					     procread_data(reader, used + 2) :
+					     NULL;
+		if (!daemon_classify(d, batch[i].pid,
+				     procread_data(reader, used),
+				     procread_data(reader, used + 1), cgroup,
+				     &batch[i].group)) {
+			batch[i].type = MSG_SKIP;
+		}
+		used += per_task;
+	}
+}
+
+static bool classify_pop(void *data, void *msg)
+{
+	struct daemon_lane *lane = data;
+	return spsc_pop(&lane->intake_urgent, msg) ||
+	       spsc_pop(&lane->intake, msg);
+}
+
+static void *classify_main(void *data)
+{
+	struct daemon_lane *lane = data;
+	struct procread reader;
+	struct daemon_msg batch[CLASSIFY_BATCH];
+	size_t count;
+	if (procread_init(&reader)) {
+		error(1, errno, "Failed to allocate the procfs reader");
+	}
+	do {
+		queue_pop_wait(lane, classify_pop, &lane->classify_waiter,
+			       &batch[0]);
+		// Take whatever else the scan queued up, but leave requests
+		// that arrive meanwhile for the next turn.
+		for (count = 1; count < CLASSIFY_BATCH &&
+				batch[count - 1].type == MSG_TASK &&
+				spsc_pop(&lane->intake, &batch[count]);
+		     count++) {
+		}
+		pthread_rwlock_rdlock(&lane->d->rules_lock);
+		classify_batch(lane, &reader, batch, count);
+		pthread_rwlock_unlock(&lane->d->rules_lock);
+
+		for (size_t i = 0; i < count; i++) {
+			if (batch[i].type == MSG_SKIP) {
+				continue;
+			}
+			// A request already names its group.
+			spsc_push_wait(batch[i].type == MSG_REQUEST ?
+					       &lane->classified_urgent :
+					       &lane->classified,
+				       &batch[i]);
+		}
+		queue_wake(&lane->apply_waiter);
+	} while (batch[count - 1].type != MSG_STOP);
+	procread_free(&reader);
+	return NULL;
+}
+
+// Called with the lane lock held.
+static void forget_task(struct daemon_lane *lane, struct pidmap_entry *entry)
+{
+	if (entry->group >= 0) {
+		lane->members[entry->group]--;
+	}
+	pidmap_remove(&lane->tasks, entry);
+}
+
+static void lane_visit(struct daemon_lane *lane, const struct daemon_msg *msg)
+{
+	struct daemon *d = lane->d;
+	struct pidmap_entry *entry = pidmap_get(&lane->tasks, msg->pid);
+	if (entry && (entry->group == msg->group || entry->requested)) {
+		entry->mark = msg->generation;
+		return;
+	}
+	if (!entry && msg->group < 0) {
+		return;
+	}
+
+	char *origin = entry ? entry->origin : NULL;
+	if (entry) {
+		entry->origin = NULL;
+	}
+	if (daemon_apply(lane, msg->pid, entry ? entry->group : -1,
+			 msg->group, &origin)) {
+		if (entry) {
+			entry->origin = origin;
+		}
+		if (errno != ESRCH) {
+			error(0, errno, "Failed to move PID %d to group %s",
+			      msg->pid,
+			      msg->group < 0 ? "(none)" :
+					       d->rules.groups[msg->group].name);
+			account_send(d, ACCOUNT_FAILED, msg->generation, 0);
+		}
+		return;
+	}
+
+	if (entry) {
+		forget_task(lane, entry);
+	}
+	if (msg->group >= 0) {
+		entry = pidmap_insert(&lane->tasks, msg->pid);
+		entry->group = msg->group;
+		entry->mark = msg->generation;
+		entry->origin = origin;
+		lane->members[msg->group]++;
+	} else {
+		free(origin);
+	}
+	account_send(d, ACCOUNT_APPLIED, msg->generation, 0);
+}
+
+static void lane_request(struct daemon_lane *lane,
+			 const struct daemon_msg *msg)
+{
+	int err = 0;
+	struct pidmap_entry *entry = pidmap_get(&lane->tasks, msg->pid);
+	char *origin = entry ? entry->origin : NULL;
+	if (entry) {
+		entry->origin = NULL;
+	}
+	if (daemon_apply(lane, msg->pid, entry ? entry->group : -1,
+			 msg->group, &origin)) {
+		err = errno;
+		if (entry) {
+			entry->origin = origin;
+		}
+	} else {
+		if (entry) {
+			forget_task(lane, entry);
+		}
+		entry = pidmap_insert(&lane->tasks, msg->pid);
+		entry->group = msg->group;
+		entry->mark = msg->generation;
+		entry->requested = true;
+		entry->origin = origin;
+		lane->members[msg->group]++;
+	}
+	control_reply(msg->client, err);
+	account_send(lane->d, ACCOUNT_REQUEST, msg->generation, msg->started);
+}
+
+static void lane_sweep(struct daemon_lane *lane, const struct daemon_msg *msg)
+{
+	struct pidmap_entry *entry;
+	pthread_mutex_lock(&lane->lock);
+	pidmap_for_each(&lane->tasks, entry)
+	{
+		// A process that was requested while the scan was already
+		// running may not have been seen by it.
+		if (entry->mark != msg->generation &&
+		    (!entry->requested ||
+		     (kill(entry->pid, 0) && errno == ESRCH))) {
+			forget_task(lane, entry);
+			account_send(lane->d, ACCOUNT_FORGOTTEN,
+				     msg->generation, 0);
+		}
+	}
+	pthread_mutex_unlock(&lane->lock);
+	account_send(lane->d, ACCOUNT_SWEPT, msg->generation, msg->started);
+}
+
+static void lane_repair(struct daemon_lane *lane, const struct daemon_msg *msg)
+{
+	struct pidmap_entry *entry = pidmap_get(&lane->tasks, msg->pid);
+	// The task moved on meanwhile.
+	if (!entry || entry->group != msg->group) {
+		return;
+	}
+	if (daemon_apply(lane, msg->pid, msg->group, msg->group,
+			 &entry->origin)) {
+		if (errno != ESRCH) {
+			error(0, errno, "Failed to repair the cookie of PID %d",
+			      msg->pid);
+			account_send(lane->d, ACCOUNT_FAILED, msg->generation,
+				     0);
+		}
+		return;
+	}
+	account_send(lane->d, ACCOUNT_APPLIED, msg->generation, 0);
+}
+
+static bool apply_pop(void *data, void *msg)
+{
+	struct daemon_lane *lane = data;
+	return spsc_pop(&lane->classified_urgent, msg) ||
+	       spsc_pop(&lane->classified, msg);
+}
+
+static void *apply_main(void *data)
+{
+	struct daemon_lane *lane = data;
+	struct daemon_msg msg;
+	do {
+		queue_pop_wait(lane, apply_pop, &lane->apply_waiter, &msg);
+		pthread_rwlock_rdlock(&lane->d->rules_lock);
+		// The lock is held across the prctl so that a group that is
+		// re-pinned meanwhile sees the task in the map.
+		if (msg.type == MSG_TASK) {
+			pthread_mutex_lock(&lane->lock);
+			lane_visit(lane, &msg);
+			pthread_mutex_unlock(&lane->lock);
+		} else if (msg.type == MSG_REQUEST) {
+			pthread_mutex_lock(&lane->lock);
+			lane_request(lane, &msg);
+			pthread_mutex_unlock(&lane->lock);
+		} else if (msg.type == MSG_REPAIR) {
+			pthread_mutex_lock(&lane->lock);
+			lane_repair(lane, &msg);
+			pthread_mutex_unlock(&lane->lock);
+		} else if (msg.type == MSG_SWEEP) {
+			lane_sweep(lane, &msg);
+		}
+		pthread_rwlock_unlock(&lane->d->rules_lock);
+	} while (msg.type != MSG_STOP);
+	return NULL;
+}
+
+static void account_sweep(struct daemon *d, const struct account_msg *msg)
+{
+	struct account *a = &d->account;
+	size_t slot = msg->generation % SCANS_IN_FLIGHT;
+	if (a->sweep_generation[slot] != msg->generation) {
+		a->sweep_generation[slot] = msg->generation;
+		a->sweep_acks[slot] = 0;
+	}
+	if (++a->sweep_acks[slot] == d->lane_count) {
+		a->scans++;
+		a->last_scan_ms = (now_ns() - msg->started) / 1e6;
+	}
+}
+
+struct stage_stats {
+	size_t occupancy;
+	size_t capacity;
+	// Occupancy of the fullest lane.
+	size_t fullest;
+	size_t popped;
+};
+
+static void add_stage(struct stage_stats *stage, const struct queue_stats *q)
+{
+	stage->occupancy += q->occupancy;
+	stage->capacity += q->capacity;
+	stage->popped += q->popped;
+	if (q->occupancy > stage->fullest) {
+		stage->fullest = q->occupancy;
+	}
+}
+
+static void account_report(struct daemon *d)
+{
+	struct account *a = &d->account;
+	struct stage_stats intake = { 0 }, classified = { 0 }, urgent = { 0 };
+	struct queue_stats q;
+	for (size_t i = 0; i < d->lane_count; i++) {
+		spsc_stats(&d->lanes[i].intake, &q);
+		add_stage(&intake, &q);
+		spsc_stats(&d->lanes[i].classified, &q);
+		add_stage(&classified, &q);
+		spsc_stats(&d->lanes[i].intake_urgent, &q);
+		add_stage(&urgent, &q);
+		spsc_stats(&d->lanes[i].classified_urgent, &q);
+		add_stage(&urgent, &q);
+	}
+
+	size_t samples = a->requests < REQUEST_SAMPLES ? a->requests :
+							 REQUEST_SAMPLES;
+	double latency[REQUEST_SAMPLES];
+	memcpy(latency, a->request_ms, samples * sizeof(*latency));
+	double p50 = bench_percentile(latency, samples, 50);
+	double p99 = bench_percentile(latency, samples, 99);
+	daemon_log("pipeline: urgent queues %zu/%zu, %lu requests, p50 %.2f ms, p99 %.2f ms over the last %zu",
+		   urgent.occupancy, urgent.capacity, a->requests, p50, p99,
+		   samples);
+
+	mpmc_stats(&d->account_queue, &q);
+
+	unsigned long long now = now_ns();
+	double elapsed = (now - a->reported_at) / 1e9;
+	a->reported_at = now;
+
+	daemon_log("pipeline: %zu lanes, %lu scans, the last one took %.1f ms",
+		   d->lane_count, a->scans, a->last_scan_ms);
+	daemon_log("pipeline: classify queue %zu/%zu (fullest lane %zu), %.0f tasks/s",
+		   intake.occupancy, intake.capacity, intake.fullest,
+		   (intake.popped - a->intake_popped) / elapsed);
+	daemon_log("pipeline: apply queue %zu/%zu (fullest lane %zu), %.0f tasks/s, %lu applied, %lu failed, %lu forgotten",
+		   classified.occupancy, classified.capacity,
+		   classified.fullest,
+		   (classified.popped - a->classified_popped) / elapsed,
+		   a->applied, a->failed, a->forgotten);
+	daemon_log("pipeline: account queue %zu/%zu, %.0f events/s",
+		   q.occupancy, q.capacity,
+		   (q.popped - a->account_popped) / elapsed);
+	a->intake_popped = intake.popped;
+	a->classified_popped = classified.popped;
+	a->account_popped = q.popped;
+}
+
+static void *account_main(void *data)
+{
+	struct daemon *d = data;
+	struct account *a = &d->account;
+	struct account_msg msg;
+	do {
+		mpmc_pop_wait(&d->account_queue, &d->account_waiter, &msg);
+		switch (msg.event) {
+		case ACCOUNT_APPLIED:
+			a->applied++;
+			break;
+		case ACCOUNT_FAILED:
+			a->failed++;
+			break;
+		case ACCOUNT_FORGOTTEN:
+			a->forgotten++;
+			break;
+		case ACCOUNT_SWEPT:
+			account_sweep(d, &msg);
+			break;
+		case ACCOUNT_REQUEST:
+			a->request_ms[a->requests++ % REQUEST_SAMPLES] =
+				(msg.finished - msg.started) / 1e6;
+			break;
+		case ACCOUNT_STATS:
+		case ACCOUNT_STOP:
+			account_report(d);
+			break;
+		}
+	} while (msg.event != ACCOUNT_STOP);
+	return NULL;
+}
+
+static void daemon_scan(struct daemon *d)
+{
+	if (proc_iter_open(&d->scan)) {
+		error(0, errno, "Failed to scan /proc");
+		return;
+	}
+	d->generation++;
+	d->scanning = true;
+	d->pending = 0;
+	d->swept = 0;
+	d->scan_started = now_ns();
+}
+
+// Hand at most a budget of tasks of the current scan to the lanes. Returns
+// false when a lane is full, so that the caller waits a little before the
+// next turn.
+static bool daemon_intake(struct daemon *d)
+{
+	struct daemon_msg msg = { .generation = d->generation };
+	for (unsigned int budget = INTAKE_BUDGET; budget; budget--) {
+		if (!d->pending && !proc_iter_next(&d->scan, &d->pending)) {
+			break;
+		}
+		msg.type = MSG_TASK;
+		msg.pid = d->pending;
+		if (!lane_try_send(lane_of(d, d->pending), &msg)) {
+			return false;
+		}
+		d->pending = 0;
+	}
+	if (d->pending) {
+		return true;
+	}
+
+	// Every task was sent, so the lanes can forget the ones that were
+	// not.
+	msg.type = MSG_SWEEP;
+	msg.started = d->scan_started;
+	for (; d->swept < d->lane_count; d->swept++) {
+		if (!lane_try_send(&d->lanes[d->swept], &msg)) {
+			return false;
+		}
+	}
+	proc_iter_close(&d->scan);
+	d->scanning = false;
+	return true;
+}
+
+static void control_accept(struct daemon *d)
+{
+	for (;;) {
+		int fd = accept4(d->control_fd, NULL, NULL,
+				 SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				error(0, errno, "Failed to accept a request");
+			}
+			return;
+		}
+		if (d->client_count == CONTROL_MAX_CLIENTS) {
+			control_reply(fd, EBUSY);
+			continue;
+		}
+		d->clients[d->client_count++] = fd;
+	}
+}
+
+static void control_receive(struct daemon *d, size_t index)
+{
+	int fd = d->clients[index];
+	d->clients[index] = d->clients[--d->client_count];
+
+	char buf[CONTROL_MSG_LEN], name[CONTROL_MSG_LEN];
+	ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		close(fd);
+		return;
+	}
+	buf[len] = '\0';
+
+	struct daemon_msg msg = {
+		.type = MSG_REQUEST,
+		.generation = d->generation,
+		.started = now_ns(),
+		.client = fd,
+	};
+	if (control_parse(buf, &msg.pid, name, sizeof(name))) {
+		control_reply(fd, EINVAL);
+		return;
+	}
+	msg.group = ruleset_find_group(&d->rules, name);
+	if (msg.group < 0 || d->groups[msg.group]->retired) {
+		control_reply(fd, ENOENT);
+		return;
+	}
+	lane_send(lane_of(d, msg.pid), &msg);
+}
+
+static size_t group_members(struct daemon *d, int group)
+{
+	size_t members = 0;
+	for (size_t i = 0; i < d->lane_count; i++) {
+		pthread_mutex_lock(&d->lanes[i].lock);
+		members += d->lanes[i].members[group];
+		pthread_mutex_unlock(&d->lanes[i].lock);
+	}
+	return members;
+}
+
+static void reapply_affinity(struct daemon *d, int group)
+{
+	for (size_t i = 0; i < d->lane_count; i++) {
+		struct daemon_lane *lane = &d->lanes[i];
+		struct pidmap_entry *entry;
+		pthread_mutex_lock(&lane->lock);
+		pidmap_for_each(&lane->tasks, entry)
+		{
+			if (entry->group == group) {
+				proc_for_each_task(entry->pid, set_affinity,
+						   &d->groups[group]->place.cpus);
+			}
+		}
+		pthread_mutex_unlock(&lane->lock);
+	}
+}
+
+// Move the members of a group whose tier a reload changed in or out of the
+// background.
+static void retier_group(struct daemon *d, int group)
+{
+	const struct group_config *config = &d->rules.groups[group];
+	bool background = config->tier == GROUP_TIER_BACKGROUND;
+	for (size_t i = 0; i < d->lane_count; i++) {
+		struct daemon_lane *lane = &d->lanes[i];
+		struct pidmap_entry *entry;
+		pthread_mutex_lock(&lane->lock);
+		pidmap_for_each(&lane->tasks, entry)
+		{
+			if (entry->group != group) {
+				continue;
+			}
+			char path[PATH_MAX];
+			bool idle = !cgroup_acct_of(entry->pid, config->name,
+						    path, sizeof(path)) &&
+				    !cgroup_set_idle(path, background) &&
+				    background;
+			if (!background) {
+				proc_for_each_task(entry->pid,
+						   clear_idle_policy, NULL);
+			} else if (!idle) {
+				proc_for_each_task(entry->pid,
+						   set_idle_policy, NULL);
+			}
+		}
+		pthread_mutex_unlock(&lane->lock);
+	}
+}
+
+struct group_sample {
+	unsigned long long cpu_ns;
+	unsigned long long forceidle_ns;
+	bool cpu;
+};
+
+static int sample_thread(pid_t tid, void *data)
+{
+	struct group_sample *sample = data;
+	unsigned long long run_ns, wait_ns, forceidle_ns;
+	if (sample->cpu && !proc_read_schedstat(tid, &run_ns, &wait_ns)) {
+		sample->cpu_ns += run_ns;
+	}
+	if (!proc_read_forceidle(tid, &forceidle_ns)) {
+		sample->forceidle_ns += forceidle_ns;
+	}
+	return 0;
+}
+
+// CPU time comes from the accounting cgroup when the group has one, and is
+// summed over the members otherwise. Forced idle is always per task.
+static void sample_group(struct daemon *d, int group,
+			 struct group_sample *sample)
+{
+	struct daemon_group *g = d->groups[group];
+	struct cgroup_cpu_stat stat;
+	char cgroup[PATH_MAX];
+
+	pthread_mutex_lock(&g->cgroup_lock);
+	memcpy(cgroup, g->cgroup, sizeof(cgroup));
+	pthread_mutex_unlock(&g->cgroup_lock);
+
+	*sample = (struct group_sample){ .cpu = true };
+	if (cgroup[0] && !cgroup_read_cpu_stat(cgroup, &stat)) {
+		sample->cpu_ns = stat.usage_usec * 1000ULL;
+		sample->cpu = false;
+	}
+
+	// Copy the members out first, so that the lanes are not held up
+	// while their threads are read.
+	size_t count = 0, capacity = 0;
+	pid_t *members = NULL;
+	for (size_t i = 0; i < d->lane_count; i++) {
+		struct daemon_lane *lane = &d->lanes[i];
+		struct pidmap_entry *entry;
+		pthread_mutex_lock(&lane->lock);
+		pidmap_for_each(&lane->tasks, entry)
+		{
+			if (entry->group != group) {
+				continue;
+			}
+			if (count == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				members = realloc(members,
+						  capacity * sizeof(*members));
+				if (!members) {
+					error(1, errno,
+					      "Failed to allocate members");
+				}
+			}
+			members[count++] = entry->pid;
+		}
+		pthread_mutex_unlock(&lane->lock);
+	}
+	for (size_t i = 0; i < count; i++) {
+		proc_for_each_task(members[i], sample_thread, sample);
+	}
+	free(members);
+}
+// Pick one of the tasks the daemon placed at random. Tasks after a run of
+// empty slots of a map are a little more likely to be picked, which does
+// not matter for finding violations.
+static bool random_task(struct daemon *d, pid_t *pid, int *group)
+{
+	struct daemon_lane *lane =
+		&d->lanes[rand_r(&d->sample_seed) % d->lane_count];
+	struct pidmap *map = &lane->tasks;
+	bool found = false;
+	pthread_mutex_lock(&lane->lock);
+	size_t start = map->count ? rand_r(&d->sample_seed) % map->capacity : 0;
+	for (size_t i = 0; map->count && i < map->capacity; i++) {
+		struct pidmap_entry *entry =
+			&map->slots[(start + i) % map->capacity];
+		if (entry->pid > 0) {
+			*pid = entry->pid;
+			*group = entry->group;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lane->lock);
+	return found;
+}
+
+static bool task_group(struct daemon *d, pid_t pid, int *group)
+{
+	struct daemon_lane *lane = lane_of(d, pid);
+	pthread_mutex_lock(&lane->lock);
+	struct pidmap_entry *entry = pidmap_get(&lane->tasks, pid);
+	if (entry) {
+		*group = entry->group;
+	}
+	pthread_mutex_unlock(&lane->lock);
+	return entry;
+}
+
+struct subtree_scan {
+	struct daemon *d;
+	int group;
+	bool violated;
+	size_t checked;
+	size_t repaired;
+};
+
+static int check_thread(pid_t tid, void *data)
+{
+	struct subtree_scan *scan = data;
+	unsigned long cookie;
+	scan->checked++;
+	if (!core_sched_get(tid, &cookie) &&
+	    cookie != scan->d->groups[scan->group]->cookie) {
+		scan->violated = true;
+	}
+	return 0;
+}
+
+// Check every thread of pid and of its descendants, and have the lanes
+// repair the processes of which a thread lost its cookie.
+static int scan_subtree(pid_t pid, void *data)
+{
+	struct subtree_scan *scan = data;
+	struct daemon *d = scan->d;
+	if (task_group(d, pid, &scan->group)) {
+		scan->violated = false;
+		proc_for_each_task(pid, check_thread, scan);
+		if (scan->violated) {
+			struct daemon_msg msg = {
+				.type = MSG_REPAIR,
+				.pid = pid,
+				.group = scan->group,
+				.generation = d->generation,
+			};
+			lane_send(lane_of(d, pid), &msg);
+			scan->repaired++;
+		}
+	}
+	proc_for_each_child(pid, scan_subtree, scan);
+	return 0;
+}
+
+// Wilson score interval of a rate of k out of n at the given z-score.
+static void wilson_interval(unsigned long long k, unsigned long long n,
+			    double z, double *low, double *high)
+{
+	if (!n) {
+		*low = 0;
+		*high = 1;
+		return;
+	}
+	double p = (double)k / n;
+	double z2 = z * z;
+	double center = p + z2 / (2 * n);
+	double spread = z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+	*low = fmax(0, (center - spread) / (1 + z2 / n));
+	*high = fmin(1, (center + spread) / (1 + z2 / n));
+}
+
+// Check the cookie of a random sample of the placed processes, which costs
+// the same however many tasks the host has. Only when the sample turns up
+// violations, the violating processes and everything they started are
+// checked in full and repaired.
+static void daemon_sample(struct daemon *d)
+{
+	const struct ruleset *rules = &d->rules;
+	pid_t *violating = calloc(rules->sample_size, sizeof(*violating));
+	if (!violating) {
+		error(1, errno, "Failed to allocate the compliance sample");
+	}
+	size_t checked = 0, bad = 0, count = 0;
+	for (unsigned int i = 0; i < rules->sample_size; i++) {
+		pid_t pid;
+		int group;
+		unsigned long cookie;
+		// Tasks that exited are not part of the sample.
+		if (!random_task(d, &pid, &group) ||
+		    core_sched_get(pid, &cookie)) {
+			continue;
+		}
+		checked++;
+		if (cookie == d->groups[group]->cookie) {
+			continue;
+		}
+		bad++;
+		// The sample is drawn with replacement, but every subtree
+		// only needs to be scanned once.
+		bool seen = false;
+		for (size_t j = 0; j < count && !seen; j++) {
+			seen = violating[j] == pid;
+		}
+		if (!seen) {
+			violating[count++] = pid;
+		}
+	}
+	d->sample_ticks++;
+	d->sampled += checked;
+	d->violations += bad;
+	if (!count) {
+		free(violating);
+		return;
+	}
+
+	struct subtree_scan scan = { .d = d };
+	for (size_t i = 0; i < count; i++) {
+		scan_subtree(violating[i], &scan);
+	}
+	d->repaired += scan.repaired;
+	double low, high;
+	wilson_interval(d->violations, d->sampled, rules->sample_z, &low,
+			&high);
+	daemon_log("sample: %zu of %zu samples (%zu processes) lost their cookie, %zu threads in their subtrees checked, %zu processes repaired, violation rate %.3f%% [%.3f%%, %.3f%%]",
+		   bad, checked, count, scan.checked, scan.repaired,
+		   100.0 * d->violations / d->sampled, 100 * low, 100 * high);
+	free(violating);
+}
+
+static unsigned int free_cores(struct daemon *d)
+{
+	unsigned int count = 0;
+	for (size_t i = 0; i < d->topo.core_count; i++) {
+		count += d->placement.owner[d->topo.cores[i].id] == -1;
+	}
+	return count;
+}
+
+static void daemon_rebalance(struct daemon *d)
+{
+	unsigned long long now = now_ns();
+	double elapsed = (now - d->rebalanced_at) / 1e9;
+	d->rebalanced_at = now;
+
+	size_t count = d->rules.group_count;
+	struct rebalance_group *balance = calloc(count, sizeof(*balance));
+	struct rebalance_move *moves = calloc(count, sizeof(*moves));
+	size_t *index = calloc(count, sizeof(*index));
+	if (!balance || !moves || !index) {
+		error(1, errno, "Failed to allocate rebalance plan");
+	}
+
+	size_t participants = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct group_config *config = &d->rules.groups[i];
+		struct daemon_group *g = d->groups[i];
+		if (config->max_cores == config->cores) {
+			continue;
+		}
+
+		// Members that exit take their counters with them, so a
+		// decrease only means there is no rate for this period.
+		struct group_sample sample;
+		sample_group(d, i, &sample);
+		bool valid = g->sampled && sample.cpu_ns >= g->cpu_ns &&
+			     sample.forceidle_ns >= g->forceidle_ns;
+		g->balance.demand =
+			valid ? (sample.cpu_ns - g->cpu_ns) / 1e9 / elapsed : 0;
+		g->balance.forceidle_rate =
+			valid ? (sample.forceidle_ns - g->forceidle_ns) / 1e6 /
+					elapsed :
+				0;
+		g->cpu_ns = sample.cpu_ns;
+		g->forceidle_ns = sample.forceidle_ns;
+		g->sampled = true;
+		if (!valid) {
+			continue;
+		}
+
+		if (g->last_move) {
+			daemon_log("rebalance: group %s %s to %u cores: forced idle %.2f -> %.2f ms/s",
+				   config->name,
+				   g->last_move > 0 ? "grew" : "shrank",
+				   g->place.core_count, g->forceidle_before,
+				   g->balance.forceidle_rate);
+			g->last_move = 0;
+		}
+
+		g->balance.min_cores = config->cores;
+		g->balance.max_cores = config->max_cores;
+		g->balance.cores = g->place.core_count;
+		g->balance.members = group_members(d, i);
+		balance[participants] = g->balance;
+		index[participants++] = i;
+	}
+
+	size_t move_count = rebalance_plan(&d->rules.rebalance, balance,
+					   participants, free_cores(d),
+					   d->topo.threads_per_core, moves);
+	for (size_t i = 0; i < participants; i++) {
+		d->groups[index[i]]->balance.streak = balance[i].streak;
+	}
+
+	for (size_t i = 0; i < move_count; i++) {
+		size_t group = index[moves[i].group];
+		struct daemon_group *g = d->groups[group];
+		unsigned int before = g->place.core_count;
+		pthread_rwlock_wrlock(&d->place_lock);
+		if (moves[i].delta > 0) {
+			g->place.wanted = before + 1;
+			placement_fill(&d->placement, &d->topo, &g->place,
+				       group);
+		} else if (before) {
+			g->place.wanted = before - 1;
+			placement_release(&d->placement, &d->topo, &g->place,
+					  g->place.cores[before - 1]);
+		}
+		pthread_rwlock_unlock(&d->place_lock);
+		if (g->place.core_count == before) {
+			continue;
+		}
+		reapply_affinity(d, group);
+		g->last_move = moves[i].delta;
+		g->forceidle_before = g->balance.forceidle_rate;
+
+		char cpus[256];
+		daemon_log("rebalance: group %s %u -> %u cores (cpus %s) for a demand of %.2f cpus, %zu processes re-pinned, forced idle %.2f ms/s",
+			   d->rules.groups[group].name, before,
+			   g->place.core_count,
+			   cpulist_format(&g->place.cpus, cpus, sizeof(cpus)),
+			   g->balance.demand, g->balance.members,
+			   g->balance.forceidle_rate);
+	}
+
+	free(balance);
+	free(moves);
+	free(index);
+}
+
+static int uevent_open(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_KOBJECT_UEVENT);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		// Only events from the kernel, not the ones udev rebroadcasts.
+		.nl_groups = 1,
+	};
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool uevent_is_cpu(const char *buf, size_t len)
+{
+	bool cpu = false, hotplug = false;
+	for (size_t i = 0; i < len; i += strlen(buf + i) + 1) {
+		const char *field = buf + i;
+		if (!strcmp(field, "SUBSYSTEM=cpu")) {
+			cpu = true;
+		} else if (!strcmp(field, "ACTION=online") ||
+			   !strcmp(field, "ACTION=offline") ||
+			   !strcmp(field, "ACTION=add") ||
+			   !strcmp(field, "ACTION=remove")) {
+			hotplug = true;
+		}
+	}
+	return cpu && hotplug;
+}
+
+static void uevent_drain(struct daemon *d)
+{
+	char buf[8192];
+	for (;;) {
+		struct sockaddr_nl addr;
+		socklen_t addrlen = sizeof(addr);
+		ssize_t len = recvfrom(d->uevent_fd, buf, sizeof(buf) - 1, 0,
+				       (struct sockaddr *)&addr, &addrlen);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				error(0, errno, "Failed to receive uevent");
+			}
+			return;
+		}
+		buf[len] = '\0';
+		if (addr.nl_pid != 0 || !uevent_is_cpu(buf, len)) {
+			continue;
+		}
+		d->uevent_last = now_ns();
+		if (!d->uevent_first) {
+			d->uevent_first = d->uevent_last;
+		}
+	}
+}
+
+// Subscribe to the process events of the proc connector, which needs
+// CAP_NET_ADMIN.
+static int procev_open(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_CONNECTOR);
+	if (fd < 0) {
+		return -1;
+	}
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = CN_IDX_PROC,
+	};
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) +
+			     sizeof(enum proc_cn_mcast_op))]
+		__attribute__((aligned(NLMSG_ALIGNTO))) = { 0 };
+	struct nlmsghdr *nl = (struct nlmsghdr *)buf;
+	struct cn_msg *cn = NLMSG_DATA(nl);
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	nl->nlmsg_len = NLMSG_LENGTH(sizeof(*cn) + sizeof(op));
+	nl->nlmsg_type = NLMSG_DONE;
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof(op);
+	memcpy(cn->data, &op, sizeof(op));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    send(fd, buf, nl->nlmsg_len, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Classify a process again as soon as it executes another file. An exec
+// that does not fit in its lane, or that was lost because the socket
+// overflowed, is picked up by the next scan.
+static void procev_drain(struct daemon *d)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	for (;;) {
+		ssize_t len = recv(d->procev_fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == ENOBUFS) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EINTR) {
+				error(0, errno,
+				      "Failed to receive process events");
+			}
+			return;
+		}
+		for (struct nlmsghdr *nl = (struct nlmsghdr *)buf;
+		     NLMSG_OK(nl, (size_t)len); nl = NLMSG_NEXT(nl, len)) {
+			const struct cn_msg *cn = NLMSG_DATA(nl);
+			const struct proc_event *event =
+				(const struct proc_event *)cn->data;
+			if (cn->id.idx != CN_IDX_PROC ||
+			    cn->len < sizeof(*event) ||
+			    event->what != PROC_EVENT_EXEC) {
+				continue;
+			}
+			pid_t pid = event->event_data.exec.process_tgid;
+			struct daemon_msg msg = {
+				.type = MSG_TASK,
+				.pid = pid,
+				.generation = d->generation,
+			};
+			lane_try_send(lane_of(d, pid), &msg);
+		}
+	}
+}
+
+static const char *smt_control(char *buf, size_t len)
+{
+	FILE *file = fopen("/sys/devices/system/cpu/smt/control", "r");
+	if (!file || !fgets(buf, len, file)) {
+		snprintf(buf, len, "unknown");
+	}
+	if (file) {
+		fclose(file);
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+	return buf;
+}
+
+static void daemon_replan(struct daemon *d)
+{
+	struct topology topo;
+	if (topology_read(&topo)) {
+		error(0, errno, "Failed to read the CPU topology");
+		return;
+	}
+
+	size_t count = d->rules.group_count;
+	cpu_set_t *before = calloc(count, sizeof(*before));
+	if (!before) {
+		error(1, errno, "Failed to allocate placement");
+	}
+	// Free the cores that changed first, so that every group can pick
+	// from all of them when it is filled up again.
+	pthread_rwlock_wrlock(&d->place_lock);
+	for (size_t i = 0; i < count; i++) {
+		before[i] = d->groups[i]->place.cpus;
+		placement_revalidate(&d->placement, &d->topo, &topo,
+				     &d->groups[i]->place);
+	}
+
+	unsigned int *missing = calloc(count, sizeof(*missing));
+	if (!missing) {
+		error(1, errno, "Failed to allocate placement");
+	}
+	for (size_t i = 0; i < count; i++) {
+		missing[i] = placement_fill(&d->placement, &topo,
+					    &d->groups[i]->place, i);
+	}
+	pthread_rwlock_unlock(&d->place_lock);
+
+	size_t replanned = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct daemon_group *g = d->groups[i];
+		if (CPU_EQUAL(&before[i], &g->place.cpus)) {
+			continue;
+		}
+		replanned++;
+		reapply_affinity(d, i);
+
+		char from[256], to[256];
+		daemon_log("group %s: cpus %s -> %s%s", d->rules.groups[i].name,
+			   cpulist_format(&before[i], from, sizeof(from)),
+			   cpulist_format(&g->place.cpus, to, sizeof(to)),
+			   missing[i] ? " (not enough free cores)" : "");
+	}
+	free(before);
+	free(missing);
+	topology_free(&d->topo);
+	d->topo = topo;
+
+	char online[256], smt[32];
+	daemon_log("cpu topology changed: cpus %s online in %zu cores, smt %s; replanned %zu of %zu groups, recovered in %.1f ms",
+		   cpulist_format(&d->topo.online, online, sizeof(online)),
+		   d->topo.core_count, smt_control(smt, sizeof(smt)),
+		   replanned, count, (now_ns() - d->uevent_first) / 1e6);
+	d->uevent_first = 0;
+}
+
+static struct daemon_group *group_init(const struct group_config *config)
+{
+	struct daemon_group *g = calloc(1, sizeof(*g));
+	if (!g) {
+		error(1, errno, "Failed to allocate groups");
+	}
+	pthread_mutex_init(&g->cgroup_lock, NULL);
+	g->place.wanted = config->cores;
+	return g;
+}
+
+// Start the keeper of a group, once the signals are blocked so that the
+// keeper does not take them.
+static void group_keep(struct daemon_group *g, const char *name)
+{
+	g->keeper = start_keeper();
+	if (core_sched_create(g->keeper, SCHED_CORE_SCOPE_PID) ||
+	    core_sched_get(g->keeper, &g->cookie)) {
+		error(1, errno, "Failed to create a cookie for group %s", name);
+	}
+}
+
+// The processes that a reload classifies again, looked up by the
+// selectors of the rules that changed.
+struct reload_index {
+	uid_t *uids;
+	size_t uid_count;
+	const char **comms;
+	size_t comm_count;
+	pid_t *pids;
+	size_t count;
+	size_t capacity;
+};
+
+static int add_candidate(pid_t pid, void *data)
+{
+	struct reload_index *index = data;
+	if (index->count == index->capacity) {
+		index->capacity = index->capacity ? index->capacity * 2 : 256;
+		index->pids = realloc(index->pids,
+				      index->capacity * sizeof(*index->pids));
+		if (!index->pids) {
+			error(1, errno, "Failed to allocate the reload");
+		}
+	}
+	index->pids[index->count++] = pid;
+	return 0;
+}
+
+static int compare_uid(const void *a, const void *b)
+{
+	uid_t x = *(const uid_t *)a, y = *(const uid_t *)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_pid(const void *a, const void *b)
+{
+	pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+	return (x > y) - (x < y);
+}
+
+// The owner of /proc/<pid> is the effective uid of a dumpable process,
+// which saves reading the status file of most processes. The directory of
+// a process that is not dumpable belongs to root, so for those the status
+// file is read like classification does.
+static int find_by_uid_or_comm(pid_t pid, void *data)
+{
+	struct reload_index *index = data;
+	char path[32];
+	struct stat st;
+	snprintf(path, sizeof(path), "/proc/%d", pid);
+	uid_t uid = 0;
+	bool known = index->uid_count && !stat(path, &st);
+	if (known && !(uid = st.st_uid)) {
+		known = !proc_read_uid(pid, &uid);
+	}
+	if (known && bsearch(&uid, index->uids, index->uid_count,
+			     sizeof(*index->uids), compare_uid)) {
+		return add_candidate(pid, index);
+	}
+	struct proc_stat task;
+	if (!index->comm_count || proc_read_stat(pid, &task)) {
+		return 0;
+	}
+	for (size_t i = 0; i < index->comm_count; i++) {
+		if (!strcmp(task.comm, index->comms[i])) {
+			return add_candidate(pid, index);
+		}
+	}
+	return 0;
+}
+
+// Collect the processes that match any of the rules, sorted and without
+// duplicates. Cgroup prefixes are looked up in the cgroup tree, uids and
+// commands with a single walk over /proc.
+static size_t reload_candidates(const struct rule **rules, size_t count,
+				pid_t **pids)
+{
+	struct reload_index index = { 0 };
+	index.uids = calloc(count + 1, sizeof(*index.uids));
+	index.comms = calloc(count + 1, sizeof(*index.comms));
+	if (!index.uids || !index.comms) {
+		error(1, errno, "Failed to allocate the reload");
+	}
+	const char *root = cgroup_root();
+	for (size_t i = 0; i < count; i++) {
+		const struct rule *rule = rules[i];
+		char path[PATH_MAX];
+		switch (rule->selector) {
+		case RULE_CGROUP:
+			if (root) {
+				snprintf(path, sizeof(path), "%s%s", root,
+					 rule->len > 1 ? rule->value : "");
+				cgroup_for_each_process(path, add_candidate,
+							&index);
+			}
+			break;
+		case RULE_UID:
+			index.uids[index.uid_count++] = rule->uid;
+			break;
+		case RULE_COMM:
+			index.comms[index.comm_count++] = rule->value;
+			break;
+		}
+	}
+	if (index.uid_count || index.comm_count) {
+		qsort(index.uids, index.uid_count, sizeof(*index.uids),
+		      compare_uid);
+		proc_for_each_pid(find_by_uid_or_comm, &index);
+	}
+
+	qsort(index.pids, index.count, sizeof(*index.pids), compare_pid);
+	size_t unique = 0;
+	for (size_t i = 0; i < index.count; i++) {
+		if (!unique || index.pids[unique - 1] != index.pids[i]) {
+			index.pids[unique++] = index.pids[i];
+		}
+	}
+	free(index.uids);
+	free(index.comms);
+	*pids = index.pids;
+	return unique;
+}
+
+// Give the groups of next the index they have in old, so that the groups
+// of the tasks in the lanes and in the task maps stay valid. Groups that
+// were removed keep their slot without cores and are marked in retired, and
+// new groups go at the end. Old is left alone, as the lanes still use it.
+static void merge_groups(const struct ruleset *old, struct ruleset *next,
+			 bool *retired)
+{
+	size_t *map = calloc(next->group_count + 1, sizeof(*map));
+	if (!map) {
+		error(1, errno, "Failed to allocate groups");
+	}
+	size_t count = old->group_count;
+	for (size_t j = 0; j < next->group_count; j++) {
+		int i = ruleset_find_group(old, next->groups[j].name);
+		map[j] = i < 0 ? count++ : (size_t)i;
+	}
+
+	struct group_config *merged = calloc(count, sizeof(*merged));
+	if (!merged) {
+		error(1, errno, "Failed to allocate groups");
+	}
+	for (size_t i = 0; i < old->group_count; i++) {
+		retired[i] = true;
+		merged[i] = old->groups[i];
+		merged[i].cores = merged[i].max_cores = 0;
+	}
+	for (size_t j = 0; j < next->group_count; j++) {
+		if (map[j] < old->group_count) {
+			retired[map[j]] = false;
+		}
+		merged[map[j]] = next->groups[j];
+	}
+	for (size_t i = 0; i < old->group_count; i++) {
+		if (retired[i] && !(merged[i].name = strdup(merged[i].name))) {
+			error(1, errno, "Failed to allocate groups");
+		}
+	}
+	for (size_t k = 0; k < next->rule_count; k++) {
+		next->rules[k].group = map[next->rules[k].group];
+	}
+	free(next->groups);
+	next->groups = merged;
+	next->group_count = count;
+	free(map);
+}
+
+// Resize the cores of every group to what its configuration allows now.
+// Returns the number of groups whose CPUs changed.
+static size_t reload_placement(struct daemon *d)
+{
+	size_t count = d->rules.group_count;
+	size_t replanned = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct group_config *config = &d->rules.groups[i];
+		struct daemon_group *g = d->groups[i];
+		cpu_set_t before = g->place.cpus;
+
+		pthread_rwlock_wrlock(&d->place_lock);
+		// A group that the rebalancer resized stays at its size as
+		// long as the new range allows it.
+		unsigned int wanted = g->place.wanted;
+		if (wanted < config->cores) {
+			wanted = config->cores;
+		} else if (wanted > config->max_cores) {
+			wanted = config->max_cores;
+		}
+		g->place.wanted = wanted;
+		while (g->place.core_count > wanted) {
+			placement_release(&d->placement, &d->topo, &g->place,
+					  g->place.cores[g->place.core_count - 1]);
+		}
+		placement_fill(&d->placement, &d->topo, &g->place, i);
+		pthread_rwlock_unlock(&d->place_lock);
+
+		if (!CPU_EQUAL(&before, &g->place.cpus)) {
+			reapply_affinity(d, i);
+			replanned++;
+		}
+	}
+	return replanned;
+}
+
+static int reclassify(pid_t pid, void *data)
+{
+	struct daemon *d = data;
+	struct daemon_msg msg = {
+		.type = MSG_TASK,
+		.pid = pid,
+		.generation = d->generation,
+	};
+	lane_send(lane_of(d, pid), &msg);
+	return 0;
+}
+
+// The label of a cgroup changed, so its processes are classified again right
+// away instead of at the next scan.
+static void label_changed(const char *path, void *data)
+{
+	char abs[PATH_MAX];
+	snprintf(abs, sizeof(abs), "%s%s", cgroup_root(),
+		 strcmp(path, "/") ? path : "");
+	cgroup_for_each_process(abs, reclassify, data);
+}
+
+// Start reading labels and domains when the configuration asks for them. A
+// cache that is no longer used stays around, but is not consulted anymore.
+static void daemon_open_caches(struct daemon *d)
+{
+	const char *xattr = d->rules.label_xattr;
+	if (!xattr) {
+	} else if (d->labels.inotify_fd >= 0) {
+		label_cache_reset(&d->labels, xattr);
+	} else if (!cgroup_root()) {
+		error(0, 0, "No cgroup v2 hierarchy, labels are not used");
+	} else if (label_cache_init(&d->labels, xattr)) {
+		error(0, errno, "Failed to watch the cgroup labels");
+	}
+
+	xattr = d->rules.domain_xattr;
+	if (!xattr) {
+		return;
+	}
+	if (d->domains.slots) {
+		domain_cache_reset(&d->domains, xattr);
+	} else if (domain_cache_init(&d->domains, xattr)) {
+		error(1, errno, "Failed to allocate the domain cache");
+	}
+	if (d->procev_fd < 0 && (d->procev_fd = procev_open()) < 0) {
+		error(0, errno,
+		      "Failed to listen for process events, domains only apply from the next scan");
+	}
+}
+
+// Load the configuration again on SIGHUP. Only the processes that match a
+// rule that changed can end up in another group, so only those are
+// classified again right away, and like in a scan only the ones whose group
+// did change cost a prctl. The periodic scans classify the rest against the
+// new rules as usual.
+static void daemon_reload(struct daemon *d)
+{
+	unsigned long long started = now_ns();
+	struct ruleset next;
+	if (ruleset_load(d->opts->config, &next)) {
+		error(0, 0, "Keeping the current configuration");
+		return;
+	}
+
+	size_t changed_count;
+	const struct rule **changed =
+		ruleset_diff(&d->rules, &next, &changed_count);
+	pid_t *candidates;
+	size_t candidate_count =
+		reload_candidates(changed, changed_count, &candidates);
+	free(changed);
+
+	size_t old_count = d->rules.group_count;
+	bool *retired = calloc(old_count + 1, sizeof(*retired));
+	bool *retiered = calloc(old_count + 1, sizeof(*retiered));
+	if (!retired || !retiered) {
+		error(1, errno, "Failed to allocate groups");
+	}
+	merge_groups(&d->rules, &next, retired);
+	size_t count = next.group_count;
+	struct daemon_group **groups = calloc(count, sizeof(*groups));
+	if (!groups) {
+		error(1, errno, "Failed to allocate groups");
+	}
+	memcpy(groups, d->groups, old_count * sizeof(*groups));
+
+	// The new groups are not visible to the lanes until the swap, and
+	// get their cores after it.
+	for (size_t i = old_count; i < count; i++) {
+		groups[i] = group_init(&next.groups[i]);
+		group_keep(groups[i], next.groups[i].name);
+	}
+
+	struct ruleset old = d->rules;
+	struct daemon_group **old_groups = d->groups;
+	pthread_rwlock_wrlock(&d->rules_lock);
+	for (size_t l = 0; l < d->lane_count; l++) {
+		struct daemon_lane *lane = &d->lanes[l];
+		pthread_mutex_lock(&lane->lock);
+		size_t *members =
+			realloc(lane->members, (count + 1) * sizeof(*members));
+		if (!members) {
+			error(1, errno, "Failed to allocate groups");
+		}
+		memset(&members[old_count], 0,
+		       (count + 1 - old_count) * sizeof(*members));
+		lane->members = members;
+		pthread_mutex_unlock(&lane->lock);
+	}
+	d->rules = next;
+	d->groups = groups;
+	for (size_t i = 0; i < old_count; i++) {
+		groups[i]->retired = retired[i];
+		// Retired groups keep their configuration.
+		retiered[i] = old.groups[i].tier != next.groups[i].tier;
+	}
+	daemon_open_caches(d);
+	pthread_rwlock_unlock(&d->rules_lock);
+	free(old_groups);
+	ruleset_free(&old);
+
+	for (size_t i = 0; i < old_count; i++) {
+		if (retiered[i]) {
+			retier_group(d, i);
+		}
+	}
+	size_t replanned = reload_placement(d);
+	for (size_t i = 0; i < candidate_count; i++) {
+		reclassify(candidates[i], d);
+	}
+	free(candidates);
+
+	size_t retired_count = 0;
+	for (size_t i = 0; i < old_count; i++) {
+		retired_count += retired[i];
+	}
+	free(retired);
+	free(retiered);
+	daemon_log("reload: %zu rules changed, %zu groups added, %zu retired, %zu re-pinned, %zu processes classified again, took %.1f ms",
+		   changed_count, count - old_count, retired_count, replanned,
+		   candidate_count, (now_ns() - started) / 1e6);
+}
+
+static void lane_init(struct daemon *d, struct daemon_lane *lane)
+{
+	lane->d = d;
+	lane->holding = HOLDING_UNKNOWN;
+	lane->members = calloc(d->rules.group_count + 1,
+			       sizeof(*lane->members));
+	if (!lane->members ||
+	    spsc_init(&lane->intake, LANE_QUEUE_SIZE, sizeof(struct daemon_msg)) ||
+	    spsc_init(&lane->intake_urgent, CONTROL_MAX_CLIENTS,
+		      sizeof(struct daemon_msg)) ||
+	    spsc_init(&lane->classified, LANE_QUEUE_SIZE,
+		      sizeof(struct daemon_msg)) ||
+	    spsc_init(&lane->classified_urgent, CONTROL_MAX_CLIENTS,
+		      sizeof(struct daemon_msg)) ||
+	    queue_waiter_init(&lane->classify_waiter) ||
+	    queue_waiter_init(&lane->apply_waiter)) {
+		error(1, errno, "Failed to allocate a lane");
+	}
+	pthread_mutex_init(&lane->lock, NULL);
+	if ((errno = pthread_create(&lane->classify_thread, NULL,
+				    classify_main, lane)) ||
+	    (errno = pthread_create(&lane->apply_thread, NULL, apply_main,
+				    lane))) {
+		error(1, errno, "Failed to start a lane");
+	}
+}
+
+static size_t lane_count(const struct daemon_options *opts)
+{
+	if (opts->lanes) {
+		return opts->lanes < MAX_LANES ? opts->lanes : MAX_LANES;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t count = cpus > 0 ? cpus / CPUS_PER_LANE : 1;
+	return count < 1 ? 1 : count > MAX_LANES ? MAX_LANES : count;
+}
+
+static void daemon_init(struct daemon *d, const struct daemon_options *opts)
+{
+	memset(d, 0, sizeof(*d));
+	d->opts = opts;
+	d->running = true;
+
+	if (ruleset_load(opts->config, &d->rules)) {
+		exit(1);
+	}
+	unsigned long cookie;
+	if (core_sched_get(0, &cookie) && errno == EINVAL) {
+		error(1, 0, "Core scheduling is not supported by this kernel");
+	}
+	d->groups = calloc(d->rules.group_count, sizeof(*d->groups));
+	if (!d->groups && d->rules.group_count) {
+		error(1, errno, "Failed to allocate groups");
+	}
+	if (topology_read(&d->topo)) {
+		error(1, errno, "Failed to read the CPU topology");
+	}
+	// A reload would otherwise wait for a moment in which no lane is
+	// busy.
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+				      PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&d->rules_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_rwlock_init(&d->place_lock, NULL);
+	placement_init(&d->placement);
+	for (size_t i = 0; i < d->rules.group_count; i++) {
+		d->groups[i] = group_init(&d->rules.groups[i]);
+		if (placement_fill(&d->placement, &d->topo,
+				   &d->groups[i]->place, i)) {
+			error(0, 0, "Not enough free cores for group %s",
+			      d->rules.groups[i].name);
+		}
+	}
+
+	d->control_fd = -1;
+	if (opts->socket) {
+		d->control_fd = control_listen(opts->socket);
+		if (d->control_fd < 0) {
+			error(1, errno, "Failed to listen on %s", opts->socket);
+		}
+	}
+
+	d->uevent_fd = uevent_open();
+	if (d->uevent_fd < 0) {
+		error(0, errno,
+		      "Failed to listen for uevents, CPU hotplug will not be handled");
+	}
+	d->labels.inotify_fd = -1;
+	d->procev_fd = -1;
+	daemon_open_caches(d);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	// Block the signals before any thread is started, so that all of
+	// them inherit the mask and only the signalfd sees the signals.
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	d->signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (d->signal_fd < 0) {
+		error(1, errno, "Failed to create signalfd");
+	}
+
+	d->null_tid = start_keeper();
+	for (size_t i = 0; i < d->rules.group_count; i++) {
+		group_keep(d->groups[i], d->rules.groups[i].name);
+	}
+
+	if (mpmc_init(&d->account_queue, ACCOUNT_QUEUE_SIZE,
+		      sizeof(struct account_msg)) ||
+	    queue_waiter_init(&d->account_waiter)) {
+		error(1, errno, "Failed to allocate the account queue");
+	}
+	d->account.reported_at = now_ns();
+	if ((errno = pthread_create(&d->account_thread, NULL, account_main,
+				    d))) {
+		error(1, errno, "Failed to start the account thread");
+	}
+
+	d->lane_count = lane_count(opts);
+	d->lanes = calloc(d->lane_count, sizeof(*d->lanes));
+	if (!d->lanes) {
+		error(1, errno, "Failed to allocate lanes");
+	}
+	for (size_t i = 0; i < d->lane_count; i++) {
+		lane_init(d, &d->lanes[i]);
+	}
+}
+
+static void daemon_stop(struct daemon *d)
+{
+	struct daemon_msg stop = { .type = MSG_STOP };
+	for (size_t i = 0; i < d->lane_count; i++) {
+		lane_send(&d->lanes[i], &stop);
+	}
+	for (size_t i = 0; i < d->lane_count; i++) {
+		pthread_join(d->lanes[i].classify_thread, NULL);
+		pthread_join(d->lanes[i].apply_thread, NULL);
+	}
+	account_send(d, ACCOUNT_STOP, 0, 0);
+	pthread_join(d->account_thread, NULL);
+	for (size_t i = 0; i < d->client_count; i++) {
+		close(d->clients[i]);
+	}
+	if (d->control_fd >= 0) {
+		close(d->control_fd);
+		unlink(d->opts->socket);
+	}
+
+	for (size_t i = 0; i < d->rules.group_count; i++) {
+		daemon_log("group %s: %zu processes", d->rules.groups[i].name,
+			   group_members(d, i));
+	}
+	if (d->rules.sample_ms) {
+		double low, high;
+		wilson_interval(d->violations, d->sampled, d->rules.sample_z,
+				&low, &high);
+		daemon_log("sample: %llu processes checked in %lu rounds, %llu violations, %llu processes repaired, violation rate at most %.3f%%",
+			   d->sampled, d->sample_ticks, d->violations,
+			   d->repaired, 100 * high);
+	}
+}
+
+void daemon_run(const struct daemon_options *opts)
+{
+	struct daemon d;
+	daemon_init(&d, opts);
+
+	unsigned long long interval = opts->interval_ms * 1000000ULL;
+	unsigned long long next_scan = now_ns();
+	unsigned long long settle = UEVENT_SETTLE_MS * 1000000ULL;
+	unsigned long long rebalance = d.rules.rebalance_ms * 1000000ULL;
+	unsigned long long next_rebalance = now_ns() + rebalance;
+	unsigned long long sample = d.rules.sample_ms * 1000000ULL;
+	unsigned long long next_sample = now_ns() + sample;
+	d.rebalanced_at = now_ns();
+	d.sample_seed = now_ns();
+
+	while (d.running) {
+		unsigned long long now = now_ns();
+		if (d.uevent_first && now >= d.uevent_last + settle) {
+			daemon_replan(&d);
+		}
+		// A scan that is still being fed into the lanes when the next
+		// one is due simply delays it.
+		if (!d.scanning && now >= next_scan) {
+			daemon_scan(&d);
+			next_scan = now + interval;
+		}
+		if (rebalance && now >= next_rebalance) {
+			daemon_rebalance(&d);
+			next_rebalance = now + rebalance;
+		}
+		if (sample && now >= next_sample) {
+			daemon_sample(&d);
+			next_sample = now + sample;
+		}
+		bool stalled = d.scanning && !daemon_intake(&d);
+
+		now = now_ns();
+		unsigned long long wake = next_scan;
+		if (rebalance && next_rebalance < wake) {
+			wake = next_rebalance;
+		}
+		if (sample && next_sample < wake) {
+			wake = next_sample;
+		}
+		if (d.uevent_first && d.uevent_last + settle < wake) {
+			wake = d.uevent_last + settle;
+		}
+		int timeout = wake > now ? (wake - now + 999999) / 1000000 : 0;
+		if (d.scanning) {
+			timeout = stalled ? 1 : 0;
+		}
+
+		struct pollfd fds[5 + CONTROL_MAX_CLIENTS] = {
+			{ .fd = d.signal_fd, .events = POLLIN },
+			{ .fd = d.uevent_fd, .events = POLLIN },
+			{ .fd = d.control_fd, .events = POLLIN },
+			{ .fd = d.labels.inotify_fd, .events = POLLIN },
+			{ .fd = d.procev_fd, .events = POLLIN },
+		};
+		for (size_t i = 0; i < d.client_count; i++) {
+			fds[5 + i] = (struct pollfd){ .fd = d.clients[i],
+						      .events = POLLIN };
+		}
+		if (poll(fds, 5 + d.client_count, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			error(1, errno, "Failed to wait for events");
+		}
+		struct signalfd_siginfo info;
+		if (fds[0].revents & POLLIN &&
+		    read(d.signal_fd, &info, sizeof(info)) > 0) {
+			if (info.ssi_signo == SIGUSR1) {
+				account_send(&d, ACCOUNT_STATS, 0, 0);
+			} else if (info.ssi_signo == SIGHUP) {
+				daemon_reload(&d);
+				rebalance = d.rules.rebalance_ms * 1000000ULL;
+				next_rebalance = now_ns() + rebalance;
+				sample = d.rules.sample_ms * 1000000ULL;
+				next_sample = now_ns() + sample;
+			} else {
+				d.running = false;
+			}
+		}
+		if (fds[1].revents & POLLIN) {
+			uevent_drain(&d);
+		}
+		if (fds[3].revents & POLLIN) {
+			label_cache_drain(&d.labels, label_changed, &d);
+		}
+		if (fds[4].revents & POLLIN) {
+			procev_drain(&d);
+		}
+		// Walk backwards, as a handled client is replaced by the last
+		// one.
+		for (size_t i = d.client_count; i-- > 0;) {
+			if (fds[5 + i].revents) {
+				control_receive(&d, i);
+			}
+		}
+		if (fds[2].revents & POLLIN) {
+			control_accept(&d);
+		}
+	}
+
+	daemon_stop(&d);
+}
@@ -0,0 +1,23 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_DAEMON_H
+#define CORESCHED_DAEMON_H
+
+struct daemon_options {
+	const char *config;
+	// Time between two full scans of /proc in milliseconds.
+	unsigned int interval_ms;
+	// Number of classify and apply lanes, 0 to pick one per 32 CPUs.
+	unsigned int lanes;
+	// Control socket to accept requests on, or NULL for none.
+	const char *socket;
+};
+
+// Keep every process that matches a rule of the configuration in the
+// cookie of its group until SIGINT or SIGTERM is received. SIGUSR1 prints
+// the occupancy and throughput of every stage of the daemon, and SIGHUP
+// loads the configuration again.
+void daemon_run(const struct daemon_options *opts);
+
+#endif
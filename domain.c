@@ -0,0 +1,199 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "domain.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#define DOMAIN_INITIAL_CAPACITY 256
+// Entries of executables that were replaced pile up, so the cache starts
+// over once it holds this many.
+#define DOMAIN_MAX_ENTRIES 16384
+
+static bool same_time(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static bool same_file(const struct domain_entry *entry, const struct stat *st)
+{
+	return entry->ino == st->st_ino && entry->dev == st->st_dev &&
+	       same_time(&entry->mtime, &st->st_mtim) &&
+	       same_time(&entry->ctime, &st->st_ctim);
+}
+
+static size_t domain_hash(const struct stat *st, size_t capacity)
+{
+	unsigned long long key = st->st_ino;
+	key ^= (unsigned long long)st->st_dev << 40;
+	key ^= st->st_mtim.tv_sec * 0x9e3779b97f4a7c15ull;
+	key ^= st->st_mtim.tv_nsec;
+	return ((key * 11400714819323198485ull) >> 32) & (capacity - 1);
+}
+
+static void domain_clear(struct domain_cache *cache, size_t capacity)
+{
+	for (size_t i = 0; i < cache->capacity; i++) {
+		free(cache->slots[i].domain);
+	}
+	free(cache->slots);
+	cache->slots = calloc(capacity, sizeof(*cache->slots));
+	if (!cache->slots) {
+		error(1, errno, "Failed to allocate the domain cache");
+	}
+	cache->capacity = capacity;
+	cache->count = 0;
+}
+
+static void domain_grow(struct domain_cache *cache)
+{
+	struct domain_entry *old = cache->slots;
+	size_t old_capacity = cache->capacity;
+	cache->capacity *= 2;
+	cache->slots = calloc(cache->capacity, sizeof(*cache->slots));
+	if (!cache->slots) {
+		error(1, errno, "Failed to allocate the domain cache");
+	}
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (!old[i].ino) {
+			continue;
+		}
+		struct stat st = {
+			.st_dev = old[i].dev,
+			.st_ino = old[i].ino,
+			.st_mtim = old[i].mtime,
+		};
+		size_t j = domain_hash(&st, cache->capacity);
+		while (cache->slots[j].ino) {
+			j = (j + 1) & (cache->capacity - 1);
+		}
+		cache->slots[j] = old[i];
+	}
+	free(old);
+}
+
+int domain_cache_init(struct domain_cache *cache, const char *xattr)
+{
+	memset(cache, 0, sizeof(*cache));
+	if (strlen(xattr) >= sizeof(cache->xattr)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(cache->xattr, xattr);
+	pthread_mutex_init(&cache->lock, NULL);
+	domain_clear(cache, DOMAIN_INITIAL_CAPACITY);
+	return 0;
+}
+
+void domain_cache_free(struct domain_cache *cache)
+{
+	for (size_t i = 0; i < cache->capacity; i++) {
+		free(cache->slots[i].domain);
+	}
+	free(cache->slots);
+	pthread_mutex_destroy(&cache->lock);
+	memset(cache, 0, sizeof(*cache));
+}
+
+void domain_cache_reset(struct domain_cache *cache, const char *xattr)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (strcmp(cache->xattr, xattr) &&
+	    strlen(xattr) < sizeof(cache->xattr)) {
+		strcpy(cache->xattr, xattr);
+		domain_clear(cache, DOMAIN_INITIAL_CAPACITY);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// Anyone who can write to a file can set its user attributes, so those
+// only count on executables of root that only root can change. Only root
+// can set trusted attributes.
+static bool domain_trusted(const struct domain_cache *cache,
+			   const struct stat *st)
+{
+	return !strncmp(cache->xattr, "trusted.", strlen("trusted.")) ||
+	       (st->st_uid == 0 && !(st->st_mode & (S_IWGRP | S_IWOTH)));
+}
+
+bool domain_lookup(struct domain_cache *cache, pid_t pid, char *domain,
+		   size_t len)
+{
+	char exe[32];
+	struct stat st;
+	snprintf(exe, sizeof(exe), "/proc/%d/exe", pid);
+	if (stat(exe, &st) || !st.st_ino) {
+		return false;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	size_t i = domain_hash(&st, cache->capacity);
+	while (cache->slots[i].ino && !same_file(&cache->slots[i], &st)) {
+		i = (i + 1) & (cache->capacity - 1);
+	}
+	struct domain_entry *entry = &cache->slots[i];
+	if (!entry->ino) {
+		// The attribute is read outside of the lock. If the process
+		// executed another file meanwhile, what was read belongs to
+		// that one, and is not cached.
+		char xattr[sizeof(cache->xattr)];
+		strcpy(xattr, cache->xattr);
+		bool trusted = domain_trusted(cache, &st);
+		pthread_mutex_unlock(&cache->lock);
+		char value[256];
+		ssize_t value_len = -1;
+		if (trusted) {
+			value_len = getxattr(exe, xattr, value,
+					     sizeof(value) - 1);
+		}
+		struct domain_entry fresh = {
+			.dev = st.st_dev,
+			.ino = st.st_ino,
+			.mtime = st.st_mtim,
+			.ctime = st.st_ctim,
+		};
+		struct stat after;
+		if (stat(exe, &after) || !same_file(&fresh, &after)) {
+			return false;
+		}
+		if (value_len > 0) {
+			value[value_len] = '\0';
+			if (!(fresh.domain = strdup(value))) {
+				error(1, errno,
+				      "Failed to allocate the domain cache");
+			}
+		}
+
+		pthread_mutex_lock(&cache->lock);
+		if (cache->count >= DOMAIN_MAX_ENTRIES) {
+			domain_clear(cache, DOMAIN_INITIAL_CAPACITY);
+		} else if ((cache->count + 1) * 4 >= cache->capacity * 3) {
+			domain_grow(cache);
+		}
+		// Another thread may have added it meanwhile.
+		i = domain_hash(&st, cache->capacity);
+		while (cache->slots[i].ino &&
+		       !same_file(&cache->slots[i], &st)) {
+			i = (i + 1) & (cache->capacity - 1);
+		}
+		entry = &cache->slots[i];
+		if (entry->ino) {
+			free(fresh.domain);
+		} else {
+			*entry = fresh;
+			cache->count++;
+		}
+	}
+	bool found = entry->domain && strlen(entry->domain) < len;
+	if (found) {
+		strcpy(domain, entry->domain);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return found;
+}
@@ -0,0 +1,52 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_DOMAIN_H
+#define CORESCHED_DOMAIN_H
+
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+// The extended attribute of an executable that names the group its
+// processes always run in, unless the configuration names another one.
+#define DOMAIN_XATTR "user.coresched.domain"
+
+// The domain of one executable, or NULL if it has none. An empty slot has
+// inode 0.
+struct domain_entry {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	char *domain;
+};
+
+// Domains of executables, cached by the file they were read from. Replacing
+// or writing the executable changes its mtime, and setting the attribute or
+// changing its owner or mode changes its ctime, so a changed file is simply
+// a new key. Stale entries are dropped when the cache fills up.
+struct domain_cache {
+	pthread_mutex_t lock;
+	char xattr[XATTR_NAME_MAX + 1];
+	struct domain_entry *slots;
+	size_t capacity;
+	size_t count;
+};
+
+int domain_cache_init(struct domain_cache *cache, const char *xattr);
+void domain_cache_free(struct domain_cache *cache);
+
+// Read another attribute from now on, which drops every cached domain.
+void domain_cache_reset(struct domain_cache *cache, const char *xattr);
+
+// Copy the domain of the executable of pid into domain. Returns false if the
+// executable has none, it is not trusted with a user attribute, the domain
+// does not fit or pid is gone.
+bool domain_lookup(struct domain_cache *cache, pid_t pid, char *domain,
+		   size_t len);
+
+#endif
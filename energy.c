@@ -0,0 +1,349 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "energy.h"
+#include "util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RAPL_GLOB "/sys/class/powercap/intel-rapl:[0-9]*"
+#define MSR_PMU "/sys/bus/event_source/devices/msr"
+#define CPUFREQ_PATH "/sys/devices/system/cpu/cpu%zu/cpufreq/scaling_cur_freq"
+// How often the cpufreq fallback samples every CPU.
+#define CPUFREQ_INTERVAL_MS 100
+
+static int read_ull(int fd, unsigned long long *value)
+{
+	char buf[32];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		return -1;
+	}
+	buf[len] = '\0';
+	*value = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+static int read_path_ull(const char *path, unsigned long long *value)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	int ret = read_ull(fd, value);
+	close(fd);
+	return ret;
+}
+
+// Only the package domains, as the others are parts of their package.
+static void open_rapl(struct energy_meter *meter)
+{
+	glob_t domains;
+	if (glob(RAPL_GLOB, 0, NULL, &domains)) {
+		return;
+	}
+	for (size_t i = 0; i < domains.gl_pathc; i++) {
+		const char *dir = domains.gl_pathv[i];
+		char path[PATH_MAX];
+		char name[32] = "";
+		snprintf(path, sizeof(path), "%s/name", dir);
+		FILE *file = fopen(path, "r");
+		if (file) {
+			if (!fgets(name, sizeof(name), file)) {
+				name[0] = '\0';
+			}
+			fclose(file);
+		}
+		if (strncmp(name, "package", 7) ||
+		    meter->packages == ENERGY_MAX_PACKAGES) {
+			continue;
+		}
+
+		size_t p = meter->packages;
+		snprintf(path, sizeof(path), "%s/max_energy_range_uj", dir);
+		if (read_path_ull(path, &meter->max_uj[p])) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/energy_uj", dir);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		unsigned long long uj;
+		// energy_uj is only readable by root since the PLATYPUS
+		// side channel.
+		if (fd < 0 || read_ull(fd, &uj)) {
+			if (fd >= 0) {
+				close(fd);
+			}
+			continue;
+		}
+		meter->package_fds[meter->packages++] = fd;
+	}
+	globfree(&domains);
+}
+
+// The config of an event of the msr PMU, from its "event=0x.." file.
+static int msr_event(const char *name, unsigned long long *config)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), MSR_PMU "/events/%s", name);
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return -1;
+	}
+	int ret = fscanf(file, "event=%llx", config) == 1 ? 0 : -1;
+	fclose(file);
+	return ret;
+}
+
+static int open_msr(unsigned long long type, unsigned long long config,
+		    size_t cpu)
+{
+	struct perf_event_attr attr = {
+		.type = type,
+		.size = sizeof(attr),
+		.config = config,
+	};
+	return syscall(SYS_perf_event_open, &attr, -1, (int)cpu, -1,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+static void close_fds(int *fds, size_t count)
+{
+	for (size_t i = 0; fds && i < count; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+	free(fds);
+}
+
+static bool open_aperf_mperf(struct energy_meter *meter)
+{
+	unsigned long long type, aperf, mperf, tsc;
+	if (read_path_ull(MSR_PMU "/type", &type) ||
+	    msr_event("aperf", &aperf) || msr_event("mperf", &mperf) ||
+	    msr_event("tsc", &tsc)) {
+		return false;
+	}
+	size_t cpus = sysconf(_SC_NPROCESSORS_CONF);
+	meter->aperf_fds = malloc(cpus * sizeof(int));
+	meter->mperf_fds = malloc(cpus * sizeof(int));
+	if (!meter->aperf_fds || !meter->mperf_fds) {
+		error(1, errno, "Failed to allocate counters");
+	}
+	// Offline CPUs fail to open and are skipped when reading.
+	bool any = false;
+	for (size_t cpu = 0; cpu < cpus; cpu++) {
+		meter->aperf_fds[cpu] = open_msr(type, aperf, cpu);
+		meter->mperf_fds[cpu] = open_msr(type, mperf, cpu);
+		if (meter->aperf_fds[cpu] >= 0 && meter->mperf_fds[cpu] >= 0) {
+			if (!any) {
+				meter->tsc_fd = open_msr(type, tsc, cpu);
+			}
+			any = true;
+		}
+	}
+	meter->cpus = cpus;
+	if (!any || meter->tsc_fd < 0) {
+		close_fds(meter->aperf_fds, cpus);
+		close_fds(meter->mperf_fds, cpus);
+		meter->aperf_fds = meter->mperf_fds = NULL;
+		meter->cpus = 0;
+		return false;
+	}
+	return true;
+}
+
+static unsigned long long read_counter(int fd)
+{
+	unsigned long long value = 0;
+	if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+		return 0;
+	}
+	return value;
+}
+
+static void read_aperf_mperf(const struct energy_meter *meter,
+			     unsigned long long *aperf,
+			     unsigned long long *mperf, unsigned long long *tsc)
+{
+	*aperf = *mperf = 0;
+	for (size_t cpu = 0; cpu < meter->cpus; cpu++) {
+		if (meter->aperf_fds[cpu] >= 0 && meter->mperf_fds[cpu] >= 0) {
+			*aperf += read_counter(meter->aperf_fds[cpu]);
+			*mperf += read_counter(meter->mperf_fds[cpu]);
+		}
+	}
+	*tsc = read_counter(meter->tsc_fd);
+}
+
+// Average of scaling_cur_freq over the CPUs that have it, in MHz, or 0.
+static double sample_cpufreq(void)
+{
+	size_t cpus = sysconf(_SC_NPROCESSORS_CONF);
+	double sum = 0;
+	size_t count = 0;
+	for (size_t cpu = 0; cpu < cpus; cpu++) {
+		char path[PATH_MAX];
+		unsigned long long khz;
+		snprintf(path, sizeof(path), CPUFREQ_PATH, cpu);
+		if (!read_path_ull(path, &khz)) {
+			sum += khz / 1e3;
+			count++;
+		}
+	}
+	return count ? sum / count : 0;
+}
+
+static void *sampler_main(void *data)
+{
+	struct energy_meter *meter = data;
+	pthread_mutex_lock(&meter->lock);
+	while (!meter->stopping) {
+		pthread_mutex_unlock(&meter->lock);
+		double mhz = sample_cpufreq();
+		pthread_mutex_lock(&meter->lock);
+		meter->sampled_mhz += mhz;
+		meter->samples++;
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += CPUFREQ_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (!meter->stopping &&
+		       pthread_cond_timedwait(&meter->stop, &meter->lock,
+					      &deadline) != ETIMEDOUT) {
+		}
+	}
+	pthread_mutex_unlock(&meter->lock);
+	return NULL;
+}
+
+void energy_open(struct energy_meter *meter)
+{
+	memset(meter, 0, sizeof(*meter));
+	meter->tsc_fd = -1;
+	pthread_mutex_init(&meter->lock, NULL);
+	pthread_cond_init(&meter->stop, NULL);
+
+	open_rapl(meter);
+	if (!meter->packages) {
+		error(0, 0,
+		      "Package energy is not readable through powercap, reporting no power");
+	}
+	if (!open_aperf_mperf(meter)) {
+		meter->cpufreq = sample_cpufreq() > 0;
+		if (meter->cpufreq) {
+			error(0, 0,
+			      "APERF and MPERF are not available, sampling scaling_cur_freq instead");
+		} else {
+			error(0, 0,
+			      "Neither APERF and MPERF nor cpufreq are available, reporting no frequency");
+		}
+	}
+}
+
+void energy_close(struct energy_meter *meter)
+{
+	for (size_t p = 0; p < meter->packages; p++) {
+		close(meter->package_fds[p]);
+	}
+	close_fds(meter->aperf_fds, meter->cpus);
+	close_fds(meter->mperf_fds, meter->cpus);
+	if (meter->tsc_fd >= 0) {
+		close(meter->tsc_fd);
+	}
+	pthread_mutex_destroy(&meter->lock);
+	pthread_cond_destroy(&meter->stop);
+}
+
+bool energy_has_power(const struct energy_meter *meter)
+{
+	return meter->packages;
+}
+
+bool energy_has_frequency(const struct energy_meter *meter)
+{
+	return meter->cpus || meter->cpufreq;
+}
+
+void energy_start(struct energy_meter *meter)
+{
+	for (size_t p = 0; p < meter->packages; p++) {
+		read_ull(meter->package_fds[p], &meter->start_uj[p]);
+	}
+	if (meter->cpus) {
+		read_aperf_mperf(meter, &meter->start_aperf,
+				 &meter->start_mperf, &meter->start_tsc);
+	}
+	if (meter->cpufreq) {
+		meter->stopping = false;
+		meter->sampled_mhz = 0;
+		meter->samples = 0;
+		errno = pthread_create(&meter->sampler, NULL, sampler_main,
+				       meter);
+		if (errno) {
+			error(1, errno, "Failed to start the cpufreq sampler");
+		}
+	}
+	meter->start_ns = now_ns();
+}
+
+void energy_stop(struct energy_meter *meter, struct energy_reading *reading)
+{
+	double seconds = (now_ns() - meter->start_ns) / 1e9;
+	reading->seconds += seconds;
+
+	if (meter->packages) {
+		double uj = 0;
+		for (size_t p = 0; p < meter->packages; p++) {
+			unsigned long long end = 0;
+			read_ull(meter->package_fds[p], &end);
+			// The counter wraps at max_energy_range_uj.
+			if (end < meter->start_uj[p]) {
+				end += meter->max_uj[p];
+			}
+			uj += end - meter->start_uj[p];
+		}
+		reading->joules += uj / 1e6;
+	} else {
+		reading->joules = NAN;
+	}
+
+	if (meter->cpus) {
+		unsigned long long aperf, mperf, tsc;
+		read_aperf_mperf(meter, &aperf, &mperf, &tsc);
+		// MPERF counts at the TSC frequency while a CPU is not halted,
+		// and APERF at the frequency it actually runs at.
+		double tsc_mhz = (tsc - meter->start_tsc) / seconds / 1e6;
+		double ratio = mperf > meter->start_mperf ?
+				       (double)(aperf - meter->start_aperf) /
+					       (mperf - meter->start_mperf) :
+				       0;
+		reading->mega_cycles += tsc_mhz * ratio * seconds;
+	} else if (meter->cpufreq) {
+		pthread_mutex_lock(&meter->lock);
+		meter->stopping = true;
+		pthread_cond_signal(&meter->stop);
+		pthread_mutex_unlock(&meter->lock);
+		pthread_join(meter->sampler, NULL);
+		double mhz = meter->samples ?
+				     meter->sampled_mhz / meter->samples :
+				     sample_cpufreq();
+		reading->mega_cycles += mhz * seconds;
+	} else {
+		reading->mega_cycles = NAN;
+	}
+}
@@ -0,0 +1,68 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_ENERGY_H
+#define CORESCHED_ENERGY_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Forced idle lowers package power and leaves more turbo headroom to the
+// siblings that do run, so the benchmarks can report energy and frequency
+// next to throughput. Energy comes from the package domains of powercap
+// RAPL. The effective frequency comes from the APERF and MPERF counters of
+// the msr PMU, or from sampling scaling_cur_freq of cpufreq where perf does
+// not expose them. Sources that are not available read as NAN.
+
+#define ENERGY_MAX_PACKAGES 16
+
+struct energy_reading {
+	double seconds;
+	double joules;
+	// Frequency times seconds, so that readings of several intervals add
+	// up. mega_cycles / seconds is the average frequency in MHz.
+	double mega_cycles;
+};
+
+struct energy_meter {
+	size_t packages;
+	int package_fds[ENERGY_MAX_PACKAGES];
+	unsigned long long max_uj[ENERGY_MAX_PACKAGES];
+	unsigned long long start_uj[ENERGY_MAX_PACKAGES];
+
+	// One aperf and one mperf counter per CPU, and the TSC of one CPU
+	// that MPERF counts at.
+	size_t cpus;
+	int *aperf_fds;
+	int *mperf_fds;
+	int tsc_fd;
+	unsigned long long start_aperf;
+	unsigned long long start_mperf;
+	unsigned long long start_tsc;
+
+	// The cpufreq fallback samples in a thread while the meter runs.
+	bool cpufreq;
+	pthread_t sampler;
+	pthread_mutex_t lock;
+	pthread_cond_t stop;
+	bool stopping;
+	double sampled_mhz;
+	size_t samples;
+
+	unsigned long long start_ns;
+};
+
+// Find the sources that this system exposes and report the missing ones on
+// stderr. Always succeeds, a meter without sources only measures time.
+void energy_open(struct energy_meter *meter);
+void energy_close(struct energy_meter *meter);
+
+bool energy_has_power(const struct energy_meter *meter);
+bool energy_has_frequency(const struct energy_meter *meter);
+
+// Measure the interval between start and stop and add it to reading.
+void energy_start(struct energy_meter *meter);
+void energy_stop(struct energy_meter *meter, struct energy_reading *reading);
+
+#endif
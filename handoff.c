@@ -0,0 +1,261 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "handoff.h"
+#include "coresched.h"
+#include "queue.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define HANDOFF_BUCKETS 256
+#define HANDOFF_IDLE_MS 1000
+#define HANDOFF_QUEUE_SIZE 1024
+
+struct handoff_request {
+	// NULL tells the worker to stop.
+	handoff_fn fn;
+	void *arg;
+};
+
+struct handoff_worker {
+	struct handoff *h;
+	struct handoff_worker *next;
+	unsigned long tenant;
+	struct mpmc_queue queue;
+	struct queue_waiter waiter;
+	sem_t started;
+	int start_error;
+};
+
+struct handoff {
+	// Producers push while holding the lock for reading. A worker only
+	// removes itself while holding it for writing, so that nothing can be
+	// pushed to a queue that nobody pops anymore.
+	pthread_rwlock_t lock;
+	struct handoff_worker *buckets[HANDOFF_BUCKETS];
+	unsigned int idle_ms;
+	size_t queue_size;
+	bool cookies;
+	// Guards worker_count, which destroy waits on to reach zero.
+	pthread_mutex_t count_lock;
+	pthread_cond_t stopped;
+	size_t worker_count;
+};
+
+static struct handoff_worker **bucket(struct handoff *h, unsigned long tenant)
+{
+	return &h->buckets[(tenant * 2654435761UL) % HANDOFF_BUCKETS];
+}
+
+static struct handoff_worker *find_worker(struct handoff *h,
+					  unsigned long tenant)
+{
+	for (struct handoff_worker *w = *bucket(h, tenant); w; w = w->next) {
+		if (w->tenant == tenant) {
+			return w;
+		}
+	}
+	return NULL;
+}
+
+static void free_worker(struct handoff_worker *w)
+{
+	mpmc_free(&w->queue);
+	queue_waiter_destroy(&w->waiter);
+	sem_destroy(&w->started);
+	free(w);
+}
+
+// Take the worker out of the table if it is still idle. Returns false if a
+// request came in after all.
+static bool retire_worker(struct handoff_worker *w,
+			  struct handoff_request *request)
+{
+	struct handoff *h = w->h;
+	pthread_rwlock_wrlock(&h->lock);
+	if (mpmc_pop(&w->queue, request)) {
+		pthread_rwlock_unlock(&h->lock);
+		return false;
+	}
+	struct handoff_worker **at = bucket(h, w->tenant);
+	while (*at != w) {
+		at = &(*at)->next;
+	}
+	*at = w->next;
+	pthread_rwlock_unlock(&h->lock);
+	return true;
+}
+
+static void *worker_main(void *data)
+{
+	struct handoff_worker *w = data;
+	struct handoff *h = w->h;
+	int err = 0;
+	if (h->cookies && core_sched_create(0, SCHED_CORE_SCOPE_PID)) {
+		err = errno;
+	}
+	w->start_error = err;
+	// start_worker frees a worker that failed to start as soon as it is
+	// woken up, so w must not be touched after that.
+	sem_post(&w->started);
+	if (err) {
+		return NULL;
+	}
+
+	struct handoff_request request;
+	for (;;) {
+		if (!mpmc_pop_timedwait(&w->queue, &w->waiter, &request,
+					h->idle_ms) &&
+		    retire_worker(w, &request)) {
+			break;
+		}
+		if (!request.fn) {
+			// handoff_destroy already took the worker out.
+			break;
+		}
+		request.fn(request.arg);
+	}
+
+	free_worker(w);
+	pthread_mutex_lock(&h->count_lock);
+	if (!--h->worker_count) {
+		pthread_cond_broadcast(&h->stopped);
+	}
+	pthread_mutex_unlock(&h->count_lock);
+	return NULL;
+}
+
+// Called with the lock held for writing.
+static struct handoff_worker *start_worker(struct handoff *h,
+					   unsigned long tenant)
+{
+	struct handoff_worker *w = calloc(1, sizeof(*w));
+	if (!w) {
+		return NULL;
+	}
+	w->h = h;
+	w->tenant = tenant;
+	if (mpmc_init(&w->queue, h->queue_size, sizeof(struct handoff_request))) {
+		free(w);
+		return NULL;
+	}
+	queue_waiter_init(&w->waiter);
+	sem_init(&w->started, 0, 0);
+
+	pthread_mutex_lock(&h->count_lock);
+	h->worker_count++;
+	pthread_mutex_unlock(&h->count_lock);
+
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int err = pthread_create(&thread, &attr, worker_main, w);
+	pthread_attr_destroy(&attr);
+	if (!err) {
+		while (sem_wait(&w->started) && errno == EINTR) {
+		}
+		err = w->start_error;
+	}
+	if (err) {
+		pthread_mutex_lock(&h->count_lock);
+		h->worker_count--;
+		pthread_mutex_unlock(&h->count_lock);
+		free_worker(w);
+		errno = err;
+		return NULL;
+	}
+
+	w->next = *bucket(h, tenant);
+	*bucket(h, tenant) = w;
+	return w;
+}
+
+struct handoff *handoff_create(const struct handoff_options *opts)
+{
+	struct handoff *h = calloc(1, sizeof(*h));
+	if (!h) {
+		return NULL;
+	}
+	h->idle_ms = opts->idle_ms ? opts->idle_ms : HANDOFF_IDLE_MS;
+	h->queue_size = opts->queue_size ? opts->queue_size :
+					   HANDOFF_QUEUE_SIZE;
+	h->cookies = !opts->no_cookie;
+	pthread_rwlock_init(&h->lock, NULL);
+	pthread_mutex_init(&h->count_lock, NULL);
+	pthread_cond_init(&h->stopped, NULL);
+	return h;
+}
+
+void handoff_destroy(struct handoff *h)
+{
+	pthread_rwlock_wrlock(&h->lock);
+	struct handoff_request stop = { NULL, NULL };
+	for (size_t i = 0; i < HANDOFF_BUCKETS; i++) {
+		while (h->buckets[i]) {
+			struct handoff_worker *w = h->buckets[i];
+			h->buckets[i] = w->next;
+			mpmc_push_wait(&w->queue, &stop);
+			queue_wake(&w->waiter);
+		}
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	pthread_mutex_lock(&h->count_lock);
+	while (h->worker_count) {
+		pthread_cond_wait(&h->stopped, &h->count_lock);
+	}
+	pthread_mutex_unlock(&h->count_lock);
+
+	pthread_rwlock_destroy(&h->lock);
+	pthread_mutex_destroy(&h->count_lock);
+	pthread_cond_destroy(&h->stopped);
+	free(h);
+}
+
+int handoff_submit(struct handoff *h, unsigned long tenant, handoff_fn fn,
+		   void *arg)
+{
+	struct handoff_request request = { fn, arg };
+	for (;;) {
+		pthread_rwlock_rdlock(&h->lock);
+		struct handoff_worker *w = find_worker(h, tenant);
+		if (w) {
+			// Woken with the lock held, as a retiring worker frees
+			// itself once it has the lock.
+			bool pushed = mpmc_push(&w->queue, &request);
+			if (pushed) {
+				queue_wake(&w->waiter);
+			}
+			pthread_rwlock_unlock(&h->lock);
+			if (pushed) {
+				return 0;
+			}
+			// Not while holding the lock, which a worker may be
+			// waiting for to retire.
+			sched_yield();
+			continue;
+		}
+		pthread_rwlock_unlock(&h->lock);
+
+		pthread_rwlock_wrlock(&h->lock);
+		if (!find_worker(h, tenant) && !start_worker(h, tenant)) {
+			pthread_rwlock_unlock(&h->lock);
+			return -1;
+		}
+		pthread_rwlock_unlock(&h->lock);
+	}
+}
+
+size_t handoff_worker_count(struct handoff *h)
+{
+	pthread_mutex_lock(&h->count_lock);
+	size_t count = h->worker_count;
+	pthread_mutex_unlock(&h->count_lock);
+	return count;
+}
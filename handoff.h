@@ -0,0 +1,54 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_HANDOFF_H
+#define CORESCHED_HANDOFF_H
+
+// Per-tenant workers for servers that handle requests of mutually
+// untrusted tenants, part of libcoresched.a. Instead of moving the serving
+// thread into the cookie of a tenant for every request, every tenant gets a
+// worker thread with a cookie of its own, and requests are handed to that
+// worker over a lock-free queue. Workers start on the first request of
+// their tenant and stop again after being idle for a while.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct handoff;
+
+typedef void (*handoff_fn)(void *arg);
+
+struct handoff_options {
+	// How long a worker waits for a request before it stops. Defaults
+	// to 1000.
+	unsigned int idle_ms;
+	// Requests that can wait for each worker. Defaults to 1024.
+	size_t queue_size;
+	// Run the workers without cookies, to compare against.
+	bool no_cookie;
+};
+
+// Returns NULL with errno set on failure.
+struct handoff *handoff_create(const struct handoff_options *opts);
+
+// Run the requests that were handed off and stop every worker.
+void handoff_destroy(struct handoff *h);
+
+// Run fn(arg) on the worker of tenant, starting one if there is none.
+// Requests of one tenant run in the order they were handed off. Returns
+// 0, or -1 with errno set if a worker could not be started.
+int handoff_submit(struct handoff *h, unsigned long tenant, handoff_fn fn,
+		   void *arg);
+
+// The number of workers that are running.
+size_t handoff_worker_count(struct handoff *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
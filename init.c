@@ -0,0 +1,106 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "init.h"
+#include "coresched.h"
+
+#include <errno.h>
+#include <error.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static pid_t parse_init_pid(const char *str)
+{
+	char *end;
+	long pid = strtol(str, &end, 10);
+	if (*end || end == str || pid <= 0) {
+		error(1, 0, "Failed to parse pid %s", str);
+	}
+	return pid;
+}
+
+// Reap every zombie, and return once the program is one of them.
+static void reap_all(pid_t child, int *status, bool *exited)
+{
+	int wstatus;
+	pid_t pid;
+	while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+		if (pid != child) {
+			continue;
+		}
+		*exited = true;
+		if (WIFEXITED(wstatus)) {
+			*status = WEXITSTATUS(wstatus);
+		} else {
+			*status = 128 + WTERMSIG(wstatus);
+		}
+	}
+}
+
+_Noreturn void init_run(int argc, char **argv)
+{
+	pid_t from = 0;
+	int arg = 0;
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (!strcmp(argv[arg], "--")) {
+			arg++;
+			break;
+		} else if (!strcmp(argv[arg], "-p") && arg + 1 < argc) {
+			from = parse_init_pid(argv[++arg]);
+		} else if (!strncmp(argv[arg], "--pid=", 6)) {
+			from = parse_init_pid(argv[arg] + 6);
+		} else {
+			error(1, 0, "Unknown init option '%s'", argv[arg]);
+		}
+	}
+	if (arg == argc) {
+		error(1, 0, "init has to be followed by a program to run");
+	}
+
+	// Signals are only taken with sigwaitinfo, so that none of them can
+	// interrupt the init, and the program gets the mask back.
+	sigset_t all, old;
+	sigfillset(&all);
+	sigprocmask(SIG_SETMASK, &all, &old);
+
+	// The cookie is inherited by the program and everything it starts.
+	if (from ? core_sched_share_from(from) :
+		   core_sched_create(0, SCHED_CORE_SCOPE_TGID)) {
+		error(1, errno, from ? "Failed to pull cookie from PID %d" :
+				       "Failed to create cookie",
+		      from);
+	}
+	// Outside of a PID namespace, orphans of the program are ours to
+	// reap all the same.
+	if (getpid() != 1) {
+		prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+	}
+
+	pid_t child = fork();
+	if (child == -1) {
+		error(1, errno, "Failed to spawn %s", argv[arg]);
+	}
+	if (!child) {
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		execvp(argv[arg], &argv[arg]);
+		error(127, errno, "Failed to run %s", argv[arg]);
+	}
+
+	int status = 0;
+	bool exited = false;
+	while (!exited) {
+		siginfo_t info;
+		int sig = sigwaitinfo(&all, &info);
+		if (sig == SIGCHLD) {
+			reap_all(child, &status, &exited);
+		} else if (sig > 0) {
+			kill(child, sig);
+		}
+	}
+	exit(status);
+}
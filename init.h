@@ -0,0 +1,19 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_INIT_H
+#define CORESCHED_INIT_H
+
+// Run as the init process of a container: give this process a new cookie,
+// or the cookie of another process, start the program with it, forward
+// signals to the program and reap every zombie that is reparented to us.
+// Exits with the exit status of the program, or 128 + the signal that
+// killed it.
+//
+// argv starts after "init" and is "[-p PID] [--] PROGRAM ARGS...". It is
+// parsed by hand and nothing is allocated on the way to starting the
+// program, so that the init adds as little to the start of a container as
+// possible.
+_Noreturn void init_run(int argc, char **argv);
+
+#endif
@@ -0,0 +1,354 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "label.h"
+#include "cgroup.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#define LABEL_EVENTS (IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static size_t label_hash(unsigned long long id, size_t capacity)
+{
+	return ((id * 11400714819323198485ull) >> 32) & (capacity - 1);
+}
+
+static struct label_entry *label_get(const struct label_cache *cache,
+				     unsigned long long id)
+{
+	if (!cache->capacity) {
+		return NULL;
+	}
+	for (size_t i = label_hash(id, cache->capacity);;
+	     i = (i + 1) & (cache->capacity - 1)) {
+		struct label_entry *entry = &cache->slots[i];
+		if (entry->id == id) {
+			return entry;
+		}
+		if (!entry->id) {
+			return NULL;
+		}
+	}
+}
+
+// Put an entry in a table that has room for it.
+static void label_put(struct label_cache *cache, struct label_entry entry)
+{
+	size_t i = label_hash(entry.id, cache->capacity);
+	while (cache->slots[i].id) {
+		i = (i + 1) & (cache->capacity - 1);
+	}
+	cache->slots[i] = entry;
+	cache->count++;
+}
+
+// Rehash the entries that keep returns true for into a table of capacity
+// slots, and free the others.
+static void label_rehash(struct label_cache *cache, size_t capacity,
+			 bool (*keep)(const struct label_entry *, const void *),
+			 const void *data)
+{
+	if (!capacity) {
+		return;
+	}
+	struct label_entry *old = cache->slots;
+	size_t old_capacity = cache->capacity;
+	cache->slots = calloc(capacity, sizeof(*cache->slots));
+	if (!cache->slots) {
+		error(1, errno, "Failed to allocate the label cache");
+	}
+	cache->capacity = capacity;
+	cache->count = 0;
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (!old[i].id) {
+			continue;
+		}
+		if (keep(&old[i], data)) {
+			label_put(cache, old[i]);
+		} else {
+			free(old[i].path);
+			free(old[i].label);
+		}
+	}
+	free(old);
+}
+
+static bool keep_all(const struct label_entry *entry, const void *data)
+{
+	(void)entry;
+	(void)data;
+	return true;
+}
+
+static bool keep_none(const struct label_entry *entry, const void *data)
+{
+	(void)entry;
+	(void)data;
+	return false;
+}
+
+// Drop the cgroup at data and the cgroups below it.
+static bool keep_outside(const struct label_entry *entry, const void *data)
+{
+	const char *path = data;
+	size_t len = strlen(path);
+	return strncmp(entry->path, path, len) ||
+	       (entry->path[len] != '\0' && entry->path[len] != '/' &&
+		len > 1);
+}
+
+int label_cache_init(struct label_cache *cache, const char *xattr)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->inotify_fd = -1;
+	if (strlen(xattr) >= sizeof(cache->xattr)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (cache->inotify_fd < 0) {
+		return -1;
+	}
+	strcpy(cache->xattr, xattr);
+	pthread_mutex_init(&cache->lock, NULL);
+	return 0;
+}
+
+void label_cache_free(struct label_cache *cache)
+{
+	for (size_t i = 0; i < cache->capacity; i++) {
+		free(cache->slots[i].path);
+		free(cache->slots[i].label);
+	}
+	for (size_t i = 0; i < cache->watch_count; i++) {
+		free(cache->watches[i].path);
+	}
+	free(cache->slots);
+	free(cache->watches);
+	close(cache->inotify_fd);
+	pthread_mutex_destroy(&cache->lock);
+	memset(cache, 0, sizeof(*cache));
+	cache->inotify_fd = -1;
+}
+
+void label_cache_reset(struct label_cache *cache, const char *xattr)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (strcmp(cache->xattr, xattr) &&
+	    strlen(xattr) < sizeof(cache->xattr)) {
+		strcpy(cache->xattr, xattr);
+		label_rehash(cache, cache->capacity, keep_none, NULL);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static int compare_wd(const void *a, const void *b)
+{
+	const struct label_watch *x = a;
+	const struct label_watch *y = b;
+	return (x->wd > y->wd) - (x->wd < y->wd);
+}
+
+static struct label_watch *label_find_watch(const struct label_cache *cache,
+					    int wd)
+{
+	struct label_watch key = { .wd = wd };
+	return bsearch(&key, cache->watches, cache->watch_count,
+		       sizeof(*cache->watches), compare_wd);
+}
+
+// Watch the directory of a cgroup. Watching a directory again returns the
+// descriptor it already has, and new descriptors are always higher than the
+// ones before, which keeps the watches sorted.
+static void label_watch(struct label_cache *cache, const char *abs,
+			const char *path)
+{
+	int wd = inotify_add_watch(cache->inotify_fd, abs, LABEL_EVENTS);
+	if (wd < 0 || label_find_watch(cache, wd)) {
+		return;
+	}
+	if (cache->watch_count == cache->watch_capacity) {
+		size_t capacity =
+			cache->watch_capacity ? cache->watch_capacity * 2 : 64;
+		struct label_watch *watches = realloc(
+			cache->watches, capacity * sizeof(*cache->watches));
+		if (!watches) {
+			error(1, errno, "Failed to allocate the label cache");
+		}
+		cache->watches = watches;
+		cache->watch_capacity = capacity;
+	}
+	struct label_watch watch = { .wd = wd, .path = strdup(path) };
+	if (!watch.path) {
+		error(1, errno, "Failed to allocate the label cache");
+	}
+	cache->watches[cache->watch_count++] = watch;
+	if (cache->watch_count > 1 &&
+	    cache->watches[cache->watch_count - 2].wd > wd) {
+		qsort(cache->watches, cache->watch_count,
+		      sizeof(*cache->watches), compare_wd);
+	}
+}
+
+// Anyone who can write to a directory can set its user attributes, and a
+// tenant owns the cgroups that were delegated to it. Only root can set
+// trusted attributes.
+static bool label_trusted(const struct label_cache *cache, const char *abs)
+{
+	struct stat st;
+	if (!strncmp(cache->xattr, "trusted.", strlen("trusted."))) {
+		return true;
+	}
+	return !stat(abs, &st) && st.st_uid == 0 &&
+	       !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// Walk from the cgroup up to the root until a directory has the attribute,
+// skipping the directories that are not trusted with one. Every directory
+// on the way is watched before its attribute is read, so a label that is
+// set meanwhile, or an owner that changes, still invalidates the result.
+static char *label_resolve(struct label_cache *cache, const char *root,
+			   const char *path)
+{
+	char abs[PATH_MAX];
+	char rel[PATH_MAX];
+	snprintf(rel, sizeof(rel), "%s", path);
+	for (;;) {
+		snprintf(abs, sizeof(abs), "%s%s", root,
+			 strcmp(rel, "/") ? rel : "");
+		label_watch(cache, abs, rel);
+
+		char value[256];
+		ssize_t len = -1;
+		if (label_trusted(cache, abs)) {
+			len = getxattr(abs, cache->xattr, value,
+				       sizeof(value) - 1);
+		}
+		if (len > 0) {
+			value[len] = '\0';
+			char *label = strdup(value);
+			if (!label) {
+				error(1, errno, "Failed to allocate the label cache");
+			}
+			return label;
+		}
+
+		char *slash = strrchr(rel, '/');
+		if (!slash || slash == rel) {
+			if (!strcmp(rel, "/")) {
+				return NULL;
+			}
+			strcpy(rel, "/");
+		} else {
+			*slash = '\0';
+		}
+	}
+}
+
+bool label_lookup(struct label_cache *cache, const char *path, char *label,
+		  size_t len)
+{
+	const char *root = cgroup_root();
+	char abs[PATH_MAX];
+	struct stat st;
+	if (!root || path[0] != '/') {
+		return false;
+	}
+	snprintf(abs, sizeof(abs), "%s%s", root, path);
+	if (stat(abs, &st)) {
+		return false;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	struct label_entry *entry = label_get(cache, st.st_ino);
+	// A cgroup that was moved is looked up again under its new path.
+	if (entry && strcmp(entry->path, path)) {
+		char moved[PATH_MAX];
+		snprintf(moved, sizeof(moved), "%s", entry->path);
+		label_rehash(cache, cache->capacity, keep_outside, moved);
+		entry = NULL;
+	}
+	if (!entry) {
+		struct label_entry fresh = {
+			.id = st.st_ino,
+			.path = strdup(path),
+			.label = label_resolve(cache, root, path),
+		};
+		if (!fresh.path) {
+			error(1, errno, "Failed to allocate the label cache");
+		}
+		if ((cache->count + 1) * 4 >= cache->capacity * 3) {
+			label_rehash(cache,
+				     cache->capacity ? cache->capacity * 2 : 256,
+				     keep_all, NULL);
+		}
+		label_put(cache, fresh);
+		entry = label_get(cache, fresh.id);
+	}
+	bool found = entry->label && strlen(entry->label) < len;
+	if (found) {
+		strcpy(label, entry->label);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return found;
+}
+
+void label_cache_drain(struct label_cache *cache,
+		       void (*fn)(const char *path, void *data), void *data)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(cache->inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *ptr = buf; ptr < buf + len;) {
+			const struct inotify_event *event = (void *)ptr;
+			ptr += sizeof(*event) + event->len;
+
+			// Events were lost, so any label may have changed.
+			if (event->mask & IN_Q_OVERFLOW) {
+				pthread_mutex_lock(&cache->lock);
+				label_rehash(cache, cache->capacity, keep_none,
+					     NULL);
+				pthread_mutex_unlock(&cache->lock);
+				fn("/", data);
+				continue;
+			}
+
+			pthread_mutex_lock(&cache->lock);
+			struct label_watch *watch =
+				label_find_watch(cache, event->wd);
+			if (!watch) {
+				pthread_mutex_unlock(&cache->lock);
+				continue;
+			}
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s", watch->path);
+			if (event->mask & LABEL_EVENTS) {
+				label_rehash(cache, cache->capacity,
+					     keep_outside, path);
+			}
+			if (event->mask & IN_IGNORED) {
+				free(watch->path);
+				size_t index = watch - cache->watches;
+				memmove(watch, watch + 1,
+					(cache->watch_count - index - 1) *
+						sizeof(*watch));
+				cache->watch_count--;
+			}
+			pthread_mutex_unlock(&cache->lock);
+
+			// A removed cgroup has no processes left to move.
+			if (event->mask & IN_ATTRIB) {
+				fn(path, data);
+			}
+		}
+	}
+}
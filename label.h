@@ -0,0 +1,68 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_LABEL_H
+#define CORESCHED_LABEL_H
+
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// The extended attribute that holds the group of a cgroup, unless the
+// configuration names another one. Setting it needs Linux 5.15, which
+// added user extended attributes to cgroup v2.
+#define LABEL_XATTR "user.coresched.group"
+
+// The label of one cgroup, or NULL if neither it nor an ancestor has one.
+struct label_entry {
+	// The cgroup ID, which is the inode number of its directory. 0 marks
+	// an empty slot.
+	unsigned long long id;
+	char *path;
+	char *label;
+};
+
+// A directory that inotify watches, sorted by watch descriptor.
+struct label_watch {
+	int wd;
+	char *path;
+};
+
+// Labels of cgroups, read from an extended attribute of their directory. A
+// cgroup without the attribute has the label of its closest ancestor that
+// has one. A user attribute is ignored on a directory that root does not
+// own or that others can write to. The labels are cached by cgroup ID and
+// dropped again when inotify reports that the attribute of a cgroup or of
+// one of its ancestors changed, or that the cgroup was removed or moved.
+// Paths are relative to cgroup_root() and start with '/'.
+struct label_cache {
+	pthread_mutex_t lock;
+	int inotify_fd;
+	char xattr[XATTR_NAME_MAX + 1];
+	struct label_entry *slots;
+	size_t capacity;
+	size_t count;
+	struct label_watch *watches;
+	size_t watch_count;
+	size_t watch_capacity;
+};
+
+int label_cache_init(struct label_cache *cache, const char *xattr);
+void label_cache_free(struct label_cache *cache);
+
+// Read another attribute from now on, which drops every cached label.
+void label_cache_reset(struct label_cache *cache, const char *xattr);
+
+// Copy the label of the cgroup at path into label. Returns false if the
+// cgroup has no label or it does not fit.
+bool label_lookup(struct label_cache *cache, const char *path, char *label,
+		  size_t len);
+
+// Handle the pending inotify events, and call fn with the path of every
+// cgroup whose label may have changed. The processes below it may have to
+// move to another group.
+void label_cache_drain(struct label_cache *cache,
+		       void (*fn)(const char *path, void *data), void *data);
+
+#endif
@@ -0,0 +1,105 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "pidmap.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdlib.h>
+
+#define PIDMAP_EMPTY 0
+#define PIDMAP_TOMBSTONE -1
+
+static size_t pidmap_hash(pid_t pid, size_t capacity)
+{
+	return ((unsigned int)pid * 2654435761u) & (capacity - 1);
+}
+
+struct pidmap_entry *pidmap_get(const struct pidmap *map, pid_t pid)
+{
+	if (!map->capacity) {
+		return NULL;
+	}
+	for (size_t i = pidmap_hash(pid, map->capacity);;
+	     i = (i + 1) & (map->capacity - 1)) {
+		struct pidmap_entry *entry = &map->slots[i];
+		if (entry->pid == pid) {
+			return entry;
+		}
+		if (entry->pid == PIDMAP_EMPTY) {
+			return NULL;
+		}
+	}
+}
+
+static void pidmap_grow(struct pidmap *map)
+{
+	struct pidmap old = *map;
+	// Only grow when live entries fill the table, otherwise rehashing at
+	// the same size is enough to get rid of the tombstones.
+	map->capacity = old.capacity ? old.capacity : 1024;
+	if (old.count * 2 >= old.capacity) {
+		map->capacity *= 2;
+	}
+	map->slots = calloc(map->capacity, sizeof(*map->slots));
+	if (!map->slots) {
+		error(1, errno, "Failed to allocate pid table");
+	}
+	map->count = 0;
+	map->used = 0;
+
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (old.slots[i].pid > 0) {
+			*pidmap_insert(map, old.slots[i].pid) = old.slots[i];
+		}
+	}
+	free(old.slots);
+}
+
+struct pidmap_entry *pidmap_insert(struct pidmap *map, pid_t pid)
+{
+	struct pidmap_entry *entry = pidmap_get(map, pid);
+	if (entry) {
+		return entry;
+	}
+	if ((map->used + 1) * 4 >= map->capacity * 3) {
+		pidmap_grow(map);
+	}
+
+	struct pidmap_entry *tombstone = NULL;
+	size_t i = pidmap_hash(pid, map->capacity);
+	while (map->slots[i].pid != PIDMAP_EMPTY) {
+		if (!tombstone && map->slots[i].pid == PIDMAP_TOMBSTONE) {
+			tombstone = &map->slots[i];
+		}
+		i = (i + 1) & (map->capacity - 1);
+	}
+	if (tombstone) {
+		entry = tombstone;
+	} else {
+		entry = &map->slots[i];
+		map->used++;
+	}
+	map->count++;
+	*entry = (struct pidmap_entry){ .pid = pid, .group = -1 };
+	return entry;
+}
+
+void pidmap_remove(struct pidmap *map, struct pidmap_entry *entry)
+{
+	free(entry->origin);
+	entry->origin = NULL;
+	entry->pid = PIDMAP_TOMBSTONE;
+	map->count--;
+}
+
+void pidmap_free(struct pidmap *map)
+{
+	for (size_t i = 0; i < map->capacity; i++) {
+		if (map->slots[i].pid > 0) {
+			free(map->slots[i].origin);
+		}
+	}
+	free(map->slots);
+	*map = (struct pidmap){ 0 };
+}
@@ -0,0 +1,48 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_PIDMAP_H
+#define CORESCHED_PIDMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// What the daemon remembers about a process it has classified.
+struct pidmap_entry {
+	pid_t pid;
+	int group;
+	// Scan generation in which the process was last seen.
+	unsigned int mark;
+	// Assigned through the control socket, which the rules do not
+	// override.
+	bool requested;
+	// The cgroup the process was in before the daemon moved it into an
+	// accounting cgroup, relative to the cgroup root, or NULL. Owned by
+	// the entry.
+	char *origin;
+};
+
+// Open addressing hash table keyed by pid. Entry pointers are invalidated by
+// pidmap_insert.
+struct pidmap {
+	struct pidmap_entry *slots;
+	size_t capacity;
+	size_t count;
+	size_t used;
+};
+
+#define pidmap_for_each(map, entry)                                         \
+	for (entry = (map)->slots; entry < (map)->slots + (map)->capacity; \
+	     entry++)                                                      \
+		if (entry->pid > 0)
+
+struct pidmap_entry *pidmap_get(const struct pidmap *map, pid_t pid);
+
+// Return the entry of pid, creating an entry without a group if needed.
+struct pidmap_entry *pidmap_insert(struct pidmap *map, pid_t pid);
+
+void pidmap_remove(struct pidmap *map, struct pidmap_entry *entry);
+void pidmap_free(struct pidmap *map);
+
+#endif
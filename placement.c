@@ -0,0 +1,86 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "placement.h"
+
+#include <string.h>
+
+void placement_init(struct placement *pl)
+{
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		pl->owner[i] = -1;
+	}
+}
+
+void placement_update_cpus(const struct topology *topo,
+			   struct placement_group *group)
+{
+	CPU_ZERO(&group->cpus);
+	for (unsigned int i = 0; i < group->core_count; i++) {
+		const struct topology_core *core =
+			topology_find_core(topo, group->cores[i]);
+		if (core) {
+			CPU_OR(&group->cpus, &group->cpus, &core->cpus);
+		}
+	}
+}
+
+unsigned int placement_fill(struct placement *pl, const struct topology *topo,
+			    struct placement_group *group, int index)
+{
+	// First pass only takes complete cores, the second pass takes
+	// whatever is left.
+	for (int pass = 0; pass < 2; pass++) {
+		for (size_t i = 0; i < topo->core_count &&
+				   group->core_count < group->wanted;
+		     i++) {
+			const struct topology_core *core = &topo->cores[i];
+			if (pl->owner[core->id] != -1 ||
+			    (!pass &&
+			     CPU_COUNT(&core->cpus) < topo->threads_per_core)) {
+				continue;
+			}
+			pl->owner[core->id] = index;
+			group->cores[group->core_count++] = core->id;
+		}
+	}
+	placement_update_cpus(topo, group);
+	return group->wanted - group->core_count;
+}
+
+void placement_release(struct placement *pl, const struct topology *topo,
+		       struct placement_group *group, int core_id)
+{
+	for (unsigned int i = 0; i < group->core_count; i++) {
+		if (group->cores[i] != core_id) {
+			continue;
+		}
+		pl->owner[core_id] = -1;
+		group->cores[i] = group->cores[--group->core_count];
+		break;
+	}
+	placement_update_cpus(topo, group);
+}
+
+bool placement_revalidate(struct placement *pl, const struct topology *old,
+			  const struct topology *topo,
+			  struct placement_group *group)
+{
+	bool changed = false;
+	for (unsigned int i = 0; i < group->core_count;) {
+		int id = group->cores[i];
+		const struct topology_core *before =
+			topology_find_core(old, id);
+		const struct topology_core *after =
+			topology_find_core(topo, id);
+		if (before && after && CPU_EQUAL(&before->cpus, &after->cpus)) {
+			i++;
+			continue;
+		}
+		pl->owner[id] = -1;
+		group->cores[i] = group->cores[--group->core_count];
+		changed = true;
+	}
+	placement_update_cpus(topo, group);
+	return changed;
+}
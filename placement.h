@@ -0,0 +1,49 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_PLACEMENT_H
+#define CORESCHED_PLACEMENT_H
+
+#include "topology.h"
+
+#include <sched.h>
+#include <stdbool.h>
+
+// Groups that are pinned own whole SMT cores, so that all siblings of a
+// core only ever run tasks that share the group's cookie.
+struct placement_group {
+	unsigned int wanted;
+	// Ids of the owned cores, see struct topology_core.
+	int cores[CPU_SETSIZE];
+	unsigned int core_count;
+	// Union of the siblings of all owned cores.
+	cpu_set_t cpus;
+};
+
+struct placement {
+	// Group index that owns the core with this id, or -1.
+	int owner[CPU_SETSIZE];
+};
+
+void placement_init(struct placement *pl);
+
+// Give the group free cores until it owns as many as it wants. Cores with
+// all their siblings online are preferred. Returns the number of cores that
+// could not be found.
+unsigned int placement_fill(struct placement *pl, const struct topology *topo,
+			    struct placement_group *group, int index);
+
+// Hand a core back. The group's cpus are updated from topo.
+void placement_release(struct placement *pl, const struct topology *topo,
+		       struct placement_group *group, int core_id);
+
+// Drop the cores of the group that disappeared or whose siblings changed in
+// topo. Returns whether the group lost any core.
+bool placement_revalidate(struct placement *pl, const struct topology *old,
+			  const struct topology *topo,
+			  struct placement_group *group);
+
+void placement_update_cpus(const struct topology *topo,
+			   struct placement_group *group);
+
+#endif
@@ -0,0 +1,370 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "plan.h"
+#include "coresched.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct plan_edge {
+	size_t a;
+	size_t b;
+};
+
+// Name lookup while parsing, as share lines can name thousands of groups.
+struct name_index {
+	size_t *slots;
+	size_t capacity;
+};
+
+static size_t hash_name(const char *name)
+{
+	size_t hash = 14695981039346656037ULL;
+	for (; *name; name++) {
+		hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+// Slots hold the index of a group plus one, 0 for an empty slot.
+static size_t *index_slot(const struct name_index *index,
+			  const struct plan *plan, const char *name)
+{
+	size_t mask = index->capacity - 1;
+	for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+		size_t *slot = &index->slots[i];
+		if (!*slot || !strcmp(plan->groups[*slot - 1].name, name)) {
+			return slot;
+		}
+	}
+}
+
+static void index_grow(struct name_index *index, const struct plan *plan)
+{
+	size_t capacity = index->capacity ? index->capacity * 2 : 64;
+	struct name_index grown = { calloc(capacity, sizeof(size_t)),
+				    capacity };
+	if (!grown.slots) {
+		error(1, errno, "Failed to allocate the group index");
+	}
+	for (size_t i = 0; i < plan->group_count; i++) {
+		*index_slot(&grown, plan, plan->groups[i].name) = i + 1;
+	}
+	free(index->slots);
+	*index = grown;
+}
+
+static bool parse_pid_value(const char *str, pid_t *pid)
+{
+	char *end = NULL;
+	errno = 0;
+	long value = strtol(str, &end, 10);
+	*pid = value;
+	return !errno && end != str && *end == '\0' && value > 0;
+}
+
+static int parse_group(struct plan *plan, struct name_index *index,
+		       const char *path, unsigned int line, char *saveptr)
+{
+	char *name = strtok_r(NULL, " \t", &saveptr);
+	if (!name) {
+		error_at_line(0, 0, path, line, "group requires a name");
+		return -1;
+	}
+	if (index->capacity && *index_slot(index, plan, name)) {
+		error_at_line(0, 0, path, line, "group %s is already defined",
+			      name);
+		return -1;
+	}
+
+	struct plan_group group = { .load = 1 };
+	char *option;
+	while ((option = strtok_r(NULL, " \t", &saveptr))) {
+		char *end = NULL;
+		pid_t pid;
+		if (!strncmp(option, "load=", 5)) {
+			group.load = strtod(option + 5, &end);
+			if (end == option + 5 || *end || group.load < 0) {
+				error_at_line(0, 0, path, line,
+					      "invalid load '%s'", option + 5);
+				free(group.pids);
+				return -1;
+			}
+		} else if (parse_pid_value(option, &pid)) {
+			pid_t *pids = realloc(group.pids, (group.pid_count + 1) *
+								  sizeof(*pids));
+			if (!pids) {
+				error(1, errno, "Failed to allocate group %s",
+				      name);
+			}
+			pids[group.pid_count++] = pid;
+			group.pids = pids;
+		} else {
+			error_at_line(0, 0, path, line,
+				      "invalid group option '%s'", option);
+			free(group.pids);
+			return -1;
+		}
+	}
+
+	struct plan_group *groups = realloc(
+		plan->groups, (plan->group_count + 1) * sizeof(*groups));
+	if (!groups || !(group.name = strdup(name))) {
+		error(1, errno, "Failed to allocate group %s", name);
+	}
+	groups[plan->group_count++] = group;
+	plan->groups = groups;
+	// Keep the index at most half full.
+	if (plan->group_count * 2 > index->capacity) {
+		index_grow(index, plan);
+	} else {
+		*index_slot(index, plan, name) = plan->group_count;
+	}
+	return 0;
+}
+
+static int parse_share(struct plan *plan, struct name_index *index,
+		       struct plan_edge **edges, size_t *edge_count,
+		       const char *path, unsigned int line, char *saveptr)
+{
+	size_t *members = NULL;
+	size_t count = 0;
+	char *name;
+	while ((name = strtok_r(NULL, " \t", &saveptr))) {
+		size_t slot = index->capacity ? *index_slot(index, plan, name) :
+						0;
+		if (!slot) {
+			error_at_line(0, 0, path, line,
+				      "group %s is not defined", name);
+			free(members);
+			return -1;
+		}
+		size_t *grown = realloc(members, (count + 1) * sizeof(*grown));
+		if (!grown) {
+			error(1, errno, "Failed to allocate share line");
+		}
+		members = grown;
+		members[count++] = slot - 1;
+	}
+	if (count < 2) {
+		error_at_line(0, 0, path, line,
+			      "share requires at least two groups");
+		free(members);
+		return -1;
+	}
+
+	size_t added = count * (count - 1) / 2;
+	struct plan_edge *grown =
+		realloc(*edges, (*edge_count + added) * sizeof(*grown));
+	if (!grown) {
+		error(1, errno, "Failed to allocate share line");
+	}
+	*edges = grown;
+	for (size_t i = 0; i < count; i++) {
+		for (size_t j = i + 1; j < count; j++) {
+			grown[(*edge_count)++] =
+				(struct plan_edge){ members[i], members[j] };
+		}
+	}
+	free(members);
+	return 0;
+}
+
+static bool may_share(const struct plan *plan, size_t a, size_t b)
+{
+	return plan->may_share[a * plan->words + b / 64] >> (b % 64) & 1;
+}
+
+static void set_may_share(struct plan *plan, size_t a, size_t b)
+{
+	if (a == b || may_share(plan, a, b)) {
+		return;
+	}
+	plan->may_share[a * plan->words + b / 64] |= 1ULL << (b % 64);
+	plan->may_share[b * plan->words + a / 64] |= 1ULL << (a % 64);
+	plan->groups[a].degree++;
+	plan->groups[b].degree++;
+}
+
+int plan_load(const char *path, struct plan *plan)
+{
+	memset(plan, 0, sizeof(*plan));
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		error(0, errno, "Failed to open %s", path);
+		return -1;
+	}
+
+	struct name_index index = { 0 };
+	struct plan_edge *edges = NULL;
+	size_t edge_count = 0;
+	char *buf = NULL;
+	size_t size = 0;
+	unsigned int line = 0;
+	int ret = 0;
+	while (!ret && getline(&buf, &size, file) != -1) {
+		line++;
+		buf[strcspn(buf, "#\n")] = '\0';
+
+		char *saveptr = NULL;
+		char *keyword = strtok_r(buf, " \t", &saveptr);
+		if (!keyword) {
+			continue;
+		}
+		if (!strcmp(keyword, "group")) {
+			ret = parse_group(plan, &index, path, line, saveptr);
+		} else if (!strcmp(keyword, "share")) {
+			ret = parse_share(plan, &index, &edges, &edge_count,
+					  path, line, saveptr);
+		} else {
+			error_at_line(0, 0, path, line, "unknown keyword '%s'",
+				      keyword);
+			ret = -1;
+		}
+	}
+	free(buf);
+	free(index.slots);
+	fclose(file);
+
+	if (!ret) {
+		plan->words = (plan->group_count + 63) / 64;
+		plan->may_share = calloc(plan->group_count * plan->words,
+					 sizeof(*plan->may_share));
+		if (!plan->may_share && plan->group_count) {
+			error(1, errno, "Failed to allocate the share graph");
+		}
+		for (size_t i = 0; i < edge_count; i++) {
+			set_may_share(plan, edges[i].a, edges[i].b);
+		}
+	}
+	free(edges);
+	if (ret) {
+		plan_free(plan);
+	}
+	return ret;
+}
+
+void plan_free(struct plan *plan)
+{
+	for (size_t i = 0; i < plan->group_count; i++) {
+		free(plan->groups[i].name);
+		free(plan->groups[i].pids);
+	}
+	free(plan->groups);
+	free(plan->may_share);
+	free(plan->cookie_load);
+	memset(plan, 0, sizeof(*plan));
+}
+
+static const struct plan *sort_plan;
+
+static int compare_degree(const void *a, const void *b)
+{
+	const struct plan_group *x = &sort_plan->groups[*(const size_t *)a];
+	const struct plan_group *y = &sort_plan->groups[*(const size_t *)b];
+	if (x->degree != y->degree) {
+		return x->degree < y->degree ? -1 : 1;
+	}
+	return (*(const size_t *)a > *(const size_t *)b) -
+	       (*(const size_t *)a < *(const size_t *)b);
+}
+
+// Greedy clique cover. The groups with the fewest partners go first, as
+// they have the fewest cookies to choose from. Every cookie keeps the
+// intersection of what its groups may share with, so checking whether a
+// group may join it is a single bit test.
+void plan_solve(struct plan *plan, double max_load)
+{
+	size_t n = plan->group_count;
+	size_t *order = calloc(n ? n : 1, sizeof(*order));
+	size_t words = n ? n * plan->words : 1;
+	uint64_t *common = calloc(words, sizeof(*common));
+	free(plan->cookie_load);
+	plan->cookie_load = calloc(n ? n : 1, sizeof(*plan->cookie_load));
+	if (!order || !common || !plan->cookie_load) {
+		error(1, errno, "Failed to allocate the plan");
+	}
+	for (size_t i = 0; i < n; i++) {
+		order[i] = i;
+	}
+	sort_plan = plan;
+	qsort(order, n, sizeof(*order), compare_degree);
+
+	plan->cookie_count = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t g = order[i];
+		struct plan_group *group = &plan->groups[g];
+		size_t best = plan->cookie_count;
+		for (size_t c = 0; c < plan->cookie_count; c++) {
+			if (!(common[c * plan->words + g / 64] >> (g % 64) & 1)) {
+				continue;
+			}
+			if (max_load <= 0) {
+				best = c;
+				break;
+			}
+			if (plan->cookie_load[c] + group->load <= max_load &&
+			    (best == plan->cookie_count ||
+			     plan->cookie_load[c] < plan->cookie_load[best])) {
+				best = c;
+			}
+		}
+
+		uint64_t *cookie = &common[best * plan->words];
+		const uint64_t *partners = &plan->may_share[g * plan->words];
+		if (best == plan->cookie_count) {
+			plan->cookie_count++;
+			memcpy(cookie, partners, plan->words * sizeof(*cookie));
+		} else {
+			for (size_t w = 0; w < plan->words; w++) {
+				cookie[w] &= partners[w];
+			}
+		}
+		group->cookie = best;
+		plan->cookie_load[best] += group->load;
+	}
+	free(order);
+	free(common);
+}
+
+size_t plan_apply(const struct plan *plan)
+{
+	size_t failed = 0;
+	for (size_t c = 0; c < plan->cookie_count; c++) {
+		// The first process gets a new cookie, which is then pulled
+		// into this thread and pushed to the others.
+		pid_t first = 0;
+		for (size_t i = 0; i < plan->group_count; i++) {
+			const struct plan_group *group = &plan->groups[i];
+			for (size_t p = 0;
+			     group->cookie == c && p < group->pid_count; p++) {
+				pid_t pid = group->pids[p];
+				int err = 0;
+				if (!first) {
+					if (core_sched_create(
+						    pid, SCHED_CORE_SCOPE_TGID) ||
+					    core_sched_share_from(pid)) {
+						err = errno;
+					} else {
+						first = pid;
+					}
+				} else if (core_sched_share_to(
+						   pid, SCHED_CORE_SCOPE_TGID)) {
+					err = errno;
+				}
+				if (err) {
+					error(0, err,
+					      "Failed to give PID %d of group %s cookie %zu",
+					      pid, group->name, c);
+					failed++;
+				}
+			}
+		}
+	}
+	return failed;
+}
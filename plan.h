@@ -0,0 +1,59 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_PLAN_H
+#define CORESCHED_PLAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Groups that may share a cookie do not force each other idle, so the
+// fewer cookies a host needs, the less SMT capacity it loses. A plan is
+// read from a line based file. Empty lines and lines starting with '#' are
+// ignored, and groups have to be declared before they are used:
+//
+//	group NAME [load=LOAD] [PID]...
+//	share NAME NAME...
+//
+// A share line declares that every pair of the groups on it may share a
+// cookie. The solver then covers the groups with as few cookies as it can
+// find, every cookie being a set of groups that may pairwise share.
+
+struct plan_group {
+	char *name;
+	double load;
+	pid_t *pids;
+	size_t pid_count;
+	// Number of groups this one may share with.
+	size_t degree;
+	// Index of the cookie the solver assigned.
+	size_t cookie;
+};
+
+struct plan {
+	struct plan_group *groups;
+	size_t group_count;
+	// Bitset per group of the groups it may share with.
+	uint64_t *may_share;
+	size_t words;
+	size_t cookie_count;
+	double *cookie_load;
+};
+
+// Parse the plan at path. Errors are reported with their line number and
+// cause -1 to be returned.
+int plan_load(const char *path, struct plan *plan);
+void plan_free(struct plan *plan);
+
+// Assign a cookie to every group. When max_load is positive, a group joins
+// the least loaded cookie it may join whose load stays within max_load,
+// instead of the first one.
+void plan_solve(struct plan *plan, double max_load);
+
+// Create a cookie for the first process of every cookie and push it to the
+// other processes of its groups. Returns the number of processes that
+// could not be given their cookie.
+size_t plan_apply(const struct plan *plan);
+
+#endif
@@ -0,0 +1,475 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "pool.h"
+#include "coresched.h"
+#include "proc.h"
+#include "queue.h"
+#include "topology.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Tasks a worker can hold on its own deque, and tasks that can wait to be
+// picked up from outside the pool.
+#define POOL_DEQUE_SIZE 4096
+#define POOL_INJECT_SIZE 65536
+// Rounds of looking for work before a worker goes to sleep.
+#define POOL_SPINS 64
+
+struct pool_slot {
+	_Atomic(pool_task_fn) fn;
+	_Atomic(void *) arg;
+};
+
+// A Chase-Lev deque. The owner pushes and takes at the bottom, other
+// workers steal from the top, and only a take of the last task races with
+// the thieves.
+struct pool_deque {
+	_Alignas(QUEUE_CACHE_LINE) atomic_long top;
+	_Alignas(QUEUE_CACHE_LINE) atomic_long bottom;
+	struct pool_slot slots[POOL_DEQUE_SIZE];
+};
+
+struct pool_worker {
+	struct pool *pool;
+	pthread_t thread;
+	pid_t tid;
+	int cpu;
+	// The workers on the siblings of this one, including itself.
+	size_t core_first;
+	size_t core_count;
+	unsigned int seed;
+	struct pool_deque deque;
+};
+
+// A thread that was moved off the pool's cores, with the affinity it had
+// before and the one it was given.
+struct pool_moved {
+	pid_t tid;
+	cpu_set_t before;
+	cpu_set_t after;
+};
+
+struct pool {
+	struct pool_worker *workers;
+	size_t worker_count;
+	struct mpmc_queue inject;
+	// Tasks that were submitted and did not finish yet.
+	atomic_size_t pending;
+	pthread_mutex_t done_lock;
+	pthread_cond_t done;
+	// Workers that are asleep or about to be.
+	atomic_int idle;
+	sem_t wake;
+	atomic_bool stopping;
+	sem_t started;
+	int start_error;
+	unsigned long cookie;
+	bool cookies;
+	bool reserved;
+	struct pool_moved *moved;
+	size_t moved_count;
+	cpu_set_t cpus;
+};
+
+static _Thread_local struct pool_worker *current_worker;
+
+static bool deque_push(struct pool_deque *d, pool_task_fn fn, void *arg)
+{
+	long bottom = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	long top = atomic_load_explicit(&d->top, memory_order_acquire);
+	if (bottom - top >= POOL_DEQUE_SIZE) {
+		return false;
+	}
+	struct pool_slot *slot = &d->slots[bottom & (POOL_DEQUE_SIZE - 1)];
+	atomic_store_explicit(&slot->fn, fn, memory_order_relaxed);
+	atomic_store_explicit(&slot->arg, arg, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, bottom + 1, memory_order_relaxed);
+	return true;
+}
+
+static bool deque_take(struct pool_deque *d, pool_task_fn *fn, void **arg)
+{
+	long bottom =
+		atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, bottom, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long top = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (top > bottom) {
+		atomic_store_explicit(&d->bottom, bottom + 1,
+				      memory_order_relaxed);
+		return false;
+	}
+
+	struct pool_slot *slot = &d->slots[bottom & (POOL_DEQUE_SIZE - 1)];
+	*fn = atomic_load_explicit(&slot->fn, memory_order_relaxed);
+	*arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+	if (top == bottom) {
+		// The last task, which a thief may be taking as well.
+		bool won = atomic_compare_exchange_strong_explicit(
+			&d->top, &top, top + 1, memory_order_seq_cst,
+			memory_order_relaxed);
+		atomic_store_explicit(&d->bottom, bottom + 1,
+				      memory_order_relaxed);
+		return won;
+	}
+	return true;
+}
+
+static bool deque_steal(struct pool_deque *d, pool_task_fn *fn, void **arg)
+{
+	long top = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long bottom = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (top >= bottom) {
+		return false;
+	}
+	struct pool_slot *slot = &d->slots[top & (POOL_DEQUE_SIZE - 1)];
+	*fn = atomic_load_explicit(&slot->fn, memory_order_relaxed);
+	*arg = atomic_load_explicit(&slot->arg, memory_order_relaxed);
+	return atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+						       memory_order_seq_cst,
+						       memory_order_relaxed);
+}
+
+struct pool_job {
+	pool_task_fn fn;
+	void *arg;
+};
+
+static bool find_job(struct pool_worker *w, struct pool_job *job)
+{
+	struct pool *pool = w->pool;
+	if (deque_take(&w->deque, &job->fn, &job->arg)) {
+		return true;
+	}
+	// Siblings first, as their tasks likely share data that is already
+	// in the caches of the core.
+	for (size_t i = 0; i < w->core_count; i++) {
+		struct pool_worker *victim = &pool->workers[w->core_first + i];
+		if (victim != w &&
+		    deque_steal(&victim->deque, &job->fn, &job->arg)) {
+			return true;
+		}
+	}
+	w->seed = w->seed * 1103515245 + 12345;
+	size_t start = (w->seed >> 16) % pool->worker_count;
+	for (size_t i = 0; i < pool->worker_count; i++) {
+		struct pool_worker *victim =
+			&pool->workers[(start + i) % pool->worker_count];
+		if (victim != w &&
+		    deque_steal(&victim->deque, &job->fn, &job->arg)) {
+			return true;
+		}
+	}
+	return mpmc_pop(&pool->inject, job);
+}
+
+static void wake_worker(struct pool *pool)
+{
+	// Pairs with the fence in worker_main: either the worker sees the
+	// new task, or this sees that it went to sleep.
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&pool->idle, memory_order_relaxed) > 0) {
+		sem_post(&pool->wake);
+	}
+}
+
+static void run_job(struct pool *pool, const struct pool_job *job)
+{
+	job->fn(job->arg);
+	if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+		pthread_mutex_lock(&pool->done_lock);
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->done_lock);
+	}
+}
+
+static int worker_start(struct pool_worker *w)
+{
+	struct pool *pool = w->pool;
+	cpu_set_t cpu;
+	CPU_ZERO(&cpu);
+	CPU_SET(w->cpu, &cpu);
+	if (sched_setaffinity(0, sizeof(cpu), &cpu)) {
+		return errno;
+	}
+	if (!pool->cookies) {
+		return 0;
+	}
+	// The first worker creates the cookie and the others join it.
+	if (w == pool->workers) {
+		if (core_sched_create(0, SCHED_CORE_SCOPE_PID) ||
+		    core_sched_get(0, &pool->cookie)) {
+			return errno;
+		}
+	} else if (core_sched_share_from(pool->workers[0].tid)) {
+		return errno;
+	}
+	return 0;
+}
+
+static void *worker_main(void *data)
+{
+	struct pool_worker *w = data;
+	struct pool *pool = w->pool;
+	current_worker = w;
+	w->tid = gettid();
+	pool->start_error = worker_start(w);
+	sem_post(&pool->started);
+	if (pool->start_error) {
+		return NULL;
+	}
+
+	struct pool_job job;
+	for (;;) {
+		bool found = false;
+		for (int spin = 0; spin < POOL_SPINS && !found; spin++) {
+			found = find_job(w, &job);
+		}
+		if (found) {
+			run_job(pool, &job);
+			continue;
+		}
+
+		atomic_fetch_add(&pool->idle, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (find_job(w, &job)) {
+			atomic_fetch_sub(&pool->idle, 1);
+			run_job(pool, &job);
+			continue;
+		}
+		if (atomic_load(&pool->stopping)) {
+			break;
+		}
+		while (sem_wait(&pool->wake) && errno == EINTR) {
+		}
+		atomic_fetch_sub(&pool->idle, 1);
+	}
+	return NULL;
+}
+
+static int reserve_thread(pid_t tid, void *data)
+{
+	struct pool *pool = data;
+	for (size_t i = 0; i < pool->worker_count; i++) {
+		if (pool->workers[i].tid == tid) {
+			return 0;
+		}
+	}
+	struct pool_moved moved = { .tid = tid };
+	if (sched_getaffinity(tid, sizeof(moved.before), &moved.before)) {
+		return 0;
+	}
+	CPU_XOR(&moved.after, &moved.before, &pool->cpus);
+	CPU_AND(&moved.after, &moved.after, &moved.before);
+	// A thread that may only run on the pool's cores keeps them, and one
+	// that never ran on them is left alone.
+	if (!CPU_COUNT(&moved.after) ||
+	    CPU_EQUAL(&moved.after, &moved.before) ||
+	    sched_setaffinity(tid, sizeof(moved.after), &moved.after)) {
+		return 0;
+	}
+	struct pool_moved *list = realloc(
+		pool->moved, (pool->moved_count + 1) * sizeof(*pool->moved));
+	if (!list) {
+		sched_setaffinity(tid, sizeof(moved.before), &moved.before);
+		return 0;
+	}
+	list[pool->moved_count++] = moved;
+	pool->moved = list;
+	return 0;
+}
+
+static void reserve_cores(struct pool *pool)
+{
+	proc_for_each_task(getpid(), reserve_thread, pool);
+}
+
+// Give the threads that were moved their affinity back, unless they changed
+// it themselves meanwhile.
+static void release_cores(struct pool *pool)
+{
+	for (size_t i = 0; i < pool->moved_count; i++) {
+		struct pool_moved *moved = &pool->moved[i];
+		cpu_set_t cpus;
+		if (!sched_getaffinity(moved->tid, sizeof(cpus), &cpus) &&
+		    CPU_EQUAL(&cpus, &moved->after)) {
+			sched_setaffinity(moved->tid, sizeof(moved->before),
+					  &moved->before);
+		}
+	}
+	free(pool->moved);
+	pool->moved = NULL;
+	pool->moved_count = 0;
+}
+
+// Lay the workers out by core, so that the workers of one core are next to
+// each other.
+static int plan_workers(struct pool *pool, const char *cpulist)
+{
+	struct topology topo;
+	cpu_set_t wanted;
+	if (topology_read(&topo)) {
+		return -1;
+	}
+	wanted = topo.online;
+	if (cpulist && cpulist_parse(cpulist, &wanted)) {
+		topology_free(&topo);
+		errno = EINVAL;
+		return -1;
+	}
+
+	CPU_ZERO(&pool->cpus);
+	pool->workers = calloc(CPU_COUNT(&topo.online), sizeof(*pool->workers));
+	if (!pool->workers) {
+		topology_free(&topo);
+		return -1;
+	}
+	for (size_t core = 0; core < topo.core_count; core++) {
+		cpu_set_t both;
+		CPU_AND(&both, &topo.cores[core].cpus, &wanted);
+		if (!CPU_COUNT(&both)) {
+			continue;
+		}
+		size_t first = pool->worker_count;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &topo.cores[core].cpus)) {
+				continue;
+			}
+			CPU_SET(cpu, &pool->cpus);
+			struct pool_worker *w =
+				&pool->workers[pool->worker_count++];
+			w->pool = pool;
+			w->cpu = cpu;
+			w->core_first = first;
+			w->seed = cpu + 1;
+		}
+		for (size_t i = first; i < pool->worker_count; i++) {
+			pool->workers[i].core_count = pool->worker_count - first;
+		}
+	}
+	topology_free(&topo);
+	if (!pool->worker_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static void stop_workers(struct pool *pool, size_t started)
+{
+	atomic_store(&pool->stopping, true);
+	for (size_t i = 0; i < started; i++) {
+		sem_post(&pool->wake);
+	}
+	for (size_t i = 0; i < started; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+}
+
+static void pool_free(struct pool *pool)
+{
+	mpmc_free(&pool->inject);
+	sem_destroy(&pool->wake);
+	sem_destroy(&pool->started);
+	pthread_mutex_destroy(&pool->done_lock);
+	pthread_cond_destroy(&pool->done);
+	free(pool->workers);
+	free(pool);
+}
+
+struct pool *pool_create(const struct pool_options *opts)
+{
+	struct pool *pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		return NULL;
+	}
+	pool->cookies = !opts->no_cookie;
+	if (mpmc_init(&pool->inject, POOL_INJECT_SIZE,
+		      sizeof(struct pool_job))) {
+		free(pool);
+		return NULL;
+	}
+	sem_init(&pool->wake, 0, 0);
+	sem_init(&pool->started, 0, 0);
+	pthread_mutex_init(&pool->done_lock, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	if (plan_workers(pool, opts->cpus)) {
+		int saved = errno;
+		pool_free(pool);
+		errno = saved;
+		return NULL;
+	}
+
+	// One at a time, as the later workers join the cookie of the first.
+	for (size_t i = 0; i < pool->worker_count; i++) {
+		struct pool_worker *w = &pool->workers[i];
+		int err = pthread_create(&w->thread, NULL, worker_main, w);
+		if (!err) {
+			sem_wait(&pool->started);
+			err = pool->start_error;
+			i += !!err;
+		}
+		if (err) {
+			stop_workers(pool, i);
+			pool_free(pool);
+			errno = err;
+			return NULL;
+		}
+	}
+
+	if (opts->reserve) {
+		pool->reserved = true;
+		reserve_cores(pool);
+	}
+	return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+	pool_wait(pool);
+	stop_workers(pool, pool->worker_count);
+	if (pool->reserved) {
+		release_cores(pool);
+	}
+	pool_free(pool);
+}
+
+void pool_submit(struct pool *pool, pool_task_fn fn, void *arg)
+{
+	atomic_fetch_add(&pool->pending, 1);
+	struct pool_worker *w = current_worker;
+	if (!w || w->pool != pool || !deque_push(&w->deque, fn, arg)) {
+		struct pool_job job = { fn, arg };
+		mpmc_push_wait(&pool->inject, &job);
+	}
+	wake_worker(pool);
+}
+
+void pool_wait(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->done_lock);
+	while (atomic_load(&pool->pending)) {
+		pthread_cond_wait(&pool->done, &pool->done_lock);
+	}
+	pthread_mutex_unlock(&pool->done_lock);
+}
+
+size_t pool_worker_count(const struct pool *pool)
+{
+	return pool->worker_count;
+}
+
+unsigned long pool_cookie(const struct pool *pool)
+{
+	return pool->cookie;
+}
@@ -0,0 +1,60 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_POOL_H
+#define CORESCHED_POOL_H
+
+// A pool of worker threads for applications, part of libcoresched.a. It
+// starts one worker per SMT sibling of a set of cores, and gives all of them
+// a cookie of their own, so that the siblings of those cores only run work
+// of the pool at the same time. Work is spread with work-stealing deques:
+// tasks submitted by a worker stay on its own deque, idle workers steal
+// from their siblings first and from the other cores after that.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct pool;
+
+typedef void (*pool_task_fn)(void *arg);
+
+struct pool_options {
+	// The cores to run on, as a cpulist of any of their CPUs. Every
+	// online core when NULL.
+	const char *cpus;
+	// Keep the other threads of the process off the cores of the pool
+	// while it exists.
+	bool reserve;
+	// Run without a cookie, to compare against.
+	bool no_cookie;
+};
+
+// Returns NULL with errno set on failure. Core scheduling not being
+// available is a failure unless no_cookie is set.
+struct pool *pool_create(const struct pool_options *opts);
+
+// Wait for all tasks and stop the workers.
+void pool_destroy(struct pool *pool);
+
+// Queue fn(arg) to run on a worker. Can be called from any thread,
+// including from within a task.
+void pool_submit(struct pool *pool, pool_task_fn fn, void *arg);
+
+// Wait until every task submitted so far, and every task those submitted,
+// has finished.
+void pool_wait(struct pool *pool);
+
+size_t pool_worker_count(const struct pool *pool);
+
+// The cookie shared by the workers, 0 without one.
+unsigned long pool_cookie(const struct pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,250 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "proc.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int for_each_numeric_dir(const char *path, proc_task_fn fn, void *data)
+{
+	DIR *dir = opendir(path);
+	if (!dir) {
+		return -1;
+	}
+
+	int ret = 0;
+	struct dirent *entry;
+	while (!ret && (entry = readdir(dir))) {
+		char *end = NULL;
+		long pid = strtol(entry->d_name, &end, 10);
+		if (*end != '\0' || end == entry->d_name || pid <= 0) {
+			continue;
+		}
+		ret = fn(pid, data);
+	}
+	closedir(dir);
+	return ret;
+}
+
+int proc_for_each_pid(proc_task_fn fn, void *data)
+{
+	return for_each_numeric_dir("/proc", fn, data);
+}
+
+int proc_for_each_task(pid_t pid, proc_task_fn fn, void *data)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	return for_each_numeric_dir(path, fn, data);
+}
+
+struct child_walk {
+	pid_t pid;
+	proc_task_fn fn;
+	void *data;
+};
+
+static int visit_children(pid_t tid, void *data)
+{
+	struct child_walk *walk = data;
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/task/%d/children", walk->pid,
+		 tid);
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return 0;
+	}
+	int ret = 0;
+	int child;
+	while (!ret && fscanf(file, "%d", &child) == 1) {
+		ret = walk->fn(child, walk->data);
+	}
+	fclose(file);
+	return ret;
+}
+
+int proc_for_each_child(pid_t pid, proc_task_fn fn, void *data)
+{
+	struct child_walk walk = { pid, fn, data };
+	return proc_for_each_task(pid, visit_children, &walk);
+}
+
+int proc_iter_open(struct proc_iter *iter)
+{
+	iter->dir = opendir("/proc");
+	return iter->dir ? 0 : -1;
+}
+
+bool proc_iter_next(struct proc_iter *iter, pid_t *pid)
+{
+	struct dirent *entry;
+	while (iter->dir && (entry = readdir(iter->dir))) {
+		char *end = NULL;
+		long value = strtol(entry->d_name, &end, 10);
+		if (*end == '\0' && end != entry->d_name && value > 0) {
+			*pid = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+void proc_iter_close(struct proc_iter *iter)
+{
+	if (iter->dir) {
+		closedir(iter->dir);
+		iter->dir = NULL;
+	}
+}
+
+// Read a whole procfs file into buf and terminate it.
+static int read_file(const char *path, char *buf, size_t len)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	size_t used = 0;
+	ssize_t ret;
+	while (used < len - 1 &&
+	       (ret = read(fd, buf + used, len - 1 - used)) > 0) {
+		used += ret;
+	}
+	close(fd);
+	buf[used] = '\0';
+	return 0;
+}
+
+int proc_parse_stat(const char *buf, struct proc_stat *stat)
+{
+	// The command name can contain spaces and parentheses, so start
+	// parsing after the last closing parenthesis.
+	const char *open = strchr(buf, '(');
+	const char *fields = strrchr(buf, ')');
+	if (!open || !fields ||
+	    sscanf(fields, ") %c %d %d", &stat->state, &stat->ppid,
+		   &stat->pgid) != 3) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t comm_len = fields - open - 1;
+	if (comm_len >= sizeof(stat->comm)) {
+		comm_len = sizeof(stat->comm) - 1;
+	}
+	memcpy(stat->comm, open + 1, comm_len);
+	stat->comm[comm_len] = '\0';
+
+	// processor is the 39th field, the 36th after the parenthesis.
+	stat->processor = -1;
+	const char *field = fields + 1;
+	for (int i = 0; i < 36 && field; i++) {
+		field = strchr(field + 1, ' ');
+	}
+	if (field) {
+		stat->processor = atoi(field + 1);
+	}
+	return 0;
+}
+
+int proc_read_stat(pid_t pid, struct proc_stat *stat)
+{
+	char path[64];
+	char buf[512];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if (read_file(path, buf, sizeof(buf))) {
+		return -1;
+	}
+	return proc_parse_stat(buf, stat);
+}
+
+int proc_parse_uid(const char *status, uid_t *uid)
+{
+	const char *line = strstr(status, "\nUid:");
+	unsigned int real, effective;
+	if (!line || sscanf(line, "\nUid: %u %u", &real, &effective) != 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	*uid = effective;
+	return 0;
+}
+
+int proc_read_uid(pid_t pid, uid_t *uid)
+{
+	char path[64];
+	char buf[4096];
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if (read_file(path, buf, sizeof(buf))) {
+		return -1;
+	}
+	return proc_parse_uid(buf, uid);
+}
+
+pid_t proc_read_pgid(pid_t pid)
+{
+	struct proc_stat stat;
+	if (proc_read_stat(pid, &stat)) {
+		return -1;
+	}
+	return stat.pgid;
+}
+
+bool proc_is_kthread(pid_t pid, const struct proc_stat *stat)
+{
+	// kthreadd is pid 2 and the parent of every other kernel thread.
+	return pid == 2 || stat->ppid == 2;
+}
+
+int proc_parse_schedstat(const char *buf, unsigned long long *run_ns,
+			 unsigned long long *wait_ns)
+{
+	if (sscanf(buf, "%llu %llu", run_ns, wait_ns) != 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+int proc_read_schedstat(pid_t tid, unsigned long long *run_ns,
+			unsigned long long *wait_ns)
+{
+	char path[64];
+	char buf[128];
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", tid);
+	if (read_file(path, buf, sizeof(buf))) {
+		return -1;
+	}
+	return proc_parse_schedstat(buf, run_ns, wait_ns);
+}
+
+void proc_parse_forceidle(const char *buf, unsigned long long *ns)
+{
+	*ns = 0;
+	const char *line = strstr(buf, "\ncore_forceidle_sum");
+	const char *value = line ? strchr(line, ':') : NULL;
+	// Printed as milliseconds with a six digit fraction.
+	unsigned long long ms = 0, frac = 0;
+	if (value && sscanf(value, ": %llu.%llu", &ms, &frac) >= 1) {
+		*ns = ms * 1000000ULL + frac;
+	}
+}
+
+int proc_read_forceidle(pid_t tid, unsigned long long *ns)
+{
+	char path[64];
+	char buf[PROC_SCHED_LEN];
+	snprintf(path, sizeof(path), "/proc/%d/sched", tid);
+
+	*ns = 0;
+	if (read_file(path, buf, sizeof(buf))) {
+		return -1;
+	}
+	proc_parse_forceidle(buf, ns);
+	return 0;
+}
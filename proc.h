@@ -0,0 +1,78 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_PROC_H
+#define CORESCHED_PROC_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef int (*proc_task_fn)(pid_t pid, void *data);
+
+// Call fn for every process (or every thread of pid) currently in /proc.
+// Iteration stops early when fn returns non-zero, and that value is
+// returned. Tasks that disappear while iterating are silently skipped.
+int proc_for_each_pid(proc_task_fn fn, void *data);
+int proc_for_each_task(pid_t pid, proc_task_fn fn, void *data);
+// Call fn for every child process of pid, as listed in the children file
+// of each of its threads. Requires CONFIG_PROC_CHILDREN.
+int proc_for_each_child(pid_t pid, proc_task_fn fn, void *data);
+
+// Walk /proc a few processes at a time, for callers that have other work to
+// do in between.
+struct proc_iter {
+	void *dir;
+};
+
+int proc_iter_open(struct proc_iter *iter);
+// Store the next pid and return true, or return false at the end.
+bool proc_iter_next(struct proc_iter *iter, pid_t *pid);
+void proc_iter_close(struct proc_iter *iter);
+
+// The kernel limits task names to 16 bytes including the terminator.
+#define PROC_COMM_LEN 16
+
+struct proc_stat {
+	char comm[PROC_COMM_LEN];
+	char state;
+	pid_t ppid;
+	pid_t pgid;
+	// CPU the task last ran on.
+	int processor;
+};
+
+// The leading fields of /proc/<pid>/stat.
+int proc_read_stat(pid_t pid, struct proc_stat *stat);
+int proc_parse_stat(const char *buf, struct proc_stat *stat);
+
+// The effective uid from the contents of /proc/<pid>/status. It is also
+// the owner of /proc/<pid>, except for processes that are not dumpable,
+// whose directory belongs to root.
+int proc_parse_uid(const char *status, uid_t *uid);
+int proc_read_uid(pid_t pid, uid_t *uid);
+
+// Process group of pid, or -1 if it cannot be read.
+pid_t proc_read_pgid(pid_t pid);
+
+// Kernel threads cannot be given a cookie and are skipped by scans.
+bool proc_is_kthread(pid_t pid, const struct proc_stat *stat);
+
+// Time spent running and waiting on a runqueue in nanoseconds, taken from
+// /proc/<tid>/schedstat.
+int proc_read_schedstat(pid_t tid, unsigned long long *run_ns,
+			unsigned long long *wait_ns);
+int proc_parse_schedstat(const char *buf, unsigned long long *run_ns,
+			 unsigned long long *wait_ns);
+
+// /proc/<tid>/sched is a few kilobytes long, and core_forceidle_sum is near
+// its end.
+#define PROC_SCHED_LEN 8192
+
+// core_forceidle_sum from /proc/<tid>/sched in nanoseconds. This is the time
+// that the task was running while an SMT sibling was forced idle. Kernels
+// without CONFIG_SCHED_CORE or CONFIG_SCHEDSTATS do not report it, in which
+// case 0 is returned.
+int proc_read_forceidle(pid_t tid, unsigned long long *ns);
+void proc_parse_forceidle(const char *buf, unsigned long long *ns);
+
+#endif
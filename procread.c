@@ -0,0 +1,376 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+// io_uring is driven through its system calls directly, to avoid a
+// dependency on liburing. Every file takes three linked operations: an
+// openat into a slot of the registered file table, a read into the
+// registered buffer of the slot, and a close of the slot.
+
+#include "procread.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define PROCREAD_OPS 3
+
+enum { OP_OPEN, OP_READ, OP_CLOSE };
+
+// The completion of an operation that replaced the rest of a split chain.
+#define OP_SKIPPED (~0ULL)
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int complete)
+{
+	return syscall(SYS_io_uring_enter, fd, submit, complete,
+		       IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg,
+			  unsigned int count)
+{
+	return syscall(SYS_io_uring_register, fd, opcode, arg, count);
+}
+
+static void uring_unmap(struct procread *r)
+{
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_size);
+	}
+	if (r->cq_ring && r->cq_ring != r->sq_ring) {
+		munmap(r->cq_ring, r->cq_ring_size);
+	}
+	if (r->sq_ring) {
+		munmap(r->sq_ring, r->sq_ring_size);
+	}
+	r->sqes = r->cq_ring = r->sq_ring = NULL;
+}
+
+static int uring_init(struct procread *r)
+{
+	struct io_uring_params p = { 0 };
+	r->ring_fd = uring_setup(PROCREAD_BATCH * PROCREAD_OPS, &p);
+	if (r->ring_fd < 0) {
+		return -1;
+	}
+	// Opening into the file table needs Linux 5.15, which has no feature
+	// flag of its own. This only rules out kernels before 5.12, and
+	// uring_probe() catches the ones in between.
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_NATIVE_WORKERS)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (r->cq_ring_size > r->sq_ring_size) {
+		r->sq_ring_size = r->cq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		return -1;
+	}
+	r->cq_ring = r->sq_ring;
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		return -1;
+	}
+
+	char *sq = r->sq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(sq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(sq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(sq + p.cq_off.ring_mask);
+	r->cqes = sq + p.cq_off.cqes;
+
+	// An empty file table to open into, and the buffers.
+	int files[PROCREAD_BATCH];
+	memset(files, -1, sizeof(files));
+	struct iovec iov = {
+		.iov_base = r->buffers,
+		.iov_len = PROCREAD_BATCH * PROCREAD_BUF_SIZE,
+	};
+	if (uring_register(r->ring_fd, IORING_REGISTER_FILES, files,
+			   PROCREAD_BATCH) ||
+	    uring_register(r->ring_fd, IORING_REGISTER_BUFFERS, &iov, 1)) {
+		return -1;
+	}
+	return 0;
+}
+
+static struct io_uring_sqe *next_sqe(struct procread *r, unsigned int *tail)
+{
+	unsigned int index = *tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)r->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	(*tail)++;
+	return sqe;
+}
+
+// Submit a single operation and wait for its result.
+static int uring_once(struct procread *r, const struct io_uring_sqe *op)
+{
+	unsigned int tail = *r->sq_tail;
+	*next_sqe(r, &tail) = *op;
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+	int ret;
+	while ((ret = uring_enter(r->ring_fd, 1, 1)) < 0 && errno == EINTR) {
+	}
+	if (ret < 1) {
+		return ret < 0 ? -errno : -EAGAIN;
+	}
+	unsigned int head = *r->cq_head;
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (uring_enter(r->ring_fd, 0, 1) < 0 && errno != EINTR) {
+			return -errno;
+		}
+	}
+	ret = ((struct io_uring_cqe *)r->cqes + (head & *r->cq_mask))->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+// Linux 5.12 to 5.14 ignore file_index and open a normal file descriptor
+// instead, after which every read from a slot would fail. Try one open.
+static int uring_probe(struct procread *r)
+{
+	struct io_uring_sqe op = {
+		.opcode = IORING_OP_OPENAT,
+		.fd = AT_FDCWD,
+		.addr = (unsigned long)"/proc/self/stat",
+		.open_flags = O_RDONLY | O_CLOEXEC,
+		.file_index = 1,
+	};
+	int res = uring_once(r, &op);
+	if (res > 0) {
+		close(res);
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	op = (struct io_uring_sqe){
+		.opcode = IORING_OP_CLOSE,
+		.file_index = 1,
+	};
+	uring_once(r, &op);
+	return 0;
+}
+
+int procread_init(struct procread *r)
+{
+	memset(r, 0, sizeof(*r));
+	r->ring_fd = -1;
+	r->buffers = malloc(PROCREAD_BATCH * PROCREAD_BUF_SIZE);
+	if (!r->buffers) {
+		return -1;
+	}
+	r->uring = !uring_init(r) && !uring_probe(r);
+	if (!r->uring) {
+		uring_unmap(r);
+		if (r->ring_fd >= 0) {
+			close(r->ring_fd);
+			r->ring_fd = -1;
+		}
+	}
+	return 0;
+}
+
+void procread_free(struct procread *r)
+{
+	uring_unmap(r);
+	if (r->ring_fd >= 0) {
+		close(r->ring_fd);
+	}
+	free(r->buffers);
+	r->buffers = NULL;
+}
+
+static void read_one(struct procread *r, size_t i, const char *path)
+{
+	char *buf = r->buffers + i * PROCREAD_BUF_SIZE;
+	r->lengths[i] = -1;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	ssize_t used = 0, ret;
+	while (used < PROCREAD_BUF_SIZE - 1 &&
+	       (ret = read(fd, buf + used, PROCREAD_BUF_SIZE - 1 - used)) > 0) {
+		used += ret;
+	}
+	close(fd);
+	buf[used] = '\0';
+	r->lengths[i] = used;
+}
+
+static void read_plain(struct procread *r, const char *const *paths,
+		       size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		read_one(r, i, paths[i]);
+	}
+}
+
+// The kernel took the operations of a batch up to done, which ends inside
+// the chain of a file. The start of that chain runs on its own, and the
+// rest of it is replaced by no-ops so that it never runs unlinked.
+static size_t split_chain(struct procread *r, unsigned int start,
+			  unsigned int done)
+{
+	size_t i = done / PROCREAD_OPS;
+	for (unsigned int op = done % PROCREAD_OPS; op < PROCREAD_OPS; op++) {
+		unsigned int index = (start + i * PROCREAD_OPS + op) &
+				     *r->sq_mask;
+		struct io_uring_sqe *sqe =
+			(struct io_uring_sqe *)r->sqes + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = OP_SKIPPED;
+	}
+	return i;
+}
+
+static bool read_uring(struct procread *r, const char *const *paths,
+		       size_t count)
+{
+	// procfs files cannot be opened or read without blocking, so skip the
+	// non-blocking attempt and let the workers of the ring handle the
+	// chains of a batch in parallel.
+	unsigned int start = *r->sq_tail;
+	unsigned int tail = start;
+	for (size_t i = 0; i < count; i++) {
+		struct io_uring_sqe *sqe = next_sqe(r, &tail);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (unsigned long)paths[i];
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->file_index = i + 1;
+		sqe->flags = IOSQE_IO_LINK | IOSQE_ASYNC;
+		sqe->user_data = i * PROCREAD_OPS + OP_OPEN;
+
+		sqe = next_sqe(r, &tail);
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = i;
+		sqe->addr = (unsigned long)(r->buffers + i * PROCREAD_BUF_SIZE);
+		sqe->len = PROCREAD_BUF_SIZE - 1;
+		sqe->buf_index = 0;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+		sqe->user_data = i * PROCREAD_OPS + OP_READ;
+
+		// Not reached when the read failed, but the next open into
+		// the slot replaces the file anyway.
+		sqe = next_sqe(r, &tail);
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->file_index = i + 1;
+		sqe->user_data = i * PROCREAD_OPS + OP_CLOSE;
+	}
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+	// The kernel can take fewer operations than it was given, for
+	// example when it is short on memory. The rest stays in the ring and
+	// is submitted again while waiting, as its completions are waited for
+	// too. A file whose chain was split is read without the ring
+	// afterwards.
+	unsigned int pending = count * PROCREAD_OPS;
+	unsigned int unsubmitted = pending;
+	bool split[PROCREAD_BATCH] = { false };
+	bool opened = false, rejected = false, unfixed = false;
+	while (pending) {
+		unsigned int head = *r->cq_head;
+		unsigned int cq_tail =
+			__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == cq_tail || unsubmitted) {
+			int submitted = uring_enter(r->ring_fd, unsubmitted,
+						    head == cq_tail);
+			if (submitted < 0 && errno != EINTR &&
+			    errno != EAGAIN && errno != EBUSY) {
+				return false;
+			}
+			if (submitted > 0) {
+				unsubmitted -= submitted;
+				unsigned int done =
+					count * PROCREAD_OPS - unsubmitted;
+				if (done % PROCREAD_OPS) {
+					split[split_chain(r, start, done)] =
+						true;
+				}
+			}
+			if (head == cq_tail) {
+				continue;
+			}
+		}
+		for (; head != cq_tail; head++, pending--) {
+			struct io_uring_cqe *cqe =
+				(struct io_uring_cqe *)r->cqes +
+				(head & *r->cq_mask);
+			if (cqe->user_data == OP_SKIPPED) {
+				continue;
+			}
+			size_t i = cqe->user_data / PROCREAD_OPS;
+			int op = cqe->user_data % PROCREAD_OPS;
+			if (op == OP_OPEN) {
+				// An open that ignored file_index returns a
+				// normal file descriptor.
+				if (cqe->res > 0) {
+					close(cqe->res);
+					unfixed = true;
+				}
+				opened |= cqe->res == 0;
+				rejected |= cqe->res == -EINVAL;
+			} else if (op == OP_READ) {
+				r->lengths[i] = cqe->res < 0 ? -1 : cqe->res;
+				if (cqe->res >= 0) {
+					r->buffers[i * PROCREAD_BUF_SIZE +
+						   cqe->res] = '\0';
+				}
+			}
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (split[i] && r->lengths[i] < 0) {
+			read_one(r, i, paths[i]);
+		}
+	}
+	// A kernel that cannot open into the file table rejects every open,
+	// or opens normal file descriptors instead.
+	return !unfixed && (opened || !rejected);
+}
+
+void procread_run(struct procread *r, const char *const *paths, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		r->lengths[i] = -1;
+	}
+	if (r->uring && !read_uring(r, paths, count)) {
+		r->uring = false;
+	}
+	if (!r->uring) {
+		read_plain(r, paths, count);
+	}
+}
@@ -0,0 +1,54 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_PROCREAD_H
+#define CORESCHED_PROCREAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Files that are read with one submission.
+#define PROCREAD_BATCH 256
+// Room for every file, enough for /proc/<tid>/sched.
+#define PROCREAD_BUF_SIZE 8192
+
+// Reads many small procfs files at once. With io_uring, the open, read and
+// close of every file in a batch go to the kernel in a single system call,
+// into buffers that are registered once. Without it, the files are read one
+// after the other.
+struct procread {
+	int ring_fd;
+	bool uring;
+	char *buffers;
+	ssize_t lengths[PROCREAD_BATCH];
+	// Mappings of the submission and completion rings.
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	void *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	void *cqes;
+};
+
+int procread_init(struct procread *r);
+void procread_free(struct procread *r);
+
+// Read up to PROCREAD_BATCH files. Afterwards procread_data returns the
+// NUL-terminated contents of each, or NULL if it could not be read.
+void procread_run(struct procread *r, const char *const *paths, size_t count);
+
+static inline const char *procread_data(const struct procread *r, size_t i)
+{
+	return r->lengths[i] < 0 ? NULL : r->buffers + i * PROCREAD_BUF_SIZE;
+}
+
+#endif
@@ -0,0 +1,299 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "queue.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Number of attempts to pop before the consumer goes to sleep.
+#define QUEUE_SPINS 256
+
+static size_t round_capacity(size_t capacity)
+{
+	size_t size = 2;
+	while (size < capacity) {
+		size <<= 1;
+	}
+	return size;
+}
+
+int spsc_init(struct spsc_queue *q, size_t capacity, size_t elem_size)
+{
+	capacity = round_capacity(capacity);
+	q->slots = calloc(capacity, elem_size);
+	if (!q->slots) {
+		return -1;
+	}
+	q->elem_size = elem_size;
+	q->mask = capacity - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+void spsc_free(struct spsc_queue *q)
+{
+	free(q->slots);
+	q->slots = NULL;
+}
+
+bool spsc_push(struct spsc_queue *q, const void *elem)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail - head > q->mask) {
+		return false;
+	}
+	memcpy(q->slots + (tail & q->mask) * q->elem_size, elem,
+	       q->elem_size);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+bool spsc_pop(struct spsc_queue *q, void *elem)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail) {
+		return false;
+	}
+	memcpy(elem, q->slots + (head & q->mask) * q->elem_size,
+	       q->elem_size);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return true;
+}
+
+void spsc_stats(struct spsc_queue *q, struct queue_stats *stats)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	stats->capacity = q->mask + 1;
+	stats->occupancy = tail > head ? tail - head : 0;
+	stats->popped = head;
+}
+
+static atomic_size_t *cell_sequence(struct mpmc_queue *q, size_t pos)
+{
+	return (atomic_size_t *)(q->cells + (pos & q->mask) * q->cell_size);
+}
+
+static void *cell_data(struct mpmc_queue *q, size_t pos)
+{
+	return q->cells + (pos & q->mask) * q->cell_size +
+	       sizeof(atomic_size_t);
+}
+
+int mpmc_init(struct mpmc_queue *q, size_t capacity, size_t elem_size)
+{
+	capacity = round_capacity(capacity);
+	size_t align = _Alignof(max_align_t);
+	q->cell_size = (sizeof(atomic_size_t) + elem_size + align - 1) /
+		       align * align;
+	q->cells = calloc(capacity, q->cell_size);
+	if (!q->cells) {
+		return -1;
+	}
+	q->elem_size = elem_size;
+	q->mask = capacity - 1;
+	for (size_t i = 0; i < capacity; i++) {
+		atomic_init(cell_sequence(q, i), i);
+	}
+	atomic_init(&q->enqueue_pos, 0);
+	atomic_init(&q->dequeue_pos, 0);
+	return 0;
+}
+
+void mpmc_free(struct mpmc_queue *q)
+{
+	free(q->cells);
+	q->cells = NULL;
+}
+
+bool mpmc_push(struct mpmc_queue *q, const void *elem)
+{
+	size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	for (;;) {
+		atomic_size_t *seq = cell_sequence(q, pos);
+		ptrdiff_t diff = atomic_load_explicit(seq, memory_order_acquire) -
+				 pos;
+		if (!diff) {
+			// The slot is free, claim it by moving the position.
+			if (atomic_compare_exchange_weak_explicit(
+				    &q->enqueue_pos, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				memcpy(cell_data(q, pos), elem, q->elem_size);
+				atomic_store_explicit(seq, pos + 1,
+						      memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			// The consumer of the previous round did not free
+			// the slot yet, so the queue is full.
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->enqueue_pos,
+						   memory_order_relaxed);
+		}
+	}
+}
+
+bool mpmc_pop(struct mpmc_queue *q, void *elem)
+{
+	size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	for (;;) {
+		atomic_size_t *seq = cell_sequence(q, pos);
+		ptrdiff_t diff = atomic_load_explicit(seq, memory_order_acquire) -
+				 (pos + 1);
+		if (!diff) {
+			if (atomic_compare_exchange_weak_explicit(
+				    &q->dequeue_pos, &pos, pos + 1,
+				    memory_order_relaxed,
+				    memory_order_relaxed)) {
+				memcpy(elem, cell_data(q, pos), q->elem_size);
+				atomic_store_explicit(seq, pos + q->mask + 1,
+						      memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&q->dequeue_pos,
+						   memory_order_relaxed);
+		}
+	}
+}
+
+void mpmc_stats(struct mpmc_queue *q, struct queue_stats *stats)
+{
+	size_t dequeued =
+		atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	size_t enqueued =
+		atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	stats->capacity = q->mask + 1;
+	stats->occupancy = enqueued > dequeued ? enqueued - dequeued : 0;
+	stats->popped = dequeued;
+}
+
+int queue_waiter_init(struct queue_waiter *w)
+{
+	atomic_init(&w->sleeping, false);
+	return sem_init(&w->sem, 0, 0);
+}
+
+void queue_waiter_destroy(struct queue_waiter *w)
+{
+	sem_destroy(&w->sem);
+}
+
+void queue_wake(struct queue_waiter *w)
+{
+	// Pairs with the fence in queue_pop_wait: either the consumer sees the
+	// element that was just pushed, or this sees that it is asleep.
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&w->sleeping, memory_order_relaxed) &&
+	    atomic_exchange(&w->sleeping, false)) {
+		sem_post(&w->sem);
+	}
+}
+
+void queue_pop_wait(void *q, queue_pop_fn pop, struct queue_waiter *w,
+		    void *elem)
+{
+	for (;;) {
+		for (int i = 0; i < QUEUE_SPINS; i++) {
+			if (pop(q, elem)) {
+				return;
+			}
+		}
+		atomic_store(&w->sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (pop(q, elem)) {
+			atomic_store(&w->sleeping, false);
+			return;
+		}
+		while (sem_wait(&w->sem) && errno == EINTR) {
+		}
+	}
+}
+
+bool queue_pop_timedwait(void *q, queue_pop_fn pop, struct queue_waiter *w,
+			 void *elem, unsigned int timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	for (;;) {
+		for (int i = 0; i < QUEUE_SPINS; i++) {
+			if (pop(q, elem)) {
+				return true;
+			}
+		}
+		atomic_store(&w->sleeping, true);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (pop(q, elem)) {
+			atomic_store(&w->sleeping, false);
+			return true;
+		}
+		if (!sem_timedwait(&w->sem, &deadline) || errno == EINTR) {
+			continue;
+		}
+		// A producer that already cleared the flag is about to post,
+		// and that post must not be left for the next wait.
+		if (!atomic_exchange(&w->sleeping, false)) {
+			while (sem_wait(&w->sem) && errno == EINTR) {
+			}
+		}
+		return pop(q, elem);
+	}
+}
+
+static bool spsc_pop_any(void *q, void *elem)
+{
+	return spsc_pop(q, elem);
+}
+
+static bool mpmc_pop_any(void *q, void *elem)
+{
+	return mpmc_pop(q, elem);
+}
+
+void spsc_push_wait(struct spsc_queue *q, const void *elem)
+{
+	while (!spsc_push(q, elem)) {
+		sched_yield();
+	}
+}
+
+void spsc_pop_wait(struct spsc_queue *q, struct queue_waiter *w, void *elem)
+{
+	queue_pop_wait(q, spsc_pop_any, w, elem);
+}
+
+void mpmc_push_wait(struct mpmc_queue *q, const void *elem)
+{
+	while (!mpmc_push(q, elem)) {
+		sched_yield();
+	}
+}
+
+void mpmc_pop_wait(struct mpmc_queue *q, struct queue_waiter *w, void *elem)
+{
+	queue_pop_wait(q, mpmc_pop_any, w, elem);
+}
+
+bool mpmc_pop_timedwait(struct mpmc_queue *q, struct queue_waiter *w,
+			void *elem, unsigned int timeout_ms)
+{
+	return queue_pop_timedwait(q, mpmc_pop_any, w, elem, timeout_ms);
+}
@@ -0,0 +1,89 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_QUEUE_H
+#define CORESCHED_QUEUE_H
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define QUEUE_CACHE_LINE 64
+
+// Bounded queue for one producer and one consumer. Elements are copied in
+// and out, and the capacity is rounded up to a power of two.
+struct spsc_queue {
+	char *slots;
+	size_t elem_size;
+	size_t mask;
+	// Both counters only grow, so they double as the number of elements
+	// that were ever pushed and popped.
+	_Alignas(QUEUE_CACHE_LINE) atomic_size_t head;
+	_Alignas(QUEUE_CACHE_LINE) atomic_size_t tail;
+};
+
+int spsc_init(struct spsc_queue *q, size_t capacity, size_t elem_size);
+void spsc_free(struct spsc_queue *q);
+// Return false without blocking if the queue is full or empty.
+bool spsc_push(struct spsc_queue *q, const void *elem);
+bool spsc_pop(struct spsc_queue *q, void *elem);
+
+// Bounded queue for any number of producers and consumers, after Dmitry
+// Vyukov's design: every slot carries a sequence number that tells whose
+// turn it is, so producers and consumers only contend on their own counter.
+struct mpmc_queue {
+	char *cells;
+	size_t cell_size;
+	size_t elem_size;
+	size_t mask;
+	_Alignas(QUEUE_CACHE_LINE) atomic_size_t enqueue_pos;
+	_Alignas(QUEUE_CACHE_LINE) atomic_size_t dequeue_pos;
+};
+
+int mpmc_init(struct mpmc_queue *q, size_t capacity, size_t elem_size);
+void mpmc_free(struct mpmc_queue *q);
+bool mpmc_push(struct mpmc_queue *q, const void *elem);
+bool mpmc_pop(struct mpmc_queue *q, void *elem);
+
+// Statistics that can be read from any thread while the queue is in use.
+struct queue_stats {
+	size_t capacity;
+	size_t occupancy;
+	// Number of elements popped since the queue was created.
+	size_t popped;
+};
+
+void spsc_stats(struct spsc_queue *q, struct queue_stats *stats);
+void mpmc_stats(struct mpmc_queue *q, struct queue_stats *stats);
+
+// Lets the consumer of a queue sleep while the queue is empty, instead of
+// spinning. Producers call queue_wake after every push; it only makes a
+// system call when the consumer is actually asleep.
+struct queue_waiter {
+	atomic_bool sleeping;
+	sem_t sem;
+};
+
+int queue_waiter_init(struct queue_waiter *w);
+void queue_waiter_destroy(struct queue_waiter *w);
+void queue_wake(struct queue_waiter *w);
+
+// Pop from any queue or set of queues, sleeping on w until pop succeeds.
+typedef bool (*queue_pop_fn)(void *q, void *elem);
+void queue_pop_wait(void *q, queue_pop_fn pop, struct queue_waiter *w,
+		    void *elem);
+// The same, but give up after timeout_ms and return false.
+bool queue_pop_timedwait(void *q, queue_pop_fn pop, struct queue_waiter *w,
+			 void *elem, unsigned int timeout_ms);
+
+// Blocking variants. Pushing spins while the queue is full, which is how
+// a slow consumer pushes back on its producers.
+void spsc_push_wait(struct spsc_queue *q, const void *elem);
+void spsc_pop_wait(struct spsc_queue *q, struct queue_waiter *w, void *elem);
+void mpmc_push_wait(struct mpmc_queue *q, const void *elem);
+void mpmc_pop_wait(struct mpmc_queue *q, struct queue_waiter *w, void *elem);
+bool mpmc_pop_timedwait(struct mpmc_queue *q, struct queue_waiter *w,
+			void *elem, unsigned int timeout_ms);
+
+#endif
@@ -0,0 +1,95 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "rebalance.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static int compare_moves(const void *a, const void *b)
+{
+	const struct rebalance_move *x = a, *y = b;
+	// Shrinks first, since they free the cores that growing groups need.
+	if (x->delta != y->delta) {
+		return x->delta - y->delta;
+	}
+	double score_x = x->benefit / x->cost, score_y = y->benefit / y->cost;
+	return (score_x < score_y) - (score_x > score_y);
+}
+
+// The number of cores the group would like from its demand alone. To avoid
+// flapping, a group only shrinks when its demand fits in one core less with
+// twice the headroom to spare.
+static int wanted_delta(const struct rebalance_params *params,
+			const struct rebalance_group *group,
+			unsigned int threads_per_core)
+{
+	// An unpinned group already runs on every CPU, so it can neither grow
+	// nor shrink by a core.
+	if (!group->cores) {
+		return 0;
+	}
+	double headroom = 1 + params->headroom_pct / 100.0;
+	double capacity = group->cores * threads_per_core;
+	if (group->demand * headroom > capacity &&
+	    group->cores < group->max_cores) {
+		return 1;
+	}
+	double smaller = (group->cores - 1.0) * threads_per_core;
+	if (group->cores > group->min_cores && group->cores > 1 &&
+	    group->demand * (2 * headroom - 1) < smaller) {
+		return -1;
+	}
+	return 0;
+}
+
+size_t rebalance_plan(const struct rebalance_params *params,
+		      struct rebalance_group *groups, size_t count,
+		      unsigned int free_cores, unsigned int threads_per_core,
+		      struct rebalance_move *moves)
+{
+	size_t candidates = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct rebalance_group *group = &groups[i];
+		int delta = wanted_delta(params, group, threads_per_core);
+		if (!delta) {
+			group->streak = 0;
+			continue;
+		}
+		if ((delta > 0) != (group->streak > 0)) {
+			group->streak = 0;
+		}
+		group->streak += delta;
+		if ((unsigned int)abs(group->streak) < params->steps) {
+			continue;
+		}
+
+		// Every member thread changes affinity and may migrate, so
+		// the cost is the group size. Growing pays off more when
+		// the demand exceeds the capacity by more, shrinking when
+		// more capacity sits unused.
+		double capacity = group->cores * threads_per_core;
+		struct rebalance_move *move = &moves[candidates++];
+		move->group = i;
+		move->delta = delta;
+		move->cost = group->members + 1.0;
+		move->benefit = fabs(group->demand - capacity) + 1e-3;
+	}
+
+	qsort(moves, candidates, sizeof(*moves), compare_moves);
+	size_t chosen = 0;
+	for (size_t i = 0; i < candidates && chosen < params->max_moves; i++) {
+		struct rebalance_move move = moves[i];
+		if (move.delta > 0) {
+			if (!free_cores) {
+				continue;
+			}
+			free_cores--;
+		} else {
+			free_cores++;
+		}
+		groups[move.group].streak = 0;
+		moves[chosen++] = move;
+	}
+	return chosen;
+}
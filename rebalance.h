@@ -0,0 +1,52 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_REBALANCE_H
+#define CORESCHED_REBALANCE_H
+
+#include <stddef.h>
+
+struct rebalance_params {
+	// Number of consecutive periods a group has to want the same change
+	// before it is made.
+	unsigned int steps;
+	// Extra capacity a group should have above its demand, in percent.
+	unsigned int headroom_pct;
+	// Maximum number of core moves in one period.
+	unsigned int max_moves;
+};
+
+// What the rebalancer knows about a group that may change size.
+struct rebalance_group {
+	unsigned int min_cores;
+	unsigned int max_cores;
+	unsigned int cores;
+	size_t members;
+	// CPUs the group used on average during the last period.
+	double demand;
+	// Forced idle caused by the group in ms per second.
+	double forceidle_rate;
+	// Positive when the group wanted to grow for this many periods in a
+	// row, negative when it wanted to shrink.
+	int streak;
+};
+
+struct rebalance_move {
+	size_t group;
+	// +1 to give the group a core, -1 to take one away.
+	int delta;
+	// Threads that have to change affinity for this move.
+	double cost;
+	double benefit;
+};
+
+// Update the streaks of all groups from their demand and choose at most
+// params->max_moves moves. Growing needs a free core, which can come from
+// a group that shrinks in the same period. Returns the number of moves
+// written to moves, which must have room for count entries.
+size_t rebalance_plan(const struct rebalance_params *params,
+		      struct rebalance_group *groups, size_t count,
+		      unsigned int free_cores, unsigned int threads_per_core,
+		      struct rebalance_move *moves);
+
+#endif
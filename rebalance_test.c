@@ -0,0 +1,88 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "rebalance.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+static const struct rebalance_params params = {
+	.steps = 1,
+	.headroom_pct = 20,
+	.max_moves = 4,
+};
+
+// Plan one period for a single group, with free cores to grow into.
+static size_t plan_one(struct rebalance_group *group,
+		       struct rebalance_move *move)
+{
+	return rebalance_plan(&params, group, 1, 4, 2, move);
+}
+
+// A group with 0 cores is unpinned and runs on every CPU. Giving it a core
+// would confine it to one, so it never grows, however busy it is.
+static void unpinned_does_not_grow(void)
+{
+	struct rebalance_group group = {
+		.min_cores = 0,
+		.max_cores = 4,
+		.cores = 0,
+		.members = 8,
+		.demand = 16,
+	};
+	struct rebalance_move move;
+	assert(plan_one(&group, &move) == 0);
+}
+
+// Taking the last core away would unpin the group and give it every CPU,
+// so an idle group on one core stays there.
+static void single_core_does_not_shrink(void)
+{
+	struct rebalance_group group = {
+		.min_cores = 0,
+		.max_cores = 4,
+		.cores = 1,
+		.members = 8,
+		.demand = 0,
+	};
+	struct rebalance_move move;
+	assert(plan_one(&group, &move) == 0);
+}
+
+static void single_core_grows(void)
+{
+	struct rebalance_group group = {
+		.min_cores = 1,
+		.max_cores = 4,
+		.cores = 1,
+		.members = 8,
+		.demand = 4,
+	};
+	struct rebalance_move move;
+	assert(plan_one(&group, &move) == 1);
+	assert(move.group == 0 && move.delta == 1);
+}
+
+static void idle_group_shrinks_to_one_core(void)
+{
+	struct rebalance_group group = {
+		.min_cores = 1,
+		.max_cores = 4,
+		.cores = 2,
+		.members = 8,
+		.demand = 0,
+	};
+	struct rebalance_move move;
+	assert(plan_one(&group, &move) == 1);
+	assert(move.group == 0 && move.delta == -1);
+}
+
+int main(void)
+{
+	unpinned_does_not_grow();
+	single_core_does_not_shrink();
+	single_core_grows();
+	idle_group_shrinks_to_one_core();
+	printf("rebalance: all tests passed\n");
+	return 0;
+}
@@ -0,0 +1,527 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "rules.h"
+#include "domain.h"
+#include "label.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sched.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int ruleset_find_group(const struct ruleset *set, const char *name)
+{
+	for (size_t i = 0; i < set->group_count; i++) {
+		if (!strcmp(set->groups[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static bool parse_uint_value(const char *str, unsigned long *value)
+{
+	char *end = NULL;
+	errno = 0;
+	*value = strtoul(str, &end, 10);
+	return !errno && end != str && *end == '\0' && str[0] != '-';
+}
+
+static int parse_cores(char *value, struct group_config *group)
+{
+	unsigned long min, max;
+	char *dash = strchr(value, '-');
+	if (dash) {
+		*dash = '\0';
+		if (!parse_uint_value(value, &min) ||
+		    !parse_uint_value(dash + 1, &max)) {
+			return -1;
+		}
+	} else if (parse_uint_value(value, &min)) {
+		max = min;
+	} else {
+		return -1;
+	}
+	// 0 cores leaves a group unpinned, which a range cannot shrink to.
+	if (min > max || max > CPU_SETSIZE || (dash && !min)) {
+		return -1;
+	}
+	group->cores = min;
+	group->max_cores = max;
+	return 0;
+}
+
+static int parse_rebalance(struct ruleset *set, const char *path,
+			   unsigned int line, char *saveptr)
+{
+	set->rebalance = (struct rebalance_params){
+		.steps = 3,
+		.headroom_pct = 20,
+		.max_moves = 1,
+	};
+	set->rebalance_ms = 0;
+
+	char *option;
+	while ((option = strtok_r(NULL, " \t", &saveptr))) {
+		char *value = strchr(option, '=');
+		unsigned long number;
+		if (!value || !parse_uint_value(value + 1, &number) ||
+		    number > UINT_MAX) {
+			error_at_line(0, 0, path, line,
+				      "invalid rebalance option '%s'", option);
+			return -1;
+		}
+		*value = '\0';
+		if (!strcmp(option, "every") && number) {
+			set->rebalance_ms = number;
+		} else if (!strcmp(option, "steps") && number) {
+			set->rebalance.steps = number;
+		} else if (!strcmp(option, "headroom")) {
+			set->rebalance.headroom_pct = number;
+		} else if (!strcmp(option, "moves") && number) {
+			set->rebalance.max_moves = number;
+		} else {
+			error_at_line(0, 0, path, line,
+				      "invalid rebalance option '%s'", option);
+			return -1;
+		}
+	}
+	if (!set->rebalance_ms) {
+		error_at_line(0, 0, path, line, "rebalance requires every=MS");
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_sample(struct ruleset *set, const char *path,
+			unsigned int line, char *saveptr)
+{
+	static const struct {
+		unsigned long pct;
+		double z;
+	} levels[] = {
+		{ 80, 1.2816 }, { 90, 1.6449 }, { 95, 1.9600 },
+		{ 98, 2.3263 }, { 99, 2.5758 },
+	};
+	set->sample_ms = 0;
+	set->sample_size = 64;
+	set->sample_z = 1.96;
+
+	char *option;
+	while ((option = strtok_r(NULL, " \t", &saveptr))) {
+		char *value = strchr(option, '=');
+		unsigned long number;
+		if (!value || !parse_uint_value(value + 1, &number) ||
+		    number > UINT_MAX) {
+			error_at_line(0, 0, path, line,
+				      "invalid sample option '%s'", option);
+			return -1;
+		}
+		*value = '\0';
+		bool valid = number;
+		if (!strcmp(option, "every")) {
+			set->sample_ms = number;
+		} else if (!strcmp(option, "size")) {
+			set->sample_size = number;
+		} else if (!strcmp(option, "confidence")) {
+			valid = false;
+			for (size_t i = 0; i < sizeof(levels) / sizeof(*levels);
+			     i++) {
+				if (levels[i].pct == number) {
+					set->sample_z = levels[i].z;
+					valid = true;
+				}
+			}
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			error_at_line(0, 0, path, line,
+				      "invalid sample option '%s'", option);
+			return -1;
+		}
+	}
+	if (!set->sample_ms) {
+		error_at_line(0, 0, path, line, "sample requires every=MS");
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_group(struct ruleset *set, const char *path,
+		       unsigned int line, char *saveptr)
+{
+	char *name = strtok_r(NULL, " \t", &saveptr);
+	if (!name) {
+		error_at_line(0, 0, path, line, "group requires a name");
+		return -1;
+	}
+	if (ruleset_find_group(set, name) >= 0) {
+		error_at_line(0, 0, path, line, "group %s is already defined",
+			      name);
+		return -1;
+	}
+
+	struct group_config group = { 0 };
+	char *option;
+	while ((option = strtok_r(NULL, " \t", &saveptr))) {
+		if (!strncmp(option, "cores=", 6)) {
+			if (parse_cores(option + 6, &group)) {
+				error_at_line(0, 0, path, line,
+					      "invalid number of cores");
+				return -1;
+			}
+		} else if (!strcmp(option, "accounting")) {
+			group.accounting = GROUP_ACCT_DEDICATED;
+		} else if (!strcmp(option, "accounting=leaf")) {
+			group.accounting = GROUP_ACCT_LEAF;
+		} else if (!strcmp(option, "tier=service")) {
+			group.tier = GROUP_TIER_SERVICE;
+		} else if (!strcmp(option, "tier=background")) {
+			group.tier = GROUP_TIER_BACKGROUND;
+		} else {
+			error_at_line(0, 0, path, line,
+				      "invalid group option '%s'", option);
+			return -1;
+		}
+	}
+
+	struct group_config *groups =
+		realloc(set->groups, (set->group_count + 1) * sizeof(*groups));
+	if (!groups || !(group.name = strdup(name))) {
+		error(1, errno, "Failed to allocate group %s", name);
+	}
+	groups[set->group_count++] = group;
+	set->groups = groups;
+	return 0;
+}
+
+// Parse the options of labels and domains, which only name the extended
+// attribute to read.
+static int parse_xattr(const char *keyword, const char *xattr, char **result,
+		       const char *path, unsigned int line, char *saveptr)
+{
+	char *option;
+	while ((option = strtok_r(NULL, " \t", &saveptr))) {
+		if (strncmp(option, "xattr=", 6) || !option[6] ||
+		    strlen(option + 6) > XATTR_NAME_MAX) {
+			error_at_line(0, 0, path, line,
+				      "invalid %s option '%s'", keyword,
+				      option);
+			return -1;
+		}
+		xattr = option + 6;
+	}
+	free(*result);
+	if (!(*result = strdup(xattr))) {
+		error(1, errno, "Failed to allocate %s", keyword);
+	}
+	return 0;
+}
+
+static int parse_match(struct ruleset *set, const char *path,
+		       unsigned int line, char *saveptr)
+{
+	char *name = strtok_r(NULL, " \t", &saveptr);
+	char *selector = strtok_r(NULL, " \t", &saveptr);
+	if (!name || !selector || strtok_r(NULL, " \t", &saveptr)) {
+		error_at_line(0, 0, path, line,
+			      "match requires a group and one selector");
+		return -1;
+	}
+	int group = ruleset_find_group(set, name);
+	if (group < 0) {
+		error_at_line(0, 0, path, line, "group %s is not defined",
+			      name);
+		return -1;
+	}
+
+	struct rule rule = { .group = group, .line = line };
+	char *value = strchr(selector, '=');
+	if (!value || !value[1]) {
+		error_at_line(0, 0, path, line,
+			      "selector '%s' requires a value", selector);
+		return -1;
+	}
+	*value++ = '\0';
+
+	unsigned long uid;
+	if (!strcmp(selector, "cgroup") && value[0] == '/') {
+		rule.selector = RULE_CGROUP;
+		// A trailing slash would never match on a component boundary.
+		size_t len = strlen(value);
+		while (len > 1 && value[len - 1] == '/') {
+			value[--len] = '\0';
+		}
+		set->needs_cgroup = true;
+	} else if (!strcmp(selector, "uid") && parse_uint_value(value, &uid)) {
+		rule.selector = RULE_UID;
+		rule.uid = uid;
+	} else if (!strcmp(selector, "comm") &&
+		   strlen(value) < PROC_COMM_LEN) {
+		rule.selector = RULE_COMM;
+	} else {
+		error_at_line(0, 0, path, line, "invalid selector %s=%s",
+			      selector, value);
+		return -1;
+	}
+
+	struct rule *rules =
+		realloc(set->rules, (set->rule_count + 1) * sizeof(*rules));
+	if (!rules || !(rule.value = strdup(value))) {
+		error(1, errno, "Failed to allocate rule");
+	}
+	rule.len = strlen(rule.value);
+	rules[set->rule_count++] = rule;
+	set->rules = rules;
+	return 0;
+}
+
+int ruleset_load(const char *path, struct ruleset *set)
+{
+	memset(set, 0, sizeof(*set));
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		error(0, errno, "Failed to open %s", path);
+		return -1;
+	}
+
+	char *buf = NULL;
+	size_t size = 0;
+	unsigned int line = 0;
+	int ret = 0;
+	while (!ret && getline(&buf, &size, file) != -1) {
+		line++;
+		buf[strcspn(buf, "#\n")] = '\0';
+
+		char *saveptr = NULL;
+		char *keyword = strtok_r(buf, " \t", &saveptr);
+		if (!keyword) {
+			continue;
+		}
+		if (!strcmp(keyword, "group")) {
+			ret = parse_group(set, path, line, saveptr);
+		} else if (!strcmp(keyword, "match")) {
+			ret = parse_match(set, path, line, saveptr);
+		} else if (!strcmp(keyword, "rebalance")) {
+			ret = parse_rebalance(set, path, line, saveptr);
+		} else if (!strcmp(keyword, "sample")) {
+			ret = parse_sample(set, path, line, saveptr);
+		} else if (!strcmp(keyword, "labels")) {
+			ret = parse_xattr(keyword, LABEL_XATTR,
+					  &set->label_xattr, path, line,
+					  saveptr);
+			set->needs_cgroup = true;
+		} else if (!strcmp(keyword, "domains")) {
+			ret = parse_xattr(keyword, DOMAIN_XATTR,
+					  &set->domain_xattr, path, line,
+					  saveptr);
+		} else {
+			error_at_line(0, 0, path, line, "unknown keyword '%s'",
+				      keyword);
+			ret = -1;
+		}
+	}
+	free(buf);
+	fclose(file);
+
+	if (ret) {
+		ruleset_free(set);
+	}
+	return ret;
+}
+
+void ruleset_free(struct ruleset *set)
+{
+	for (size_t i = 0; i < set->group_count; i++) {
+		free(set->groups[i].name);
+	}
+	for (size_t i = 0; i < set->rule_count; i++) {
+		free(set->rules[i].value);
+	}
+	free(set->groups);
+	free(set->rules);
+	free(set->label_xattr);
+	free(set->domain_xattr);
+	memset(set, 0, sizeof(*set));
+}
+
+bool rule_matches(const struct rule *rule, const struct task_info *task)
+{
+	switch (rule->selector) {
+	case RULE_CGROUP:
+		// Prefixes only match on a path component boundary.
+		return !strncmp(task->cgroup, rule->value, rule->len) &&
+		       (task->cgroup[rule->len] == '\0' ||
+			task->cgroup[rule->len] == '/' || rule->len == 1);
+	case RULE_UID:
+		return task->uid == rule->uid;
+	case RULE_COMM:
+		return !strcmp(task->comm, rule->value);
+	}
+	return false;
+}
+
+int ruleset_classify(const struct ruleset *set, const struct task_info *task)
+{
+	for (size_t i = 0; i < set->rule_count; i++) {
+		if (rule_matches(&set->rules[i], task)) {
+			return set->rules[i].group;
+		}
+	}
+	return -1;
+}
+
+struct rule_ref {
+	const struct ruleset *set;
+	size_t index;
+};
+
+static int compare_key(const struct rule_ref *x, const struct rule_ref *y)
+{
+	const struct rule *r = &x->set->rules[x->index];
+	const struct rule *q = &y->set->rules[y->index];
+	if (r->selector != q->selector) {
+		return r->selector < q->selector ? -1 : 1;
+	}
+	int cmp = r->selector == RULE_UID ?
+			  (r->uid > q->uid) - (r->uid < q->uid) :
+			  strcmp(r->value, q->value);
+	return cmp ? cmp :
+		     strcmp(x->set->groups[r->group].name,
+			    y->set->groups[q->group].name);
+}
+
+static int compare_refs(const void *a, const void *b)
+{
+	const struct rule_ref *x = a, *y = b;
+	int cmp = compare_key(x, y);
+	return cmp ? cmp : (x->index > y->index) - (x->index < y->index);
+}
+
+static struct rule_ref *sorted_rules(const struct ruleset *set)
+{
+	struct rule_ref *refs = calloc(set->rule_count + 1, sizeof(*refs));
+	if (!refs) {
+		error(1, errno, "Failed to allocate the rule diff");
+	}
+	for (size_t i = 0; i < set->rule_count; i++) {
+		refs[i] = (struct rule_ref){ set, i };
+	}
+	qsort(refs, set->rule_count, sizeof(*refs), compare_refs);
+	return refs;
+}
+
+// Mark the entries of seq that are part of a longest increasing
+// subsequence.
+static void mark_increasing(const size_t *seq, size_t n, bool *in)
+{
+	size_t *tails = calloc(n + 1, sizeof(*tails));
+	size_t *prev = calloc(n + 1, sizeof(*prev));
+	if (!tails || !prev) {
+		error(1, errno, "Failed to allocate the rule diff");
+	}
+	size_t length = 0;
+	for (size_t i = 0; i < n; i++) {
+		size_t low = 0, high = length;
+		while (low < high) {
+			size_t mid = (low + high) / 2;
+			if (seq[tails[mid]] < seq[i]) {
+				low = mid + 1;
+			} else {
+				high = mid;
+			}
+		}
+		prev[i] = low ? tails[low - 1] : SIZE_MAX;
+		tails[low] = i;
+		if (low == length) {
+			length++;
+		}
+	}
+	for (size_t i = length ? tails[length - 1] : SIZE_MAX; i != SIZE_MAX;
+	     i = prev[i]) {
+		in[i] = true;
+	}
+	free(tails);
+	free(prev);
+}
+
+const struct rule **ruleset_diff(const struct ruleset *old,
+				 const struct ruleset *next, size_t *count)
+{
+	struct rule_ref *a = sorted_rules(old);
+	struct rule_ref *b = sorted_rules(next);
+	// Position in next of the rule of old that it is paired with, or
+	// SIZE_MAX. Equal rules are paired in the order they appear in.
+	size_t *paired = calloc(old->rule_count + 1, sizeof(*paired));
+	bool *kept_next = calloc(next->rule_count + 1, sizeof(*kept_next));
+	const struct rule **changed = calloc(
+		old->rule_count + next->rule_count + 1, sizeof(*changed));
+	if (!paired || !kept_next || !changed) {
+		error(1, errno, "Failed to allocate the rule diff");
+	}
+	for (size_t i = 0; i < old->rule_count; i++) {
+		paired[i] = SIZE_MAX;
+	}
+	for (size_t i = 0, j = 0; i < old->rule_count && j < next->rule_count;) {
+		int cmp = compare_key(&a[i], &b[j]);
+		if (!cmp) {
+			paired[a[i].index] = b[j].index;
+			i++;
+			j++;
+		} else if (cmp < 0) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	// The paired rules in the order of old, by their position in next.
+	// The ones outside of a longest increasing run of positions moved.
+	size_t pairs = 0;
+	size_t *positions = calloc(old->rule_count + 1, sizeof(*positions));
+	size_t *from = calloc(old->rule_count + 1, sizeof(*from));
+	bool *in_order = calloc(old->rule_count + 1, sizeof(*in_order));
+	if (!positions || !from || !in_order) {
+		error(1, errno, "Failed to allocate the rule diff");
+	}
+	for (size_t i = 0; i < old->rule_count; i++) {
+		if (paired[i] != SIZE_MAX) {
+			from[pairs] = i;
+			positions[pairs++] = paired[i];
+		}
+	}
+	mark_increasing(positions, pairs, in_order);
+	for (size_t p = 0; p < pairs; p++) {
+		if (in_order[p]) {
+			kept_next[positions[p]] = true;
+		} else {
+			paired[from[p]] = SIZE_MAX;
+		}
+	}
+
+	*count = 0;
+	for (size_t i = 0; i < old->rule_count; i++) {
+		if (paired[i] == SIZE_MAX) {
+			changed[(*count)++] = &old->rules[i];
+		}
+	}
+	for (size_t j = 0; j < next->rule_count; j++) {
+		if (!kept_next[j]) {
+			changed[(*count)++] = &next->rules[j];
+		}
+	}
+	free(a);
+	free(b);
+	free(paired);
+	free(kept_next);
+	free(positions);
+	free(from);
+	free(in_order);
+	return changed;
+}
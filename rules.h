@@ -0,0 +1,158 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_RULES_H
+#define CORESCHED_RULES_H
+
+#include "proc.h"
+#include "rebalance.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// The daemon configuration is line based. Empty lines and lines starting
+// with '#' are ignored. A group is declared with
+//
+//	group NAME [cores=N|cores=MIN-MAX] [accounting[=leaf]] [tier=TIER]
+//
+// A group in tier=background holds batch work that should only use what the
+// other groups leave: its processes are put in a cgroup with cpu.idle set
+// when the group has accounting, and run with SCHED_IDLE otherwise. The
+// default is tier=service.
+//
+// A group with a range of cores is resized between MIN and MAX by the
+// rebalancer. MIN is at least 1, since a group without cores is not pinned
+// at all. The rebalancer is enabled with
+//
+//	rebalance every=MS [steps=N] [headroom=PCT] [moves=N]
+//
+// The daemon checks that the processes it placed still have the cookie of
+// their group by sampling a few of them at random, with
+//
+//	sample every=MS [size=N] [confidence=PCT]
+//
+// where PCT is one of 80, 90, 95, 98 or 99 and sets the confidence of the
+// reported bounds on the violation rate.
+//
+// Processes are assigned to a group with one selector per line
+//
+//	match NAME cgroup=/prefix | uid=UID | comm=COMM
+//
+// The first matching rule in file order decides the group of a process.
+//
+// With
+//
+//	labels [xattr=NAME]
+//
+// a cgroup can name the group of its processes itself in the extended
+// attribute user.coresched.group, or NAME, of its directory. The label of
+// the closest labeled ancestor counts for a cgroup without one, and a
+// labeled cgroup takes precedence over the match rules. Labels that do not
+// name a group are ignored, and so are labels of directories that root does
+// not own or that others can write to, since whoever can write to a
+// directory can set its user attributes. Attributes in the trusted
+// namespace only root can set, so those count on any directory.
+//
+// With
+//
+//	domains [xattr=NAME]
+//
+// an executable names the group its processes always run in, whoever
+// starts them, in the extended attribute user.coresched.domain, or NAME.
+// Processes are classified again as soon as they execute a file, and a
+// domain takes precedence over labels and rules, but not over a request on
+// the control socket. As with labels, a user attribute only counts on an
+// executable that root owns and only root can write to.
+
+enum rule_selector {
+	RULE_CGROUP,
+	RULE_UID,
+	RULE_COMM,
+};
+
+struct rule {
+	enum rule_selector selector;
+	char *value;
+	size_t len;
+	uid_t uid;
+	size_t group;
+	unsigned int line;
+};
+
+enum group_accounting {
+	GROUP_ACCT_NONE,
+	GROUP_ACCT_DEDICATED,
+	GROUP_ACCT_LEAF,
+};
+
+enum group_tier {
+	GROUP_TIER_SERVICE,
+	GROUP_TIER_BACKGROUND,
+};
+
+struct group_config {
+	char *name;
+	// Number of whole SMT cores to pin the group to, 0 to not pin it.
+	unsigned int cores;
+	// Upper bound for the rebalancer, equal to cores for a fixed size.
+	unsigned int max_cores;
+	enum group_accounting accounting;
+	enum group_tier tier;
+};
+
+struct ruleset {
+	struct group_config *groups;
+	size_t group_count;
+	struct rule *rules;
+	size_t rule_count;
+	// Whether classification needs the cgroup of a process.
+	bool needs_cgroup;
+	// Extended attribute that labels cgroups with a group, NULL if
+	// labels are not used.
+	char *label_xattr;
+	// Extended attribute of executables that names their group, NULL if
+	// domains are not used.
+	char *domain_xattr;
+	// Period of the rebalancer in milliseconds, 0 if it is disabled.
+	unsigned int rebalance_ms;
+	struct rebalance_params rebalance;
+	// Period of the compliance sampling in milliseconds, 0 if it is
+	// disabled, the processes checked per period and the z-score of the
+	// confidence level.
+	unsigned int sample_ms;
+	unsigned int sample_size;
+	double sample_z;
+};
+
+// What is known about a process when it gets classified.
+struct task_info {
+	pid_t pid;
+	uid_t uid;
+	char comm[PROC_COMM_LEN];
+	char cgroup[PATH_MAX];
+};
+
+// Parse the configuration at path. Errors are reported with their line
+// number and cause -1 to be returned.
+int ruleset_load(const char *path, struct ruleset *set);
+void ruleset_free(struct ruleset *set);
+
+// The index of the group the task belongs to, or -1 if no rule matches.
+int ruleset_classify(const struct ruleset *set, const struct task_info *task);
+bool rule_matches(const struct rule *rule, const struct task_info *task);
+
+int ruleset_find_group(const struct ruleset *set, const char *name);
+
+// The rules of old and next that can put a task in a different group under
+// the two sets: the rules that only one of them has, and the rules that both
+// have but whose order changed relative to the others, as only the first
+// match counts. Rules are the same when their selector, value and group name
+// are. A task that matches none of the returned rules is in the group with
+// the same name under both sets. The returned array points into both sets
+// and is freed by the caller.
+const struct rule **ruleset_diff(const struct ruleset *old,
+				 const struct ruleset *next, size_t *count);
+
+#endif
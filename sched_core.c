@@ -0,0 +1,27 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "coresched.h"
+
+int core_sched_get(pid_t pid, unsigned long *cookie)
+{
+	*cookie = 0;
+	return prctl(PR_SCHED_CORE, PR_SCHED_CORE_GET, pid,
+		     SCHED_CORE_SCOPE_PID, cookie);
+}
+
+int core_sched_create(pid_t pid, core_sched_type_t type)
+{
+	return prctl(PR_SCHED_CORE, PR_SCHED_CORE_CREATE, pid, type, 0);
+}
+
+int core_sched_share_from(pid_t pid)
+{
+	return prctl(PR_SCHED_CORE, PR_SCHED_CORE_SHARE_FROM, pid,
+		     SCHED_CORE_SCOPE_PID, 0);
+}
+
+int core_sched_share_to(pid_t pid, core_sched_type_t type)
+{
+	return prctl(PR_SCHED_CORE, PR_SCHED_CORE_SHARE_TO, pid, type, 0);
+}
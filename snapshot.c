@@ -0,0 +1,172 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "snapshot.h"
+#include "coresched.h"
+#include "procread.h"
+#include "util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every thread takes three files: stat, schedstat and sched.
+#define FILES_PER_THREAD 3
+#define THREADS_PER_BATCH (PROCREAD_BATCH / FILES_PER_THREAD)
+
+struct task_ref {
+	pid_t pid;
+	pid_t tid;
+};
+
+struct task_list {
+	struct task_ref *tasks;
+	size_t count;
+	size_t capacity;
+	pid_t pid;
+};
+
+static int add_thread(pid_t tid, void *data)
+{
+	struct task_list *list = data;
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 1024;
+		list->tasks = realloc(list->tasks,
+				      list->capacity * sizeof(*list->tasks));
+		if (!list->tasks) {
+			error(1, errno, "Failed to allocate thread list");
+		}
+	}
+	list->tasks[list->count++] = (struct task_ref){ list->pid, tid };
+	return 0;
+}
+
+static int add_process(pid_t pid, void *data)
+{
+	struct task_list *list = data;
+	list->pid = pid;
+	proc_for_each_task(pid, add_thread, list);
+	return 0;
+}
+
+static void add_sample(struct snapshot *snap,
+		       const struct thread_sample *sample)
+{
+	if (snap->count == snap->capacity) {
+		snap->capacity = snap->capacity ? snap->capacity * 2 : 1024;
+		snap->threads = realloc(snap->threads,
+					snap->capacity * sizeof(*snap->threads));
+		if (!snap->threads) {
+			error(1, errno, "Failed to allocate thread samples");
+		}
+	}
+	snap->threads[snap->count++] = *sample;
+}
+
+static void sample_batch(struct snapshot *snap, struct procread *reader,
+			 const struct task_ref *tasks, size_t count)
+{
+	char paths[PROCREAD_BATCH][48];
+	const char *path_list[PROCREAD_BATCH];
+	static const char *files[FILES_PER_THREAD] = { "stat", "schedstat",
+						       "sched" };
+	for (size_t i = 0; i < count * FILES_PER_THREAD; i++) {
+		snprintf(paths[i], sizeof(paths[i]), "/proc/%d/task/%d/%s",
+			 tasks[i / FILES_PER_THREAD].pid,
+			 tasks[i / FILES_PER_THREAD].tid,
+			 files[i % FILES_PER_THREAD]);
+		path_list[i] = paths[i];
+	}
+	procread_run(reader, path_list, count * FILES_PER_THREAD);
+
+	for (size_t i = 0; i < count; i++) {
+		const char *stat_buf = procread_data(reader, i * FILES_PER_THREAD);
+		const char *schedstat = procread_data(reader, i * FILES_PER_THREAD + 1);
+		const char *sched = procread_data(reader, i * FILES_PER_THREAD + 2);
+		struct thread_sample sample = { .tid = tasks[i].tid,
+						.pid = tasks[i].pid };
+		struct proc_stat stat;
+		if (!stat_buf || !schedstat ||
+		    proc_parse_stat(stat_buf, &stat) ||
+		    proc_is_kthread(tasks[i].pid, &stat) ||
+		    proc_parse_schedstat(schedstat, &sample.run_ns,
+					 &sample.wait_ns)) {
+			continue;
+		}
+		if (sched) {
+			proc_parse_forceidle(sched, &sample.forceidle_ns);
+		}
+		core_sched_get(sample.tid, &sample.cookie);
+		memcpy(sample.comm, stat.comm, sizeof(sample.comm));
+		sample.processor = stat.processor;
+		add_sample(snap, &sample);
+	}
+}
+
+static int compare_tid(const void *a, const void *b)
+{
+	const struct thread_sample *x = a, *y = b;
+	return (x->tid > y->tid) - (x->tid < y->tid);
+}
+
+// Snapshots are taken over and over by the same command, so the reader and
+// its registered buffers are set up once.
+static struct procread reader;
+static bool reader_ready;
+
+void snapshot_take(struct snapshot *snap)
+{
+	if (!reader_ready) {
+		if (procread_init(&reader)) {
+			error(1, errno, "Failed to allocate the procfs reader");
+		}
+		reader_ready = true;
+	}
+
+	struct task_list list = { 0 };
+	snap->count = 0;
+	snap->taken_at = now_ns();
+	proc_for_each_pid(add_process, &list);
+	for (size_t i = 0; i < list.count; i += THREADS_PER_BATCH) {
+		size_t left = list.count - i;
+		sample_batch(snap, &reader, list.tasks + i,
+			     left < THREADS_PER_BATCH ? left :
+							THREADS_PER_BATCH);
+	}
+	free(list.tasks);
+	qsort(snap->threads, snap->count, sizeof(*snap->threads),
+	      compare_tid);
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+	free(snap->threads);
+	memset(snap, 0, sizeof(*snap));
+}
+
+struct thread_sample *snapshot_find(const struct snapshot *snap, pid_t tid)
+{
+	struct thread_sample key = { .tid = tid };
+	return bsearch(&key, snap->threads, snap->count, sizeof(key),
+		       compare_tid);
+}
+
+void snapshot_diff(const struct snapshot *before, struct snapshot *after)
+{
+	double elapsed_ns = after->taken_at - before->taken_at;
+	for (size_t i = 0; i < after->count; i++) {
+		struct thread_sample *t = &after->threads[i];
+		struct thread_sample *prev = snapshot_find(before, t->tid);
+		if (!prev || elapsed_ns <= 0) {
+			continue;
+		}
+		t->diffed = true;
+		t->run_pct = 100 * (t->run_ns - prev->run_ns) / elapsed_ns;
+		t->wait_pct = 100 * (t->wait_ns - prev->wait_ns) / elapsed_ns;
+		t->forceidle_delta_ns = t->forceidle_ns - prev->forceidle_ns;
+		t->forceidle_rate = t->forceidle_delta_ns / 1e6 /
+				    (elapsed_ns / 1e9);
+	}
+}
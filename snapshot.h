@@ -0,0 +1,46 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_SNAPSHOT_H
+#define CORESCHED_SNAPSHOT_H
+
+#include "proc.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct thread_sample {
+	pid_t tid;
+	pid_t pid;
+	unsigned long long run_ns;
+	unsigned long long wait_ns;
+	unsigned long long forceidle_ns;
+	unsigned long cookie;
+	char comm[PROC_COMM_LEN];
+	int processor;
+	// Filled in by snapshot_diff from the previous snapshot.
+	bool diffed;
+	double run_pct;
+	double wait_pct;
+	unsigned long long forceidle_delta_ns;
+	double forceidle_rate;
+};
+
+// The scheduling counters of every user space thread at one point in time,
+// sorted by tid.
+struct snapshot {
+	struct thread_sample *threads;
+	size_t count;
+	size_t capacity;
+	unsigned long long taken_at;
+};
+
+void snapshot_take(struct snapshot *snap);
+void snapshot_free(struct snapshot *snap);
+struct thread_sample *snapshot_find(const struct snapshot *snap, pid_t tid);
+
+// Compute the rates of every thread in after that also exists in before.
+void snapshot_diff(const struct snapshot *before, struct snapshot *after);
+
+#endif
@@ -0,0 +1,253 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "topology.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+
+int cpulist_parse(const char *str, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (*str && *str != '\n') {
+		char *end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+		if (end == str || first < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+		if (last >= CPU_SETSIZE) {
+			errno = ERANGE;
+			return -1;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		str = end;
+		if (*str == ',') {
+			str++;
+		}
+	}
+	return 0;
+}
+
+char *cpulist_format(const cpu_set_t *set, char *buf, size_t len)
+{
+	size_t used = 0;
+	buf[0] = '\0';
+	for (int cpu = 0; cpu < CPU_SETSIZE && used < len; cpu++) {
+		if (!CPU_ISSET(cpu, set)) {
+			continue;
+		}
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+			last++;
+		}
+		const char *sep = used ? "," : "";
+		if (last == cpu) {
+			used += snprintf(buf + used, len - used, "%s%d", sep,
+					 cpu);
+		} else {
+			used += snprintf(buf + used, len - used, "%s%d-%d",
+					 sep, cpu, last);
+		}
+		cpu = last;
+	}
+	return buf;
+}
+
+static int read_cpulist(const char *path, cpu_set_t *set)
+{
+	char buf[4096];
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return -1;
+	}
+	char *line = fgets(buf, sizeof(buf), file);
+	fclose(file);
+	if (!line) {
+		errno = EINVAL;
+		return -1;
+	}
+	return cpulist_parse(line, set);
+}
+
+int topology_read(struct topology *topo)
+{
+	memset(topo, 0, sizeof(*topo));
+	if (read_cpulist(SYSFS_CPU "/online", &topo->online)) {
+		return -1;
+	}
+
+	topo->cores = calloc(CPU_COUNT(&topo->online), sizeof(*topo->cores));
+	if (!topo->cores) {
+		return -1;
+	}
+
+	cpu_set_t seen;
+	CPU_ZERO(&seen);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &topo->online) || CPU_ISSET(cpu, &seen)) {
+			continue;
+		}
+
+		char path[128];
+		cpu_set_t siblings;
+		snprintf(path, sizeof(path),
+			 SYSFS_CPU "/cpu%d/topology/thread_siblings_list",
+			 cpu);
+		if (read_cpulist(path, &siblings)) {
+			// Without topology information every CPU is its own
+			// core, which is what the scheduler assumes as well.
+			CPU_ZERO(&siblings);
+			CPU_SET(cpu, &siblings);
+		}
+		// The list may still name siblings that are going offline.
+		CPU_AND(&siblings, &siblings, &topo->online);
+		CPU_SET(cpu, &siblings);
+		CPU_OR(&seen, &seen, &siblings);
+
+		struct topology_core *core = &topo->cores[topo->core_count++];
+		core->id = cpu;
+		core->cpus = siblings;
+		if (CPU_COUNT(&siblings) > topo->threads_per_core) {
+			topo->threads_per_core = CPU_COUNT(&siblings);
+		}
+	}
+	return 0;
+}
+
+void topology_free(struct topology *topo)
+{
+	free(topo->cores);
+	topo->cores = NULL;
+	topo->core_count = 0;
+}
+
+int topology_core_of(const struct topology *topo, int cpu)
+{
+	for (size_t i = 0; i < topo->core_count; i++) {
+		if (CPU_ISSET(cpu, &topo->cores[i].cpus)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+const struct topology_core *topology_find_core(const struct topology *topo,
+					       int id)
+{
+	for (size_t i = 0; i < topo->core_count; i++) {
+		if (topo->cores[i].id == id) {
+			return &topo->cores[i];
+		}
+	}
+	return NULL;
+}
+
+static int write_sysfs(const char *path, const char *value)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t len = strlen(value);
+	int ret = write(fd, value, len) == len ? 0 : -1;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
+static int set_cpu_online(int cpu, bool online)
+{
+	char path[128];
+	snprintf(path, sizeof(path), SYSFS_CPU "/cpu%d/online", cpu);
+	return write_sysfs(path, online ? "1" : "0");
+}
+
+int smt_disable(struct smt_saved *saved)
+{
+	memset(saved, 0, sizeof(*saved));
+
+	FILE *file = fopen(SYSFS_CPU "/smt/control", "r");
+	if (file) {
+		if (!fgets(saved->control, sizeof(saved->control), file)) {
+			saved->control[0] = '\0';
+		}
+		fclose(file);
+		saved->control[strcspn(saved->control, "\n")] = '\0';
+	}
+	if (!strcmp(saved->control, "off") ||
+	    !strcmp(saved->control, "forceoff")) {
+		return 0;
+	}
+	if (!strcmp(saved->control, "on") &&
+	    !write_sysfs(SYSFS_CPU "/smt/control", "off")) {
+		saved->method = SMT_CONTROL;
+		return 0;
+	}
+
+	struct topology topo;
+	if (topology_read(&topo)) {
+		return -1;
+	}
+	saved->method = SMT_OFFLINED;
+	int ret = 0;
+	for (size_t i = 0; i < topo.core_count && !ret; i++) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (cpu == topo.cores[i].id ||
+			    !CPU_ISSET(cpu, &topo.cores[i].cpus)) {
+				continue;
+			}
+			if (set_cpu_online(cpu, false)) {
+				ret = -1;
+				break;
+			}
+			CPU_SET(cpu, &saved->offlined);
+		}
+	}
+	topology_free(&topo);
+	if (ret) {
+		int saved_errno = errno;
+		smt_restore(saved);
+		errno = saved_errno;
+	}
+	return ret;
+}
+
+int smt_restore(const struct smt_saved *saved)
+{
+	int ret = 0;
+	switch (saved->method) {
+	case SMT_UNCHANGED:
+		break;
+	case SMT_CONTROL:
+		ret = write_sysfs(SYSFS_CPU "/smt/control", saved->control);
+		break;
+	case SMT_OFFLINED:
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &saved->offlined) &&
+			    set_cpu_online(cpu, true)) {
+				ret = -1;
+			}
+		}
+		break;
+	}
+	return ret;
+}
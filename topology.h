@@ -0,0 +1,58 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_TOPOLOGY_H
+#define CORESCHED_TOPOLOGY_H
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// A physical core and the SMT siblings that share it. A core is identified
+// by the lowest numbered online CPU in its thread_siblings_list.
+struct topology_core {
+	int id;
+	cpu_set_t cpus;
+};
+
+struct topology {
+	cpu_set_t online;
+	struct topology_core *cores;
+	size_t core_count;
+	// Highest number of online siblings of any core.
+	int threads_per_core;
+};
+
+int topology_read(struct topology *topo);
+void topology_free(struct topology *topo);
+
+// Index of the core that cpu belongs to, or -1 if the cpu is offline.
+int topology_core_of(const struct topology *topo, int cpu);
+
+// Find the core with the given id, or NULL if it no longer exists.
+const struct topology_core *topology_find_core(const struct topology *topo,
+					       int id);
+
+// How SMT was turned off, so that it can be turned back on.
+struct smt_saved {
+	enum {
+		SMT_UNCHANGED,
+		SMT_CONTROL,
+		SMT_OFFLINED,
+	} method;
+	char control[32];
+	cpu_set_t offlined;
+};
+
+// Turn SMT off through smt/control, or by offlining every sibling but the
+// first of each core when the control is not available.
+int smt_disable(struct smt_saved *saved);
+int smt_restore(const struct smt_saved *saved);
+
+// Parse a cpulist such as "0-3,8,10-11" as used in sysfs.
+int cpulist_parse(const char *str, cpu_set_t *set);
+
+// Format a cpu set as a cpulist. Returns buf.
+char *cpulist_format(const cpu_set_t *set, char *buf, size_t len);
+
+#endif
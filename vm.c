@@ -0,0 +1,340 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "vm.h"
+#include "coresched.h"
+#include "proc.h"
+#include "topology.h"
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Longest QEMU command line that is searched for -smp.
+#define VM_CMDLINE_LEN 65536
+
+struct vhost_search {
+	pid_t owner;
+	char name[PROC_COMM_LEN];
+	struct vhost_worker *workers;
+	size_t count;
+};
+
+static void add_worker(struct vhost_search *search, pid_t tid, bool kthread)
+{
+	struct vhost_worker *workers =
+		realloc(search->workers,
+			(search->count + 1) * sizeof(*workers));
+	if (!workers) {
+		error(1, errno, "Failed to allocate vhost workers");
+	}
+	workers[search->count++] = (struct vhost_worker){ tid, kthread };
+	search->workers = workers;
+}
+
+static int visit_thread(pid_t tid, void *data)
+{
+	struct vhost_search *search = data;
+	struct proc_stat stat;
+	if (tid != search->owner && !proc_read_stat(tid, &stat) &&
+	    !strcmp(stat.comm, search->name)) {
+		add_worker(search, tid, false);
+	}
+	return 0;
+}
+
+static int visit_kthread(pid_t pid, void *data)
+{
+	struct vhost_search *search = data;
+	struct proc_stat stat;
+	if (!proc_read_stat(pid, &stat) && proc_is_kthread(pid, &stat) &&
+	    !strcmp(stat.comm, search->name)) {
+		add_worker(search, pid, true);
+	}
+	return 0;
+}
+
+size_t vm_find_vhost_workers(pid_t pid, struct vhost_worker **workers)
+{
+	struct vhost_search search = { .owner = pid };
+	snprintf(search.name, sizeof(search.name), "vhost-%d", pid);
+
+	proc_for_each_task(pid, visit_thread, &search);
+	// User workers replaced the kernel threads, so only look for the
+	// old style when the thread group has none.
+	if (!search.count) {
+		proc_for_each_pid(visit_kthread, &search);
+	}
+	*workers = search.workers;
+	return search.count;
+}
+
+size_t vm_tag_vhost_workers(pid_t pid)
+{
+	unsigned long cookie;
+	if (core_sched_get(pid, &cookie)) {
+		error(1, errno, "Failed to get cookie from PID %d", pid);
+	}
+	if (!cookie) {
+		error(1, 0,
+		      "PID %d doesn't have a core scheduling cookie, create one first",
+		      pid);
+	}
+
+	struct vhost_worker *workers;
+	size_t count = vm_find_vhost_workers(pid, &workers);
+	if (!count) {
+		printf("pid %d has no vhost workers\n", pid);
+		free(workers);
+		return 0;
+	}
+	if (core_sched_share_from(pid)) {
+		error(1, errno, "Failed to pull cookie from PID %d", pid);
+	}
+
+	size_t failed = 0;
+	for (size_t i = 0; i < count; i++) {
+		const char *kind = workers[i].kthread ? "kernel" : "user";
+		unsigned long current;
+		if (!core_sched_get(workers[i].tid, &current) &&
+		    current == cookie) {
+			printf("vhost worker %d (%s): already has cookie 0x%lx\n",
+			       workers[i].tid, kind, cookie);
+		} else if (core_sched_share_to(workers[i].tid,
+					       SCHED_CORE_SCOPE_PID)) {
+			printf("vhost worker %d (%s): could not be tagged: %s\n",
+			       workers[i].tid, kind, strerror(errno));
+			failed++;
+		} else {
+			printf("vhost worker %d (%s): tagged with cookie 0x%lx\n",
+			       workers[i].tid, kind, cookie);
+		}
+	}
+	free(workers);
+	return failed;
+}
+
+int vm_parse_topology(const char *spec, struct vm_topology *topo)
+{
+	unsigned long cpus = 0, product = 1, threads = 1;
+	char *copy = strdup(spec);
+	if (!copy) {
+		return -1;
+	}
+
+	int ret = 0;
+	char *save = NULL;
+	for (char *item = strtok_r(copy, ",", &save); item;
+	     item = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(item, '=');
+		const char *key = value ? item : "cpus";
+		value = value ? value + 1 : item;
+		if (value != item) {
+			value[-1] = '\0';
+		}
+		char *end;
+		errno = 0;
+		unsigned long n = strtoul(value, &end, 10);
+		if (*end || end == value || errno || !n || n > UINT_MAX) {
+			ret = -1;
+			break;
+		}
+		if (!strcmp(key, "cpus")) {
+			cpus = n;
+		} else if (!strcmp(key, "threads")) {
+			threads = n;
+			product *= n;
+		} else if (!strcmp(key, "sockets") || !strcmp(key, "dies") ||
+			   !strcmp(key, "clusters") || !strcmp(key, "cores") ||
+			   !strcmp(key, "books") || !strcmp(key, "drawers")) {
+			product *= n;
+		} else if (strcmp(key, "maxcpus")) {
+			ret = -1;
+			break;
+		}
+	}
+	free(copy);
+	if (ret) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Like QEMU, the number of CPUs follows from the topology when it
+	// is not given.
+	topo->vcpus = cpus ? cpus : product;
+	topo->threads = threads;
+	return 0;
+}
+
+int vm_read_topology(pid_t pid, struct vm_topology *topo)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	char *buf = malloc(VM_CMDLINE_LEN + 1);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	size_t len = 0;
+	ssize_t n;
+	while (len < VM_CMDLINE_LEN &&
+	       (n = read(fd, buf + len, VM_CMDLINE_LEN - len)) > 0) {
+		len += n;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	int ret = -1;
+	errno = ENOENT;
+	for (char *arg = buf; arg < buf + len; arg += strlen(arg) + 1) {
+		if (strcmp(arg, "-smp") && strcmp(arg, "--smp")) {
+			continue;
+		}
+		char *value = arg + strlen(arg) + 1;
+		if (value < buf + len) {
+			ret = vm_parse_topology(value, topo);
+		}
+		break;
+	}
+	free(buf);
+	return ret;
+}
+
+struct vcpu_search {
+	pid_t *tids;
+	unsigned int count;
+};
+
+// QEMU names its vCPU threads "CPU <index>/KVM".
+static int visit_vcpu(pid_t tid, void *data)
+{
+	struct vcpu_search *search = data;
+	struct proc_stat stat;
+	unsigned int index;
+	char kvm[4];
+	if (!proc_read_stat(tid, &stat) &&
+	    sscanf(stat.comm, "CPU %u/%3s", &index, kvm) == 2 &&
+	    !strcmp(kvm, "KVM") && index < search->count) {
+		search->tids[index] = tid;
+	}
+	return 0;
+}
+
+// Give the vCPU thread tid the cookie of the VM, unless it already has it.
+static int tag_vcpu(pid_t tid, unsigned long cookie)
+{
+	unsigned long current;
+	if (!core_sched_get(tid, &current) && current == cookie) {
+		return 0;
+	}
+	return core_sched_share_to(tid, SCHED_CORE_SCOPE_PID);
+}
+
+size_t vm_pin_vcpus(pid_t pid, const struct vm_topology *topo)
+{
+	unsigned long cookie;
+	if (core_sched_get(pid, &cookie)) {
+		error(1, errno, "Failed to get cookie from PID %d", pid);
+	}
+	if (!cookie) {
+		error(1, 0,
+		      "PID %d doesn't have a core scheduling cookie, create one first",
+		      pid);
+	}
+	if (topo->threads < 2) {
+		printf("pid %d shows no SMT to its guest, nothing to pair\n",
+		       pid);
+		return 0;
+	}
+	if (core_sched_share_from(pid)) {
+		error(1, errno, "Failed to pull cookie from PID %d", pid);
+	}
+
+	struct vcpu_search search = { .count = topo->vcpus };
+	search.tids = calloc(topo->vcpus, sizeof(*search.tids));
+	if (!search.tids) {
+		error(1, errno, "Failed to allocate vCPU threads");
+	}
+	proc_for_each_task(pid, visit_vcpu, &search);
+
+	struct topology host;
+	cpu_set_t allowed;
+	if (topology_read(&host)) {
+		error(1, errno, "Failed to read the CPU topology");
+	}
+	if (sched_getaffinity(pid, sizeof(allowed), &allowed)) {
+		error(1, errno, "Failed to get the CPUs of PID %d", pid);
+	}
+	CPU_AND(&allowed, &allowed, &host.online);
+
+	unsigned int guest_cores =
+		(topo->vcpus + topo->threads - 1) / topo->threads;
+	size_t host_core = 0, failed = 0;
+	for (unsigned int core = 0; core < guest_cores; core++) {
+		unsigned int first = core * topo->threads;
+		unsigned int last = first + topo->threads;
+		last = last < topo->vcpus ? last : topo->vcpus;
+
+		// The next host core with a sibling for every vCPU.
+		cpu_set_t siblings;
+		CPU_ZERO(&siblings);
+		for (; host_core < host.core_count; host_core++) {
+			CPU_AND(&siblings, &host.cores[host_core].cpus,
+				&allowed);
+			if (CPU_COUNT(&siblings) >= (int)(last - first)) {
+				break;
+			}
+		}
+		if (host_core == host.core_count) {
+			printf("guest core %u: no host core with %u free siblings left\n",
+			       core, last - first);
+			failed++;
+			continue;
+		}
+
+		printf("guest core %u -> host core %d:", core,
+		       host.cores[host_core].id);
+		bool paired = true;
+		int cpu = -1;
+		for (unsigned int vcpu = first; vcpu < last; vcpu++) {
+			while (!CPU_ISSET(++cpu, &siblings)) {
+			}
+			pid_t tid = search.tids[vcpu];
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			if (!tid) {
+				printf(" vCPU %u not found", vcpu);
+				paired = false;
+			} else if (sched_setaffinity(tid, sizeof(one), &one)) {
+				printf(" vCPU %u could not be pinned: %s", vcpu,
+				       strerror(errno));
+				paired = false;
+			} else if (tag_vcpu(tid, cookie)) {
+				printf(" vCPU %u could not be tagged: %s", vcpu,
+				       strerror(errno));
+				paired = false;
+			} else {
+				printf(" vCPU %u on CPU %d", vcpu, cpu);
+			}
+		}
+		printf("%s\n", paired ? "" : " (not paired)");
+		failed += !paired;
+		host_core++;
+	}
+	printf("paired %zu of %u guest cores with cookie 0x%lx\n",
+	       guest_cores - failed, guest_cores, cookie);
+
+	topology_free(&host);
+	free(search.tids);
+	return failed;
+}
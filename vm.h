@@ -0,0 +1,46 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_VM_H
+#define CORESCHED_VM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct vhost_worker {
+	pid_t tid;
+	// Kernels before 6.4 run vhost work in kernel threads named
+	// vhost-<owner pid> instead of in the owner's thread group.
+	bool kthread;
+};
+
+// Find the vhost workers of the VM process pid. The caller frees workers.
+size_t vm_find_vhost_workers(pid_t pid, struct vhost_worker **workers);
+
+// Give every vhost worker of the VM process pid the cookie of pid and
+// report for each of them whether that worked. Returns the number of
+// workers that could not be tagged.
+size_t vm_tag_vhost_workers(pid_t pid);
+
+// The CPU topology that a VM shows its guest.
+struct vm_topology {
+	unsigned int vcpus;
+	// SMT threads per guest core.
+	unsigned int threads;
+};
+
+// Parse a topology in the syntax of QEMU's -smp option, for example
+// "8,threads=2" or "sockets=1,cores=4,threads=2".
+int vm_parse_topology(const char *spec, struct vm_topology *topo);
+
+// Find the -smp option on the command line of the QEMU process pid.
+int vm_read_topology(pid_t pid, struct vm_topology *topo);
+
+// Pin the vCPU threads of the VM process pid so that the vCPUs of every
+// guest core run on the siblings of one host core, using the cores that
+// pid is allowed to run on, and give them the cookie of pid. Reports the
+// pairing and returns the number of guest cores that could not be paired.
+size_t vm_pin_vcpus(pid_t pid, const struct vm_topology *topo);
+
+#endif
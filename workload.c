@@ -0,0 +1,472 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#include "workload.h"
+#include "coresched.h"
+#include "util.h"
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Every thread keeps at most this many latency samples.
+#define WORKLOAD_SAMPLES 4096
+// Amount of work in one operation of the compute kernels.
+#define WORKLOAD_OP_ITERATIONS 4096
+#define WORKLOAD_OP_SYSCALLS 64
+#define WORKLOAD_FP_LEN 1024
+
+static const char *kernel_names[] = {
+	[WORKLOAD_INT] = "int",	      [WORKLOAD_FP] = "fp",
+	[WORKLOAD_STREAM] = "stream", [WORKLOAD_CHASE] = "chase",
+	[WORKLOAD_SYSCALL] = "syscall", [WORKLOAD_SLEEP] = "sleep",
+};
+
+const char *workload_kernel_name(enum workload_kernel kernel)
+{
+	return kernel_names[kernel];
+}
+
+static bool parse_number(const char *str, unsigned long long max,
+			 unsigned long long *value)
+{
+	char *end = NULL;
+	errno = 0;
+	*value = strtoull(str, &end, 10);
+	return !errno && end != str && *end == '\0' && str[0] != '-' &&
+	       *value <= max;
+}
+
+static int parse_pair(char *pair, struct workload *wl,
+		      struct workload_class *class, const char **error_msg)
+{
+	char *value = strchr(pair, '=');
+	unsigned long long number;
+	if (!value) {
+		*error_msg = "workload keys need a value";
+		return -1;
+	}
+	*value++ = '\0';
+
+	if (!strcmp(pair, "kernel")) {
+		for (size_t i = 0; i < sizeof(kernel_names) / sizeof(*kernel_names);
+		     i++) {
+			if (!strcmp(value, kernel_names[i])) {
+				class->kernel = i;
+				return 0;
+			}
+		}
+		*error_msg = "unknown workload kernel";
+		return -1;
+	}
+	if (!parse_number(value, UINT32_MAX, &number)) {
+		*error_msg = "workload values must be non-negative numbers";
+		return -1;
+	}
+	if (!strcmp(pair, "threads") && number > 0) {
+		class->threads = number;
+	} else if (!strcmp(pair, "duty") && number > 0 && number <= 100) {
+		class->duty = number;
+	} else if (!strcmp(pair, "period") && number > 0) {
+		class->period_ms = number;
+	} else if (!strcmp(pair, "size") && number > 0) {
+		class->size_kb = number;
+	} else if (!strcmp(pair, "ops")) {
+		class->ops = number;
+	} else if (!strcmp(pair, "cookie")) {
+		class->cookie = number;
+	} else if (!strcmp(pair, "time") && number > 0) {
+		wl->time_ms = number;
+	} else if (!strcmp(pair, "seed")) {
+		wl->seed = number;
+	} else {
+		*error_msg = "unknown workload key or value out of range";
+		return -1;
+	}
+	return 0;
+}
+
+int workload_parse(const char *spec, struct workload *wl,
+		   const char **error_msg)
+{
+	memset(wl, 0, sizeof(*wl));
+	wl->seed = 1;
+
+	char *copy = strdup(spec);
+	if (!copy) {
+		error(1, errno, "Failed to parse workload");
+	}
+	int ret = 0;
+	char *class_save = NULL;
+	for (char *text = strtok_r(copy, ";", &class_save); text && !ret;
+	     text = strtok_r(NULL, ";", &class_save)) {
+		struct workload_class class = {
+			.threads = 1,
+			.kernel = WORKLOAD_INT,
+			.duty = 100,
+			.period_ms = 10,
+			.size_kb = 4096,
+			.cookie = -1,
+		};
+		char *pair_save = NULL;
+		for (char *pair = strtok_r(text, ",", &pair_save);
+		     pair && !ret; pair = strtok_r(NULL, ",", &pair_save)) {
+			ret = parse_pair(pair, wl, &class, error_msg);
+		}
+
+		struct workload_class *classes =
+			realloc(wl->classes,
+				(wl->class_count + 1) * sizeof(*classes));
+		if (!classes) {
+			error(1, errno, "Failed to parse workload");
+		}
+		classes[wl->class_count++] = class;
+		wl->classes = classes;
+	}
+	free(copy);
+
+	if (!ret && !wl->class_count) {
+		*error_msg = "the workload has no threads";
+		ret = -1;
+	}
+	bool bounded = wl->time_ms;
+	for (size_t i = 0; i < wl->class_count; i++) {
+		bounded |= wl->classes[i].ops != 0;
+	}
+	if (!bounded) {
+		wl->time_ms = 1000;
+	}
+	if (ret) {
+		workload_free(wl);
+	}
+	return ret;
+}
+
+void workload_free(struct workload *wl)
+{
+	free(wl->classes);
+	memset(wl, 0, sizeof(*wl));
+}
+
+struct workload_thread {
+	const struct workload_class *class;
+	pthread_t thread;
+	pid_t tid;
+	uint64_t rng;
+	pthread_barrier_t *ready;
+	atomic_bool *stop;
+	void *buffer;
+	size_t buffer_len;
+	size_t position;
+	unsigned long long ops;
+	unsigned long long recorded;
+	size_t sample_count;
+	double samples[WORKLOAD_SAMPLES];
+};
+
+static uint64_t xorshift(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+// Keeps the compiler from optimizing the kernels away.
+static volatile uint64_t workload_sink;
+
+static void op_int(struct workload_thread *t)
+{
+	uint64_t x = t->rng, acc = 0;
+	for (int i = 0; i < WORKLOAD_OP_ITERATIONS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		acc += x * 0x9e3779b97f4a7c15ULL;
+	}
+	t->rng = x;
+	workload_sink = acc;
+}
+
+static void op_fp(struct workload_thread *t)
+{
+	double *a = t->buffer;
+	for (int round = 0; round < WORKLOAD_OP_ITERATIONS / WORKLOAD_FP_LEN;
+	     round++) {
+		for (int i = 0; i < WORKLOAD_FP_LEN; i++) {
+			a[i] = a[i] * 0.999999 + 0.5;
+		}
+	}
+	workload_sink = a[0];
+}
+
+static void op_stream(struct workload_thread *t)
+{
+	uint64_t *words = t->buffer;
+	size_t count = t->buffer_len / sizeof(*words);
+	size_t half = count / 2;
+	for (size_t i = 0; i < half; i++) {
+		words[i] = words[half + i] + 3 * words[i];
+	}
+	workload_sink = words[0];
+}
+
+static void op_chase(struct workload_thread *t)
+{
+	size_t *next = t->buffer;
+	size_t at = t->position;
+	for (int i = 0; i < WORKLOAD_OP_ITERATIONS; i++) {
+		at = next[at];
+	}
+	t->position = at;
+}
+
+static void op_syscall(struct workload_thread *t)
+{
+	(void)t;
+	for (int i = 0; i < WORKLOAD_OP_SYSCALLS; i++) {
+		getppid();
+	}
+}
+
+static void op_sleep(struct workload_thread *t)
+{
+	(void)t;
+	struct timespec nap = { .tv_nsec = 50000 };
+	nanosleep(&nap, NULL);
+}
+
+static void (*const kernel_ops[])(struct workload_thread *) = {
+	[WORKLOAD_INT] = op_int,       [WORKLOAD_FP] = op_fp,
+	[WORKLOAD_STREAM] = op_stream, [WORKLOAD_CHASE] = op_chase,
+	[WORKLOAD_SYSCALL] = op_syscall, [WORKLOAD_SLEEP] = op_sleep,
+};
+
+static void prepare_buffer(struct workload_thread *t)
+{
+	const struct workload_class *class = t->class;
+	switch (class->kernel) {
+	case WORKLOAD_FP:
+		t->buffer_len = WORKLOAD_FP_LEN * sizeof(double);
+		break;
+	case WORKLOAD_STREAM:
+	case WORKLOAD_CHASE:
+		t->buffer_len = class->size_kb * 1024;
+		break;
+	default:
+		return;
+	}
+	t->buffer = malloc(t->buffer_len);
+	if (!t->buffer) {
+		error(1, errno, "Failed to allocate workload buffer");
+	}
+
+	if (class->kernel == WORKLOAD_CHASE) {
+		// Sattolo's algorithm gives a single cycle through every
+		// slot, so the chase never gets stuck in a short loop.
+		size_t *next = t->buffer;
+		size_t count = t->buffer_len / sizeof(*next);
+		for (size_t i = 0; i < count; i++) {
+			next[i] = i;
+		}
+		for (size_t i = count - 1; i > 0; i--) {
+			size_t j = xorshift(&t->rng) % i;
+			size_t tmp = next[i];
+			next[i] = next[j];
+			next[j] = tmp;
+		}
+	} else if (class->kernel == WORKLOAD_FP) {
+		double *a = t->buffer;
+		for (size_t i = 0; i < WORKLOAD_FP_LEN; i++) {
+			a[i] = (double)(xorshift(&t->rng) % 1000);
+		}
+	} else {
+		memset(t->buffer, 1, t->buffer_len);
+	}
+}
+
+// Reservoir sampling keeps the samples representative of the whole run,
+// and the seeded generator keeps them reproducible.
+static void record(struct workload_thread *t, double us)
+{
+	t->recorded++;
+	if (t->sample_count < WORKLOAD_SAMPLES) {
+		t->samples[t->sample_count++] = us;
+		return;
+	}
+	uint64_t slot = xorshift(&t->rng) % t->recorded;
+	if (slot < WORKLOAD_SAMPLES) {
+		t->samples[slot] = us;
+	}
+}
+
+static void *workload_thread(void *data)
+{
+	struct workload_thread *t = data;
+	const struct workload_class *class = t->class;
+	void (*op)(struct workload_thread *) = kernel_ops[class->kernel];
+
+	t->tid = gettid();
+	prepare_buffer(t);
+	// Once for the tid to be known, once for the cookies to be set.
+	pthread_barrier_wait(t->ready);
+	pthread_barrier_wait(t->ready);
+
+	unsigned long long period = class->period_ms * 1000000ULL;
+	unsigned long long busy = period * class->duty / 100;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!atomic_load_explicit(t->stop, memory_order_relaxed) &&
+	       (!class->ops || t->ops < class->ops)) {
+		unsigned long long start = now_ns();
+		unsigned long long until = start + busy;
+		unsigned long long at = start;
+		do {
+			op(t);
+			unsigned long long end = now_ns();
+			record(t, (end - at) / 1e3);
+			at = end;
+			t->ops++;
+		} while (at < until && (!class->ops || t->ops < class->ops));
+
+		if (class->duty < 100) {
+			next.tv_nsec += period % 1000000000ULL;
+			next.tv_sec += period / 1000000000ULL +
+				       next.tv_nsec / 1000000000L;
+			next.tv_nsec %= 1000000000L;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+					NULL);
+		}
+	}
+	free(t->buffer);
+	return NULL;
+}
+
+static void assign_cookies(struct workload_thread *threads, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		int cookie = threads[i].class->cookie;
+		if (cookie < 0) {
+			continue;
+		}
+		size_t first = 0;
+		while (threads[first].class->cookie != cookie) {
+			first++;
+		}
+		int ret;
+		if (first == i) {
+			ret = core_sched_create(threads[i].tid,
+						SCHED_CORE_SCOPE_PID);
+		} else {
+			ret = core_sched_share_from(threads[first].tid);
+			if (!ret) {
+				ret = core_sched_share_to(threads[i].tid,
+							  SCHED_CORE_SCOPE_PID);
+			}
+		}
+		if (ret) {
+			error(1, errno, "Failed to set cookie %d of thread %d",
+			      cookie, threads[i].tid);
+		}
+	}
+}
+
+void workload_run(const struct workload *wl, bool cookies,
+		  struct workload_result *result)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < wl->class_count; i++) {
+		count += wl->classes[i].threads;
+	}
+	struct workload_thread *threads = calloc(count, sizeof(*threads));
+	if (!threads) {
+		error(1, errno, "Failed to allocate workload threads");
+	}
+
+	pthread_barrier_t ready;
+	atomic_bool stop = false;
+	pthread_barrier_init(&ready, NULL, count + 1);
+
+	size_t index = 0;
+	for (size_t i = 0; i < wl->class_count; i++) {
+		for (unsigned int j = 0; j < wl->classes[i].threads; j++) {
+			struct workload_thread *t = &threads[index];
+			t->class = &wl->classes[i];
+			t->ready = &ready;
+			t->stop = &stop;
+			// xorshift must not start at zero.
+			t->rng = (wl->seed + 1) * 0x9e3779b97f4a7c15ULL +
+				 index;
+			if ((errno = pthread_create(&t->thread, NULL,
+						    workload_thread, t))) {
+				error(1, errno,
+				      "Failed to start workload thread");
+			}
+			index++;
+		}
+	}
+
+	pthread_barrier_wait(&ready);
+	if (cookies) {
+		assign_cookies(threads, count);
+	}
+	unsigned long long begin = now_ns();
+	pthread_barrier_wait(&ready);
+
+	if (wl->time_ms) {
+		struct timespec duration = {
+			.tv_sec = wl->time_ms / 1000,
+			.tv_nsec = (wl->time_ms % 1000) * 1000000L,
+		};
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &duration, NULL);
+	} else {
+		// The classes with ops bound the run, the others are stopped
+		// once those are done.
+		for (size_t i = 0; i < count; i++) {
+			if (threads[i].class->ops) {
+				pthread_join(threads[i].thread, NULL);
+			}
+		}
+	}
+	atomic_store(&stop, true);
+
+	memset(result, 0, sizeof(*result));
+	for (size_t i = 0; i < count; i++) {
+		if (wl->time_ms || !threads[i].class->ops) {
+			pthread_join(threads[i].thread, NULL);
+		}
+		result->latency_count += threads[i].sample_count;
+	}
+	result->wall_s = (now_ns() - begin) / 1e9;
+	result->latency_us =
+		calloc(result->latency_count ? result->latency_count : 1,
+		       sizeof(*result->latency_us));
+	if (!result->latency_us) {
+		error(1, errno, "Failed to allocate workload results");
+	}
+	size_t at = 0;
+	for (size_t i = 0; i < count; i++) {
+		result->ops += threads[i].ops;
+		memcpy(result->latency_us + at, threads[i].samples,
+		       threads[i].sample_count * sizeof(double));
+		at += threads[i].sample_count;
+	}
+
+	pthread_barrier_destroy(&ready);
+	free(threads);
+}
+
+void workload_result_free(struct workload_result *result)
+{
+	free(result->latency_us);
+	memset(result, 0, sizeof(*result));
+}
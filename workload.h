@@ -0,0 +1,76 @@
+// Copyright 2024 - Thijs Raymakers
+// Licensed under the EUPL v1.2
+
+#ifndef CORESCHED_WORKLOAD_H
+#define CORESCHED_WORKLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A synthetic workload is described by one or more thread classes separated
+// by ';', each a comma separated list of key=value pairs:
+//
+//	threads=N	number of threads of this class (1)
+//	kernel=K	int, fp, stream, chase, syscall or sleep (int)
+//	duty=PCT	percentage of each period spent working (100)
+//	period=MS	length of a duty cycle period (10)
+//	size=KB		working set of the stream and chase kernels (4096)
+//	ops=N		stop a thread after N operations (0, no limit)
+//	cookie=N	threads with the same N share a cookie (no cookie)
+//
+// Two keys apply to the whole workload and can appear in any class:
+//
+//	time=MS		stop after this long (1000 when no class sets ops)
+//	seed=N		seed of all random choices (1)
+//
+// Without time, classes without ops run until every class with ops is done.
+
+enum workload_kernel {
+	WORKLOAD_INT,
+	WORKLOAD_FP,
+	WORKLOAD_STREAM,
+	WORKLOAD_CHASE,
+	WORKLOAD_SYSCALL,
+	WORKLOAD_SLEEP,
+};
+
+struct workload_class {
+	unsigned int threads;
+	enum workload_kernel kernel;
+	unsigned int duty;
+	unsigned int period_ms;
+	size_t size_kb;
+	unsigned long ops;
+	int cookie;
+};
+
+struct workload {
+	struct workload_class *classes;
+	size_t class_count;
+	unsigned int time_ms;
+	unsigned long long seed;
+};
+
+struct workload_result {
+	unsigned long long ops;
+	double wall_s;
+	// Duration of a sample of the operations in microseconds.
+	double *latency_us;
+	size_t latency_count;
+};
+
+// Parse spec into wl. On failure, a description of the problem is stored in
+// error_msg.
+int workload_parse(const char *spec, struct workload *wl,
+		   const char **error_msg);
+void workload_free(struct workload *wl);
+
+// Run the workload in the calling process until every thread is done. When
+// cookies is false, the cookie keys are ignored.
+void workload_run(const struct workload *wl, bool cookies,
+		  struct workload_result *result);
+void workload_result_free(struct workload_result *result);
+
+const char *workload_kernel_name(enum workload_kernel kernel);
+
+#endif